@@ -4,18 +4,24 @@
 	shared memory layout:
 		shared memory start
 		fixed size headers
-		entries_start
+		shard 0 - entries_start
 		...
-		entries_end
+		shard 0 - entries_end
 
-		buffers_start
+		shard 0 - buffers_start
 		...
-		buffers_end
+		shard 0 - buffers_end
+		...
+		shard N-1 - entries_start
+		...
+		shard N-1 - buffers_end
 		shared memory end
 
-	the shared memory is composed of 3 sections:
+	the shared memory is composed of a fixed size header, followed by N equally sized 
+	shards. the shard of a key is chosen according to the key hash, each shard has its 
+	own lock, so that operations on different shards do not block each other.
 	1. fixed size headers - contains the ngx_slab_pool_t struct allocated by nginx,
-		the log context string and ngx_buffer_cache_sh_t
+		the log context string and an array of ngx_buffer_cache_sh_t (one per shard)
 	2. entries - an array of ngx_buffer_cache_entry_t, each entry has a key and 
 		points to a buffer in the buffers section. the entries are connected with a 
 		red/black tree for fast lookup by key. the entries section grows as needed until 
@@ -23,11 +29,36 @@
 		linked lists - the free queue and the used queue. the entries move between these 
 		queues as they are allocated / deallocated
 	3. buffers - a cyclic queue of variable size buffers. the buffers section starts
-		at the end of the shared memory and grows towards its beginning until it bumps
+		at the end of the shard and grows towards its beginning until it bumps
 		into the entries section. the buffers section has 2 pointers:
 		a. when a buffer is allocated, it is allocated before the write head
 		b. when an entry is freed, the read head of the buffers section moves
 
+	lock markers - an entry in state CES_FILLING that marks a key that is currently being
+	generated by some request, so that other requests can wait for it instead of generating
+	it in parallel. markers do not have a buffer and are only members of the rb tree, they
+	are removed when the key is stored, or when the request that created them is freed.
+
+	admission sketch - optional, a count-min sketch (4 rows of 4 bit counters, stored as bytes)
+	placed at the beginning of each shard, before the entries section. the sketch counts the
+	fetches of each key, when the shard is full, a new entry is stored only if its key was fetched
+	more frequently than the key of the entry that would be evicted (TinyLFU). the counters are
+	halved periodically, so that the sketch reflects the recent popularity of the keys.
+
+	pins - an entry that is referenced by a request that sends it directly from the shared memory
+	has a positive ref_count, such entries are never evicted. when the oldest entry is pinned, it is 
+	skipped - the write head moves below it and the entry becomes the most recent one, giving up the 
+	free space that was left between the read head and the write head. the given up space is 
+	reclaimed when the read head reaches the entry again.
+
+	disk tier - optional, a file that persists the cache entries across restarts (see ngx_buffer_cache_disk.c).
+	entries that are evicted in order to make room are demoted to the file - the entry is copied while the lock is
+	held, since its buffer is reused once the lock is released, and the copy is written by a thread pool. entries 
+	that were loaded from the file are not written again. after a fetch misses the shared memory, the caller can 
+	promote the key from the file (ngx_buffer_cache_promote). when the shared memory is created, it is loaded with 
+	the most recent entries of the file, and when the master process exits, the entries of the shared memory are 
+	saved to the file (ngx_buffer_cache_snapshot). the lock of the disk tier is placed in the fixed size headers, 
+	following the shards array.
 */
 
 // Note: code taken from ngx_str_rbtree_insert_value, updated the node comparison
@@ -120,26 +151,121 @@ ngx_buffer_cache_reset(ngx_buffer_cache_sh_t *cache)
 	ngx_rbtree_init(&cache->rbtree, &cache->sentinel, ngx_buffer_cache_rbtree_insert_value);
 	ngx_queue_init(&cache->used_queue);
 	ngx_queue_init(&cache->free_queue);
+	ngx_queue_init(&cache->locks_queue);
+
+	// invalidate any outstanding pins
+	cache->generation++;
+	cache->pin_count = 0;
 
 	// update stats (everything is evicted)
 	cache->stats.evicted = cache->stats.store_ok;
 	cache->stats.evicted_bytes = cache->stats.store_bytes;
 }
 
+static void
+ngx_buffer_cache_init_shards(ngx_buffer_cache_t *cache, ngx_buffer_cache_sh_t *sh)
+{
+	ngx_buffer_cache_shard_t* cur_shard;
+	ngx_buffer_cache_shard_t* last_shard;
+
+	last_shard = cache->shards + cache->shard_count;
+	for (cur_shard = cache->shards; cur_shard < last_shard; cur_shard++, sh++)
+	{
+		cur_shard->sh = sh;
+#if (NGX_HAVE_ATOMIC_OPS)
+		cur_shard->mutex = &sh->mutex;
+#else
+		cur_shard->mutex = &cache->shpool->mutex;
+#endif // NGX_HAVE_ATOMIC_OPS
+	}
+}
+
+static ngx_buffer_cache_disk_sh_t*
+ngx_buffer_cache_get_disk_sh(ngx_buffer_cache_t *cache, ngx_buffer_cache_sh_t *sh)
+{
+	return (ngx_buffer_cache_disk_sh_t*)ngx_align_ptr((u_char*)(sh + cache->shard_count), NGX_ALIGNMENT);
+}
+
+static ngx_int_t
+ngx_buffer_cache_open_disk(ngx_buffer_cache_t *cache, ngx_buffer_cache_sh_t *sh, ngx_log_t* log)
+{
+	ngx_buffer_cache_disk_sh_t* disk_sh;
+	ngx_shmtx_t* mutex;
+
+	disk_sh = ngx_buffer_cache_get_disk_sh(cache, sh);
+#if (NGX_HAVE_ATOMIC_OPS)
+	mutex = &disk_sh->mutex;
+#else
+	mutex = &cache->shpool->mutex;
+#endif // NGX_HAVE_ATOMIC_OPS
+
+	return ngx_buffer_cache_disk_open(cache->disk, disk_sh, mutex, log);
+}
+
+static ngx_flag_t ngx_buffer_cache_load_entry(void* context, u_char* key, u_char* buffer, size_t size, time_t write_time);
+
+static ngx_uint_t
+ngx_buffer_cache_get_sketch_width(size_t shard_size)
+{
+	ngx_uint_t width;
+
+	for (width = SKETCH_MIN_WIDTH;
+		width < SKETCH_MAX_WIDTH && width * 2 * SKETCH_SHARD_SIZE_PER_COUNTER <= shard_size;
+		width *= 2);
+
+	return width;
+}
+
 static ngx_int_t
 ngx_buffer_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
 	ngx_buffer_cache_sh_t *sh;
+	ngx_buffer_cache_sh_t *cur_sh;
 	ngx_buffer_cache_t *ocache = data;
+	ngx_buffer_cache_disk_sh_t *disk_sh;
 	ngx_buffer_cache_t *cache;
+	size_t sketch_size;
+	size_t shard_size;
+	ngx_uint_t sketch_width;
+	ngx_uint_t i;
 	u_char* p;
 
 	cache = shm_zone->data;
 
 	if (ocache)
 	{
-		cache->sh = ocache->sh;
+		if (ocache->shard_count != cache->shard_count)
+		{
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+				"buffer cache \"%V\" uses %ui shards, previously it used %ui shards",
+				&shm_zone->shm.name, cache->shard_count, ocache->shard_count);
+			return NGX_ERROR;
+		}
+
+		if (ocache->admission != cache->admission)
+		{
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+				"buffer cache \"%V\" admission sketch was %s, cannot change it without restarting",
+				&shm_zone->shm.name, ocache->admission ? "enabled" : "disabled");
+			return NGX_ERROR;
+		}
+
+		if ((ocache->disk == NULL) != (cache->disk == NULL) ||
+			(cache->disk != NULL && !ngx_buffer_cache_disk_equals(ocache->disk, cache->disk)))
+		{
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+				"buffer cache \"%V\" disk tier was changed, cannot change it without restarting",
+				&shm_zone->shm.name);
+			return NGX_ERROR;
+		}
+
 		cache->shpool = ocache->shpool;
+		ngx_buffer_cache_init_shards(cache, ocache->shards[0].sh);
+
+		if (cache->disk != NULL)
+		{
+			return ngx_buffer_cache_open_disk(cache, ocache->shards[0].sh, shm_zone->shm.log);
+		}
 		return NGX_OK;
 	}
 
@@ -147,7 +273,12 @@ ngx_buffer_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
 	if (shm_zone->shm.exists) 
 	{
-		cache->sh = cache->shpool->data;
+		ngx_buffer_cache_init_shards(cache, cache->shpool->data);
+
+		if (cache->disk != NULL)
+		{
+			return ngx_buffer_cache_open_disk(cache, cache->shpool->data, shm_zone->shm.log);
+		}
 		return NGX_OK;
 	}
 
@@ -158,42 +289,189 @@ ngx_buffer_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 	cache->shpool->log_ctx = p;
 	p = ngx_sprintf(cache->shpool->log_ctx, " in buffer cache \"%V\"%Z", &shm_zone->shm.name);
 
-	// allocate the shared cache state
+	// allocate the shared cache state of all shards
+	p = ngx_align_ptr(p, NGX_ALIGNMENT);
 	sh = (ngx_buffer_cache_sh_t*)p;
-	p += sizeof(*sh);
-	cache->sh = sh;
+	p += sizeof(*sh) * cache->shard_count;
 
 	cache->shpool->data = sh;
 
-	// initialize fixed cache fields
-	sh->entries_start = (ngx_buffer_cache_entry_t*)p;
-	sh->buffers_end = shm_zone->shm.addr + shm_zone->shm.size;
-	sh->access_time = 0;
+	// allocate the shared state of the disk tier
+	if (cache->disk != NULL)
+	{
+		disk_sh = ngx_buffer_cache_get_disk_sh(cache, sh);
+		p = (u_char*)(disk_sh + 1);
 
-	// reset the stats
-	ngx_memzero(&sh->stats, sizeof(sh->stats));
+#if (NGX_HAVE_ATOMIC_OPS)
+		if (ngx_shmtx_create(&disk_sh->mutex, &disk_sh->lock, NULL) != NGX_OK)
+		{
+			return NGX_ERROR;
+		}
+#endif // NGX_HAVE_ATOMIC_OPS
 
-	// reset the cache status
-	ngx_buffer_cache_reset(sh);
-	sh->reset = 0;
+		ngx_memzero(&disk_sh->stats, sizeof(disk_sh->stats));
+	}
+
+	// split the remaining space evenly between the shards
+	p = ngx_align_ptr(p, BUFFER_ALIGNMENT);
+	shard_size = ((shm_zone->shm.addr + shm_zone->shm.size - p) / cache->shard_count) & (~(BUFFER_ALIGNMENT - 1));
+
+	if (cache->admission)
+	{
+		sketch_width = ngx_buffer_cache_get_sketch_width(shard_size);
+		sketch_size = ngx_align(SKETCH_DEPTH * sketch_width, BUFFER_ALIGNMENT);
+	}
+	else
+	{
+		sketch_width = 0;
+		sketch_size = 0;
+	}
+
+	for (i = 0, cur_sh = sh; i < cache->shard_count; i++, cur_sh++)
+	{
+#if (NGX_HAVE_ATOMIC_OPS)
+		if (ngx_shmtx_create(&cur_sh->mutex, &cur_sh->lock, NULL) != NGX_OK)
+		{
+			return NGX_ERROR;
+		}
+#endif // NGX_HAVE_ATOMIC_OPS
+
+		// initialize the admission sketch
+		if (sketch_size > 0)
+		{
+			cur_sh->sketch = p;
+			ngx_memzero(cur_sh->sketch, sketch_size);
+		}
+		else
+		{
+			cur_sh->sketch = NULL;
+		}
+		cur_sh->sketch_width = sketch_width;
+		cur_sh->sketch_additions = 0;
+
+		// initialize fixed cache fields
+		cur_sh->entries_start = (ngx_buffer_cache_entry_t*)(p + sketch_size);
+		p += shard_size;
+		cur_sh->buffers_end = p;
+		cur_sh->access_time = 0;
+		cur_sh->generation = 0;
+		cur_sh->fill_id = 0;
+		cur_sh->pending = 0;
+
+		// reset the stats
+		ngx_memzero(&cur_sh->stats, sizeof(cur_sh->stats));
+
+		// reset the cache status
+		ngx_buffer_cache_reset(cur_sh);
+		cur_sh->reset = 0;
+	}
+
+	ngx_buffer_cache_init_shards(cache, sh);
+
+	if (cache->disk != NULL)
+	{
+		if (ngx_buffer_cache_open_disk(cache, sh, shm_zone->shm.log) != NGX_OK)
+		{
+			return NGX_ERROR;
+		}
+
+		// warm up the memory cache with the most recent entries of the disk tier
+		ngx_buffer_cache_disk_load(cache->disk, shard_size * cache->shard_count / 2, ngx_buffer_cache_load_entry, cache);
+	}
 
 	return NGX_OK;
 }
 
+static ngx_buffer_cache_shard_t*
+ngx_buffer_cache_get_shard(ngx_buffer_cache_t* cache, uint32_t hash)
+{
+	return &cache->shards[hash % cache->shard_count];
+}
+
+/* Note: must be called with the mutex locked */
+static ngx_flag_t
+ngx_buffer_cache_skip_pinned_entry(ngx_buffer_cache_sh_t *cache, ngx_buffer_cache_entry_t* entry)
+{
+	// Note: the entry can be skipped only when its buffer ends at the read head (Layout: S////R    W///E),
+	//		otherwise, the entries that were stored after it lie between the entry and the write head
+	if (cache->buffers_write < cache->buffers_read ||
+		entry->start_offset >= cache->buffers_read ||
+		ngx_queue_last(&cache->used_queue) == &entry->queue_node)
+	{
+		return 0;
+	}
+
+	// make the entry the most recent one
+	ngx_queue_remove(&entry->queue_node);
+	ngx_queue_insert_tail(&cache->used_queue, &entry->queue_node);
+
+	// give up the space between the read head and the write head
+	cache->buffers_read = entry->start_offset;
+	cache->buffers_write = entry->start_offset;
+
+	return 1;
+}
+
 /* Note: must be called with the mutex locked */
+static void
+ngx_buffer_cache_demote_entry(ngx_buffer_cache_demote_t* demote, ngx_buffer_cache_entry_t* entry)
+{
+	u_char* buffer;
+
+	if (entry->state != CES_READY || entry->on_disk ||
+		(demote->expiration != 0 && ngx_time() >= (time_t)(entry->write_time + demote->expiration)))
+	{
+		return;
+	}
+
+	buffer = ngx_buffer_cache_disk_write_alloc(demote->disk, entry->key, entry->buffer_size, entry->write_time, &demote->writes);
+	if (buffer == NULL)
+	{
+		return;
+	}
+
+	ngx_memcpy(buffer, entry->start_offset, entry->buffer_size);
+}
+
+static void
+ngx_buffer_cache_post_demotions(ngx_buffer_cache_demote_t* demote)
+{
+	if (demote != NULL && demote->writes != NULL)
+	{
+		ngx_buffer_cache_disk_write_post(demote->disk, demote->writes);
+		demote->writes = NULL;
+	}
+}
+
+/* Note: must be called with the mutex locked, when demote is not null, the freed entry is added to the writes 
+	of the disk tier, the writes must be posted after the mutex is unlocked */
 static ngx_buffer_cache_entry_t*
-ngx_buffer_cache_free_oldest_entry(ngx_buffer_cache_sh_t *cache, uint32_t expiration)
+ngx_buffer_cache_free_oldest_entry(ngx_buffer_cache_sh_t *cache, uint32_t expiration, ngx_buffer_cache_demote_t* demote)
 {
 	ngx_buffer_cache_entry_t* entry;
 
-	// verify we have an entry to free
-	if (ngx_queue_empty(&cache->used_queue))
+	for (;;)
 	{
-		return NULL;
+		// verify we have an entry to free
+		if (ngx_queue_empty(&cache->used_queue))
+		{
+			return NULL;
+		}
+
+		// verify the entry is not pinned, pinned entries are skipped when evicting to make room
+		entry = container_of(ngx_queue_head(&cache->used_queue), ngx_buffer_cache_entry_t, queue_node);
+		if (entry->ref_count == 0)
+		{
+			break;
+		}
+
+		if (expiration || !ngx_buffer_cache_skip_pinned_entry(cache, entry))
+		{
+			return NULL;
+		}
 	}
 
 	// verify the entry is not locked
-	entry = container_of(ngx_queue_head(&cache->used_queue), ngx_buffer_cache_entry_t, queue_node);
 	if (ngx_time() < entry->access_time + ENTRY_LOCK_EXPIRATION)
 	{
 		return NULL;
@@ -204,13 +482,21 @@ ngx_buffer_cache_free_oldest_entry(ngx_buffer_cache_sh_t *cache, uint32_t expira
 	{
 		return NULL;
 	}
+
+	if (demote != NULL)
+	{
+		ngx_buffer_cache_demote_entry(demote, entry);
+	}
 	
+	// remove from rb tree
+	if (entry->state != CES_INVALID)
+	{
+		ngx_rbtree_delete(&cache->rbtree, &entry->node);
+	}
+
 	// update the state
 	entry->state = CES_FREE;
 
-	// remove from rb tree
-	ngx_rbtree_delete(&cache->rbtree, &entry->node);
-
 	// move from used_queue to free_queue
 	ngx_queue_remove(&entry->queue_node);
 	ngx_queue_insert_tail(&cache->free_queue, &entry->queue_node);
@@ -236,7 +522,7 @@ ngx_buffer_cache_free_oldest_entry(ngx_buffer_cache_sh_t *cache, uint32_t expira
 
 /* Note: must be called with the mutex locked */
 static ngx_buffer_cache_entry_t*
-ngx_buffer_cache_get_free_entry(ngx_buffer_cache_sh_t *cache)
+ngx_buffer_cache_get_free_entry(ngx_buffer_cache_sh_t *cache, ngx_buffer_cache_demote_t* demote)
 {
 	ngx_buffer_cache_entry_t* entry;
 
@@ -254,18 +540,20 @@ ngx_buffer_cache_get_free_entry(ngx_buffer_cache_sh_t *cache)
 
 		// initialize the state and add to free queue
 		entry->state = CES_FREE;
+		entry->ref_count = 0;
 		ngx_queue_insert_tail(&cache->free_queue, &entry->queue_node);
 		return entry;
 	}
 	
-	return ngx_buffer_cache_free_oldest_entry(cache, 0);
+	return ngx_buffer_cache_free_oldest_entry(cache, 0, demote);
 }
 
 /* Note: must be called with the mutex locked */
 static u_char*
 ngx_buffer_cache_get_free_buffer(
 	ngx_buffer_cache_sh_t *cache,
-	size_t size)
+	size_t size,
+	ngx_buffer_cache_demote_t* demote)
 {
 	u_char* buffer_start;
 
@@ -275,10 +563,11 @@ ngx_buffer_cache_get_free_buffer(
 		return NULL;
 	}
 
-	buffer_start = (u_char*)((intptr_t)(cache->buffers_write - size) & (~(BUFFER_ALIGNMENT - 1)));
-
 	for (;;)
 	{
+		// Note: recalculated on every iteration, since skipping a pinned entry moves the write position
+		buffer_start = (u_char*)((intptr_t)(cache->buffers_write - size) & (~(BUFFER_ALIGNMENT - 1)));
+
 		// Layout:	S	W/////R		E
 		if (cache->buffers_write < cache->buffers_read || 
 			(cache->buffers_write == cache->buffers_read && ngx_queue_empty(&cache->used_queue)))
@@ -298,7 +587,6 @@ ngx_buffer_cache_get_free_buffer(
 
 			// cannot allocate here, move the write position to the end
 			cache->buffers_write = cache->buffers_end;
-			buffer_start = (u_char*)((intptr_t)(cache->buffers_write - size) & (~(BUFFER_ALIGNMENT - 1)));
 			continue;
 		}
 
@@ -310,7 +598,7 @@ ngx_buffer_cache_get_free_buffer(
 		}
 
 		// not enough room, free an entry
-		if (ngx_buffer_cache_free_oldest_entry(cache, 0) == NULL)
+		if (ngx_buffer_cache_free_oldest_entry(cache, 0, demote) == NULL)
 		{
 			break;
 		}
@@ -319,169 +607,568 @@ ngx_buffer_cache_get_free_buffer(
 	return NULL;
 }
 
-ngx_flag_t
-ngx_buffer_cache_fetch(
-	ngx_buffer_cache_t* cache,
-	u_char* key,
-	u_char** buffer,
-	size_t* buffer_size)
+/* Note: must be called with the mutex locked */
+static void
+ngx_buffer_cache_sketch_increment(ngx_buffer_cache_sh_t *cache, const u_char* key)
 {
-	ngx_buffer_cache_entry_t* entry;
-	ngx_buffer_cache_sh_t *sh = cache->sh;
-	ngx_flag_t result = 0;
-	uint32_t hash;
+	u_char* counters[SKETCH_DEPTH];
+	u_char* row;
+	u_char* end;
+	ngx_uint_t min_count;
+	ngx_uint_t i;
+
+	// Note: the key is an md5 hash, so its bytes can be used directly as the row hashes
+	min_count = SKETCH_MAX_COUNT;
+	for (i = 0; i < SKETCH_DEPTH; i++, key += 4)
+	{
+		counters[i] = cache->sketch + i * cache->sketch_width +
+			((key[0] | (key[1] << 8) | (key[2] << 16) | ((uint32_t)key[3] << 24)) & (cache->sketch_width - 1));
+		if (*counters[i] < min_count)
+		{
+			min_count = *counters[i];
+		}
+	}
 
-	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+	// conservative update - increment only the minimal counters
+	if (min_count < SKETCH_MAX_COUNT)
+	{
+		for (i = 0; i < SKETCH_DEPTH; i++)
+		{
+			if (*counters[i] == min_count)
+			{
+				(*counters[i])++;
+			}
+		}
+	}
 
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	cache->sketch_additions++;
+	if (cache->sketch_additions < cache->sketch_width * SKETCH_SAMPLE_FACTOR)
+	{
+		return;
+	}
 
-	if (!sh->reset)
+	// age the counters
+	end = cache->sketch + SKETCH_DEPTH * cache->sketch_width;
+	for (row = cache->sketch; row < end; row++)
 	{
-		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
-		if (entry != NULL && entry->state == CES_READY && 
-			(cache->expiration == 0 || ngx_time() < (time_t)(entry->write_time + cache->expiration)))
-		{
-			result = 1;
+		*row >>= 1;
+	}
 
-			// update stats
-			sh->stats.fetch_hit++;
-			sh->stats.fetch_bytes += entry->buffer_size;
+	cache->sketch_additions /= 2;
+}
 
-			// copy buffer pointer and size
-			*buffer = entry->start_offset;
-			*buffer_size = entry->buffer_size;
+/* Note: must be called with the mutex locked */
+static ngx_uint_t
+ngx_buffer_cache_sketch_estimate(ngx_buffer_cache_sh_t *cache, const u_char* key)
+{
+	ngx_uint_t min_count;
+	ngx_uint_t count;
+	ngx_uint_t i;
 
-			// Note: setting the access time of the entry and cache to prevent it 
-			//		from being freed while the caller uses the buffer
-			sh->access_time = entry->access_time = ngx_time();
-		}
-		else
+	min_count = SKETCH_MAX_COUNT;
+	for (i = 0; i < SKETCH_DEPTH; i++, key += 4)
+	{
+		count = cache->sketch[i * cache->sketch_width +
+			((key[0] | (key[1] << 8) | (key[2] << 16) | ((uint32_t)key[3] << 24)) & (cache->sketch_width - 1))];
+		if (count < min_count)
 		{
-			// update stats
-			sh->stats.fetch_miss++;
+			min_count = count;
 		}
 	}
 
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+	return min_count;
+}
 
-	return result;
+/* Note: must be called with the mutex locked */
+static ngx_flag_t
+ngx_buffer_cache_admit(ngx_buffer_cache_sh_t *cache, const u_char* key, size_t size)
+{
+	ngx_buffer_cache_entry_t* victim;
+
+	// if the buffers section can still grow, no entry has to be evicted
+	if ((u_char*)(cache->entries_end + ENTRIES_ALLOC_MARGIN) + size + BUFFER_ALIGNMENT <= cache->buffers_start ||
+		ngx_queue_empty(&cache->used_queue))
+	{
+		return 1;
+	}
+
+	// admit only if the new key is more popular than the entry that will be evicted first
+	victim = container_of(ngx_queue_head(&cache->used_queue), ngx_buffer_cache_entry_t, queue_node);
+
+	return ngx_buffer_cache_sketch_estimate(cache, key) > ngx_buffer_cache_sketch_estimate(cache, victim->key);
 }
 
-ngx_flag_t
-ngx_buffer_cache_store_gather(
-	ngx_buffer_cache_t* cache, 
-	u_char* key, 
-	ngx_str_t* buffers,
-	size_t buffer_count)
+static ngx_buffer_cache_entry_t*
+ngx_buffer_cache_fetch_internal(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	ngx_buffer_cache_pin_t* pin,
+	u_char** buffer,
+	size_t* buffer_size,
+	ngx_flag_t* promoted)
 {
 	ngx_buffer_cache_entry_t* entry;
-	ngx_buffer_cache_sh_t *sh = cache->sh;
-	ngx_str_t* cur_buffer;
-	ngx_str_t* last_buffer;
-	size_t buffer_size;
+	ngx_buffer_cache_shard_t* shard;
+	ngx_buffer_cache_sh_t *sh;
 	uint32_t hash;
-	uint32_t evictions;
-	u_char* target_buffer;
 
 	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
 
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	shard = ngx_buffer_cache_get_shard(cache, hash);
+	sh = shard->sh;
+
+	ngx_shmtx_lock(shard->mutex);
 
 	if (sh->reset)
 	{
-		// a previous store operation was killed in progress, need to reset the cache
-		// since the data structures may be corrupt. we can only reset the cache after
-		// the access time expires since other processes may still be reading from / 
-		// writing to the cache
-		if (ngx_time() < sh->access_time + CACHE_LOCK_EXPIRATION)
-		{
-			ngx_shmtx_unlock(&cache->shpool->mutex);
-			return 0;
-		}
-
-		// reset the cache, leave the reset flag enabled
-		ngx_buffer_cache_reset(sh);
-
-		// update stats
-		sh->stats.reset++;
+		ngx_shmtx_unlock(shard->mutex);
+		return NULL;
 	}
-	else
+
+	if (sh->sketch != NULL)
 	{
-		// remove expired entries
-		if (cache->expiration)
-		{
-			for (evictions = MAX_EVICTIONS_PER_STORE; evictions > 0; evictions--)
-			{
-				if (!ngx_buffer_cache_free_oldest_entry(sh, cache->expiration))
-				{
-					break;
-				}
-			}
-		}
+		ngx_buffer_cache_sketch_increment(sh, key);
+	}
 
-		// make sure the entry does not already exist
-		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
-		if (entry != NULL)
+	entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
+	if (entry == NULL || entry->state != CES_READY ||
+		(cache->expiration != 0 && ngx_time() >= (time_t)(entry->write_time + cache->expiration)))
+	{
+		// update stats
+		// Note: fetches of locked keys are polls of waiting requests, they are counted in lock_wait
+		if (entry == NULL || entry->state != CES_FILLING)
 		{
-			sh->stats.store_exists++;
-			ngx_shmtx_unlock(&cache->shpool->mutex);
-			return 0;
+			sh->stats.fetch_miss++;
 		}
 
-		// enable the reset flag before we start making any changes
-		sh->reset = 1;
+		ngx_shmtx_unlock(shard->mutex);
+		return NULL;
 	}
 
-	// allocate a new entry
-	entry = ngx_buffer_cache_get_free_entry(sh);
-	if (entry == NULL)
-	{
-		goto error;
-	}
+	// update stats
+	sh->stats.fetch_hit++;
+	sh->stats.fetch_bytes += entry->buffer_size;
 
-	// calculate the buffer size
-	last_buffer = buffers + buffer_count;
-	buffer_size = 0;
-	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
-	{
-		buffer_size += cur_buffer->len;
-	}
+	// copy buffer pointer and size
+	*buffer = entry->start_offset;
+	*buffer_size = entry->buffer_size;
 
-	// allocate a buffer to hold the data
-	target_buffer = ngx_buffer_cache_get_free_buffer(sh, buffer_size);
-	if (target_buffer == NULL)
+	if (promoted != NULL)
 	{
-		goto error;
+		*promoted = entry->promoted;
 	}
 
-	// initialize the entry
-	entry->state = CES_ALLOCATED;
-	entry->node.key = hash;
-	memcpy(entry->key, key, BUFFER_CACHE_KEY_SIZE);
-	entry->start_offset = target_buffer;
-	entry->buffer_size = buffer_size;
+	// Note: setting the access time of the entry and cache to prevent it 
+	//		from being freed while the caller uses the buffer
+	sh->access_time = entry->access_time = ngx_time();
 
-	// update the write position
-	sh->buffers_write = target_buffer;
+	if (pin != NULL)
+	{
+		entry->ref_count++;
+		sh->pin_count++;
+		sh->pin_time = ngx_time();
+
+		pin->shard = shard;
+		pin->entry = entry;
+		pin->generation = sh->generation;
+		pin->fill_id = entry->fill_id;
+	}
 
-	// move from free_queue to used_queue
-	ngx_queue_remove(&entry->queue_node);
-	ngx_queue_insert_tail(&sh->used_queue, &entry->queue_node);
+	ngx_shmtx_unlock(shard->mutex);
 
-	// insert to rbtree
-	ngx_rbtree_insert(&sh->rbtree, &entry->node);
+	return entry;
+}
 
-	// update stats
+ngx_flag_t
+ngx_buffer_cache_fetch(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	u_char** buffer,
+	size_t* buffer_size)
+{
+	return ngx_buffer_cache_fetch_internal(cache, key, NULL, buffer, buffer_size, NULL) != NULL;
+}
+
+ngx_flag_t
+ngx_buffer_cache_exists(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	ngx_flag_t* promoted)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_shard_t* shard;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_flag_t result;
+	uint32_t hash;
+
+	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+
+	shard = ngx_buffer_cache_get_shard(cache, hash);
+	sh = shard->sh;
+
+	ngx_shmtx_lock(shard->mutex);
+
+	if (sh->reset)
+	{
+		ngx_shmtx_unlock(shard->mutex);
+		return 0;
+	}
+
+	entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
+	result = entry != NULL && entry->state == CES_READY &&
+		(cache->expiration == 0 || ngx_time() < (time_t)(entry->write_time + cache->expiration));
+
+	if (result && promoted != NULL)
+	{
+		*promoted = entry->promoted;
+	}
+
+	ngx_shmtx_unlock(shard->mutex);
+
+	return result;
+}
+
+ngx_flag_t
+ngx_buffer_cache_fetch_promoted(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	u_char** buffer,
+	size_t* buffer_size,
+	ngx_flag_t* promoted)
+{
+	return ngx_buffer_cache_fetch_internal(cache, key, NULL, buffer, buffer_size, promoted) != NULL;
+}
+
+void
+ngx_buffer_cache_mark_validated(
+	ngx_buffer_cache_t* cache,
+	u_char* key)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_shard_t* shard;
+	ngx_buffer_cache_sh_t *sh;
+	uint32_t hash;
+
+	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+
+	shard = ngx_buffer_cache_get_shard(cache, hash);
+	sh = shard->sh;
+
+	ngx_shmtx_lock(shard->mutex);
+
+	entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
+	if (!sh->reset && entry != NULL && entry->state == CES_READY)
+	{
+		entry->promoted = 0;
+	}
+
+	ngx_shmtx_unlock(shard->mutex);
+}
+
+void
+ngx_buffer_cache_unpin(ngx_buffer_cache_pin_t* pin)
+{
+	ngx_buffer_cache_entry_t* entry = pin->entry;
+	ngx_buffer_cache_sh_t *sh;
+
+	if (entry == NULL)
+	{
+		return;
+	}
+
+	pin->entry = NULL;
+
+	sh = pin->shard->sh;
+
+	ngx_shmtx_lock(pin->shard->mutex);
+
+	// Note: if the cache was reset since the entry was pinned, the entry may have been reused
+	if (sh->generation == pin->generation && 
+		(entry->state == CES_READY || entry->state == CES_INVALID) && 
+		entry->fill_id == pin->fill_id && 
+		entry->ref_count > 0)
+	{
+		entry->ref_count--;
+		sh->pin_count--;
+	}
+
+	ngx_shmtx_unlock(pin->shard->mutex);
+}
+
+static void
+ngx_buffer_cache_pin_cleanup(void* data)
+{
+	ngx_buffer_cache_unpin(data);
+}
+
+ngx_flag_t
+ngx_buffer_cache_fetch_pinned(
+	ngx_buffer_cache_t* cache,
+	ngx_pool_t* pool,
+	u_char* key,
+	u_char** buffer,
+	size_t* buffer_size,
+	ngx_buffer_cache_pin_t** pin)
+{
+	ngx_buffer_cache_pin_t* cur_pin;
+	ngx_pool_cleanup_t* cln;
+
+	// Note: allocating the cleanup before the lookup, in order to avoid leaving a pinned entry on failure
+	cln = ngx_pool_cleanup_add(pool, sizeof(ngx_buffer_cache_pin_t));
+	if (cln == NULL)
+	{
+		return 0;
+	}
+
+	cur_pin = cln->data;
+	cur_pin->entry = NULL;
+
+	if (ngx_buffer_cache_fetch_internal(cache, key, cur_pin, buffer, buffer_size, NULL) == NULL)
+	{
+		return 0;
+	}
+
+	cln->handler = ngx_buffer_cache_pin_cleanup;
+
+	if (pin != NULL)
+	{
+		*pin = cur_pin;
+	}
+
+	return 1;
+}
+
+ngx_flag_t
+ngx_buffer_cache_can_store(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	size_t buffer_size)
+{
+	ngx_buffer_cache_shard_t* shard;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_flag_t result;
+	uint32_t hash;
+
+	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+
+	shard = ngx_buffer_cache_get_shard(cache, hash);
+	sh = shard->sh;
+
+	// Note: storing an entry larger than half the shard would evict most of its contents
+	if (buffer_size > (size_t)(sh->buffers_end - (u_char*)sh->entries_start) / 2)
+	{
+		return 0;
+	}
+
+	ngx_shmtx_lock(shard->mutex);
+
+	result = !sh->reset && (sh->sketch == NULL || ngx_buffer_cache_admit(sh, key, buffer_size));
+
+	ngx_shmtx_unlock(shard->mutex);
+
+	return result;
+}
+
+/* Note: must be called with the mutex locked */
+static void
+ngx_buffer_cache_free_lock_marker(ngx_buffer_cache_sh_t *cache, ngx_buffer_cache_entry_t* entry)
+{
+	entry->state = CES_FREE;
+
+	ngx_rbtree_delete(&cache->rbtree, &entry->node);
+
+	// move from locks_queue to free_queue
+	ngx_queue_remove(&entry->queue_node);
+	ngx_queue_insert_tail(&cache->free_queue, &entry->queue_node);
+}
+
+/* Note: must be called with the mutex locked */
+static void
+ngx_buffer_cache_free_expired_locks(ngx_buffer_cache_sh_t *cache)
+{
+	ngx_buffer_cache_entry_t* entry;
+
+	// Note: the queue is ordered by lock time, markers with a longer timeout may delay the release of
+	//		the markers that follow them, until they expire
+	while (!ngx_queue_empty(&cache->locks_queue))
+	{
+		entry = container_of(ngx_queue_head(&cache->locks_queue), ngx_buffer_cache_entry_t, queue_node);
+		if (ngx_time() < entry->lock_expire)
+		{
+			break;
+		}
+
+		ngx_buffer_cache_free_lock_marker(cache, entry);
+
+		// update stats
+		cache->stats.lock_expired++;
+	}
+}
+
+// Note: returns NGX_OK if the entry was stored, NGX_DECLINED if it already exists, and NGX_ABORT otherwise.
+//		when demote is not null, the entries that are evicted are written to the disk tier
+static ngx_int_t
+ngx_buffer_cache_store_internal(
+	ngx_buffer_cache_t* cache, 
+	u_char* key, 
+	ngx_str_t* buffers,
+	size_t buffer_count,
+	time_t write_time,
+	ngx_flag_t promoted,
+	ngx_buffer_cache_demote_t* demote)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_shard_t* shard;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_str_t* cur_buffer;
+	ngx_str_t* last_buffer;
+	size_t buffer_size;
+	uint32_t hash;
+	uint32_t evictions;
+	u_char* target_buffer;
+
+	// calculate the buffer size
+	last_buffer = buffers + buffer_count;
+	buffer_size = 0;
+	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
+	{
+		buffer_size += cur_buffer->len;
+	}
+
+	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+
+	shard = ngx_buffer_cache_get_shard(cache, hash);
+	sh = shard->sh;
+
+	ngx_shmtx_lock(shard->mutex);
+
+	if (sh->reset)
+	{
+		// a previous store operation was killed in progress, need to reset the cache
+		// since the data structures may be corrupt. we can only reset the cache after
+		// the access time expires since other processes may still be reading from / 
+		// writing to the cache
+		if (ngx_time() < sh->access_time + CACHE_LOCK_EXPIRATION)
+		{
+			ngx_shmtx_unlock(shard->mutex);
+			return NGX_ABORT;
+		}
+
+		// Note: no new pins are created while the reset flag is set, the reset waits for the 
+		//		outstanding pins to be released, since their buffers may still be sent
+		if (sh->pin_count > 0 && ngx_time() < sh->pin_time + ENTRY_PIN_EXPIRATION)
+		{
+			ngx_shmtx_unlock(shard->mutex);
+			return NGX_ABORT;
+		}
+
+		// reset the cache, leave the reset flag enabled
+		ngx_buffer_cache_reset(sh);
+
+		// update stats
+		sh->stats.reset++;
+	}
+	else
+	{
+		// remove expired entries
+		if (cache->expiration)
+		{
+			for (evictions = MAX_EVICTIONS_PER_STORE; evictions > 0; evictions--)
+			{
+				if (!ngx_buffer_cache_free_oldest_entry(sh, cache->expiration, NULL))
+				{
+					break;
+				}
+			}
+		}
+
+		// release the locks of requests that did not complete in time
+		ngx_buffer_cache_free_expired_locks(sh);
+
+		// make sure the entry does not already exist
+		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
+		if (entry != NULL && entry->state != CES_FILLING)
+		{
+			sh->stats.store_exists++;
+			ngx_shmtx_unlock(shard->mutex);
+			return NGX_DECLINED;
+		}
+
+		// apply the admission policy
+		if (sh->sketch != NULL)
+		{
+			if (!ngx_buffer_cache_admit(sh, key, buffer_size))
+			{
+				if (entry != NULL)
+				{
+					// the entry will not be stored, release the lock to let the waiting requests proceed
+					ngx_buffer_cache_free_lock_marker(sh, entry);
+				}
+
+				sh->stats.admit_reject++;
+				ngx_shmtx_unlock(shard->mutex);
+				return NGX_ABORT;
+			}
+
+			sh->stats.admit_ok++;
+		}
+
+		// enable the reset flag before we start making any changes
+		sh->reset = 1;
+
+		if (entry != NULL)
+		{
+			// the key was locked, replace the lock marker with the stored entry
+			ngx_buffer_cache_free_lock_marker(sh, entry);
+		}
+	}
+
+	// allocate a new entry
+	entry = ngx_buffer_cache_get_free_entry(sh, demote);
+	if (entry == NULL)
+	{
+		goto error;
+	}
+
+	// allocate a buffer to hold the data
+	target_buffer = ngx_buffer_cache_get_free_buffer(sh, buffer_size, demote);
+	if (target_buffer == NULL)
+	{
+		goto error;
+	}
+
+	// initialize the entry
+	entry->state = CES_ALLOCATED;
+	entry->ref_count = 0;
+	entry->promoted = promoted;
+	entry->on_disk = promoted;
+	entry->fill_id = ++sh->fill_id;
+	entry->node.key = hash;
+	memcpy(entry->key, key, BUFFER_CACHE_KEY_SIZE);
+	entry->start_offset = target_buffer;
+	entry->buffer_size = buffer_size;
+
+	// update the write position
+	sh->buffers_write = target_buffer;
+
+	// move from free_queue to used_queue
+	ngx_queue_remove(&entry->queue_node);
+	ngx_queue_insert_tail(&sh->used_queue, &entry->queue_node);
+
+	// insert to rbtree
+	ngx_rbtree_insert(&sh->rbtree, &entry->node);
+
+	// update stats
 	sh->stats.store_ok++;
 	sh->stats.store_bytes += buffer_size;
 
 	// Note: the memcpy is performed after releasing the lock to avoid holding the lock for a long time
 	//		setting the access time of the entry and cache prevents it from being freed
 	sh->access_time = entry->access_time = ngx_time();
-	entry->write_time = ngx_time();
+	entry->write_time = write_time;
 
 	sh->reset = 0;
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+	ngx_shmtx_unlock(shard->mutex);
 
 	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
 	{
@@ -491,13 +1178,251 @@ ngx_buffer_cache_store_gather(
 	// Note: no need to obtain the lock since state is ngx_atomic_t
 	entry->state = CES_READY;
 
-	return 1;
+	ngx_buffer_cache_post_demotions(demote);
+
+	return NGX_OK;
 
 error:
 	sh->stats.store_err++;
 	sh->reset = 0;
-	ngx_shmtx_unlock(&cache->shpool->mutex);
-	return 0;
+	ngx_shmtx_unlock(shard->mutex);
+
+	ngx_buffer_cache_post_demotions(demote);
+
+	return NGX_ABORT;
+}
+
+static ngx_buffer_cache_demote_t*
+ngx_buffer_cache_init_demote(ngx_buffer_cache_t* cache, ngx_buffer_cache_demote_t* demote)
+{
+	if (cache->disk == NULL)
+	{
+		return NULL;
+	}
+
+	demote->disk = cache->disk;
+	demote->expiration = cache->expiration;
+	demote->writes = NULL;
+
+	return demote;
+}
+
+ngx_flag_t
+ngx_buffer_cache_store_gather(
+	ngx_buffer_cache_t* cache, 
+	u_char* key, 
+	ngx_str_t* buffers,
+	size_t buffer_count)
+{
+	ngx_buffer_cache_demote_t demote;
+
+	return ngx_buffer_cache_store_internal(
+		cache, 
+		key, 
+		buffers, 
+		buffer_count, 
+		ngx_time(), 
+		0, 
+		ngx_buffer_cache_init_demote(cache, &demote)) == NGX_OK;
+}
+
+void
+ngx_buffer_cache_invalidate(
+	ngx_buffer_cache_t* cache,
+	u_char* key)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_shard_t* shard;
+	ngx_buffer_cache_sh_t *sh;
+	uint32_t hash;
+
+	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+
+	shard = ngx_buffer_cache_get_shard(cache, hash);
+	sh = shard->sh;
+
+	ngx_shmtx_lock(shard->mutex);
+
+	entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
+	if (!sh->reset && entry != NULL && entry->state == CES_READY)
+	{
+		// Note: the entry remains in the used queue, since the buffers are released in queue order.
+		//		outstanding pins of the entry are released since its state is no longer ready
+		ngx_rbtree_delete(&sh->rbtree, &entry->node);
+		entry->state = CES_INVALID;
+	}
+
+	ngx_shmtx_unlock(shard->mutex);
+
+	if (cache->disk != NULL)
+	{
+		ngx_buffer_cache_disk_remove(cache->disk, key);
+	}
+}
+
+// Note: called by the master, the entries that are evicted while loading are not demoted, since the thread pool
+//		is not available, the disk tier already holds them anyway
+static ngx_flag_t
+ngx_buffer_cache_load_entry(void* context, u_char* key, u_char* buffer, size_t size, time_t write_time)
+{
+	ngx_buffer_cache_t* cache = context;
+	ngx_str_t data;
+
+	if (cache->expiration != 0 && ngx_time() >= (time_t)(write_time + cache->expiration))
+	{
+		return 0;
+	}
+
+	data.data = buffer;
+	data.len = size;
+
+	return ngx_buffer_cache_store_internal(cache, key, &data, 1, write_time, 1, NULL) == NGX_OK;
+}
+
+static void
+ngx_buffer_cache_promote_completed(void* context, u_char* key, u_char* buffer, size_t size, time_t write_time)
+{
+	ngx_buffer_cache_promote_t* promote = context;
+	ngx_buffer_cache_demote_t demote;
+	ngx_buffer_cache_t* cache = promote->cache;
+	ngx_str_t data;
+
+	if (buffer != NULL &&
+		(cache->expiration == 0 || ngx_time() < (time_t)(write_time + cache->expiration)))
+	{
+		data.data = buffer;
+		data.len = size;
+
+		(void)ngx_buffer_cache_store_internal(
+			cache, 
+			key, 
+			&data, 
+			1, 
+			write_time, 
+			1, 
+			ngx_buffer_cache_init_demote(cache, &demote));
+	}
+
+	promote->handler(promote->context);
+}
+
+ngx_int_t
+ngx_buffer_cache_promote(
+	ngx_buffer_cache_t* cache,
+	ngx_pool_t* pool,
+	u_char* key,
+	ngx_buffer_cache_promote_handler_t handler,
+	void* context)
+{
+	ngx_buffer_cache_promote_t* promote;
+
+	if (cache->disk == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	promote = ngx_palloc(pool, sizeof(*promote));
+	if (promote == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	promote->cache = cache;
+	promote->handler = handler;
+	promote->context = context;
+
+	return ngx_buffer_cache_disk_read(cache->disk, pool, key, ngx_buffer_cache_promote_completed, promote);
+}
+
+static void
+ngx_buffer_cache_snapshot_cache(ngx_buffer_cache_t* cache, ngx_log_t* log)
+{
+	ngx_buffer_cache_shard_t* cur_shard;
+	ngx_buffer_cache_shard_t* last_shard;
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_queue_t* node;
+	ngx_uint_t count;
+	size_t size;
+
+	count = 0;
+	size = 0;
+
+	last_shard = cache->shards + cache->shard_count;
+	for (cur_shard = cache->shards; cur_shard < last_shard; cur_shard++)
+	{
+		sh = cur_shard->sh;
+
+		ngx_shmtx_lock(cur_shard->mutex);
+
+		// Note: a shard that has the reset flag enabled may be corrupt
+		if (!sh->reset)
+		{
+			// save the entries oldest first, so that the most recent entries get the most recent sequences
+			for (node = ngx_queue_head(&sh->used_queue);
+				node != ngx_queue_sentinel(&sh->used_queue);
+				node = ngx_queue_next(node))
+			{
+				entry = container_of(node, ngx_buffer_cache_entry_t, queue_node);
+				if (entry->state != CES_READY ||
+					(cache->expiration != 0 && ngx_time() >= (time_t)(entry->write_time + cache->expiration)))
+				{
+					continue;
+				}
+
+				if (ngx_buffer_cache_disk_store(cache->disk, entry->key, entry->start_offset, entry->buffer_size, entry->write_time))
+				{
+					count++;
+					size += entry->buffer_size;
+				}
+			}
+		}
+
+		ngx_shmtx_unlock(cur_shard->mutex);
+	}
+
+	ngx_log_error(NGX_LOG_NOTICE, log, 0,
+		"buffer cache \"%V\" saved %ui entries, %uz bytes to disk", &cache->shm_zone->shm.name, count, size);
+}
+
+void
+ngx_buffer_cache_snapshot(ngx_cycle_t* cycle)
+{
+	ngx_shm_zone_t* shm_zone;
+	ngx_list_part_t* part;
+	ngx_buffer_cache_t* cache;
+	ngx_uint_t i;
+
+	part = &cycle->shared_memory.part;
+	shm_zone = part->elts;
+
+	for (i = 0; /* void */; i++)
+	{
+		if (i >= part->nelts)
+		{
+			if (part->next == NULL)
+			{
+				break;
+			}
+
+			part = part->next;
+			shm_zone = part->elts;
+			i = 0;
+		}
+
+		if (shm_zone[i].init != ngx_buffer_cache_init)
+		{
+			continue;
+		}
+
+		cache = shm_zone[i].data;
+		if (cache->disk == NULL || cache->shpool == NULL)
+		{
+			continue;
+		}
+
+		ngx_buffer_cache_snapshot_cache(cache, cycle->log);
+	}
 }
 
 ngx_flag_t
@@ -515,44 +1440,281 @@ ngx_buffer_cache_store(
 	return ngx_buffer_cache_store_gather(cache, key, &buffer, 1);
 }
 
+void
+ngx_buffer_cache_unlock(ngx_buffer_cache_lock_t* lock)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_shard_t* shard;
+	ngx_buffer_cache_sh_t *sh;
+	uint32_t hash;
+
+	if (lock->cache == NULL)
+	{
+		return;
+	}
+
+	hash = ngx_crc32_short(lock->key, BUFFER_CACHE_KEY_SIZE);
+
+	shard = ngx_buffer_cache_get_shard(lock->cache, hash);
+	lock->cache = NULL;
+	sh = shard->sh;
+
+	ngx_shmtx_lock(shard->mutex);
+
+	// Note: if the cache was reset since the key was locked, the marker no longer exists
+	if (!sh->reset && sh->generation == lock->generation)
+	{
+		// Note: the marker may have been replaced by a stored entry, or taken over by another request
+		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, lock->key, hash);
+		if (entry != NULL && entry->state == CES_FILLING && entry->fill_id == lock->fill_id)
+		{
+			ngx_buffer_cache_free_lock_marker(sh, entry);
+		}
+	}
+
+	ngx_shmtx_unlock(shard->mutex);
+}
+
+static void
+ngx_buffer_cache_lock_cleanup(void* data)
+{
+	ngx_buffer_cache_unlock(data);
+}
+
+ngx_int_t
+ngx_buffer_cache_lock(
+	ngx_buffer_cache_t* cache,
+	ngx_pool_t* pool,
+	u_char* key,
+	time_t timeout,
+	ngx_flag_t waiting,
+	ngx_buffer_cache_lock_t** result)
+{
+	ngx_buffer_cache_demote_t demote_buffer;
+	ngx_buffer_cache_demote_t* demote;
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_shard_t* shard;
+	ngx_buffer_cache_lock_t* lock;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_pool_cleanup_t* cln;
+	uint32_t hash;
+
+	// Note: allocating the cleanup before the lookup, in order to avoid leaving a lock marker on failure
+	cln = ngx_pool_cleanup_add(pool, sizeof(ngx_buffer_cache_lock_t));
+	if (cln == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	demote = ngx_buffer_cache_init_demote(cache, &demote_buffer);
+
+	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+
+	shard = ngx_buffer_cache_get_shard(cache, hash);
+	sh = shard->sh;
+
+	ngx_shmtx_lock(shard->mutex);
+
+	if (sh->reset)
+	{
+		ngx_shmtx_unlock(shard->mutex);
+		return NGX_DECLINED;
+	}
+
+	ngx_buffer_cache_free_expired_locks(sh);
+
+	entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
+	if (entry != NULL)
+	{
+		if (entry->state != CES_FILLING)
+		{
+			// the entry already exists (may be expired, in which case it cannot be replaced anyway)
+			ngx_shmtx_unlock(shard->mutex);
+			return NGX_DECLINED;
+		}
+
+		if (ngx_time() < entry->write_time + timeout)
+		{
+			if (!waiting)
+			{
+				sh->stats.lock_wait++;
+			}
+
+			ngx_shmtx_unlock(shard->mutex);
+			return NGX_BUSY;
+		}
+
+		// the request that locked the key did not complete in time, take over the lock
+		sh->stats.lock_expired++;
+
+		// move to the end of the locks queue
+		ngx_queue_remove(&entry->queue_node);
+		ngx_queue_insert_tail(&sh->locks_queue, &entry->queue_node);
+	}
+	else
+	{
+		// enable the reset flag before we start making any changes
+		sh->reset = 1;
+
+		entry = ngx_buffer_cache_get_free_entry(sh, demote);
+		if (entry == NULL)
+		{
+			sh->reset = 0;
+			ngx_shmtx_unlock(shard->mutex);
+			ngx_buffer_cache_post_demotions(demote);
+			return NGX_DECLINED;
+		}
+
+
+		// initialize the marker
+		entry->state = CES_FILLING;
+		entry->ref_count = 0;
+		entry->node.key = hash;
+		memcpy(entry->key, key, BUFFER_CACHE_KEY_SIZE);
+		entry->start_offset = NULL;
+		entry->buffer_size = 0;
+
+		// move from free_queue to locks_queue, markers are not members of the used queue
+		ngx_queue_remove(&entry->queue_node);
+		ngx_queue_insert_tail(&sh->locks_queue, &entry->queue_node);
+
+		// insert to rbtree
+		ngx_rbtree_insert(&sh->rbtree, &entry->node);
+
+		sh->reset = 0;
+	}
+
+	entry->fill_id = ++sh->fill_id;
+	entry->access_time = entry->write_time = ngx_time();
+	entry->lock_expire = entry->write_time + timeout;
+
+	// update stats
+	sh->stats.lock_ok++;
+
+	lock = cln->data;
+	lock->cache = cache;
+	lock->generation = sh->generation;
+	lock->fill_id = entry->fill_id;
+	ngx_memcpy(lock->key, key, BUFFER_CACHE_KEY_SIZE);
+
+	ngx_shmtx_unlock(shard->mutex);
+
+	ngx_buffer_cache_post_demotions(demote);
+
+	cln->handler = ngx_buffer_cache_lock_cleanup;
+
+	if (result != NULL)
+	{
+		*result = lock;
+	}
+
+	return NGX_OK;
+}
+
 void
 ngx_buffer_cache_get_stats(
 	ngx_buffer_cache_t* cache,
 	ngx_buffer_cache_stats_t* stats)
 {
-	ngx_buffer_cache_sh_t *sh = cache->sh;
+	ngx_buffer_cache_shard_t* cur_shard;
+	ngx_buffer_cache_shard_t* last_shard;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_atomic_t* src;
+	ngx_atomic_t* dest;
+	ngx_atomic_t* dest_end;
 
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	ngx_memzero(stats, sizeof(*stats));
 
-	memcpy(stats, &sh->stats, sizeof(sh->stats));
+	dest_end = (ngx_atomic_t*)(stats + 1);
+
+	last_shard = cache->shards + cache->shard_count;
+	for (cur_shard = cache->shards; cur_shard < last_shard; cur_shard++)
+	{
+		sh = cur_shard->sh;
 
-	stats->entries = sh->entries_end - sh->entries_start;
-	stats->data_size = sh->buffers_end - sh->buffers_start;
+		ngx_shmtx_lock(cur_shard->mutex);
 
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+		// Note: all the stats are counters, so the shards are summed field by field
+		src = (ngx_atomic_t*)&sh->stats;
+		for (dest = (ngx_atomic_t*)stats; dest < dest_end; dest++, src++)
+		{
+			*dest += *src;
+		}
+
+		stats->entries += sh->entries_end - sh->entries_start;
+		stats->data_size += sh->buffers_end - sh->buffers_start;
+
+		ngx_shmtx_unlock(cur_shard->mutex);
+	}
+
+	stats->shards = cache->shard_count;
+
+	if (cache->disk != NULL)
+	{
+		ngx_buffer_cache_disk_get_stats(cache->disk, stats);
+	}
+}
+
+ngx_atomic_t*
+ngx_buffer_cache_get_pending(ngx_buffer_cache_t* cache)
+{
+	return &cache->shards[0].sh->pending;
 }
 
 void
 ngx_buffer_cache_reset_stats(ngx_buffer_cache_t* cache)
 {
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	ngx_buffer_cache_shard_t* cur_shard;
+	ngx_buffer_cache_shard_t* last_shard;
 
-	ngx_memzero(&cache->sh->stats, sizeof(cache->sh->stats));
+	last_shard = cache->shards + cache->shard_count;
+	for (cur_shard = cache->shards; cur_shard < last_shard; cur_shard++)
+	{
+		ngx_shmtx_lock(cur_shard->mutex);
+
+		ngx_memzero(&cur_shard->sh->stats, sizeof(cur_shard->sh->stats));
 
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+		ngx_shmtx_unlock(cur_shard->mutex);
+	}
+	if (cache->disk != NULL)
+	{
+		ngx_buffer_cache_disk_reset_stats(cache->disk);
+	}
 }
 
 ngx_buffer_cache_t*
-ngx_buffer_cache_create(ngx_conf_t *cf, ngx_str_t *name, size_t size, time_t expiration, void *tag)
+ngx_buffer_cache_create(ngx_conf_t *cf, ngx_str_t *name, size_t size, time_t expiration, ngx_uint_t shard_count, void *tag)
 {
 	ngx_buffer_cache_t* cache;
 
+#if !(NGX_HAVE_ATOMIC_OPS)
+	if (shard_count > 1)
+	{
+		ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+			"zone \"%V\" shards will share a single lock, atomic operations are not supported", name);
+	}
+#endif // NGX_HAVE_ATOMIC_OPS
+
+	if (shard_count > 1 && size / shard_count < MIN_SHARD_SIZE)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"zone \"%V\" is too small for %ui shards", name, shard_count);
+		return NULL;
+	}
+
 	cache = ngx_pcalloc(cf->pool, sizeof(ngx_buffer_cache_t));
 	if (cache == NULL) 
 	{
-		return NGX_CONF_ERROR;
+		return NULL;
+	}
+
+	cache->shards = ngx_pcalloc(cf->pool, sizeof(cache->shards[0]) * shard_count);
+	if (cache->shards == NULL)
+	{
+		return NULL;
 	}
 
+	cache->shard_count = shard_count;
 	cache->expiration = expiration;
 
 	cache->shm_zone = ngx_shared_memory_add(cf, name, size, tag);
@@ -565,7 +1727,7 @@ ngx_buffer_cache_create(ngx_conf_t *cf, ngx_str_t *name, size_t size, time_t exp
 	{
 		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
 			"duplicate zone \"%V\"", name);
-		return NGX_CONF_ERROR;
+		return NULL;
 	}
 
 	cache->shm_zone->init = ngx_buffer_cache_init;
@@ -573,3 +1735,27 @@ ngx_buffer_cache_create(ngx_conf_t *cf, ngx_str_t *name, size_t size, time_t exp
 
 	return cache;
 }
+
+void
+ngx_buffer_cache_enable_admission(ngx_buffer_cache_t* cache)
+{
+	cache->admission = 1;
+}
+
+ngx_flag_t
+ngx_buffer_cache_is_persistent(ngx_buffer_cache_t* cache)
+{
+	return cache->disk != NULL;
+}
+
+ngx_int_t
+ngx_buffer_cache_enable_disk(ngx_conf_t *cf, ngx_buffer_cache_t* cache, ngx_str_t* path, off_t size)
+{
+	cache->disk = ngx_buffer_cache_disk_create(cf, path, size);
+	if (cache->disk == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
@@ -11,6 +11,14 @@
 struct ngx_buffer_cache_s;
 typedef struct ngx_buffer_cache_s ngx_buffer_cache_t;
 
+struct ngx_buffer_cache_pin_s;
+typedef struct ngx_buffer_cache_pin_s ngx_buffer_cache_pin_t;
+
+struct ngx_buffer_cache_lock_s;
+typedef struct ngx_buffer_cache_lock_s ngx_buffer_cache_lock_t;
+
+typedef void(*ngx_buffer_cache_promote_handler_t)(void* context);
+
 typedef struct {
 	ngx_atomic_t store_ok;
 	ngx_atomic_t store_bytes;
@@ -22,10 +30,23 @@ typedef struct {
 	ngx_atomic_t evicted;
 	ngx_atomic_t evicted_bytes;
 	ngx_atomic_t reset;
+	ngx_atomic_t lock_ok;
+	ngx_atomic_t lock_wait;
+	ngx_atomic_t lock_expired;
+	ngx_atomic_t admit_ok;
+	ngx_atomic_t admit_reject;
 
 	// updated only when the stats are fetched
 	ngx_atomic_t entries;
 	ngx_atomic_t data_size;
+	ngx_atomic_t shards;
+	ngx_atomic_t disk_store_ok;
+	ngx_atomic_t disk_store_bytes;
+	ngx_atomic_t disk_store_err;
+	ngx_atomic_t disk_fetch_hit;
+	ngx_atomic_t disk_fetch_bytes;
+	ngx_atomic_t disk_fetch_miss;
+	ngx_atomic_t disk_fetch_invalid;
 } ngx_buffer_cache_stats_t;
 
 // functions
@@ -35,6 +56,55 @@ ngx_flag_t ngx_buffer_cache_fetch(
 	u_char** buffer,
 	size_t* buffer_size);
 
+// Note: promoted is set if the entry was loaded from the disk tier, and ngx_buffer_cache_mark_validated
+//		was not called since. the data of such entries may be older than the source it was built from
+ngx_flag_t ngx_buffer_cache_fetch_promoted(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	u_char** buffer,
+	size_t* buffer_size,
+	ngx_flag_t* promoted);
+
+// Note: checks whether the key exists without fetching it, the stats, admission sketch and access time
+//		of the entry are not updated. promoted is optional, see ngx_buffer_cache_fetch_promoted
+ngx_flag_t ngx_buffer_cache_exists(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	ngx_flag_t* promoted);
+
+void ngx_buffer_cache_mark_validated(
+	ngx_buffer_cache_t* cache,
+	u_char* key);
+
+// Note: should be called after a fetch of the key failed. returns NGX_AGAIN if the key is read from the disk 
+//		tier, the handler is called when the read completes, whether the entry was loaded to the shared memory 
+//		or not. returns NGX_DECLINED if the cache has no disk tier or the key was not found
+ngx_int_t ngx_buffer_cache_promote(
+	ngx_buffer_cache_t* cache,
+	ngx_pool_t* pool,
+	u_char* key,
+	ngx_buffer_cache_promote_handler_t handler,
+	void* context);
+
+// Note: the entry is protected from eviction until the pool is destroyed, or until ngx_buffer_cache_unpin
+//		is called, the returned buffer must not be modified
+ngx_flag_t ngx_buffer_cache_fetch_pinned(
+	ngx_buffer_cache_t* cache,
+	ngx_pool_t* pool,
+	u_char* key,
+	u_char** buffer,
+	size_t* buffer_size,
+	ngx_buffer_cache_pin_t** pin);
+
+void ngx_buffer_cache_unpin(ngx_buffer_cache_pin_t* pin);
+
+// Note: returns whether a buffer of the given size is likely to be stored, used to avoid 
+//		building expensive buffers that will not be cached
+ngx_flag_t ngx_buffer_cache_can_store(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	size_t buffer_size);
+
 ngx_flag_t ngx_buffer_cache_store(
 	ngx_buffer_cache_t* cache,
 	u_char* key,
@@ -47,17 +117,59 @@ ngx_flag_t ngx_buffer_cache_store_gather(
 	ngx_str_t* buffers,
 	size_t buffer_count);
 
+// Note: removes the entry of the key from the shared memory and from the disk tier, used when
+//		the caller finds that the entry is stale
+void ngx_buffer_cache_invalidate(
+	ngx_buffer_cache_t* cache,
+	u_char* key);
+
+// Note: returns NGX_OK if the caller should fill the entry, the lock is released when a store of the key
+//		is attempted, when ngx_buffer_cache_unlock is called or when the pool is destroyed. returns NGX_BUSY
+//		if another request is filling the entry, and NGX_DECLINED if the lock could not be taken (e.g. the 
+//		entry already exists)
+ngx_int_t ngx_buffer_cache_lock(
+	ngx_buffer_cache_t* cache,
+	ngx_pool_t* pool,
+	u_char* key,
+	time_t timeout,
+	ngx_flag_t waiting,
+	ngx_buffer_cache_lock_t** lock);
+
+void ngx_buffer_cache_unlock(ngx_buffer_cache_lock_t* lock);
+
 void ngx_buffer_cache_get_stats(
 	ngx_buffer_cache_t* cache,
 	ngx_buffer_cache_stats_t* stats);
 
 void ngx_buffer_cache_reset_stats(ngx_buffer_cache_t* cache);
 
+// Note: returns a counter in the shared memory of the cache, shared by all the worker processes, 
+//		the caller uses it for counting the background requests that fill entries of the cache
+ngx_atomic_t* ngx_buffer_cache_get_pending(ngx_buffer_cache_t* cache);
+
 ngx_buffer_cache_t* ngx_buffer_cache_create(
 	ngx_conf_t *cf, 
 	ngx_str_t *name, 
 	size_t size, 
 	time_t expiration, 
+	ngx_uint_t shard_count,
 	void *tag);
 
+// Note: returns whether the cache has a disk tier, i.e. whether its entries survive restarts
+ngx_flag_t ngx_buffer_cache_is_persistent(ngx_buffer_cache_t* cache);
+
+// Note: must be called before the shared memory zone is initialized
+void ngx_buffer_cache_enable_admission(ngx_buffer_cache_t* cache);
+
+// Note: saves the entries of all the caches that have a disk tier to disk, must be called by the master 
+//		process after the workers exited
+void ngx_buffer_cache_snapshot(ngx_cycle_t* cycle);
+
+// Note: must be called before the shared memory zone is initialized
+ngx_int_t ngx_buffer_cache_enable_disk(
+	ngx_conf_t *cf,
+	ngx_buffer_cache_t* cache,
+	ngx_str_t* path,
+	off_t size);
+
 #endif // _NGX_BUFFER_CACHE_H_INCLUDED_
\ No newline at end of file
@@ -0,0 +1,872 @@
+#include "ngx_buffer_cache_disk.h"
+
+/*
+	disk file layout:
+		header
+		index - an array of slots
+		data - a cyclic log of records
+
+	the header and the index are mapped to memory (MAP_SHARED) by the master process, so that
+	they are shared by all the workers, and persisted to the file when the processes exit.
+	the index is an open addressing hash table, a key can be placed in one of DISK_MAX_PROBES
+	consecutive slots, when all the slots are taken, the slot of the oldest record is reused.
+
+	the data section is written sequentially, when the write position reaches the end of the
+	file, it wraps around to the beginning of the data section, overwriting the oldest records.
+	index slots may therefore point to records that were overwritten, each record starts with a
+	header that contains its key and sequence, and its data is protected by a crc32 that is saved
+	in the index slot. a slot that does not match its record is ignored and freed.
+
+	all index updates are performed under a lock that is placed in the shared memory zone of the
+	cache, the file reads / writes are performed after releasing the lock. in the workers, the
+	reads / writes and the crc calculation are performed by a thread pool, the space of a record
+	is reserved before its write is posted, and its slot is updated once the write completes.
+	the records are written synchronously only when the cache is loaded / saved by the master.
+*/
+
+// constants
+#define DISK_CACHE_MAGIC (0x4b534456)		// VDSK
+#define DISK_RECORD_MAGIC (0x44524356)		// VCRD
+#define DISK_CACHE_VERSION (3)
+#define DISK_HEADER_SIZE (4096)
+#define DISK_BYTES_PER_SLOT (16 * 1024)
+#define DISK_MIN_SLOT_COUNT (1024)
+#define DISK_MAX_PROBES (8)
+#define DISK_RECORD_ALIGNMENT (16)
+#define DISK_MAX_RECORD_RATIO (4)			// a record can take up to 1/4 of the data section
+#define DISK_MAX_PENDING_SIZE (64 * 1024 * 1024)	// per worker, writes that exceed it are dropped
+
+// typedefs
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t file_size;
+	uint64_t slot_count;
+	uint64_t write_offset;
+	uint64_t sequence;
+} ngx_buffer_cache_disk_header_t;
+
+typedef struct {
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	uint64_t offset;
+	uint64_t sequence;				// zero for free slots
+	uint32_t size;
+	uint32_t crc;
+} ngx_buffer_cache_disk_slot_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t size;
+	uint64_t sequence;
+	uint64_t write_time;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+} ngx_buffer_cache_disk_record_t;
+
+struct ngx_buffer_cache_disk_s {
+	ngx_file_t file;
+	off_t size;
+	ngx_uint_t slot_count;
+	size_t map_size;
+	ngx_buffer_cache_disk_header_t* header;
+	ngx_buffer_cache_disk_slot_t* slots;
+	ngx_buffer_cache_disk_sh_t* sh;
+	ngx_shmtx_t* mutex;
+#if (NGX_THREADS)
+	ngx_thread_pool_t* thread_pool;
+#endif // NGX_THREADS
+	size_t pending_size;			// worker local, the size of the writes that did not complete
+};
+
+#if (NGX_THREADS)
+struct ngx_buffer_cache_disk_write_s {
+	ngx_thread_task_t task;
+	ngx_buffer_cache_disk_write_t* next;
+	ngx_buffer_cache_disk_t* disk;
+	off_t offset;
+	size_t size;
+	uint32_t crc;
+	ngx_flag_t failed;
+	// followed by the record
+};
+
+typedef struct {
+	ngx_buffer_cache_disk_t* disk;
+	ngx_pool_t* pool;
+	ngx_buffer_cache_disk_slot_t slot;
+	u_char* block;
+	ngx_flag_t failed;
+	ngx_buffer_cache_disk_read_handler_t handler;
+	void* context;
+} ngx_buffer_cache_disk_read_t;
+#endif // NGX_THREADS
+
+static void
+ngx_buffer_cache_disk_cleanup(void* data)
+{
+	ngx_buffer_cache_disk_t* disk = data;
+
+	if (disk->header != NULL)
+	{
+		// Note: the index is a shared file mapping, the kernel writes it back after it is unmapped
+		if (munmap(disk->header, disk->map_size) == -1)
+		{
+			ngx_log_error(NGX_LOG_ALERT, disk->file.log, ngx_errno,
+				"munmap(%uz) failed", disk->map_size);
+		}
+
+		disk->header = NULL;
+	}
+
+	if (disk->file.fd != NGX_INVALID_FILE)
+	{
+		if (ngx_close_file(disk->file.fd) == NGX_FILE_ERROR)
+		{
+			ngx_log_error(NGX_LOG_ALERT, disk->file.log, ngx_errno,
+				ngx_close_file_n " \"%V\" failed", &disk->file.name);
+		}
+
+		disk->file.fd = NGX_INVALID_FILE;
+	}
+}
+
+ngx_buffer_cache_disk_t*
+ngx_buffer_cache_disk_create(ngx_conf_t *cf, ngx_str_t* path, off_t size)
+{
+	ngx_buffer_cache_disk_t* disk;
+	ngx_pool_cleanup_t* cln;
+
+	disk = ngx_pcalloc(cf->pool, sizeof(*disk));
+	if (disk == NULL)
+	{
+		return NULL;
+	}
+
+	disk->file.name = *path;
+	if (ngx_conf_full_name(cf->cycle, &disk->file.name, 0) != NGX_OK)
+	{
+		return NULL;
+	}
+
+	disk->file.fd = NGX_INVALID_FILE;
+	disk->file.log = cf->log;
+	disk->size = size;
+
+#if (NGX_THREADS)
+	// Note: using the default thread pool, it is created implicitly if it is not configured
+	disk->thread_pool = ngx_thread_pool_add(cf, NULL);
+	if (disk->thread_pool == NULL)
+	{
+		return NULL;
+	}
+#else
+	ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+		"disk cache \"%V\" requires thread support, nginx must be built with --with-threads", &disk->file.name);
+	return NULL;
+#endif // NGX_THREADS
+
+	disk->slot_count = ngx_max(size / DISK_BYTES_PER_SLOT, DISK_MIN_SLOT_COUNT);
+	disk->map_size = ngx_align(DISK_HEADER_SIZE + disk->slot_count * sizeof(ngx_buffer_cache_disk_slot_t), DISK_HEADER_SIZE);
+
+	if (size < (off_t)disk->map_size * 2)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"disk cache \"%V\" is too small, the minimum size is %uz", &disk->file.name, disk->map_size * 2);
+		return NULL;
+	}
+
+	cln = ngx_pool_cleanup_add(cf->pool, 0);
+	if (cln == NULL)
+	{
+		return NULL;
+	}
+
+	cln->handler = ngx_buffer_cache_disk_cleanup;
+	cln->data = disk;
+
+	return disk;
+}
+
+ngx_flag_t
+ngx_buffer_cache_disk_equals(ngx_buffer_cache_disk_t* disk1, ngx_buffer_cache_disk_t* disk2)
+{
+	return disk1->size == disk2->size &&
+		disk1->file.name.len == disk2->file.name.len &&
+		ngx_memcmp(disk1->file.name.data, disk2->file.name.data, disk1->file.name.len) == 0;
+}
+
+ngx_int_t
+ngx_buffer_cache_disk_open(
+	ngx_buffer_cache_disk_t* disk,
+	ngx_buffer_cache_disk_sh_t* sh,
+	ngx_shmtx_t* mutex,
+	ngx_log_t* log)
+{
+	ngx_buffer_cache_disk_header_t* header;
+	ngx_file_info_t fi;
+	off_t file_size;
+	void* p;
+
+	disk->sh = sh;
+	disk->mutex = mutex;
+
+	if (disk->header != NULL)
+	{
+		return NGX_OK;
+	}
+
+	disk->file.log = log;
+
+	disk->file.fd = ngx_open_file(disk->file.name.data, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+	if (disk->file.fd == NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+			ngx_open_file_n " \"%V\" failed", &disk->file.name);
+		return NGX_ERROR;
+	}
+
+	if (ngx_fd_info(disk->file.fd, &fi) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+			ngx_fd_info_n " \"%V\" failed", &disk->file.name);
+		return NGX_ERROR;
+	}
+
+	file_size = ngx_file_size(&fi);
+	if (file_size != disk->size)
+	{
+		if (ftruncate(disk->file.fd, disk->size) == -1)
+		{
+			ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+				"ftruncate() \"%V\" failed", &disk->file.name);
+			return NGX_ERROR;
+		}
+	}
+
+	p = mmap(NULL, disk->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->file.fd, 0);
+	if (p == MAP_FAILED)
+	{
+		ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+			"mmap(%uz) \"%V\" failed", disk->map_size, &disk->file.name);
+		return NGX_ERROR;
+	}
+
+	header = p;
+	disk->header = header;
+	disk->slots = (ngx_buffer_cache_disk_slot_t*)((u_char*)p + DISK_HEADER_SIZE);
+
+	// validate the persisted index, a file that was resized or created by a different version is discarded
+	if (file_size == disk->size &&
+		header->magic == DISK_CACHE_MAGIC &&
+		header->version == DISK_CACHE_VERSION &&
+		header->file_size == (uint64_t)disk->size &&
+		header->slot_count == disk->slot_count &&
+		header->write_offset >= disk->map_size &&
+		header->write_offset <= (uint64_t)disk->size)
+	{
+		ngx_log_error(NGX_LOG_NOTICE, log, 0,
+			"disk cache \"%V\" opened, sequence %uL", &disk->file.name, header->sequence);
+		return NGX_OK;
+	}
+
+	ngx_log_error(NGX_LOG_NOTICE, log, 0,
+		"disk cache \"%V\" is empty or invalid, initializing", &disk->file.name);
+
+	ngx_memzero(p, disk->map_size);
+	header->magic = DISK_CACHE_MAGIC;
+	header->version = DISK_CACHE_VERSION;
+	header->file_size = disk->size;
+	header->slot_count = disk->slot_count;
+	header->write_offset = disk->map_size;
+	header->sequence = 0;
+
+	return NGX_OK;
+}
+
+/* Note: must be called with the mutex locked */
+static ngx_buffer_cache_disk_slot_t*
+ngx_buffer_cache_disk_find_slot(ngx_buffer_cache_disk_t* disk, const u_char* key, ngx_flag_t allocate)
+{
+	ngx_buffer_cache_disk_slot_t* victim = NULL;
+	ngx_buffer_cache_disk_slot_t* slot;
+	ngx_uint_t index;
+	ngx_uint_t i;
+
+	// Note: the key is an md5 hash, so its bytes can be used directly as the hash
+	index = (key[0] | (key[1] << 8) | (key[2] << 16) | ((uint32_t)key[3] << 24)) % disk->slot_count;
+
+	for (i = 0; i < DISK_MAX_PROBES; i++)
+	{
+		slot = &disk->slots[(index + i) % disk->slot_count];
+		if (slot->sequence != 0 && ngx_memcmp(slot->key, key, BUFFER_CACHE_KEY_SIZE) == 0)
+		{
+			return slot;
+		}
+
+		// prefer free slots, then the slot of the oldest record
+		if (allocate && (victim == NULL || slot->sequence < victim->sequence))
+		{
+			victim = slot;
+		}
+	}
+
+	return victim;
+}
+
+static void
+ngx_buffer_cache_disk_free_slot(ngx_buffer_cache_disk_t* disk, const u_char* key, uint64_t sequence)
+{
+	ngx_buffer_cache_disk_slot_t* slot;
+
+	ngx_shmtx_lock(disk->mutex);
+
+	// Note: the slot may have been reused since it was read
+	slot = ngx_buffer_cache_disk_find_slot(disk, key, 0);
+	if (slot != NULL && slot->sequence == sequence)
+	{
+		slot->sequence = 0;
+	}
+
+	ngx_shmtx_unlock(disk->mutex);
+}
+
+void
+ngx_buffer_cache_disk_get_stats(ngx_buffer_cache_disk_t* disk, ngx_buffer_cache_stats_t* stats)
+{
+	ngx_buffer_cache_disk_stats_t* src = &disk->sh->stats;
+
+	stats->disk_store_ok = src->store_ok;
+	stats->disk_store_bytes = src->store_bytes;
+	stats->disk_store_err = src->store_err;
+	stats->disk_fetch_hit = src->fetch_hit;
+	stats->disk_fetch_bytes = src->fetch_bytes;
+	stats->disk_fetch_miss = src->fetch_miss;
+	stats->disk_fetch_invalid = src->fetch_invalid;
+}
+
+void
+ngx_buffer_cache_disk_reset_stats(ngx_buffer_cache_disk_t* disk)
+{
+	ngx_shmtx_lock(disk->mutex);
+
+	ngx_memzero(&disk->sh->stats, sizeof(disk->sh->stats));
+
+	ngx_shmtx_unlock(disk->mutex);
+}
+
+static size_t
+ngx_buffer_cache_disk_get_record_size(ngx_buffer_cache_disk_t* disk, size_t size)
+{
+	size_t record_size;
+
+	record_size = ngx_align(sizeof(ngx_buffer_cache_disk_record_t) + size, DISK_RECORD_ALIGNMENT);
+	if (record_size > (disk->size - disk->map_size) / DISK_MAX_RECORD_RATIO)
+	{
+		return 0;
+	}
+
+	return record_size;
+}
+
+// Note: allocates space in the log and sets the sequence of the record
+static off_t
+ngx_buffer_cache_disk_reserve(ngx_buffer_cache_disk_t* disk, ngx_buffer_cache_disk_record_t* record, size_t record_size)
+{
+	ngx_buffer_cache_disk_header_t* header = disk->header;
+	off_t offset;
+
+	ngx_shmtx_lock(disk->mutex);
+
+	if (header->write_offset + record_size > (uint64_t)disk->size)
+	{
+		header->write_offset = disk->map_size;
+	}
+
+	offset = header->write_offset;
+	header->write_offset += record_size;
+
+	record->sequence = ++header->sequence;
+
+	ngx_shmtx_unlock(disk->mutex);
+
+	return offset;
+}
+
+// Note: called after the record was written, so that the slot never points to a record that is being written
+static void
+ngx_buffer_cache_disk_publish(
+	ngx_buffer_cache_disk_t* disk,
+	ngx_buffer_cache_disk_record_t* record,
+	off_t offset,
+	uint32_t crc)
+{
+	ngx_buffer_cache_disk_slot_t* slot;
+
+	ngx_shmtx_lock(disk->mutex);
+
+	slot = ngx_buffer_cache_disk_find_slot(disk, record->key, 1);
+	ngx_memcpy(slot->key, record->key, BUFFER_CACHE_KEY_SIZE);
+	slot->offset = offset;
+	slot->sequence = record->sequence;
+	slot->size = record->size;
+	slot->crc = crc;
+
+	// update stats
+	disk->sh->stats.store_ok++;
+	disk->sh->stats.store_bytes += record->size;
+
+	ngx_shmtx_unlock(disk->mutex);
+}
+
+ngx_flag_t
+ngx_buffer_cache_disk_store(
+	ngx_buffer_cache_disk_t* disk,
+	u_char* key,
+	u_char* buffer,
+	size_t size,
+	time_t write_time)
+{
+	ngx_buffer_cache_disk_record_t record;
+	size_t record_size;
+	off_t offset;
+
+	record_size = ngx_buffer_cache_disk_get_record_size(disk, size);
+	if (record_size == 0)
+	{
+		(void)ngx_atomic_fetch_add(&disk->sh->stats.store_err, 1);
+		return 0;
+	}
+
+	record.magic = DISK_RECORD_MAGIC;
+	record.size = size;
+	record.write_time = write_time;
+	ngx_memcpy(record.key, key, BUFFER_CACHE_KEY_SIZE);
+
+	offset = ngx_buffer_cache_disk_reserve(disk, &record, record_size);
+
+	if (ngx_write_file(&disk->file, (u_char*)&record, sizeof(record), offset) != sizeof(record) ||
+		ngx_write_file(&disk->file, buffer, size, offset + sizeof(record)) != (ssize_t)size)
+	{
+		(void)ngx_atomic_fetch_add(&disk->sh->stats.store_err, 1);
+		return 0;
+	}
+
+	ngx_buffer_cache_disk_publish(disk, &record, offset, ngx_crc32_long(buffer, size));
+
+	return 1;
+}
+
+// Note: verifies that the record matches the slot, the record may have been overwritten by a newer record
+static ngx_flag_t
+ngx_buffer_cache_disk_verify(ngx_buffer_cache_disk_slot_t* slot, u_char* block)
+{
+	ngx_buffer_cache_disk_record_t* record = (ngx_buffer_cache_disk_record_t*)block;
+
+	return record->magic == DISK_RECORD_MAGIC &&
+		record->sequence == slot->sequence &&
+		record->size == slot->size &&
+		ngx_memcmp(record->key, slot->key, BUFFER_CACHE_KEY_SIZE) == 0 &&
+		ngx_crc32_long(block + sizeof(*record), slot->size) == slot->crc;
+}
+
+static ngx_flag_t
+ngx_buffer_cache_disk_slot_in_range(ngx_buffer_cache_disk_t* disk, ngx_buffer_cache_disk_slot_t* slot)
+{
+	return slot->offset >= disk->map_size &&
+		slot->offset + sizeof(ngx_buffer_cache_disk_record_t) + slot->size <= (uint64_t)disk->size;
+}
+
+static u_char*
+ngx_buffer_cache_disk_read_sync(ngx_buffer_cache_disk_t* disk, ngx_buffer_cache_disk_slot_t* slot)
+{
+	size_t size;
+	u_char* block;
+
+	if (!ngx_buffer_cache_disk_slot_in_range(disk, slot))
+	{
+		return NULL;
+	}
+
+	size = sizeof(ngx_buffer_cache_disk_record_t) + slot->size;
+
+	block = ngx_alloc(size, disk->file.log);
+	if (block == NULL)
+	{
+		return NULL;
+	}
+
+	if (ngx_read_file(&disk->file, block, size, slot->offset) != (ssize_t)size ||
+		!ngx_buffer_cache_disk_verify(slot, block))
+	{
+		ngx_free(block);
+		return NULL;
+	}
+
+	return block;
+}
+
+#if (NGX_THREADS)
+
+static void
+ngx_buffer_cache_disk_write_thread(void* data, ngx_log_t* log)
+{
+	ngx_buffer_cache_disk_write_t* write = data;
+	u_char* block = (u_char*)(write + 1);
+	size_t size = sizeof(ngx_buffer_cache_disk_record_t) + write->size;
+
+	write->crc = ngx_crc32_long(block + sizeof(ngx_buffer_cache_disk_record_t), write->size);
+
+	// Note: not using ngx_write_file, since it updates the offset of the file, which is shared between the threads
+	if (pwrite(write->disk->file.fd, block, size, write->offset) != (ssize_t)size)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_buffer_cache_disk_write_thread: pwrite() \"%V\" failed", &write->disk->file.name);
+		write->failed = 1;
+	}
+}
+
+static void
+ngx_buffer_cache_disk_write_completed(ngx_event_t* ev)
+{
+	ngx_buffer_cache_disk_write_t* write = ev->data;
+	ngx_buffer_cache_disk_t* disk = write->disk;
+
+	disk->pending_size -= write->size;
+
+	if (write->failed)
+	{
+		(void)ngx_atomic_fetch_add(&disk->sh->stats.store_err, 1);
+	}
+	else
+	{
+		ngx_buffer_cache_disk_publish(disk, (ngx_buffer_cache_disk_record_t*)(write + 1), write->offset, write->crc);
+	}
+
+	ngx_free(write);
+}
+
+u_char*
+ngx_buffer_cache_disk_write_alloc(
+	ngx_buffer_cache_disk_t* disk,
+	u_char* key,
+	size_t size,
+	time_t write_time,
+	ngx_buffer_cache_disk_write_t** writes)
+{
+	ngx_buffer_cache_disk_record_t* record;
+	ngx_buffer_cache_disk_write_t* write;
+
+	if (ngx_buffer_cache_disk_get_record_size(disk, size) == 0 ||
+		disk->pending_size + size > DISK_MAX_PENDING_SIZE)
+	{
+		(void)ngx_atomic_fetch_add(&disk->sh->stats.store_err, 1);
+		return NULL;
+	}
+
+	write = ngx_alloc(sizeof(*write) + sizeof(*record) + size, disk->file.log);
+	if (write == NULL)
+	{
+		(void)ngx_atomic_fetch_add(&disk->sh->stats.store_err, 1);
+		return NULL;
+	}
+
+	ngx_memzero(write, sizeof(*write));
+	write->disk = disk;
+	write->size = size;
+
+	record = (ngx_buffer_cache_disk_record_t*)(write + 1);
+	record->magic = DISK_RECORD_MAGIC;
+	record->size = size;
+	record->write_time = write_time;
+	ngx_memcpy(record->key, key, BUFFER_CACHE_KEY_SIZE);
+
+	write->next = *writes;
+	*writes = write;
+
+	disk->pending_size += size;
+
+	return (u_char*)(record + 1);
+}
+
+void
+ngx_buffer_cache_disk_write_post(
+	ngx_buffer_cache_disk_t* disk,
+	ngx_buffer_cache_disk_write_t* writes)
+{
+	ngx_buffer_cache_disk_record_t* record;
+	ngx_buffer_cache_disk_write_t* write;
+	ngx_thread_task_t* task;
+
+	while (writes != NULL)
+	{
+		write = writes;
+		writes = write->next;
+
+		record = (ngx_buffer_cache_disk_record_t*)(write + 1);
+
+		write->offset = ngx_buffer_cache_disk_reserve(disk, record, 
+			ngx_buffer_cache_disk_get_record_size(disk, write->size));
+
+		task = &write->task;
+		task->ctx = write;
+		task->handler = ngx_buffer_cache_disk_write_thread;
+		task->event.data = write;
+		task->event.handler = ngx_buffer_cache_disk_write_completed;
+		task->event.log = disk->file.log;
+
+		if (ngx_thread_task_post(disk->thread_pool, task) != NGX_OK)
+		{
+			disk->pending_size -= write->size;
+			(void)ngx_atomic_fetch_add(&disk->sh->stats.store_err, 1);
+			ngx_free(write);
+		}
+	}
+}
+
+static void
+ngx_buffer_cache_disk_read_thread(void* data, ngx_log_t* log)
+{
+	ngx_buffer_cache_disk_read_t* read = data;
+	size_t size = sizeof(ngx_buffer_cache_disk_record_t) + read->slot.size;
+
+	if (pread(read->disk->file.fd, read->block, size, read->slot.offset) != (ssize_t)size ||
+		!ngx_buffer_cache_disk_verify(&read->slot, read->block))
+	{
+		read->failed = 1;
+	}
+}
+
+static void
+ngx_buffer_cache_disk_read_completed(ngx_event_t* ev)
+{
+	ngx_buffer_cache_disk_record_t* record;
+	ngx_buffer_cache_disk_read_t* read = ev->data;
+	ngx_buffer_cache_disk_t* disk = read->disk;
+
+	if (read->failed)
+	{
+		ngx_buffer_cache_disk_free_slot(disk, read->slot.key, read->slot.sequence);
+		(void)ngx_atomic_fetch_add(&disk->sh->stats.fetch_invalid, 1);
+
+		read->handler(read->context, read->slot.key, NULL, 0, 0);
+	}
+	else
+	{
+		(void)ngx_atomic_fetch_add(&disk->sh->stats.fetch_hit, 1);
+		(void)ngx_atomic_fetch_add(&disk->sh->stats.fetch_bytes, read->slot.size);
+
+		record = (ngx_buffer_cache_disk_record_t*)read->block;
+		read->handler(read->context, read->slot.key, (u_char*)(record + 1), read->slot.size, (time_t)record->write_time);
+	}
+
+	ngx_pfree(read->pool, read->block);
+}
+
+ngx_int_t
+ngx_buffer_cache_disk_read(
+	ngx_buffer_cache_disk_t* disk,
+	ngx_pool_t* pool,
+	u_char* key,
+	ngx_buffer_cache_disk_read_handler_t handler,
+	void* context)
+{
+	ngx_buffer_cache_disk_slot_t* slot;
+	ngx_buffer_cache_disk_read_t* read;
+	ngx_thread_task_t* task;
+
+	task = ngx_thread_task_alloc(pool, sizeof(*read));
+	if (task == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	read = task->ctx;
+
+	ngx_shmtx_lock(disk->mutex);
+
+	slot = ngx_buffer_cache_disk_find_slot(disk, key, 0);
+	if (slot == NULL)
+	{
+		disk->sh->stats.fetch_miss++;
+		ngx_shmtx_unlock(disk->mutex);
+		return NGX_DECLINED;
+	}
+
+	read->slot = *slot;
+
+	ngx_shmtx_unlock(disk->mutex);
+
+	if (!ngx_buffer_cache_disk_slot_in_range(disk, &read->slot))
+	{
+		ngx_buffer_cache_disk_free_slot(disk, key, read->slot.sequence);
+		(void)ngx_atomic_fetch_add(&disk->sh->stats.fetch_invalid, 1);
+		return NGX_DECLINED;
+	}
+
+	read->block = ngx_palloc(pool, sizeof(ngx_buffer_cache_disk_record_t) + read->slot.size);
+	if (read->block == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	read->disk = disk;
+	read->pool = pool;
+	read->failed = 0;
+	read->handler = handler;
+	read->context = context;
+
+	task->handler = ngx_buffer_cache_disk_read_thread;
+	task->event.data = read;
+	task->event.handler = ngx_buffer_cache_disk_read_completed;
+	task->event.log = disk->file.log;
+
+	if (ngx_thread_task_post(disk->thread_pool, task) != NGX_OK)
+	{
+		ngx_pfree(pool, read->block);
+		return NGX_DECLINED;
+	}
+
+	return NGX_AGAIN;
+}
+
+#else
+
+u_char*
+ngx_buffer_cache_disk_write_alloc(
+	ngx_buffer_cache_disk_t* disk,
+	u_char* key,
+	size_t size,
+	time_t write_time,
+	ngx_buffer_cache_disk_write_t** writes)
+{
+	return NULL;
+}
+
+void
+ngx_buffer_cache_disk_write_post(
+	ngx_buffer_cache_disk_t* disk,
+	ngx_buffer_cache_disk_write_t* writes)
+{
+}
+
+ngx_int_t
+ngx_buffer_cache_disk_read(
+	ngx_buffer_cache_disk_t* disk,
+	ngx_pool_t* pool,
+	u_char* key,
+	ngx_buffer_cache_disk_read_handler_t handler,
+	void* context)
+{
+	return NGX_DECLINED;
+}
+
+#endif // NGX_THREADS
+
+void
+ngx_buffer_cache_disk_remove(
+	ngx_buffer_cache_disk_t* disk,
+	u_char* key)
+{
+	ngx_buffer_cache_disk_slot_t* slot;
+
+	ngx_shmtx_lock(disk->mutex);
+
+	slot = ngx_buffer_cache_disk_find_slot(disk, key, 0);
+	if (slot != NULL)
+	{
+		slot->sequence = 0;
+	}
+
+	ngx_shmtx_unlock(disk->mutex);
+}
+
+static int ngx_libc_cdecl
+ngx_buffer_cache_disk_compare_slots(const void *one, const void *two)
+{
+	ngx_buffer_cache_disk_slot_t* first = *(ngx_buffer_cache_disk_slot_t**)one;
+	ngx_buffer_cache_disk_slot_t* second = *(ngx_buffer_cache_disk_slot_t**)two;
+
+	// newest first
+	return first->sequence > second->sequence ? -1 : (first->sequence < second->sequence ? 1 : 0);
+}
+
+void
+ngx_buffer_cache_disk_load(
+	ngx_buffer_cache_disk_t* disk,
+	size_t max_size,
+	ngx_buffer_cache_disk_load_handler_t handler,
+	void* context)
+{
+	ngx_buffer_cache_disk_slot_t** slots;
+	ngx_buffer_cache_disk_slot_t* cur_slot;
+	ngx_buffer_cache_disk_slot_t* last_slot;
+	ngx_uint_t loaded_count;
+	ngx_uint_t count;
+	ngx_uint_t i;
+	size_t loaded_size;
+	size_t total_size;
+	u_char* block;
+
+	slots = ngx_alloc(sizeof(slots[0]) * disk->slot_count, disk->file.log);
+	if (slots == NULL)
+	{
+		return;
+	}
+
+	count = 0;
+	last_slot = disk->slots + disk->slot_count;
+	for (cur_slot = disk->slots; cur_slot < last_slot; cur_slot++)
+	{
+		if (cur_slot->sequence != 0)
+		{
+			slots[count++] = cur_slot;
+		}
+	}
+
+	ngx_sort(slots, count, sizeof(slots[0]), ngx_buffer_cache_disk_compare_slots);
+
+	// take the most recent entries that fit in the memory cache
+	total_size = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (total_size + slots[i]->size > max_size)
+		{
+			break;
+		}
+
+		total_size += slots[i]->size;
+	}
+
+	// load them oldest first, so that the most recent entries are the last to be evicted
+	loaded_count = 0;
+	loaded_size = 0;
+	while (i > 0)
+	{
+		i--;
+		cur_slot = slots[i];
+
+		block = ngx_buffer_cache_disk_read_sync(disk, cur_slot);
+		if (block == NULL)
+		{
+			cur_slot->sequence = 0;
+			continue;
+		}
+
+		if (handler(
+			context, 
+			cur_slot->key, 
+			block + sizeof(ngx_buffer_cache_disk_record_t), 
+			cur_slot->size, 
+			(time_t)((ngx_buffer_cache_disk_record_t*)block)->write_time))
+		{
+			loaded_count++;
+			loaded_size += cur_slot->size;
+		}
+
+		ngx_free(block);
+	}
+
+	ngx_free(slots);
+
+	ngx_log_error(NGX_LOG_NOTICE, disk->file.log, 0,
+		"disk cache \"%V\" loaded %ui entries, %uz bytes", &disk->file.name, loaded_count, loaded_size);
+}
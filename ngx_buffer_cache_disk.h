@@ -0,0 +1,102 @@
+#ifndef _NGX_BUFFER_CACHE_DISK_H_INCLUDED_
+#define _NGX_BUFFER_CACHE_DISK_H_INCLUDED_
+
+// includes
+#include "ngx_buffer_cache.h"
+
+// typedefs
+typedef struct {
+	ngx_atomic_t store_ok;
+	ngx_atomic_t store_bytes;
+	ngx_atomic_t store_err;
+	ngx_atomic_t fetch_hit;
+	ngx_atomic_t fetch_bytes;
+	ngx_atomic_t fetch_miss;
+	ngx_atomic_t fetch_invalid;
+} ngx_buffer_cache_disk_stats_t;
+
+typedef struct {
+	ngx_shmtx_sh_t lock;
+	ngx_shmtx_t mutex;
+	ngx_buffer_cache_disk_stats_t stats;
+} ngx_buffer_cache_disk_sh_t;
+
+struct ngx_buffer_cache_disk_s;
+typedef struct ngx_buffer_cache_disk_s ngx_buffer_cache_disk_t;
+
+struct ngx_buffer_cache_disk_write_s;
+typedef struct ngx_buffer_cache_disk_write_s ngx_buffer_cache_disk_write_t;
+
+typedef ngx_flag_t(*ngx_buffer_cache_disk_load_handler_t)(void* context, u_char* key, u_char* buffer, size_t size, time_t write_time);
+
+// Note: buffer is NULL when the record could not be read
+typedef void(*ngx_buffer_cache_disk_read_handler_t)(void* context, u_char* key, u_char* buffer, size_t size, time_t write_time);
+
+// functions
+ngx_buffer_cache_disk_t* ngx_buffer_cache_disk_create(
+	ngx_conf_t *cf,
+	ngx_str_t* path,
+	off_t size);
+
+ngx_flag_t ngx_buffer_cache_disk_equals(
+	ngx_buffer_cache_disk_t* disk1,
+	ngx_buffer_cache_disk_t* disk2);
+
+// Note: must be called from the shared memory init, the file is opened and mapped in the master process,
+//		and inherited by the workers
+ngx_int_t ngx_buffer_cache_disk_open(
+	ngx_buffer_cache_disk_t* disk,
+	ngx_buffer_cache_disk_sh_t* sh,
+	ngx_shmtx_t* mutex,
+	ngx_log_t* log);
+
+void ngx_buffer_cache_disk_get_stats(
+	ngx_buffer_cache_disk_t* disk,
+	ngx_buffer_cache_stats_t* stats);
+
+void ngx_buffer_cache_disk_reset_stats(ngx_buffer_cache_disk_t* disk);
+
+// Note: writes the record synchronously, must not be called by the workers
+ngx_flag_t ngx_buffer_cache_disk_store(
+	ngx_buffer_cache_disk_t* disk,
+	u_char* key,
+	u_char* buffer,
+	size_t size,
+	time_t write_time);
+
+// Note: allocates a write of the given size and adds it to the writes list, the caller copies the data
+//		to the returned buffer. returns NULL if the write cannot be performed (e.g. too many pending writes)
+u_char* ngx_buffer_cache_disk_write_alloc(
+	ngx_buffer_cache_disk_t* disk,
+	u_char* key,
+	size_t size,
+	time_t write_time,
+	ngx_buffer_cache_disk_write_t** writes);
+
+// Note: posts the writes to the thread pool, the writes are freed when they complete
+void ngx_buffer_cache_disk_write_post(
+	ngx_buffer_cache_disk_t* disk,
+	ngx_buffer_cache_disk_write_t* writes);
+
+// Note: returns NGX_AGAIN if the record of the key is read by the thread pool, the handler is called
+//		when the read completes. returns NGX_DECLINED if the key was not found
+ngx_int_t ngx_buffer_cache_disk_read(
+	ngx_buffer_cache_disk_t* disk,
+	ngx_pool_t* pool,
+	u_char* key,
+	ngx_buffer_cache_disk_read_handler_t handler,
+	void* context);
+
+void ngx_buffer_cache_disk_remove(
+	ngx_buffer_cache_disk_t* disk,
+	u_char* key);
+
+// Note: calls the handler on the most recently stored entries, up to max_size bytes, oldest first.
+//		must be called before the workers are started
+void ngx_buffer_cache_disk_load(
+	ngx_buffer_cache_disk_t* disk,
+	size_t max_size,
+	ngx_buffer_cache_disk_load_handler_t handler,
+	void* context);
+
+#endif // _NGX_BUFFER_CACHE_DISK_H_INCLUDED_
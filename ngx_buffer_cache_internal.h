@@ -2,6 +2,7 @@
 #define _NGX_BUFFER_CACHE_INTERNAL_H_INCLUDED_
 
 #include "ngx_buffer_cache.h"
+#include "ngx_buffer_cache_disk.h"
 #include "ngx_queue.h"
 
 // macros
@@ -10,15 +11,25 @@
 // constants
 #define CACHE_LOCK_EXPIRATION (5)
 #define ENTRY_LOCK_EXPIRATION (5)
+#define ENTRY_PIN_EXPIRATION (60)		// a reset waits for the outstanding pins up to this time (e.g. a worker crashed while holding a pin)
 #define ENTRIES_ALLOC_MARGIN (1024)		// 1K entries ~= 100KB, we reserve this space to make sure allocating entries does not become the bottleneck
 #define BUFFER_ALIGNMENT (16)
 #define MAX_EVICTIONS_PER_STORE (128)
+#define MIN_SHARD_SIZE (ENTRIES_ALLOC_MARGIN * sizeof(ngx_buffer_cache_entry_t) * 2)
+#define SKETCH_DEPTH (4)
+#define SKETCH_MIN_WIDTH (1024)
+#define SKETCH_MAX_WIDTH (1024 * 1024)
+#define SKETCH_SHARD_SIZE_PER_COUNTER (16 * 1024)	// 1 counter per row for every 16KB of shard size
+#define SKETCH_MAX_COUNT (15)
+#define SKETCH_SAMPLE_FACTOR (8)		// counters are halved after width * factor increments
 
 // enums
 enum {
 	CES_FREE,
 	CES_ALLOCATED,
 	CES_READY,
+	CES_FILLING,		// lock marker, has no buffer and is a member of the locks queue
+	CES_INVALID,		// removed from the rb tree, the buffer is released when the entry is evicted
 };
 
 // typedefs
@@ -28,18 +39,34 @@ typedef struct {
 	u_char* start_offset;
 	size_t buffer_size;
 	ngx_atomic_t state;
+	ngx_uint_t ref_count;
+	ngx_uint_t fill_id;			// identifies the lock marker / stored entry that uses the entry
 	time_t access_time;
 	time_t write_time;
+	time_t lock_expire;			// lock markers only, the time the lock expires
+	unsigned promoted:1;		// loaded from the disk tier, and not validated since
+	unsigned on_disk:1;			// the disk tier has a copy of the entry, it is not written when evicted
 	u_char key[BUFFER_CACHE_KEY_SIZE];
 } ngx_buffer_cache_entry_t;
 
 typedef struct {
+	ngx_shmtx_sh_t lock;
+	ngx_shmtx_t mutex;
 	ngx_atomic_t reset;
+	ngx_atomic_t pending;		// first shard only, see ngx_buffer_cache_get_pending
+	ngx_uint_t generation;
+	ngx_uint_t fill_id;
+	ngx_uint_t pin_count;		// number of outstanding pins
+	time_t pin_time;			// the time of the last pin
 	time_t access_time;
+	u_char* sketch;
+	ngx_uint_t sketch_width;
+	ngx_uint_t sketch_additions;
 	ngx_rbtree_t rbtree;
 	ngx_rbtree_node_t sentinel;
 	ngx_queue_t used_queue;
 	ngx_queue_t free_queue;
+	ngx_queue_t locks_queue;	// lock markers, in lock order
 	ngx_buffer_cache_entry_t* entries_start;
 	ngx_buffer_cache_entry_t* entries_end;
 	u_char* buffers_start;
@@ -49,11 +76,45 @@ typedef struct {
 	ngx_buffer_cache_stats_t stats;
 } ngx_buffer_cache_sh_t;
 
-struct ngx_buffer_cache_s {
+typedef struct {
 	ngx_buffer_cache_sh_t *sh;
+	ngx_shmtx_t *mutex;
+} ngx_buffer_cache_shard_t;
+
+struct ngx_buffer_cache_pin_s {
+	ngx_buffer_cache_shard_t *shard;
+	ngx_buffer_cache_entry_t *entry;		// NULL when released
+	ngx_uint_t generation;
+	ngx_uint_t fill_id;
+};
+
+struct ngx_buffer_cache_lock_s {
+	ngx_buffer_cache_t *cache;			// NULL when released
+	ngx_uint_t generation;
+	ngx_uint_t fill_id;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+};
+
+typedef struct {
+	ngx_buffer_cache_disk_t* disk;
+	uint32_t expiration;
+	ngx_buffer_cache_disk_write_t* writes;	// the entries that were evicted while the lock was held
+} ngx_buffer_cache_demote_t;
+
+typedef struct {
+	ngx_buffer_cache_t* cache;
+	ngx_buffer_cache_promote_handler_t handler;
+	void* context;
+} ngx_buffer_cache_promote_t;
+
+struct ngx_buffer_cache_s {
+	ngx_buffer_cache_shard_t *shards;
+	ngx_uint_t shard_count;
 	ngx_slab_pool_t *shpool;
 
 	uint32_t expiration;
+	ngx_flag_t admission;
+	ngx_buffer_cache_disk_t* disk;		// optional, persistent second tier
 
 	ngx_shm_zone_t *shm_zone;
 };
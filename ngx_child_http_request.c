@@ -14,7 +14,7 @@
 #define is_in_memory(ctx) (ctx->response_buffer != NULL)
 
 // typedefs
-typedef struct {
+typedef struct ngx_child_request_context_s {
 
 	// fixed
 	ngx_child_request_callback_t callback;
@@ -23,6 +23,9 @@ typedef struct {
 	// deferred init
 	ngx_buf_t* response_buffer;
 	ngx_list_t upstream_headers;
+	ngx_child_request_response_info_t* response_info;
+	size_t max_response_size;
+	ngx_int_t(*original_input_filter_init)(void *data);
 
 	// temporary completion state
 	ngx_http_upstream_t *upstream;
@@ -34,8 +37,33 @@ typedef struct {
 	ngx_flag_t dont_send_header;
 	ngx_int_t send_header_result;
 
+	// completed child requests that were not handled yet
+	struct ngx_child_request_context_s* next_completed;
+
 } ngx_child_request_context_t;
 
+typedef struct {
+	ngx_http_request_t* r;
+	ngx_child_request_callback_t callback;
+	void* callback_context;
+	ngx_child_request_params_t params;
+	ngx_child_request_hedge_params_t* hedge;
+	ngx_child_request_response_info_t* response_info;		// the caller response info
+
+	// Note: each request writes to a private buffer, the caller buffer is written only by the winner
+	ngx_buf_t response_buffer;		// the caller buffer
+	ngx_buf_t primary_buffer;
+	ngx_buf_t hedge_buffer;
+	ngx_buf_t result_buffer;
+	ngx_http_request_t* primary_request;
+	ngx_http_request_t* hedge_request;
+	ngx_child_request_response_info_t primary_info;
+	ngx_child_request_response_info_t hedge_info;
+	ngx_event_t timer;
+	ngx_uint_t pending;
+	ngx_flag_t completed;
+} ngx_child_request_hedge_ctx_t;
+
 typedef struct {
 	ngx_str_t name;
 	off_t offset;
@@ -44,6 +72,10 @@ typedef struct {
 // constants
 static ngx_str_t ngx_http_vod_head_method = { 4, (u_char *) "HEAD " };
 
+static ngx_str_t etag_key = ngx_string("ETag");
+static ngx_str_t last_modified_key = ngx_string("Last-Modified");
+static ngx_str_t content_range_key = ngx_string("Content-Range");
+
 static ngx_str_t range_key = ngx_string("Range");
 static u_char* range_lowcase_key = (u_char*)"range";
 static ngx_uint_t range_hash =
@@ -85,14 +117,142 @@ static ngx_child_request_hide_header_t hide_headers[] = {
 static ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 static ngx_hash_t hide_headers_hash;
 
+static ngx_int_t
+ngx_child_request_get_error_code(
+	ngx_http_request_t *r, 
+	ngx_child_request_context_t* ctx, 
+	ngx_http_upstream_t *u, 
+	ngx_int_t rc)
+{
+	if (rc == NGX_OK && is_in_memory(ctx))
+	{
+		if (u->headers_in.status_n != NGX_HTTP_OK && u->headers_in.status_n != NGX_HTTP_PARTIAL_CONTENT)
+		{
+			if (u->headers_in.status_n != 0)
+			{
+				ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+					"ngx_child_request_get_error_code: upstream returned a bad status %ui", u->headers_in.status_n);
+			}
+			else
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_child_request_get_error_code: failed to get upstream status");
+			}
+			rc = NGX_HTTP_BAD_GATEWAY;
+		}
+		else if (u->length != 0 && u->length != -1 && !u->headers_in.chunked)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_child_request_get_error_code: upstream connection was closed with %O bytes left to read", u->length);
+			rc = NGX_HTTP_BAD_GATEWAY;
+		}
+	}
+	else if (rc == NGX_ERROR)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_get_error_code: got error -1, changing to 502");
+		rc = NGX_HTTP_BAD_GATEWAY;
+	}
+
+	if (ctx->send_header_result != NGX_OK)
+	{
+		rc = ctx->send_header_result;
+	}
+
+	return rc;
+}
+
+static ngx_int_t
+ngx_child_request_get_response_info(
+	ngx_http_request_t *r,
+	ngx_http_upstream_t *u,
+	ngx_child_request_response_info_t* info)
+{
+	ngx_table_elt_t* last_modified = NULL;
+	ngx_table_elt_t* etag = NULL;
+	ngx_table_elt_t* h;
+	ngx_list_part_t* part;
+	ngx_uint_t i;
+	u_char* p;
+
+	info->validator.len = 0;
+	info->total_size = -1;
+
+	part = &u->headers_in.headers.part;
+	h = part->elts;
+
+	for (i = 0; ; i++)
+	{
+		if (i >= part->nelts)
+		{
+			if (part->next == NULL)
+			{
+				break;
+			}
+
+			part = part->next;
+			h = part->elts;
+			i = 0;
+		}
+
+		if (h[i].key.len == etag_key.len &&
+			ngx_strncasecmp(h[i].key.data, etag_key.data, etag_key.len) == 0)
+		{
+			etag = &h[i];
+		}
+		else if (h[i].key.len == last_modified_key.len &&
+			ngx_strncasecmp(h[i].key.data, last_modified_key.data, last_modified_key.len) == 0)
+		{
+			last_modified = &h[i];
+		}
+		else if (h[i].key.len == content_range_key.len &&
+			ngx_strncasecmp(h[i].key.data, content_range_key.data, content_range_key.len) == 0)
+		{
+			// Note: the format is "bytes start-end/total", total is "*" when unknown
+			p = ngx_strlchr(h[i].value.data, h[i].value.data + h[i].value.len, '/');
+			if (p != NULL)
+			{
+				p++;
+				info->total_size = ngx_atoof(p, h[i].value.data + h[i].value.len - p);
+			}
+		}
+	}
+
+	if (etag == NULL)
+	{
+		etag = last_modified;
+	}
+
+	if (etag == NULL)
+	{
+		return NGX_OK;
+	}
+
+	// Note: the header value may point to the response buffer, which is owned by the caller
+	info->validator.data = ngx_pstrdup(r->pool, &etag->value);
+	if (info->validator.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_get_response_info: ngx_pstrdup failed");
+		return NGX_ERROR;
+	}
+	info->validator.len = etag->value.len;
+
+	return NGX_OK;
+}
+
 static void
 ngx_child_request_wev_handler(ngx_http_request_t *r)
 {
+	ngx_child_request_context_t* next;
 	ngx_child_request_context_t* ctx;
 	ngx_http_upstream_t *u;
+	ngx_connection_t* c;
 	ngx_int_t rc;
 	off_t content_length;
 
+	c = r->connection;
+
 	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
 
 	// restore the write event handler
@@ -102,6 +262,9 @@ ngx_child_request_wev_handler(ngx_http_request_t *r)
 	// restore the original context
 	ngx_http_set_ctx(r, ctx->original_context, ngx_http_vod_module);
 
+	next = ctx->next_completed;
+	ctx->next_completed = NULL;
+
 	// get the completed upstream
 	u = ctx->upstream;
 	ctx->upstream = NULL;
@@ -132,40 +295,11 @@ ngx_child_request_wev_handler(ngx_http_request_t *r)
 	}
 
 	// get the final error code
-	rc = ctx->error_code;
-	if (rc == NGX_OK && is_in_memory(ctx))
-	{
-		if (u->headers_in.status_n != NGX_HTTP_OK && u->headers_in.status_n != NGX_HTTP_PARTIAL_CONTENT)
-		{
-			if (u->headers_in.status_n != 0)
-			{
-				ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-					"ngx_child_request_wev_handler: upstream returned a bad status %ui", u->headers_in.status_n);
-			}
-			else
-			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-					"ngx_child_request_wev_handler: failed to get upstream status");
-			}
-			rc = NGX_HTTP_BAD_GATEWAY;
-		}
-		else if (u->length != 0 && u->length != -1 && !u->headers_in.chunked)
-		{
-			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-				"ngx_child_request_wev_handler: upstream connection was closed with %O bytes left to read", u->length);
-			rc = NGX_HTTP_BAD_GATEWAY;
-		}
-	}
-	else if (rc == NGX_ERROR)
-	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_child_request_wev_handler: got error -1, changing to 502");
-		rc = NGX_HTTP_BAD_GATEWAY;
-	}
+	rc = ngx_child_request_get_error_code(r, ctx, u, ctx->error_code);
 
-	if (ctx->send_header_result != NGX_OK)
+	if (rc == NGX_OK && ctx->response_info != NULL)
 	{
-		rc = ctx->send_header_result;
+		rc = ngx_child_request_get_response_info(r, u, ctx->response_info);
 	}
 
 	// get the content length
@@ -201,6 +335,25 @@ ngx_child_request_wev_handler(ngx_http_request_t *r)
 			ngx_http_finalize_request(r, rc);
 		}
 	}
+
+	if (next == NULL || c->destroyed)
+	{
+		return;
+	}
+
+	// handle the next completed child request
+	// Note: the request is still alive since the next child request was not finalized yet
+	next->original_write_event_handler = r->write_event_handler;
+	r->write_event_handler = ngx_child_request_wev_handler;
+
+	next->original_context = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	ngx_http_set_ctx(r, next, ngx_http_vod_module);
+
+#if defined(nginx_version) && nginx_version >= 8012
+	ngx_http_post_request(r, NULL);
+#else
+	ngx_http_post_request(r);
+#endif
 }
 
 static ngx_int_t
@@ -210,6 +363,7 @@ ngx_child_request_finished_handler(
 	ngx_int_t rc)
 {
 	ngx_http_request_t          *pr;
+	ngx_child_request_context_t* pending;
 	ngx_child_request_context_t* ctx;
 
 	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -232,9 +386,22 @@ ngx_child_request_finished_handler(
 		return NGX_ERROR;
 	}
 
-	// replace the parent write event handler
 	pr = r->parent;
 
+	if (pr->write_event_handler == ngx_child_request_wev_handler)
+	{
+		// the completion of another child request was not handled yet (e.g. concurrent requests),
+		//	handle this one after it, the parent context must not be replaced before the callback is called
+		pending = ngx_http_get_module_ctx(pr, ngx_http_vod_module);
+		while (pending->next_completed != NULL)
+		{
+			pending = pending->next_completed;
+		}
+		pending->next_completed = ctx;
+		return NGX_OK;
+	}
+
+	// replace the parent write event handler
 	ctx->original_write_event_handler = pr->write_event_handler;
 	pr->write_event_handler = ngx_child_request_wev_handler;
 
@@ -258,6 +425,80 @@ ngx_child_request_finished_handler(
 	return NGX_OK;
 }
 
+#if defined(NGX_HTTP_SUBREQUEST_BACKGROUND)
+static ngx_int_t
+ngx_child_request_background_finished_handler(
+	ngx_http_request_t *r,
+	void *data,
+	ngx_int_t rc)
+{
+	ngx_child_request_context_t* ctx = data;
+	ngx_http_upstream_t* u = r->upstream;
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_child_request_background_finished_handler: error code %ui", rc);
+
+	// make sure we are not called twice for the same request
+	r->post_subrequest = NULL;
+
+	// Note: the parent request is not blocked by background requests, the callback is called directly
+	if (u == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_child_request_background_finished_handler: unexpected, upstream is null");
+		ctx->callback(ctx->callback_context, NGX_HTTP_BAD_GATEWAY, ctx->response_buffer, 0);
+		return NGX_OK;
+	}
+
+	rc = ngx_child_request_get_error_code(r, ctx, u, rc);
+
+	ctx->callback(ctx->callback_context, rc, &u->buffer, u->buffer.last - u->buffer.pos);
+
+	return NGX_OK;
+}
+#endif // NGX_HTTP_SUBREQUEST_BACKGROUND
+
+static ngx_int_t
+ngx_child_request_input_filter_init(void *data)
+{
+	ngx_child_request_context_t* ctx;
+	ngx_http_request_t* r = data;
+	ngx_http_upstream_t* u = r->upstream;
+	ngx_buf_t* b = &u->buffer;
+	off_t content_length;
+	size_t size;
+	u_char* p;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	// Note: called after the headers were parsed, the buffer holds the beginning of the body
+	content_length = u->headers_in.content_length_n;
+	if (content_length >= (off_t)(b->end - b->pos) &&
+		content_length < (off_t)ctx->max_response_size)
+	{
+		// leave room for detecting responses that are too big
+		size = content_length + 1;
+
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_input_filter_init: allocating a response buffer of %uz bytes", size);
+
+		p = ngx_palloc(r->pool, size);
+		if (p == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_child_request_input_filter_init: ngx_palloc failed");
+			return NGX_ERROR;
+		}
+
+		b->last = ngx_copy(p, b->pos, b->last - b->pos);
+		b->start = p;
+		b->pos = p;
+		b->end = p + size;
+	}
+
+	return ctx->original_input_filter_init(data);
+}
+
 static void
 ngx_child_request_initial_wev_handler(ngx_http_request_t *r)
 {
@@ -301,6 +542,15 @@ ngx_child_request_initial_wev_handler(ngx_http_request_t *r)
 	// initialize the headers list
 	u->headers_in.headers = ctx->upstream_headers;
 	u->headers_in.headers.last = &u->headers_in.headers.part;
+
+	// Note: the input filter context of the proxy module is the request
+	if (ctx->max_response_size > 0 && 
+		u->input_filter_init != NULL && 
+		u->input_filter_ctx == r)
+	{
+		ctx->original_input_filter_init = u->input_filter_init;
+		u->input_filter_init = ngx_child_request_input_filter_init;
+	}
 }
 
 static ngx_int_t
@@ -445,14 +695,16 @@ ngx_child_request_copy_headers(
 	return NGX_OK;
 }
 
-ngx_int_t
-ngx_child_request_start(
+static ngx_int_t
+ngx_child_request_start_internal(
 	ngx_http_request_t *r,
 	ngx_child_request_callback_t callback,
 	void* callback_context,
 	ngx_str_t* internal_location,
 	ngx_child_request_params_t* params,
-	ngx_buf_t* response_buffer)
+	ngx_buf_t* response_buffer,
+	ngx_flag_t background,
+	ngx_http_request_t** result)
 {
 	ngx_child_request_context_t* child_ctx;
 	ngx_http_post_subrequest_t *psr;
@@ -474,6 +726,8 @@ ngx_child_request_start(
 	child_ctx->callback = callback;
 	child_ctx->callback_context = callback_context;
 	child_ctx->response_buffer = response_buffer;
+	child_ctx->response_info = params->response_info;
+	child_ctx->max_response_size = params->max_response_size;
 
 	// build the subrequest uri
 	uri.data = ngx_pnalloc(r->pool, internal_location->len + params->base_uri.len + 1);
@@ -497,8 +751,18 @@ ngx_child_request_start(
 		return NGX_ERROR;
 	}
 
-	psr->handler = ngx_child_request_finished_handler;
-	psr->data = r;
+#if defined(NGX_HTTP_SUBREQUEST_BACKGROUND)
+	if (background)
+	{
+		psr->handler = ngx_child_request_background_finished_handler;
+		psr->data = child_ctx;
+	}
+	else
+#endif // NGX_HTTP_SUBREQUEST_BACKGROUND
+	{
+		psr->handler = ngx_child_request_finished_handler;
+		psr->data = r;
+	}
 
 	if (is_in_memory(child_ctx))
 	{
@@ -517,6 +781,13 @@ ngx_child_request_start(
 		flags = NGX_HTTP_SUBREQUEST_WAITED;
 	}
 
+#if defined(NGX_HTTP_SUBREQUEST_BACKGROUND)
+	if (background)
+	{
+		flags = NGX_HTTP_SUBREQUEST_IN_MEMORY | NGX_HTTP_SUBREQUEST_BACKGROUND;
+	}
+#endif // NGX_HTTP_SUBREQUEST_BACKGROUND
+
 	rc = ngx_http_subrequest(r, &uri, &params->extra_args, &sr, psr, flags);
 	if (rc == NGX_ERROR)
 	{
@@ -552,6 +823,366 @@ ngx_child_request_start(
 	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 		"ngx_child_request_start: completed successfully sr=%p", sr);
 
+	if (result != NULL)
+	{
+		*result = sr;
+	}
+
+	return NGX_AGAIN;
+}
+
+ngx_int_t
+ngx_child_request_start(
+	ngx_http_request_t *r,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_str_t* internal_location,
+	ngx_child_request_params_t* params,
+	ngx_buf_t* response_buffer)
+{
+	return ngx_child_request_start_internal(
+		r,
+		callback,
+		callback_context,
+		internal_location,
+		params,
+		response_buffer,
+		0,
+		NULL);
+}
+
+ngx_int_t
+ngx_child_request_start_background(
+	ngx_http_request_t *r,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_str_t* internal_location,
+	ngx_child_request_params_t* params,
+	ngx_buf_t* response_buffer)
+{
+#if defined(NGX_HTTP_SUBREQUEST_BACKGROUND)
+	return ngx_child_request_start_internal(
+		r,
+		callback,
+		callback_context,
+		internal_location,
+		params,
+		response_buffer,
+		1,
+		NULL);
+#else
+	return NGX_DECLINED;
+#endif // NGX_HTTP_SUBREQUEST_BACKGROUND
+}
+
+////// Hedged requests
+
+static ngx_int_t
+ngx_child_request_hedge_alloc_buffer(ngx_child_request_hedge_ctx_t* hctx, ngx_buf_t* buf)
+{
+	ngx_buf_t* b = &hctx->response_buffer;
+	size_t size;
+
+	// allocate a buffer with the same layout as the caller buffer
+	size = b->end - b->start;
+
+	buf->start = ngx_palloc(hctx->r->pool, size);
+	if (buf->start == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, hctx->r->connection->log, 0,
+			"ngx_child_request_hedge_alloc_buffer: ngx_palloc failed");
+		return NGX_ERROR;
+	}
+
+	buf->pos = buf->start + (b->pos - b->start);
+	buf->last = buf->start + (b->last - b->start);
+	buf->end = buf->start + size;
+	buf->temporary = 1;
+
+	return NGX_OK;
+}
+
+static void
+ngx_child_request_hedge_abort(ngx_child_request_hedge_ctx_t* hctx, ngx_http_request_t* sr)
+{
+	ngx_http_upstream_t* u;
+	ngx_connection_t* c;
+
+	if (sr == NULL || sr->post_subrequest == NULL)
+	{
+		// not issued / already finished, the completion is queued on the parent
+		return;
+	}
+
+	u = sr->upstream;
+	if (u == NULL || u->cleanup == NULL || u->peer.connection == NULL)
+	{
+		// the upstream was not connected yet (e.g. resolving), let it complete and discard the response
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, hctx->r->connection->log, 0,
+			"ngx_child_request_hedge_abort: upstream not connected, the response will be discarded");
+		return;
+	}
+
+	ngx_log_error(NGX_LOG_INFO, hctx->r->connection->log, 0,
+		"ngx_child_request_hedge_abort: aborting the request that lost the race");
+
+	// Note: nginx has no api for aborting a subrequest, calling u->cleanup finalizes the subrequest with 
+	//		NGX_DONE, which skips the post subrequest handler and leaves it in the postponed list of the parent.
+	//		instead, the upstream read event is posted as timed out, the upstream then finalizes the subrequest
+	//		through the regular error path (without trying another peer), and the completion callback discards
+	//		the response. the event is posted, since the parent is in the middle of handling the winner
+	u->peer.tries = 1;
+
+	c = u->peer.connection;
+	c->read->timedout = 1;
+	ngx_post_event(c->read, &ngx_posted_events);
+}
+
+static void
+ngx_child_request_hedge_complete(
+	ngx_child_request_hedge_ctx_t* hctx, 
+	ngx_int_t rc, 
+	ngx_buf_t* buf, 
+	ngx_child_request_response_info_t* info,
+	ngx_http_request_t* loser)
+{
+	hctx->completed = 1;
+
+	if (hctx->timer.timer_set)
+	{
+		ngx_del_timer(&hctx->timer);
+	}
+
+	if (hctx->pending > 0)
+	{
+		ngx_child_request_hedge_abort(hctx, loser);
+	}
+
+	if (rc != NGX_OK)
+	{
+		hctx->callback(hctx->callback_context, rc, &hctx->response_buffer, 0);
+		return;
+	}
+
+	// copy the response body to the caller buffer
+	hctx->result_buffer = hctx->response_buffer;
+	hctx->result_buffer.pos = hctx->result_buffer.last;
+	hctx->result_buffer.last = ngx_copy(hctx->result_buffer.last, buf->pos, buf->last - buf->pos);
+
+	if (hctx->response_info != NULL)
+	{
+		*hctx->response_info = *info;
+	}
+
+	// the request completed, its buffer is no longer referenced
+	ngx_pfree(hctx->r->pool, buf->start);
+
+	hctx->callback(
+		hctx->callback_context, 
+		NGX_OK, 
+		&hctx->result_buffer, 
+		hctx->result_buffer.last - hctx->result_buffer.pos);
+}
+
+static void
+ngx_child_request_hedge_discard(ngx_child_request_hedge_ctx_t* hctx, ngx_int_t rc, ngx_buf_t* buf)
+{
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, hctx->r->connection->log, 0,
+		"ngx_child_request_hedge_discard: discarding the response, rc %i", rc);
+
+	ngx_pfree(hctx->r->pool, buf->start);
+}
+
+static void
+ngx_child_request_hedge_primary_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+{
+	ngx_child_request_hedge_ctx_t* hctx = context;
+
+	hctx->pending--;
+
+	if (hctx->completed)
+	{
+		ngx_child_request_hedge_discard(hctx, rc, &hctx->primary_buffer);
+		return;
+	}
+
+	if (rc != NGX_OK && hctx->pending > 0)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, hctx->r->connection->log, 0,
+			"ngx_child_request_hedge_primary_completed: request failed %i, waiting for the hedged request", rc);
+		ngx_child_request_hedge_discard(hctx, rc, &hctx->primary_buffer);
+		return;
+	}
+
+	ngx_child_request_hedge_complete(hctx, rc, buf, &hctx->primary_info, hctx->hedge_request);
+}
+
+static void
+ngx_child_request_hedge_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+{
+	ngx_child_request_hedge_ctx_t* hctx = context;
+
+	hctx->pending--;
+
+	if (hctx->completed)
+	{
+		ngx_child_request_hedge_discard(hctx, rc, &hctx->hedge_buffer);
+		return;
+	}
+
+	if (rc != NGX_OK && hctx->pending > 0)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, hctx->r->connection->log, 0,
+			"ngx_child_request_hedge_completed: request failed %i, waiting for the primary request", rc);
+		ngx_child_request_hedge_discard(hctx, rc, &hctx->hedge_buffer);
+		return;
+	}
+
+	if (rc == NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, hctx->r->connection->log, 0,
+			"ngx_child_request_hedge_completed: the hedged request won");
+
+		hctx->hedge->won = 1;
+	}
+
+	ngx_child_request_hedge_complete(hctx, rc, buf, &hctx->hedge_info, hctx->primary_request);
+}
+
+static void
+ngx_child_request_hedge_timer_handler(ngx_event_t* ev)
+{
+	ngx_child_request_hedge_ctx_t* hctx = ev->data;
+	ngx_child_request_params_t params;
+	ngx_http_request_t* r = hctx->r;
+	ngx_connection_t* c = r->connection;
+	ngx_int_t rc;
+
+	if (hctx->completed)
+	{
+		return;
+	}
+
+	if (ngx_child_request_hedge_alloc_buffer(hctx, &hctx->hedge_buffer) != NGX_OK)
+	{
+		return;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+		"ngx_child_request_hedge_timer_handler: issuing a hedged request to %V", hctx->hedge->location);
+
+	params = hctx->params;
+	params.response_info = &hctx->hedge_info;
+
+	rc = ngx_child_request_start_internal(
+		r,
+		ngx_child_request_hedge_completed,
+		hctx,
+		hctx->hedge->location,
+		&params,
+		&hctx->hedge_buffer,
+		0,
+		&hctx->hedge_request);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_log_error(NGX_LOG_WARN, c->log, 0,
+			"ngx_child_request_hedge_timer_handler: failed to start hedged request %i", rc);
+		return;
+	}
+
+	hctx->pending++;
+	hctx->hedge->issued = 1;
+
+	ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_child_request_hedge_cleanup(void* data)
+{
+	ngx_child_request_hedge_ctx_t* hctx = data;
+
+	if (hctx->timer.timer_set)
+	{
+		ngx_del_timer(&hctx->timer);
+	}
+}
+
+ngx_int_t
+ngx_child_request_start_hedged(
+	ngx_http_request_t *r,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_str_t* internal_location,
+	ngx_child_request_params_t* params,
+	ngx_buf_t* response_buffer,
+	ngx_child_request_hedge_params_t* hedge)
+{
+	ngx_child_request_hedge_ctx_t* hctx;
+	ngx_pool_cleanup_t* cln;
+	ngx_int_t rc;
+
+	hedge->issued = 0;
+	hedge->won = 0;
+
+	hctx = ngx_pcalloc(r->pool, sizeof(*hctx));
+	if (hctx == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_start_hedged: ngx_pcalloc failed");
+		return NGX_ERROR;
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_start_hedged: ngx_pool_cleanup_add failed");
+		return NGX_ERROR;
+	}
+
+	cln->handler = ngx_child_request_hedge_cleanup;
+	cln->data = hctx;
+
+	hctx->r = r;
+	hctx->callback = callback;
+	hctx->callback_context = callback_context;
+	hctx->params = *params;
+	hctx->hedge = hedge;
+	hctx->response_info = params->response_info;
+	hctx->response_buffer = *response_buffer;
+
+	// Note: the primary request can't write to the caller buffer, since aborting it in case the hedged
+	//		request wins is asynchronous
+	rc = ngx_child_request_hedge_alloc_buffer(hctx, &hctx->primary_buffer);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	hctx->params.response_info = &hctx->primary_info;
+
+	rc = ngx_child_request_start_internal(
+		r,
+		ngx_child_request_hedge_primary_completed,
+		hctx,
+		internal_location,
+		&hctx->params,
+		&hctx->primary_buffer,
+		0,
+		&hctx->primary_request);
+	if (rc != NGX_AGAIN)
+	{
+		return rc;
+	}
+
+	hctx->pending = 1;
+
+	hctx->timer.handler = ngx_child_request_hedge_timer_handler;
+	hctx->timer.data = hctx;
+	hctx->timer.log = r->connection->log;
+
+	ngx_add_timer(&hctx->timer, hedge->delay);
+
 	return NGX_AGAIN;
 }
 
@@ -7,6 +7,11 @@
 // typedefs
 typedef void(*ngx_child_request_callback_t)(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read);
 
+typedef struct {
+	ngx_str_t validator;		// the etag of the response, or the last modified when there is no etag
+	off_t total_size;			// the total size from the content range, -1 if unknown
+} ngx_child_request_response_info_t;
+
 typedef struct {
 	ngx_uint_t method;
 	ngx_str_t base_uri;
@@ -16,8 +21,20 @@ typedef struct {
 	ngx_table_elt_t extra_header;
 	ngx_flag_t proxy_range;
 	ngx_flag_t proxy_all_headers;
+	ngx_child_request_response_info_t* response_info;		// optional, set when the response is successful
+	size_t max_response_size;		// optional, when set, the response buffer is enlarged according to the content length
 } ngx_child_request_params_t;
 
+typedef struct {
+	// input
+	ngx_str_t* location;
+	ngx_msec_t delay;
+
+	// output
+	ngx_flag_t issued;
+	ngx_flag_t won;
+} ngx_child_request_hedge_params_t;
+
 // functions
 
 // Notes:
@@ -26,6 +43,10 @@ typedef struct {
 //	2. response_buffer is optional, if it is not supplied, the upstream response gets written
 //		to the parent request. when a response buffer is supplied, the response is written to it, 
 //		the buffer should be large enough to contain both the response body and the response headers.
+//	3. when params->max_response_size is set, the response buffer only has to hold the response headers.
+//		if the response body does not fit in it, and the content length is smaller than max_response_size, 
+//		the body is received into a buffer that is allocated from the request pool, the callback gets the 
+//		buffer that holds the response, which is left with at least one free byte.
 ngx_int_t ngx_child_request_start(
 	ngx_http_request_t *r,
 	ngx_child_request_callback_t callback,
@@ -34,6 +55,32 @@ ngx_int_t ngx_child_request_start(
 	ngx_child_request_params_t* params,
 	ngx_buf_t* response_buffer);
 
+// Note: issues a duplicate request to hedge->location in case the request does not complete within 
+//		hedge->delay. the callback is called once, with the first successful response, which is copied
+//		to response_buffer. the requests receive the response into private buffers, so the request that
+//		lost can't overwrite the result. the upstream of the other request is aborted, and its response,
+//		if already received, is discarded.
+//		response_buffer is mandatory.
+ngx_int_t ngx_child_request_start_hedged(
+	ngx_http_request_t *r,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_str_t* internal_location,
+	ngx_child_request_params_t* params,
+	ngx_buf_t* response_buffer,
+	ngx_child_request_hedge_params_t* hedge);
+
+// Note: issues a request that does not block the parent request, the parent may complete before it.
+//		the callback is called when the request completes, the response is written to response_buffer, 
+//		which is mandatory. returns NGX_DECLINED if the nginx version does not support background requests.
+ngx_int_t ngx_child_request_start_background(
+	ngx_http_request_t *r,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_str_t* internal_location,
+	ngx_child_request_params_t* params,
+	ngx_buf_t* response_buffer);
+
 ngx_int_t ngx_child_request_init(ngx_conf_t *cf);
 
 #endif // _NGX_CHILD_HTTP_REQUEST_INCLUDED_
@@ -1,6 +1,68 @@
 #include "ngx_file_reader.h"
 #include <ngx_event.h>
 
+#if (NGX_HAVE_MADVISE)
+#include <sys/mman.h>
+
+// typedefs
+typedef struct {
+	ngx_queue_t queue;			// lru, most recently used first
+	uint32_t name_hash;
+	ngx_file_uniq_t uniq;
+	time_t mtime;
+	off_t size;
+	u_char* data;
+	ngx_uint_t refs;			// the number of pools that reference the mapping
+	ngx_flag_t evicted;
+} ngx_file_reader_mapping_t;
+
+// globals
+static ngx_queue_t ngx_file_reader_mappings;
+static ngx_uint_t ngx_file_reader_mapping_count;
+#endif // NGX_HAVE_MADVISE
+
+#if (NGX_HAVE_IO_URING)
+#include <liburing.h>
+#include <sys/eventfd.h>
+
+// constants
+#define IO_URING_ENTRIES (256)
+#define IO_URING_BUFFER_SIZE (256 * 1024)
+#define IO_URING_BUFFER_COUNT (32)
+#define IO_URING_BATCH_TAG (1)		// set on the user data of the reads that are part of a batch
+
+// typedefs
+typedef struct {
+	struct io_uring ring;
+	ngx_connection_t* conn;				// the eventfd that is signaled on completion
+	ngx_event_t submit_event;
+	ngx_flag_t initialized;
+	ngx_flag_t failed;
+
+	// registered buffers
+	u_char* buffers;
+	ngx_uint_t* free_buffers;
+	ngx_uint_t free_buffer_count;
+} ngx_file_reader_io_uring_t;
+
+typedef struct {
+	ngx_file_reader_io_uring_t* uring;
+	ngx_uint_t index;
+} ngx_file_reader_io_uring_buffer_t;
+
+typedef struct {
+	ngx_http_request_t* r;
+	ngx_file_reader_read_t* reads;
+	ngx_uint_t count;
+	ngx_uint_t pending;
+	ngx_file_reader_batch_callback_t callback;
+	void* context;
+} ngx_file_reader_io_uring_batch_t;
+
+// globals
+static ngx_file_reader_io_uring_t ngx_file_reader_io_uring;
+#endif // NGX_HAVE_IO_URING
+
 static ngx_int_t
 ngx_file_reader_init_open_file_info(
 	ngx_open_file_info_t* of, 
@@ -91,6 +153,8 @@ ngx_file_reader_update_state_file_info(ngx_file_reader_state_t* state, ngx_open_
 
 	state->file.fd = of->fd;
 	state->file_size = of->size;
+	state->file_mtime = of->mtime;
+	state->file_uniq = of->uniq;
 
 	return NGX_OK;
 }
@@ -115,6 +179,8 @@ ngx_file_reader_init(
 	state->log = r->connection->log;
 #if (NGX_HAVE_FILE_AIO)
 	state->use_aio = clcf->aio;
+#endif
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
 	state->read_callback = read_callback;
 	state->callback_context = callback_context;
 #endif
@@ -181,6 +247,8 @@ ngx_file_reader_init_async(
 	state->log = r->connection->log;
 #if (NGX_HAVE_FILE_AIO)
 	state->use_aio = clcf->aio;
+#endif
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
 	state->read_callback = read_callback;
 	state->callback_context = callback_context;
 #endif
@@ -297,6 +365,40 @@ ngx_file_reader_dump_file_part(ngx_file_reader_state_t* state, off_t start, off_
 	return NGX_OK;
 }
 
+// Note: the returned buffer references the file of the state, it is valid as long as the request pool exists
+ngx_buf_t*
+ngx_file_reader_create_file_buf(ngx_file_reader_state_t* state, off_t start, off_t end)
+{
+	ngx_buf_t* b;
+
+	b = ngx_calloc_buf(state->r->pool);
+	if (b == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, state->log, 0,
+			"ngx_file_reader_create_file_buf: ngx_calloc_buf failed");
+		return NULL;
+	}
+
+	b->file = &state->file;
+	b->file_pos = start;
+	b->file_last = end;
+	b->in_file = 1;
+
+	return b;
+}
+
+void
+ngx_file_reader_set_read_callback(
+	ngx_file_reader_state_t* state,
+	ngx_async_read_callback_t read_callback,
+	void* callback_context)
+{
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
+	state->read_callback = read_callback;
+	state->callback_context = callback_context;
+#endif
+}
+
 ngx_int_t
 ngx_file_reader_enable_directio(ngx_file_reader_state_t* state)
 {
@@ -315,6 +417,697 @@ ngx_file_reader_enable_directio(ngx_file_reader_state_t* state)
 	return NGX_OK;
 }
 
+ngx_int_t
+ngx_file_reader_prefetch(ngx_file_reader_state_t* state, off_t offset, size_t size)
+{
+#if (NGX_HAVE_POSIX_FADVISE)
+	int err;
+
+	if (state->file.directio || offset >= state->file_size)
+	{
+		return NGX_DECLINED;
+	}
+
+	if ((off_t)size > state->file_size - offset)
+	{
+		size = state->file_size - offset;
+	}
+
+	// Note: the kernel reads the range into the page cache in the background
+	err = posix_fadvise(state->file.fd, offset, size, POSIX_FADV_WILLNEED);
+	if (err != 0)
+	{
+		ngx_log_error(NGX_LOG_WARN, state->log, err,
+			"ngx_file_reader_prefetch: posix_fadvise \"%s\" failed", state->file.name.data);
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+#else
+	return NGX_DECLINED;
+#endif // NGX_HAVE_POSIX_FADVISE
+}
+
+#if (NGX_HAVE_MADVISE)
+
+static void
+ngx_file_reader_mapping_free(ngx_file_reader_mapping_t* mapping)
+{
+	if (munmap(mapping->data, mapping->size) != 0)
+	{
+		ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+			"ngx_file_reader_mapping_free: munmap failed");
+	}
+
+	ngx_free(mapping);
+}
+
+static void
+ngx_file_reader_mapping_release(void* data)
+{
+	ngx_file_reader_mapping_t* mapping = data;
+
+	mapping->refs--;
+	if (mapping->refs == 0 && mapping->evicted)
+	{
+		ngx_file_reader_mapping_free(mapping);
+	}
+}
+
+static void
+ngx_file_reader_mapping_evict(ngx_file_reader_mapping_t* mapping)
+{
+	ngx_queue_remove(&mapping->queue);
+	ngx_file_reader_mapping_count--;
+	mapping->evicted = 1;
+
+	if (mapping->refs == 0)
+	{
+		ngx_file_reader_mapping_free(mapping);
+	}
+}
+
+static ngx_file_reader_mapping_t*
+ngx_file_reader_mapping_get(ngx_file_reader_state_t* state, uint32_t name_hash, ngx_file_info_t* fi)
+{
+	ngx_file_reader_mapping_t* mapping;
+	ngx_queue_t* q;
+
+	if (ngx_file_reader_mappings.next == NULL)
+	{
+		ngx_queue_init(&ngx_file_reader_mappings);
+		return NULL;
+	}
+
+	for (q = ngx_queue_head(&ngx_file_reader_mappings);
+		q != ngx_queue_sentinel(&ngx_file_reader_mappings);
+		q = ngx_queue_next(q))
+	{
+		mapping = ngx_queue_data(q, ngx_file_reader_mapping_t, queue);
+		if (mapping->name_hash != name_hash || mapping->uniq != state->file_uniq)
+		{
+			continue;
+		}
+
+		if (mapping->mtime != ngx_file_mtime(fi) || mapping->size != ngx_file_size(fi))
+		{
+			// the file changed, map it again
+			ngx_file_reader_mapping_evict(mapping);
+			return NULL;
+		}
+
+		// move to the head of the lru
+		ngx_queue_remove(q);
+		ngx_queue_insert_head(&ngx_file_reader_mappings, q);
+		return mapping;
+	}
+
+	return NULL;
+}
+
+ngx_int_t
+ngx_file_reader_mmap(
+	ngx_file_reader_state_t* state,
+	ngx_pool_t* pool,
+	ngx_uint_t max_count,
+	off_t offset,
+	size_t size,
+	u_char** result)
+{
+	ngx_file_reader_mapping_t* mapping;
+	ngx_pool_cleanup_t* cln;
+	ngx_file_info_t fi;
+	uint32_t name_hash;
+	off_t start;
+	void* data;
+
+	// Note: files that use directio are read without the page cache
+	if (max_count == 0 || state->file_size <= 0 || state->file_size >= state->directio ||
+		(uint64_t)state->file_size > (size_t)NGX_MAX_SIZE_T_VALUE)
+	{
+		return NGX_DECLINED;
+	}
+
+	// Note: the size/mtime of the state may come from the open file cache, accessing a mapping 
+	//		beyond the current end of the file raises SIGBUS, so the file is checked on every use
+	if (ngx_fd_info(state->file.fd, &fi) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_WARN, state->log, ngx_errno,
+			"ngx_file_reader_mmap: " ngx_fd_info_n " \"%s\" failed", state->file.name.data);
+		return NGX_DECLINED;
+	}
+
+	if (ngx_file_size(&fi) != state->file_size || ngx_file_mtime(&fi) != state->file_mtime)
+	{
+		ngx_log_error(NGX_LOG_WARN, state->log, 0,
+			"ngx_file_reader_mmap: \"%s\" changed after it was opened, not mapping", state->file.name.data);
+		return NGX_DECLINED;
+	}
+
+	cln = ngx_pool_cleanup_add(pool, 0);
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, state->log, 0,
+			"ngx_file_reader_mmap: ngx_pool_cleanup_add failed");
+		return NGX_ERROR;
+	}
+
+	name_hash = ngx_crc32_long(state->file.name.data, state->file.name.len);
+
+	mapping = ngx_file_reader_mapping_get(state, name_hash, &fi);
+	if (mapping == NULL)
+	{
+		data = mmap(NULL, state->file_size, PROT_READ, MAP_SHARED, state->file.fd, 0);
+		if (data == MAP_FAILED)
+		{
+			ngx_log_error(NGX_LOG_WARN, state->log, ngx_errno,
+				"ngx_file_reader_mmap: mmap \"%s\" failed", state->file.name.data);
+			return NGX_DECLINED;
+		}
+
+		mapping = ngx_alloc(sizeof(*mapping), state->log);
+		if (mapping == NULL)
+		{
+			munmap(data, state->file_size);
+			return NGX_ERROR;
+		}
+
+		mapping->name_hash = name_hash;
+		mapping->uniq = state->file_uniq;
+		mapping->mtime = state->file_mtime;
+		mapping->size = state->file_size;
+		mapping->data = data;
+		mapping->refs = 0;
+		mapping->evicted = 0;
+
+		ngx_queue_insert_head(&ngx_file_reader_mappings, &mapping->queue);
+		ngx_file_reader_mapping_count++;
+
+		while (ngx_file_reader_mapping_count > max_count)
+		{
+			ngx_file_reader_mapping_evict(ngx_queue_data(
+				ngx_queue_last(&ngx_file_reader_mappings), ngx_file_reader_mapping_t, queue));
+		}
+	}
+
+	mapping->refs++;
+	cln->handler = ngx_file_reader_mapping_release;
+	cln->data = mapping;
+
+	// hint the kernel to read the range that is about to be used
+	if (offset < state->file_size && size > 0)
+	{
+		if ((off_t)size > state->file_size - offset)
+		{
+			size = state->file_size - offset;
+		}
+
+		start = offset & ~((off_t)ngx_pagesize - 1);
+		if (madvise(mapping->data + start, size + (offset - start), MADV_WILLNEED) != 0)
+		{
+			ngx_log_error(NGX_LOG_WARN, state->log, ngx_errno,
+				"ngx_file_reader_mmap: madvise \"%s\" failed", state->file.name.data);
+		}
+	}
+
+	*result = mapping->data;
+
+	return NGX_OK;
+}
+
+#else
+
+ngx_int_t
+ngx_file_reader_mmap(
+	ngx_file_reader_state_t* state,
+	ngx_pool_t* pool,
+	ngx_uint_t max_count,
+	off_t offset,
+	size_t size,
+	u_char** result)
+{
+	return NGX_DECLINED;
+}
+
+#endif // NGX_HAVE_MADVISE
+
+#if (NGX_HAVE_IO_URING)
+
+static void
+ngx_file_reader_io_uring_submit(ngx_file_reader_io_uring_t* uring)
+{
+	int rc;
+
+	if (io_uring_sq_ready(&uring->ring) == 0)
+	{
+		return;
+	}
+
+	// Note: all the reads that were queued in the current event loop iteration are submitted in a single call
+	rc = io_uring_submit(&uring->ring);
+	if (rc < 0)
+	{
+		ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, -rc,
+			"ngx_file_reader_io_uring_submit: io_uring_submit failed");
+		return;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+		"ngx_file_reader_io_uring_submit: submitted %d reads", rc);
+}
+
+static void
+ngx_file_reader_io_uring_submit_handler(ngx_event_t *ev)
+{
+	ngx_file_reader_io_uring_submit(ev->data);
+}
+
+static void
+ngx_file_reader_io_uring_read_completed(ngx_file_reader_state_t* state, int res)
+{
+	ngx_http_request_t *r = state->r;
+	ngx_connection_t *c = r->connection;
+	ssize_t bytes_read;
+	ngx_int_t rc;
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	if (res < 0)
+	{
+		ngx_log_error(NGX_LOG_ERR, state->log, -res,
+			"ngx_file_reader_io_uring_read_completed: read failed");
+		bytes_read = 0;
+		rc = NGX_ERROR;
+	}
+	else
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0,
+			"ngx_file_reader_io_uring_read_completed: read returned %d", res);
+		state->buf->last += res;
+		bytes_read = res;
+		rc = NGX_OK;
+	}
+
+	state->read_callback(state->callback_context, rc, NULL, bytes_read);
+
+	ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_file_reader_io_uring_batch_read_completed(ngx_file_reader_read_t* read, int res)
+{
+	ngx_file_reader_io_uring_batch_t* batch = read->batch;
+	ngx_http_request_t *r = batch->r;
+	ngx_connection_t *c;
+
+	if (res < 0)
+	{
+		ngx_log_error(NGX_LOG_ERR, read->state->log, -res,
+			"ngx_file_reader_io_uring_batch_read_completed: read failed");
+		read->bytes_read = NGX_ERROR;
+	}
+	else
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, read->state->log, 0,
+			"ngx_file_reader_io_uring_batch_read_completed: read returned %d", res);
+		read->buf->last += res;
+		read->bytes_read = res;
+	}
+
+	batch->pending--;
+	if (batch->pending > 0)
+	{
+		return;
+	}
+
+	c = r->connection;
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	batch->callback(batch->context, batch->reads, batch->count);
+
+	ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_file_reader_io_uring_event_handler(ngx_event_t *ev)
+{
+	ngx_file_reader_io_uring_t* uring;
+	ngx_connection_t* c = ev->data;
+	struct io_uring_cqe* cqe;
+	uintptr_t data;
+	uint64_t value;
+	int res;
+
+	uring = c->data;
+
+	// reset the eventfd counter
+	if (read(c->fd, &value, sizeof(value)) < 0 && ngx_errno != NGX_EAGAIN)
+	{
+		ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+			"ngx_file_reader_io_uring_event_handler: read() failed");
+	}
+
+	while (io_uring_peek_cqe(&uring->ring, &cqe) == 0)
+	{
+		data = (uintptr_t)io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		io_uring_cqe_seen(&uring->ring, cqe);
+
+		if (data & IO_URING_BATCH_TAG)
+		{
+			ngx_file_reader_io_uring_batch_read_completed((ngx_file_reader_read_t*)(data & ~IO_URING_BATCH_TAG), res);
+		}
+		else
+		{
+			ngx_file_reader_io_uring_read_completed((ngx_file_reader_state_t*)data, res);
+		}
+	}
+}
+
+static ngx_int_t
+ngx_file_reader_io_uring_init(ngx_file_reader_io_uring_t* uring, ngx_log_t* log)
+{
+	ngx_connection_t* c;
+	struct iovec iov;
+	ngx_uint_t i;
+	int fd;
+	int rc;
+
+	if (uring->initialized)
+	{
+		return uring->failed ? NGX_DECLINED : NGX_OK;
+	}
+
+	// Note: initialized lazily, once per worker process
+	uring->initialized = 1;
+	uring->failed = 1;
+
+	rc = io_uring_queue_init(IO_URING_ENTRIES, &uring->ring, 0);
+	if (rc < 0)
+	{
+		ngx_log_error(NGX_LOG_WARN, log, -rc,
+			"ngx_file_reader_io_uring_init: io_uring_queue_init failed, using the default read method");
+		return NGX_DECLINED;
+	}
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd == -1)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_file_reader_io_uring_init: eventfd() failed");
+		goto failed;
+	}
+
+	rc = io_uring_register_eventfd(&uring->ring, fd);
+	if (rc < 0)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, -rc,
+			"ngx_file_reader_io_uring_init: io_uring_register_eventfd failed");
+		close(fd);
+		goto failed;
+	}
+
+	c = ngx_get_connection(fd, ngx_cycle->log);
+	if (c == NULL)
+	{
+		close(fd);
+		goto failed;
+	}
+
+	c->data = uring;
+	c->read->handler = ngx_file_reader_io_uring_event_handler;
+	c->read->log = ngx_cycle->log;
+
+	if (ngx_add_event(c->read, NGX_READ_EVENT, (ngx_event_flags & NGX_USE_CLEAR_EVENT) ? NGX_CLEAR_EVENT : NGX_LEVEL_EVENT) != NGX_OK)
+	{
+		ngx_free_connection(c);
+		close(fd);
+		goto failed;
+	}
+
+	uring->conn = c;
+
+	uring->submit_event.handler = ngx_file_reader_io_uring_submit_handler;
+	uring->submit_event.data = uring;
+	uring->submit_event.log = ngx_cycle->log;
+
+	// register the buffers, failure is not fatal (e.g. RLIMIT_MEMLOCK is too low)
+	uring->buffers = ngx_memalign(ngx_pagesize, IO_URING_BUFFER_SIZE * IO_URING_BUFFER_COUNT, log);
+	uring->free_buffers = ngx_alloc(sizeof(uring->free_buffers[0]) * IO_URING_BUFFER_COUNT, log);
+	if (uring->buffers != NULL && uring->free_buffers != NULL)
+	{
+		iov.iov_base = uring->buffers;
+		iov.iov_len = IO_URING_BUFFER_SIZE * IO_URING_BUFFER_COUNT;
+
+		rc = io_uring_register_buffers(&uring->ring, &iov, 1);
+		if (rc == 0)
+		{
+			for (i = 0; i < IO_URING_BUFFER_COUNT; i++)
+			{
+				uring->free_buffers[i] = i;
+			}
+			uring->free_buffer_count = IO_URING_BUFFER_COUNT;
+		}
+		else
+		{
+			ngx_log_error(NGX_LOG_INFO, log, -rc,
+				"ngx_file_reader_io_uring_init: io_uring_register_buffers failed, not using registered buffers");
+		}
+	}
+
+	if (uring->free_buffer_count == 0)
+	{
+		ngx_free(uring->buffers);
+		uring->buffers = NULL;
+	}
+
+	uring->failed = 0;
+
+	return NGX_OK;
+
+failed:
+
+	io_uring_queue_exit(&uring->ring);
+	return NGX_DECLINED;
+}
+
+static void
+ngx_file_reader_io_uring_free_buffer(void* data)
+{
+	ngx_file_reader_io_uring_buffer_t* buffer = data;
+	ngx_file_reader_io_uring_t* uring = buffer->uring;
+
+	uring->free_buffers[uring->free_buffer_count++] = buffer->index;
+}
+
+u_char*
+ngx_file_reader_io_uring_alloc_buffer(ngx_pool_t* pool, size_t size)
+{
+	ngx_file_reader_io_uring_buffer_t* buffer;
+	ngx_file_reader_io_uring_t* uring = &ngx_file_reader_io_uring;
+	ngx_pool_cleanup_t* cln;
+
+	if (ngx_file_reader_io_uring_init(uring, pool->log) != NGX_OK ||
+		uring->free_buffer_count == 0 ||
+		size > IO_URING_BUFFER_SIZE)
+	{
+		return NULL;
+	}
+
+	cln = ngx_pool_cleanup_add(pool, sizeof(*buffer));
+	if (cln == NULL)
+	{
+		return NULL;
+	}
+
+	buffer = cln->data;
+	buffer->uring = uring;
+	buffer->index = uring->free_buffers[--uring->free_buffer_count];
+
+	cln->handler = ngx_file_reader_io_uring_free_buffer;
+
+	return uring->buffers + buffer->index * IO_URING_BUFFER_SIZE;
+}
+
+void
+ngx_file_reader_io_uring_release_buffer(ngx_pool_t* pool, u_char* start)
+{
+	ngx_file_reader_io_uring_buffer_t* buffer;
+	ngx_file_reader_io_uring_t* uring = &ngx_file_reader_io_uring;
+	ngx_pool_cleanup_t* c;
+	ngx_uint_t index;
+
+	if (uring->buffers == NULL ||
+		start < uring->buffers ||
+		start >= uring->buffers + IO_URING_BUFFER_SIZE * IO_URING_BUFFER_COUNT)
+	{
+		return;
+	}
+
+	index = (start - uring->buffers) / IO_URING_BUFFER_SIZE;
+
+	for (c = pool->cleanup; c; c = c->next)
+	{
+		if (c->handler != ngx_file_reader_io_uring_free_buffer)
+		{
+			continue;
+		}
+
+		buffer = c->data;
+		if (buffer->index == index)
+		{
+			c->handler(c->data);
+			c->handler = NULL;
+			return;
+		}
+	}
+}
+
+static void
+ngx_file_reader_io_uring_prep_read(
+	ngx_file_reader_io_uring_t* uring,
+	struct io_uring_sqe* sqe,
+	ngx_fd_t fd,
+	ngx_buf_t *buf,
+	size_t size,
+	off_t offset)
+{
+	if (uring->buffers != NULL &&
+		buf->last >= uring->buffers &&
+		buf->last + size <= uring->buffers + IO_URING_BUFFER_SIZE * IO_URING_BUFFER_COUNT)
+	{
+		io_uring_prep_read_fixed(sqe, fd, buf->last, size, offset, 0);
+	}
+	else
+	{
+		io_uring_prep_read(sqe, fd, buf->last, size, offset);
+	}
+}
+
+static ngx_int_t
+ngx_file_reader_io_uring_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size, off_t offset)
+{
+	ngx_file_reader_io_uring_t* uring = &ngx_file_reader_io_uring;
+	struct io_uring_sqe* sqe;
+
+	if (ngx_file_reader_io_uring_init(uring, state->log) != NGX_OK)
+	{
+		return NGX_DECLINED;
+	}
+
+	sqe = io_uring_get_sqe(&uring->ring);
+	if (sqe == NULL)
+	{
+		// the submission queue is full, flush it
+		ngx_file_reader_io_uring_submit(uring);
+
+		sqe = io_uring_get_sqe(&uring->ring);
+		if (sqe == NULL)
+		{
+			return NGX_DECLINED;
+		}
+	}
+
+	ngx_file_reader_io_uring_prep_read(uring, sqe, state->file.fd, buf, size, offset);
+
+	io_uring_sqe_set_data(sqe, state);
+
+	// submit on the next posted events pass, in order to batch the reads of the current iteration
+	if (!uring->submit_event.posted)
+	{
+		ngx_post_event(&uring->submit_event, &ngx_posted_events);
+	}
+
+	// wait for completion
+	state->r->main->blocked++;
+	state->r->aio = 1;
+
+	state->buf = buf;
+	return NGX_AGAIN;
+}
+
+ngx_int_t
+ngx_file_reader_io_uring_read_batch(
+	ngx_http_request_t* r,
+	ngx_file_reader_read_t* reads,
+	ngx_uint_t count,
+	ngx_file_reader_batch_callback_t callback,
+	void* context)
+{
+	ngx_file_reader_io_uring_batch_t* batch;
+	ngx_file_reader_io_uring_t* uring = &ngx_file_reader_io_uring;
+	ngx_file_reader_read_t* cur_read;
+	ngx_file_reader_read_t* last_read;
+	struct io_uring_sqe* sqe;
+
+	if (ngx_file_reader_io_uring_init(uring, r->connection->log) != NGX_OK)
+	{
+		return NGX_DECLINED;
+	}
+
+	// make sure all the reads fit in the submission queue
+	if (io_uring_sq_space_left(&uring->ring) < count)
+	{
+		ngx_file_reader_io_uring_submit(uring);
+
+		if (io_uring_sq_space_left(&uring->ring) < count)
+		{
+			return NGX_DECLINED;
+		}
+	}
+
+	batch = ngx_palloc(r->pool, sizeof(*batch));
+	if (batch == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	batch->r = r;
+	batch->reads = reads;
+	batch->count = count;
+	batch->pending = count;
+	batch->callback = callback;
+	batch->context = context;
+
+	last_read = reads + count;
+	for (cur_read = reads; cur_read < last_read; cur_read++)
+	{
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cur_read->state->log, 0, 
+			"ngx_file_reader_io_uring_read_batch: reading offset %O size %uz", cur_read->offset, cur_read->size);
+
+		cur_read->batch = batch;
+
+		sqe = io_uring_get_sqe(&uring->ring);
+
+		ngx_file_reader_io_uring_prep_read(
+			uring, 
+			sqe, 
+			cur_read->state->file.fd, 
+			cur_read->buf, 
+			cur_read->size, 
+			cur_read->offset);
+
+		io_uring_sqe_set_data(sqe, (void*)((uintptr_t)cur_read | IO_URING_BATCH_TAG));
+	}
+
+	// Note: the reads of the batch are submitted together with the reads of other requests
+	if (!uring->submit_event.posted)
+	{
+		ngx_post_event(&uring->submit_event, &ngx_posted_events);
+	}
+
+	// wait for completion
+	r->main->blocked++;
+	r->aio = 1;
+
+	return NGX_AGAIN;
+}
+
+#endif // NGX_HAVE_IO_URING
+
 #if (NGX_HAVE_FILE_AIO)
 
 static void
@@ -364,6 +1157,17 @@ ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size,
 
 	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read: reading offset %O size %uz", offset, size);
 
+#if (NGX_HAVE_IO_URING)
+	if (state->use_io_uring)
+	{
+		rc = ngx_file_reader_io_uring_read(state, buf, size, offset);
+		if (rc != NGX_DECLINED)
+		{
+			return rc;
+		}
+	}
+#endif
+
 	if (state->use_aio)
 	{
 		rc = ngx_file_aio_read(&state->file, buf->last, size, offset, state->r->pool);
@@ -406,6 +1210,17 @@ ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size,
 
 	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read: reading offset %O size %uz", offset, size);
 
+#if (NGX_HAVE_IO_URING)
+	if (state->use_io_uring)
+	{
+		rc = ngx_file_reader_io_uring_read(state, buf, size, offset);
+		if (rc != NGX_DECLINED)
+		{
+			return rc;
+		}
+	}
+#endif
+
 	rc = ngx_read_file(&state->file, buf->last, size, offset);
 	if (rc < 0)
 	{
@@ -21,8 +21,15 @@ typedef struct {
 	ngx_flag_t log_not_found;
 	ngx_log_t* log;
 	off_t file_size;
+	time_t file_mtime;
+	ngx_file_uniq_t file_uniq;
 #if (NGX_HAVE_FILE_AIO)
 	ngx_flag_t use_aio;
+#endif
+#if (NGX_HAVE_IO_URING)
+	ngx_flag_t use_io_uring;
+#endif
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
 	ngx_async_read_callback_t read_callback;
 	void* callback_context;
 	ngx_buf_t* buf;
@@ -51,10 +58,61 @@ ngx_int_t ngx_file_reader_init_async(
 	ngx_str_t* path);
 #endif
 
+void ngx_file_reader_set_read_callback(
+	ngx_file_reader_state_t* state,
+	ngx_async_read_callback_t read_callback,
+	void* callback_context);
+
 ngx_int_t ngx_file_reader_dump_file_part(ngx_file_reader_state_t* state, off_t start, off_t end);
 
+ngx_buf_t* ngx_file_reader_create_file_buf(ngx_file_reader_state_t* state, off_t start, off_t end);
+
 ngx_int_t ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size, off_t offset);
 
 ngx_int_t ngx_file_reader_enable_directio(ngx_file_reader_state_t* state);
 
+// Note: hints the kernel to read the range into the page cache, returns NGX_DECLINED when not supported
+ngx_int_t ngx_file_reader_prefetch(ngx_file_reader_state_t* state, off_t offset, size_t size);
+
+// Note: returns a read only mapping of the whole file, and hints the kernel to read the range [offset, offset + size).
+//		the mappings are cached per worker (up to max_count files), the mapping remains valid until the pool is destroyed.
+//		returns NGX_DECLINED when not supported
+ngx_int_t ngx_file_reader_mmap(
+	ngx_file_reader_state_t* state,
+	ngx_pool_t* pool,
+	ngx_uint_t max_count,
+	off_t offset,
+	size_t size,
+	u_char** result);
+
+#if (NGX_HAVE_IO_URING)
+typedef struct {
+	ngx_file_reader_state_t* state;
+	ngx_buf_t* buf;
+	size_t size;
+	off_t offset;
+	ssize_t bytes_read;				// set on completion, NGX_ERROR if the read failed
+	void* batch;
+} ngx_file_reader_read_t;
+
+typedef void (*ngx_file_reader_batch_callback_t)(void* context, ngx_file_reader_read_t* reads, ngx_uint_t count);
+
+// Note: submits all the reads in a single io_uring submission, the callback is called once all the reads 
+//		complete. returns NGX_AGAIN on success, and NGX_DECLINED if the reads cannot be submitted together
+ngx_int_t ngx_file_reader_io_uring_read_batch(
+	ngx_http_request_t* r,
+	ngx_file_reader_read_t* reads,
+	ngx_uint_t count,
+	ngx_file_reader_batch_callback_t callback,
+	void* context);
+
+// Note: returns a buffer that is registered with the io_uring instance of the worker, or NULL
+//		if such a buffer is not available. the buffer is released when the pool is destroyed
+u_char* ngx_file_reader_io_uring_alloc_buffer(ngx_pool_t* pool, size_t size);
+
+// Note: releases a buffer returned by ngx_file_reader_io_uring_alloc_buffer before the pool is destroyed,
+//		does nothing if the buffer is not a registered buffer
+void ngx_file_reader_io_uring_release_buffer(ngx_pool_t* pool, u_char* start);
+#endif
+
 #endif // _NGX_FILE_READER_H_INCLUDED_
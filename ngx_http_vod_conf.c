@@ -19,6 +19,7 @@ static ngx_str_t ngx_http_vod_filepath = ngx_string("vod_filepath");
 static ngx_str_t ngx_http_vod_suburi = ngx_string("vod_suburi");
 static ngx_str_t ngx_http_vod_sequence_id = ngx_string("vod_sequence_id");
 static ngx_str_t ngx_http_vod_clip_id = ngx_string("vod_clip_id");
+static ngx_str_t ngx_http_vod_clip_ids = ngx_string("vod_clip_ids");
 static ngx_str_t ngx_http_vod_dynamic_mapping = ngx_string("vod_dynamic_mapping");
 static ngx_str_t ngx_http_vod_request_params = ngx_string("vod_request_params");
 
@@ -63,6 +64,15 @@ ngx_http_vod_add_variables(ngx_conf_t *cf)
 
 	var->get_handler = ngx_http_vod_set_clip_id_var;
 
+	// clip ids
+	var = ngx_http_add_variable(cf, &ngx_http_vod_clip_ids, NGX_HTTP_VAR_NOCACHEABLE);
+	if (var == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	var->get_handler = ngx_http_vod_set_clip_ids_var;
+
 	// dynamic mapping
 	var = ngx_http_add_variable(cf, &ngx_http_vod_dynamic_mapping, NGX_HTTP_VAR_NOCACHEABLE);
 	if (var == NULL)
@@ -139,13 +149,37 @@ ngx_http_vod_create_loc_conf(ngx_conf_t *cf)
 	conf->segmenter.align_to_key_frames = NGX_CONF_UNSET;
 	conf->segmenter.get_segment_count = NGX_CONF_UNSET_PTR;
 	conf->segmenter.get_segment_durations = NGX_CONF_UNSET_PTR;
+	conf->segment_cache_max_entry_size = NGX_CONF_UNSET_SIZE;
+	conf->remote_block_size = NGX_CONF_UNSET_SIZE;
+	conf->cache_lock = NGX_CONF_UNSET;
+	conf->cache_lock_timeout = NGX_CONF_UNSET;
+	conf->cache_peers = NGX_CONF_UNSET_PTR;
+	conf->cache_peer_max_response_size = NGX_CONF_UNSET_SIZE;
 	conf->initial_read_size = NGX_CONF_UNSET_SIZE;
+	conf->parallel_metadata_read = NGX_CONF_UNSET;
 	conf->max_metadata_size = NGX_CONF_UNSET_SIZE;
 	conf->max_frames_size = NGX_CONF_UNSET_SIZE;
 	conf->cache_buffer_size = NGX_CONF_UNSET_SIZE;
+	conf->coalesce_reads = NGX_CONF_UNSET;
+	conf->coalesce_reads_max_gap = NGX_CONF_UNSET_SIZE;
+	conf->coalesce_reads_max_size = NGX_CONF_UNSET_SIZE;
+	conf->segment_prefetch = NGX_CONF_UNSET;
+	conf->segment_prefetch_max_size = NGX_CONF_UNSET_SIZE;
+	conf->segment_prefetch_max_pending = NGX_CONF_UNSET_UINT;
+	conf->speculative_segments = NGX_CONF_UNSET;
+	conf->speculative_segments_max_connections = NGX_CONF_UNSET_UINT;
+	conf->speculative_segments_max_pending = NGX_CONF_UNSET_UINT;
+	conf->segment_collapse = NGX_CONF_UNSET;
+	conf->zero_copy_segments = NGX_CONF_UNSET;
+	conf->mmap_frames = NGX_CONF_UNSET;
+	conf->mmap_frames_max_files = NGX_CONF_UNSET_UINT;
 	conf->max_upstream_headers_size = NGX_CONF_UNSET_SIZE;
+	conf->upstream_hedge = NGX_CONF_UNSET;
+	conf->upstream_hedge_percentile = NGX_CONF_UNSET_UINT;
+	conf->upstream_hedge_min_delay = NGX_CONF_UNSET_MSEC;
 	conf->ignore_edit_list = NGX_CONF_UNSET;
 	conf->max_mapping_response_size = NGX_CONF_UNSET_SIZE;
+	conf->subrequest_concurrency = NGX_CONF_UNSET_UINT;
 
 	conf->expires[CACHE_TYPE_VOD] = NGX_CONF_UNSET;
 	conf->expires[CACHE_TYPE_LIVE] = NGX_CONF_UNSET;
@@ -159,6 +193,9 @@ ngx_http_vod_create_loc_conf(ngx_conf_t *cf)
 #if (NGX_THREADS)
 	conf->open_file_thread_pool = NGX_CONF_UNSET_PTR;
 #endif
+#if (NGX_HAVE_IO_URING)
+	conf->io_uring = NGX_CONF_UNSET;
+#endif
 
 	// submodules
 	for (cur_module = submodules; *cur_module != NULL; cur_module++)
@@ -223,6 +260,26 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 		conf->metadata_cache = prev->metadata_cache;
 	}
 
+	if (conf->frame_index_cache == NULL)
+	{
+		conf->frame_index_cache = prev->frame_index_cache;
+	}
+
+	if (conf->moov_location_cache == NULL)
+	{
+		conf->moov_location_cache = prev->moov_location_cache;
+	}
+
+	if (conf->segment_cache == NULL)
+	{
+		conf->segment_cache = prev->segment_cache;
+	}
+
+	if (conf->remote_block_cache == NULL)
+	{
+		conf->remote_block_cache = prev->remote_block_cache;
+	}
+
 	if (conf->dynamic_mapping_cache == NULL)
 	{
 		conf->dynamic_mapping_cache = prev->dynamic_mapping_cache;
@@ -243,10 +300,43 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 		ngx_conf_merge_value(conf->expires[cache_type], prev->expires[cache_type], -1);
 	}
 
+	ngx_conf_merge_size_value(conf->segment_cache_max_entry_size, prev->segment_cache_max_entry_size, 4 * 1024 * 1024);
+	ngx_conf_merge_size_value(conf->remote_block_size, prev->remote_block_size, 64 * 1024);
+	if (conf->remote_block_size == 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_remote_block_size\" must be greater than zero");
+		return NGX_CONF_ERROR;
+	}
+	ngx_conf_merge_value(conf->cache_lock, prev->cache_lock, 0);
+	ngx_conf_merge_sec_value(conf->cache_lock_timeout, prev->cache_lock_timeout, 5);
+	ngx_conf_merge_ptr_value(conf->cache_peers, prev->cache_peers, NULL);
+	ngx_conf_merge_str_value(conf->cache_peer_self, prev->cache_peer_self, "");
+	if (conf->cache_peer_self.len == 0)
+	{
+		conf->cache_peer_self = cf->cycle->hostname;
+	}
+	ngx_conf_merge_str_value(conf->cache_peer_location, prev->cache_peer_location, "");
+	ngx_conf_merge_size_value(conf->cache_peer_max_response_size, prev->cache_peer_max_response_size, 4 * 1024 * 1024);
+
 	ngx_conf_merge_size_value(conf->initial_read_size, prev->initial_read_size, 4096);
+	ngx_conf_merge_value(conf->parallel_metadata_read, prev->parallel_metadata_read, 0);
 	ngx_conf_merge_size_value(conf->max_metadata_size, prev->max_metadata_size, 128 * 1024 * 1024);
 	ngx_conf_merge_size_value(conf->max_frames_size, prev->max_frames_size, 16 * 1024 * 1024);
 	ngx_conf_merge_size_value(conf->cache_buffer_size, prev->cache_buffer_size, 256 * 1024);
+	ngx_conf_merge_value(conf->coalesce_reads, prev->coalesce_reads, 0);
+	ngx_conf_merge_size_value(conf->coalesce_reads_max_gap, prev->coalesce_reads_max_gap, 64 * 1024);
+	ngx_conf_merge_size_value(conf->coalesce_reads_max_size, prev->coalesce_reads_max_size, 4 * 1024 * 1024);
+	ngx_conf_merge_value(conf->segment_prefetch, prev->segment_prefetch, 0);
+	ngx_conf_merge_size_value(conf->segment_prefetch_max_size, prev->segment_prefetch_max_size, 4 * 1024 * 1024);
+	ngx_conf_merge_uint_value(conf->segment_prefetch_max_pending, prev->segment_prefetch_max_pending, 8);
+	ngx_conf_merge_value(conf->speculative_segments, prev->speculative_segments, 0);
+	ngx_conf_merge_uint_value(conf->speculative_segments_max_connections, prev->speculative_segments_max_connections, 64);
+	ngx_conf_merge_uint_value(conf->speculative_segments_max_pending, prev->speculative_segments_max_pending, 1);
+	ngx_conf_merge_value(conf->segment_collapse, prev->segment_collapse, 0);
+	ngx_conf_merge_value(conf->zero_copy_segments, prev->zero_copy_segments, 0);
+	ngx_conf_merge_value(conf->mmap_frames, prev->mmap_frames, 0);
+	ngx_conf_merge_uint_value(conf->mmap_frames_max_files, prev->mmap_frames_max_files, 128);
 	ngx_conf_merge_size_value(conf->max_upstream_headers_size, prev->max_upstream_headers_size, 4 * 1024);
 	
 	if (conf->output_buffer_pool == NULL)
@@ -261,6 +351,16 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 		conf->upstream_extra_args = prev->upstream_extra_args;
 	}
 
+	ngx_conf_merge_value(conf->upstream_hedge, prev->upstream_hedge, 0);
+	ngx_conf_merge_uint_value(conf->upstream_hedge_percentile, prev->upstream_hedge_percentile, 95);
+	if (conf->upstream_hedge_percentile < 1 || conf->upstream_hedge_percentile > 99)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_upstream_hedge_percentile\" must be between 1 and 99");
+		return NGX_CONF_ERROR;
+	}
+	ngx_conf_merge_msec_value(conf->upstream_hedge_min_delay, prev->upstream_hedge_min_delay, 50);
+
 	ngx_conf_merge_str_value(conf->path_response_prefix, prev->path_response_prefix, "{\"sequences\":[{\"clips\":[{\"type\":\"source\",\"path\":\"");
 	ngx_conf_merge_str_value(conf->path_response_postfix, prev->path_response_postfix, "\"}]}]}");
 	ngx_conf_merge_size_value(conf->max_mapping_response_size, prev->max_mapping_response_size, 1024);
@@ -272,6 +372,17 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	{
 		conf->source_clip_map_uri = prev->source_clip_map_uri;
 	}
+	if (conf->source_clip_map_batch_uri == NULL)
+	{
+		conf->source_clip_map_batch_uri = prev->source_clip_map_batch_uri;
+	}
+	ngx_conf_merge_uint_value(conf->subrequest_concurrency, prev->subrequest_concurrency, 1);
+	if (conf->subrequest_concurrency == 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_subrequest_concurrency\" must be greater than zero");
+		return NGX_CONF_ERROR;
+	}
 	if (conf->redirect_segments_url == NULL)
 	{
 		conf->redirect_segments_url = prev->redirect_segments_url;
@@ -328,6 +439,9 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 #if (NGX_THREADS)
 	ngx_conf_merge_ptr_value(conf->open_file_thread_pool, prev->open_file_thread_pool, NULL);
 #endif
+#if (NGX_HAVE_IO_URING)
+	ngx_conf_merge_value(conf->io_uring, prev->io_uring, 0);
+#endif
 
 	// validate vod_upstream / vod_upstream_host_header used when needed
 	if (conf->request_handler == ngx_http_vod_remote_request_handler)
@@ -631,7 +745,12 @@ ngx_http_vod_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
 	ngx_buffer_cache_t **cache = (ngx_buffer_cache_t **)((u_char*)conf + cmd->offset);
 	ngx_str_t  *value;
+	ngx_str_t disk_path;
+	ngx_str_t str;
+	ngx_int_t shard_count;
+	ngx_uint_t i;
 	ssize_t size;
+	off_t disk_size;
 	time_t expiration;
 
 	value = cf->args->elts;
@@ -662,32 +781,132 @@ ngx_http_vod_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 		return NGX_CONF_ERROR;
 	}
 
-	if (cf->args->nelts > 3)
+	expiration = 0;
+	shard_count = 1;
+	disk_path.len = 0;
+	disk_size = 0;
+
+	for (i = 3; i < cf->args->nelts; i++)
 	{
-		expiration = ngx_parse_time(&value[3], 1);
+		if (ngx_strncmp(value[i].data, "shards=", sizeof("shards=") - 1) == 0)
+		{
+			str.data = value[i].data + sizeof("shards=") - 1;
+			str.len = value[i].len - (sizeof("shards=") - 1);
+
+			shard_count = ngx_atoi(str.data, str.len);
+			if (shard_count == NGX_ERROR || shard_count <= 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid shard count %V", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "disk=", sizeof("disk=") - 1) == 0)
+		{
+			disk_path.data = value[i].data + sizeof("disk=") - 1;
+			disk_path.len = value[i].len - (sizeof("disk=") - 1);
+
+			if (disk_path.len == 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid disk path %V", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "disk_size=", sizeof("disk_size=") - 1) == 0)
+		{
+			str.data = value[i].data + sizeof("disk_size=") - 1;
+			str.len = value[i].len - (sizeof("disk_size=") - 1);
+
+			disk_size = ngx_parse_offset(&str);
+			if (disk_size == NGX_ERROR || disk_size <= 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid disk size %V", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		expiration = ngx_parse_time(&value[i], 1);
 		if (expiration == (time_t)NGX_ERROR) 
 		{
 			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-				"invalid expiration %V", &value[3]);
+				"invalid expiration %V", &value[i]);
 			return NGX_CONF_ERROR;
 		}
 	}
-	else
+
+	// Note: ngx_buffer_cache_create logs the reason of the failure
+	*cache = ngx_buffer_cache_create(cf, &value[1], size, expiration, shard_count, &ngx_http_vod_module);
+	if (*cache == NULL)
 	{
-		expiration = 0;
+		return NGX_CONF_ERROR;
 	}
 
-	*cache = ngx_buffer_cache_create(cf, &value[1], size, expiration, &ngx_http_vod_module);
-	if (*cache == NULL)
+	if (disk_path.len != 0)
+	{
+		// Note: entries that are loaded from the disk tier are validated against the source file (metadata),
+		//		or are immutable (vod mappings), the entries of the other caches may be stale after a restart
+		if (cmd->offset != offsetof(ngx_http_vod_loc_conf_t, metadata_cache) &&
+			cmd->offset != offsetof(ngx_http_vod_loc_conf_t, mapping_cache[CACHE_TYPE_VOD]))
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"disk is not supported in \"%V\"", &cmd->name);
+			return NGX_CONF_ERROR;
+		}
+
+		if (disk_size == 0)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"disk_size not specified in \"%V\"", &cmd->name);
+			return NGX_CONF_ERROR;
+		}
+
+		if (ngx_buffer_cache_enable_disk(cf, *cache, &disk_path, disk_size) != NGX_OK)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"failed to create disk cache");
+			return NGX_CONF_ERROR;
+		}
+	}
+	else if (disk_size != 0)
 	{
 		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-			"failed to create cache");
+			"disk not specified in \"%V\"", &cmd->name);
 		return NGX_CONF_ERROR;
 	}
 
 	return NGX_CONF_OK;
 }
 
+static char *
+ngx_http_vod_segment_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_buffer_cache_t **cache = (ngx_buffer_cache_t **)((u_char*)conf + cmd->offset);
+	char* rv;
+
+	rv = ngx_http_vod_cache_command(cf, cmd, conf);
+	if (rv != NGX_CONF_OK)
+	{
+		return rv;
+	}
+
+	if (*cache != NULL)
+	{
+		ngx_buffer_cache_enable_admission(*cache);
+	}
+
+	return NGX_CONF_OK;
+}
+
 static char *
 ngx_http_vod_perf_counters_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -833,6 +1052,17 @@ ngx_http_vod_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 	return NGX_CONF_OK;
 }
 
+static char *
+ngx_http_vod_cache_peer_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_core_loc_conf_t *clcf;
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_vod_cache_peer_handler;
+
+	return NGX_CONF_OK;
+}
+
 ngx_command_t ngx_http_vod_commands[] = {
 
 	// basic parameters
@@ -930,26 +1160,117 @@ ngx_command_t ngx_http_vod_commands[] = {
 	
 	// mp4 reading parameters
 	{ ngx_string("vod_metadata_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, metadata_cache),
 	NULL },
 
+	{ ngx_string("vod_frame_index_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, frame_index_cache),
+	NULL },
+
+	{ ngx_string("vod_moov_location_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, moov_location_cache),
+	NULL },
+
 	{ ngx_string("vod_response_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, response_cache[CACHE_TYPE_VOD]),
 	NULL },
 
 	{ ngx_string("vod_live_response_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, response_cache[CACHE_TYPE_LIVE]),
 	NULL },
 
+	{ ngx_string("vod_segment_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_segment_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segment_cache),
+	NULL },
+
+	{ ngx_string("vod_segment_cache_max_entry_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segment_cache_max_entry_size),
+	NULL },
+
+	{ ngx_string("vod_remote_block_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, remote_block_cache),
+	NULL },
+
+	{ ngx_string("vod_remote_block_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, remote_block_size),
+	NULL },
+
+	{ ngx_string("vod_cache_lock"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cache_lock),
+	NULL },
+
+	{ ngx_string("vod_cache_lock_timeout"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_sec_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cache_lock_timeout),
+	NULL },
+
+	{ ngx_string("vod_cache_peer"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_str_array_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cache_peers),
+	NULL },
+
+	{ ngx_string("vod_cache_peer_self"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_str_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cache_peer_self),
+	NULL },
+
+	{ ngx_string("vod_cache_peer_location"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_str_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cache_peer_location),
+	NULL },
+
+	{ ngx_string("vod_cache_peer_max_response_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cache_peer_max_response_size),
+	NULL },
+
+	{ ngx_string("vod_cache_peer_server"),
+	NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+	ngx_http_vod_cache_peer_server,
+	0,
+	0,
+	NULL },
+
 	{ ngx_string("vod_initial_read_size"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_conf_set_size_slot,
@@ -957,6 +1278,13 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, initial_read_size),
 	NULL },
 
+	{ ngx_string("vod_parallel_metadata_read"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, parallel_metadata_read),
+	NULL },
+
 	{ ngx_string("vod_max_metadata_size"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_conf_set_size_slot,
@@ -978,6 +1306,97 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, cache_buffer_size),
 	NULL },
 
+	{ ngx_string("vod_coalesce_reads"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, coalesce_reads),
+	NULL },
+
+	{ ngx_string("vod_coalesce_reads_max_gap"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, coalesce_reads_max_gap),
+	NULL },
+
+	{ ngx_string("vod_coalesce_reads_max_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, coalesce_reads_max_size),
+	NULL },
+
+	{ ngx_string("vod_segment_prefetch"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segment_prefetch),
+	NULL },
+
+	{ ngx_string("vod_segment_prefetch_max_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segment_prefetch_max_size),
+	NULL },
+
+	{ ngx_string("vod_segment_prefetch_max_pending"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segment_prefetch_max_pending),
+	NULL },
+
+	{ ngx_string("vod_speculative_segments"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, speculative_segments),
+	NULL },
+
+	{ ngx_string("vod_speculative_segments_max_connections"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, speculative_segments_max_connections),
+	NULL },
+
+	{ ngx_string("vod_speculative_segments_max_pending"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, speculative_segments_max_pending),
+	NULL },
+
+	{ ngx_string("vod_segment_collapse"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segment_collapse),
+	NULL },
+
+	{ ngx_string("vod_zero_copy_segments"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, zero_copy_segments),
+	NULL },
+
+	{ ngx_string("vod_mmap_frames"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, mmap_frames),
+	NULL },
+
+	{ ngx_string("vod_mmap_frames_max_files"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, mmap_frames_max_files),
+	NULL },
+
 	{ ngx_string("vod_ignore_edit_list"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_conf_set_flag_slot,
@@ -1014,23 +1433,44 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, upstream_extra_args),
 	NULL },
 
+	{ ngx_string("vod_upstream_hedge"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, upstream_hedge),
+	NULL },
+
+	{ ngx_string("vod_upstream_hedge_percentile"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, upstream_hedge_percentile),
+	NULL },
+
+	{ ngx_string("vod_upstream_hedge_min_delay"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_msec_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, upstream_hedge_min_delay),
+	NULL },
+
 	// path request parameters - mapped mode only
 	{ ngx_string("vod_mapping_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, mapping_cache[CACHE_TYPE_VOD]),
 	NULL },
 
 	{ ngx_string("vod_live_mapping_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, mapping_cache[CACHE_TYPE_LIVE]),
 	NULL },
 
 	{ ngx_string("vod_dynamic_mapping_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, dynamic_mapping_cache),
@@ -1071,6 +1511,20 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, source_clip_map_uri),
 	NULL },
 
+	{ ngx_string("vod_source_clip_map_batch_uri"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_http_set_complex_value_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, source_clip_map_batch_uri),
+	NULL },
+
+	{ ngx_string("vod_subrequest_concurrency"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, subrequest_concurrency),
+	NULL },
+
 	{ ngx_string("vod_redirect_segments_url"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_http_set_complex_value_slot,
@@ -1175,7 +1629,7 @@ ngx_command_t ngx_http_vod_commands[] = {
 	NULL },
 
 	{ ngx_string("vod_drm_info_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, drm_info_cache),
@@ -1241,6 +1695,15 @@ ngx_command_t ngx_http_vod_commands[] = {
 	NULL },
 #endif
 
+#if (NGX_HAVE_IO_URING)
+	{ ngx_string("vod_io_uring"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, io_uring),
+	NULL },
+#endif
+
 #include "ngx_http_vod_dash_commands.h"
 #include "ngx_http_vod_hds_commands.h"
 #include "ngx_http_vod_hls_commands.h"
@@ -32,15 +32,44 @@ struct ngx_http_vod_loc_conf_s {
 	ngx_http_complex_value_t *base_url;
 	ngx_http_complex_value_t *segments_base_url;
 	ngx_buffer_cache_t* metadata_cache;
+	ngx_buffer_cache_t* frame_index_cache;
+	ngx_buffer_cache_t* moov_location_cache;
 	ngx_buffer_cache_t* response_cache[CACHE_TYPE_COUNT];
+	ngx_buffer_cache_t* segment_cache;
+	size_t segment_cache_max_entry_size;
+	ngx_buffer_cache_t* remote_block_cache;
+	size_t remote_block_size;
+	ngx_flag_t cache_lock;
+	time_t cache_lock_timeout;
+	ngx_array_t* cache_peers;
+	ngx_str_t cache_peer_self;
+	ngx_str_t cache_peer_location;
+	size_t cache_peer_max_response_size;
 	size_t initial_read_size;
+	ngx_flag_t parallel_metadata_read;
 	size_t max_metadata_size;
 	size_t max_frames_size;
 	size_t cache_buffer_size;
+	ngx_flag_t coalesce_reads;
+	size_t coalesce_reads_max_gap;
+	size_t coalesce_reads_max_size;
+	ngx_flag_t segment_prefetch;
+	size_t segment_prefetch_max_size;
+	ngx_uint_t segment_prefetch_max_pending;
+	ngx_flag_t speculative_segments;
+	ngx_uint_t speculative_segments_max_connections;
+	ngx_uint_t speculative_segments_max_pending;
+	ngx_flag_t segment_collapse;
+	ngx_flag_t zero_copy_segments;
+	ngx_flag_t mmap_frames;
+	ngx_uint_t mmap_frames_max_files;
 	buffer_pool_t* output_buffer_pool;
 	size_t max_upstream_headers_size;
 	ngx_flag_t ignore_edit_list;
 	ngx_http_complex_value_t *upstream_extra_args;
+	ngx_flag_t upstream_hedge;
+	ngx_uint_t upstream_hedge_percentile;
+	ngx_msec_t upstream_hedge_min_delay;
 	ngx_buffer_cache_t* mapping_cache[CACHE_TYPE_COUNT];
 	ngx_buffer_cache_t* dynamic_mapping_cache;
 	ngx_str_t path_response_prefix;
@@ -48,6 +77,8 @@ struct ngx_http_vod_loc_conf_s {
 	size_t max_mapping_response_size;
 	ngx_http_complex_value_t* dynamic_clip_map_uri;
 	ngx_http_complex_value_t* source_clip_map_uri;
+	ngx_http_complex_value_t* source_clip_map_batch_uri;
+	ngx_uint_t subrequest_concurrency;
 	ngx_http_complex_value_t* redirect_segments_url;
 	ngx_http_complex_value_t* media_set_map_uri;
 	ngx_http_complex_value_t* apply_dynamic_mapping;
@@ -77,6 +108,9 @@ struct ngx_http_vod_loc_conf_s {
 #if (NGX_THREADS)
 	ngx_thread_pool_t *open_file_thread_pool;
 #endif
+#if (NGX_HAVE_IO_URING)
+	ngx_flag_t io_uring;
+#endif
 
 	// derived fields
 	ngx_hash_t uri_params_hash;
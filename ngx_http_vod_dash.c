@@ -160,6 +160,7 @@ ngx_http_vod_dash_mp4_init_frame_processor(
 	dash_fragment_header_extensions_t header_extensions;
 	ngx_http_vod_loc_conf_t* conf = submodule_context->conf;
 	fragment_writer_state_t* state;
+	write_file_range_callback_t write_file_range = NULL;
 	segment_writer_t edash_writer;
 	vod_status_t rc;
 	bool_t reuse_buffers = FALSE;
@@ -196,6 +197,8 @@ ngx_http_vod_dash_mp4_init_frame_processor(
 	else
 	{
 		// unencrypted
+		write_file_range = segment_writer->write_file_range;
+
 		ngx_memzero(&header_extensions, sizeof(header_extensions));
 
 		rc = dash_packager_build_fragment_header(
@@ -232,6 +235,11 @@ ngx_http_vod_dash_mp4_init_frame_processor(
 			return ngx_http_vod_status_to_ngx_error(rc);
 		}
 
+		if (write_file_range != NULL)
+		{
+			mp4_builder_frame_writer_enable_file_ranges(state, write_file_range);
+		}
+
 		*frame_processor = (ngx_http_vod_frame_processor_t)mp4_builder_frame_writer_process;
 		*frame_processor_state = state;
 	}
@@ -17,6 +17,8 @@
 #include "vod/mp4/mp4_format.h"
 #include "vod/mkv/mkv_format.h"
 #include "vod/input/read_cache.h"
+#include "vod/input/frames_source_cache.h"
+#include "vod/input/frames_source_mmap.h"
 #include "vod/filters/audio_filter.h"
 #include "vod/filters/dynamic_clip.h"
 #include "vod/filters/concat_clip.h"
@@ -25,6 +27,20 @@
 #include "vod/media_set_parser.h"
 #include "vod/manifest_utils.h"
 
+// constants
+#define CACHE_LOCK_POLL_INTERVAL (20)		// msec
+#define HEDGE_LATENCY_SAMPLE_COUNT (256)
+#define SEGMENT_PREFETCH_HISTORY_SIZE (256)
+#define SEGMENT_PREFETCH_MAX_RANGES (4)
+#define IO_URING_READAHEAD_COUNT (8)		// max number of planned ranges that are read together with a cache miss
+#define CACHE_PEER_INITIAL_BUFFER_SIZE (4096)	// enough for the response headers, the body buffer is sized by the content length
+
+// macros
+// Note: encrypted segments depend on per request keys (secret key / drm info), they are not shared 
+//		between requests (segment cache / collapsing / speculation)
+#define ngx_http_vod_segment_shareable(conf)	\
+	((conf)->secret_key == NULL && !(conf)->drm_enabled)
+
 enum {
 	// mapping state machine
 	STATE_MAP_INITIAL,
@@ -36,6 +52,8 @@ enum {
 	STATE_READ_METADATA_INITIAL,
 	STATE_READ_METADATA_OPEN_FILE,
 	STATE_READ_METADATA_READ,
+	STATE_READ_METADATA_PREFETCH,
+	STATE_READ_METADATA_VALIDATE,
 	STATE_READ_FRAMES_OPEN_FILE,
 	STATE_READ_FRAMES_READ,
 	STATE_OPEN_FILE,
@@ -51,6 +69,12 @@ enum {
 	READER_COUNT
 };
 
+enum {
+	PEER_CACHE_METADATA,
+	PEER_CACHE_MAPPING,
+	PEER_CACHE_DYNAMIC_MAPPING,
+};
+
 // typedefs
 struct ngx_http_vod_ctx_s;
 typedef struct ngx_http_vod_ctx_s ngx_http_vod_ctx_t;
@@ -66,36 +90,150 @@ typedef ngx_int_t(*ngx_http_vod_mapping_get_uri_t)(ngx_http_vod_ctx_t *ctx, ngx_
 typedef struct {
 	uint32_t type;
 	uint32_t part_count;
+	uint64_t file_size;			// zero for remote files
+	uint64_t file_mtime;
 } multipart_cache_header_t;
 
+typedef struct {
+	uint64_t file_size;
+	uint64_t file_mtime;
+	uint64_t moov_offset;
+	uint64_t moov_size;
+	uint32_t ftyp_size;
+	// followed by the ftyp atom
+} ngx_http_vod_moov_location_t;
+
+typedef struct {
+	ngx_queue_t queue;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	ngx_pool_t* pool;
+	ngx_uint_t refs;				// the leader + the followers
+	ngx_queue_t followers;
+	ngx_chain_t* out;				// a copy of the output of the leader
+	ngx_chain_t** out_end;
+	ngx_str_t content_type;
+	off_t content_length;
+	ngx_flag_t header_sent;
+	ngx_flag_t done;
+} ngx_http_vod_collapse_t;
+
+typedef struct {
+	ngx_queue_t queue;
+	ngx_http_request_t* r;
+	ngx_http_vod_collapse_t* collapse;
+	ngx_flag_t attached;
+} ngx_http_vod_collapse_follower_t;
+
 typedef struct {
 	ngx_http_request_t* r;
 	ngx_chain_t* chain_head;
 	ngx_chain_t* chain_end;
 	size_t total_size;
+	ngx_array_t* cache_buffers;		// the buffers of the response, NULL when the response is not cached
+	size_t cache_max_size;
+	ngx_http_vod_collapse_t* collapse;		// NULL when the output is not shared with other requests
+	ngx_flag_t client_failed;		// the output can't be sent, the segment is generated only for the followers
 } ngx_http_vod_write_segment_context_t;
 
 typedef struct {
 	ngx_http_request_t* r;
 	ngx_str_t cur_remote_suburi;
+
+	// hedged read state
+	ngx_child_request_hedge_params_t hedge;
+	ngx_child_request_callback_t read_callback;
+	void* read_callback_context;
+	ngx_msec_t read_start_time;
+
+	// remote block cache read state
+	ngx_str_t block_validator;		// the validator of the cached blocks of the file
+	ngx_buf_t* block_read_buf;
+	u_char* block_read_last;
+	off_t block_read_start;
+	off_t block_read_offset;
+	off_t block_read_end;
+	off_t block_range_start;
+	ngx_buf_t block_buffer;
+	ngx_child_request_response_info_t block_response_info;
 } ngx_http_vod_http_reader_state_t;
 
+typedef struct {
+	ngx_atomic_t* counter;
+	ngx_flag_t pending;
+} ngx_http_vod_pending_t;
+
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	ngx_http_vod_http_reader_state_t* state;
+	off_t block_start;
+	ngx_buf_t buffer;
+	ngx_child_request_response_info_t response_info;
+	ngx_http_vod_pending_t* pending;
+} ngx_http_vod_segment_prefetch_t;
+
+typedef struct {
+	u_char file_key[MEDIA_CLIP_KEY_SIZE];
+	uint64_t start_offset;
+	uint64_t end_offset;
+} ngx_http_vod_prefetched_range_t;
+
 typedef struct {
 	off_t alignment;
 	size_t extra_size;
 } ngx_http_vod_alloc_params_t;
 
+typedef struct {
+	ngx_str_t name;
+	size_t conf_offset;
+	uint32_t cache_count;
+} ngx_http_vod_peer_cache_t;
+
 typedef struct {
 	u_char cache_key[MEDIA_CLIP_KEY_SIZE];
 	ngx_str_t* cache_key_prefix;
 	ngx_buffer_cache_t** caches;
 	uint32_t cache_count;
+	ngx_http_vod_peer_cache_t* peer_cache;		// NULL when the caches are not shared with the peers
 	void* reader_context;
 	size_t max_response_size;
 	ngx_http_vod_mapping_get_uri_t get_uri;
 	ngx_http_vod_mapping_apply_t apply;
 } ngx_http_vod_mapping_context_t;
 
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	ngx_str_t* location;
+	ngx_child_request_params_t child_params;
+	size_t max_response_size;
+	u_char cache_key[BUFFER_CACHE_KEY_SIZE];
+	ngx_flag_t cache_hit;
+	ngx_buffer_cache_lock_t* cache_lock;
+	ngx_buf_t response_buffer;
+	ngx_str_t response;
+} ngx_http_vod_fanout_request_t;
+
+typedef struct {
+	ngx_http_vod_fanout_request_t* requests;	// NULL when no fan out is in progress
+	ngx_uint_t count;
+	ngx_uint_t next;
+	ngx_uint_t pending;
+	ngx_uint_t started;
+	ngx_int_t rc;
+} ngx_http_vod_fanout_t;
+
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	media_clip_source_t* source;		// NULL once the result was consumed by the state machine
+	void* reader_context;
+#if (NGX_THREADS)
+	void* async_open_context;
+#endif
+	ngx_buf_t read_buffer;
+	ngx_http_vod_moov_location_t* moov_location;	// set when the moov atom was read instead of the file header
+	ngx_int_t rc;
+	ngx_flag_t pending;
+} ngx_http_vod_prefetch_t;
+
 struct ngx_http_vod_ctx_s {
 	// base params
 	ngx_http_vod_submodule_context_t submodule_context;
@@ -106,6 +244,9 @@ struct ngx_http_vod_ctx_s {
 	int state;
 	u_char request_key[BUFFER_CACHE_KEY_SIZE];
 	ngx_http_vod_state_machine_t state_machine;
+	ngx_flag_t speculative;		// the response is generated only for saving it to the segment cache
+	ngx_http_vod_collapse_t* collapse;		// set when other requests may attach to the output of this request
+	ngx_buffer_cache_pin_t* cache_pin;		// cache hits only, pins the cached response until it is sent
 
 	// iterators
 	media_sequence_t* cur_sequence;
@@ -121,6 +262,25 @@ struct ngx_http_vod_ctx_s {
 	// mapping
 	ngx_http_vod_mapping_context_t mapping;
 
+	// concurrent subrequests
+	ngx_http_vod_fanout_t fanout;
+
+	// cache lock
+	ngx_event_t cache_lock_event;
+	ngx_msec_t cache_lock_start;
+	ngx_flag_t cache_lock_waiting;
+	ngx_buffer_cache_lock_t* cache_lock;
+
+	// disk tier promotion
+	u_char promote_key[BUFFER_CACHE_KEY_SIZE];
+	ngx_flag_t promote_done;
+
+	// cache peer lookup
+	u_char peer_key[BUFFER_CACHE_KEY_SIZE];
+	ngx_flag_t peer_lookup_done;
+	ngx_buf_t peer_buffer;
+	ngx_str_t peer_response;
+
 	// read metadata state
 	ngx_buf_t read_buffer;
 	media_format_t* format;
@@ -131,10 +291,19 @@ struct ngx_http_vod_ctx_s {
 	void* metadata_reader_context;
 	ngx_str_t* metadata_parts;
 	size_t metadata_part_count;
+	multipart_cache_header_t metadata_header;
+	media_format_read_request_t last_metadata_read;
+	ngx_http_vod_moov_location_t* moov_location;
+
+	// parallel metadata read state
+	ngx_http_vod_prefetch_t* prefetch;
+	ngx_uint_t prefetch_count;
+	int prefetch_next_state;
 
 	// read frames state
 	media_base_metadata_t* base_metadata;
 	media_format_read_request_t frames_read_req;
+	media_frame_index_cache_t frame_index_cache;
 
 	// clipper
 	media_clipper_parse_result_t* clipper_parse_result;
@@ -157,6 +326,11 @@ struct ngx_http_vod_ctx_s {
 	// segment requests only
 	size_t content_length;
 	read_cache_state_t read_cache_state;
+#if (NGX_HAVE_IO_URING)
+	read_cache_get_read_buffer_t* readahead_reads;
+	ngx_buf_t* readahead_bufs;
+	ngx_file_reader_read_t* batch_reads;
+#endif // NGX_HAVE_IO_URING
 	ngx_http_vod_frame_processor_t frame_processor;
 	void* frame_processor_state;
 	ngx_chain_t out;
@@ -166,6 +340,13 @@ struct ngx_http_vod_ctx_s {
 // forward declarations
 static ngx_int_t ngx_http_vod_run_state_machine(ngx_http_vod_ctx_t *ctx);
 static ngx_int_t ngx_http_vod_process_init(ngx_cycle_t *cycle);
+static void ngx_http_vod_master_exit(ngx_cycle_t *cycle);
+static void ngx_http_vod_handle_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read);
+static void ngx_http_vod_segment_prefetch(ngx_http_vod_ctx_t *ctx);
+static ngx_int_t ngx_http_vod_async_http_block_read(ngx_http_vod_http_reader_state_t *state, ngx_buf_t *buf, size_t size, off_t offset);
+static void ngx_http_vod_speculate_next_segment(ngx_http_vod_ctx_t *ctx);
+static ngx_int_t ngx_http_vod_mmap_frames(ngx_http_vod_ctx_t *ctx);
+static void ngx_http_vod_collapse_finish(ngx_http_vod_ctx_t* ctx, ngx_int_t rc);
 
 // globals
 ngx_module_t  ngx_http_vod_module = {
@@ -179,13 +360,32 @@ ngx_module_t  ngx_http_vod_module = {
     NULL,                             /* init thread */
     NULL,                             /* exit thread */
     NULL,                             /* exit process */
-    NULL,                             /* exit master */
+    ngx_http_vod_master_exit,         /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
 static ngx_str_t options_content_type = ngx_string("text/plain");
+static ngx_str_t peer_content_type = ngx_string("application/octet-stream");
 static ngx_str_t empty_string = ngx_null_string;
 
+// the latencies of recent upstream range requests, used for calculating the hedge delay (per worker)
+static ngx_msec_t hedge_latencies[HEDGE_LATENCY_SAMPLE_COUNT];
+static ngx_uint_t hedge_latency_count;
+
+// the ranges that were prefetched by the segment prefetcher, indexed by file key (per worker)
+static ngx_http_vod_prefetched_range_t prefetched_ranges[SEGMENT_PREFETCH_HISTORY_SIZE];
+static ngx_atomic_t segment_prefetch_pending;
+
+// the segments that are currently generated by collapsed requests (per worker)
+static ngx_queue_t collapsed_segments;
+
+// the caches that can be fetched from the peers, the name is used in the peer request uri
+static ngx_http_vod_peer_cache_t peer_caches[] = {
+	{ ngx_string("metadata"), offsetof(ngx_http_vod_loc_conf_t, metadata_cache), 1 },
+	{ ngx_string("mapping"), offsetof(ngx_http_vod_loc_conf_t, mapping_cache), CACHE_TYPE_COUNT },
+	{ ngx_string("dynamic_mapping"), offsetof(ngx_http_vod_loc_conf_t, dynamic_mapping_cache), 1 },
+};
+
 static media_format_t* media_formats[] = {
 	&mp4_format,
 	// XXXXX add &mkv_format,
@@ -341,6 +541,51 @@ not_found:
 	return NGX_OK;
 }
 
+ngx_int_t
+ngx_http_vod_set_clip_ids_var(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+	media_clip_source_t* cur_clip;
+	ngx_http_vod_ctx_t *ctx;
+	u_char* p;
+	size_t size;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	if (ctx == NULL || ctx->submodule_context.media_set.mapped_sources_head == NULL)
+	{
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	size = 0;
+	for (cur_clip = ctx->submodule_context.media_set.mapped_sources_head; cur_clip != NULL; cur_clip = cur_clip->next)
+	{
+		size += cur_clip->mapped_uri.len + 1;
+	}
+
+	p = ngx_pnalloc(r->pool, size);
+	if (p == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_set_clip_ids_var: ngx_pnalloc failed");
+		return NGX_ERROR;
+	}
+
+	v->data = p;
+
+	for (cur_clip = ctx->submodule_context.media_set.mapped_sources_head; cur_clip != NULL; cur_clip = cur_clip->next)
+	{
+		p = ngx_copy(p, cur_clip->mapped_uri.data, cur_clip->mapped_uri.len);
+		*p++ = ',';
+	}
+
+	v->valid = 1;
+	v->no_cacheable = 1;
+	v->not_found = 0;
+	v->len = p - 1 - v->data;		// remove the trailing comma
+
+	return NGX_OK;
+}
+
 ngx_int_t
 ngx_http_vod_set_dynamic_mapping_var(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
 {
@@ -444,6 +689,67 @@ ngx_buffer_cache_fetch_perf(
 	return result;
 }
 
+static ngx_flag_t
+ngx_buffer_cache_fetch_promoted_perf(
+	ngx_perf_counters_t* perf_counters,
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	u_char** buffer,
+	size_t* buffer_size,
+	ngx_flag_t* promoted)
+{
+	ngx_perf_counter_context(pcctx);
+	ngx_flag_t result;
+	
+	ngx_perf_counter_start(pcctx);
+
+	result = ngx_buffer_cache_fetch_promoted(cache, key, buffer, buffer_size, promoted);
+
+	ngx_perf_counter_end(perf_counters, pcctx, PC_FETCH_CACHE);
+
+	return result;
+}
+
+static int
+ngx_buffer_cache_fetch_pinned_perf(
+	ngx_http_request_t* r,
+	ngx_perf_counters_t* perf_counters,
+	ngx_buffer_cache_t** caches,
+	uint32_t cache_count,
+	u_char* key,
+	u_char** buffer,
+	size_t* buffer_size,
+	ngx_buffer_cache_pin_t** pin)
+{
+	ngx_perf_counter_context(pcctx);
+	ngx_buffer_cache_t* cache;
+	uint32_t cache_index;
+
+	ngx_perf_counter_start(pcctx);
+
+	for (cache_index = 0; cache_index < cache_count; cache_index++)
+	{
+		cache = caches[cache_index];
+		if (cache == NULL)
+		{
+			continue;
+		}
+
+		if (!ngx_buffer_cache_fetch_pinned(cache, r->pool, key, buffer, buffer_size, pin))
+		{
+			continue;
+		}
+
+		ngx_perf_counter_end(perf_counters, pcctx, PC_FETCH_CACHE);
+
+		return cache_index;
+	}
+
+	ngx_perf_counter_end(perf_counters, pcctx, PC_FETCH_CACHE);
+
+	return -1;
+}
+
 static int
 ngx_buffer_cache_fetch_copy_perf(
 	ngx_http_request_t* r,
@@ -599,7 +905,8 @@ ngx_buffer_cache_fetch_multipart_perf(
 	ngx_buffer_cache_t* cache,
 	u_char* key,
 	multipart_cache_header_t* header,
-	ngx_str_t** out_parts)
+	ngx_str_t** out_parts,
+	ngx_flag_t* promoted)
 {
 	vod_str_t* cur_part;
 	vod_str_t* parts;
@@ -610,12 +917,13 @@ ngx_buffer_cache_fetch_multipart_perf(
 	u_char* p;
 	size_t size;
 
-	if (!ngx_buffer_cache_fetch_perf(
+	if (!ngx_buffer_cache_fetch_promoted_perf(
 		ctx->perf_counters,
 		cache,
 		key,
 		&p,
-		&size))
+		&size,
+		promoted))
 	{
 		return 0;
 	}
@@ -758,1619 +1066,5136 @@ ngx_http_vod_finalize_request(ngx_http_vod_ctx_t *ctx, ngx_int_t rc)
 
 	ngx_perf_counter_end(ctx->perf_counters, ctx->total_perf_counter_context, PC_TOTAL);
 
+	if (rc != NGX_AGAIN)
+	{
+		ngx_http_vod_collapse_finish(ctx, rc);
+	}
+
 	ngx_http_finalize_request(ctx->submodule_context.r, rc);
 }
 
+static void
+ngx_http_vod_free_buffer(ngx_pool_t* pool, u_char* start)
+{
+#if (NGX_HAVE_IO_URING)
+	ngx_file_reader_io_uring_release_buffer(pool, start);
+#endif // NGX_HAVE_IO_URING
+
+	ngx_pfree(pool, start);
+}
+
 static ngx_int_t
-ngx_http_vod_alloc_read_buffer(ngx_http_vod_ctx_t *ctx, size_t size, int alloc_params_index)
+ngx_http_vod_alloc_buffer(ngx_http_vod_ctx_t *ctx, ngx_buf_t* buf, size_t size, int alloc_params_index)
 {
 	ngx_http_vod_alloc_params_t* alloc_params = ctx->alloc_params + alloc_params_index;
-	u_char* start = ctx->read_buffer.start;
+	u_char* start = buf->start;
 
 	size += alloc_params->extra_size;
 
 	if (start == NULL ||										// no buffer
-		start + size > ctx->read_buffer.end ||					// buffer too small
+		start + size > buf->end ||								// buffer too small
 		((intptr_t)start & (alloc_params->alignment - 1)) != 0)	// buffer not conforming to alignment
 	{
-		if (alloc_params->alignment > 1)
+#if (NGX_HAVE_IO_URING)
+		if (start != NULL)
 		{
-			start = ngx_pmemalign(ctx->submodule_context.request_context.pool, size, alloc_params->alignment);
+			// Note: the existing buffer is not referenced, since it would have been overwritten if it was
+			//		large enough. release it, in case it is a registered buffer
+			ngx_file_reader_io_uring_release_buffer(ctx->submodule_context.request_context.pool, start);
 		}
-		else
+#endif // NGX_HAVE_IO_URING
+
+		start = NULL;
+
+#if (NGX_HAVE_IO_URING)
+		if (alloc_params_index == READER_FILE && ctx->submodule_context.conf->io_uring)
 		{
-			start = ngx_palloc(ctx->submodule_context.request_context.pool, size);
+			// use a buffer that is registered with io_uring, if available
+			start = ngx_file_reader_io_uring_alloc_buffer(ctx->submodule_context.request_context.pool, size);
 		}
+#endif // NGX_HAVE_IO_URING
 
 		if (start == NULL)
 		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_alloc_read_buffer: failed to allocate read buffer of size %uz", size);
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			if (alloc_params->alignment > 1)
+			{
+				start = ngx_pmemalign(ctx->submodule_context.request_context.pool, size, alloc_params->alignment);
+			}
+			else
+			{
+				start = ngx_palloc(ctx->submodule_context.request_context.pool, size);
+			}
+
+			if (start == NULL)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_alloc_buffer: failed to allocate read buffer of size %uz", size);
+				return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			}
 		}
 
-		ctx->read_buffer.start = start;
-		ctx->read_buffer.end = start + size;
-		ctx->read_buffer.temporary = 1;
+		buf->start = start;
+		buf->end = start + size;
+		buf->temporary = 1;
 	}
 
-	ctx->read_buffer.pos = start;
-	ctx->read_buffer.last = start;
+	buf->pos = start;
+	buf->last = start;
 
 	return NGX_OK;
 }
 
-////// DRM
-
-static void
-ngx_http_vod_drm_info_request_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
+static ngx_int_t
+ngx_http_vod_alloc_read_buffer(ngx_http_vod_ctx_t *ctx, size_t size, int alloc_params_index)
 {
-	ngx_http_vod_loc_conf_t *conf;
-	ngx_http_vod_ctx_t *ctx;
-	ngx_http_request_t *r = context;
-	ngx_str_t drm_info;
+	return ngx_http_vod_alloc_buffer(ctx, &ctx->read_buffer, size, alloc_params_index);
+}
 
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
-	conf = ctx->submodule_context.conf;
+////// Concurrent subrequests
 
-	if (rc != NGX_OK)
+static ngx_int_t
+ngx_http_vod_fanout_init(ngx_http_vod_ctx_t *ctx, ngx_uint_t count)
+{
+	ngx_http_vod_fanout_t* fanout = &ctx->fanout;
+	ngx_uint_t i;
+
+	fanout->requests = ngx_pcalloc(ctx->submodule_context.r->pool, sizeof(fanout->requests[0]) * count);
+	if (fanout->requests == NULL)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_drm_info_request_finished: upstream request failed %i", rc);
-		goto finalize_request;
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_fanout_init: ngx_pcalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 
-	if (response->last >= response->end)
+	for (i = 0; i < count; i++)
 	{
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-			"ngx_http_vod_drm_info_request_finished: not enough room in buffer for null terminator");
-		rc = NGX_HTTP_BAD_GATEWAY;
-		goto finalize_request;
+		fanout->requests[i].ctx = ctx;
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_GET_DRM_INFO);
+	fanout->count = count;
+	fanout->next = 0;
+	fanout->pending = 0;
+	fanout->started = 0;
+	fanout->rc = NGX_OK;
 
-	drm_info.data = response->pos;
-	drm_info.len = content_length;
-	*response->last = '\0';
+	return NGX_OK;
+}
 
-	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		"ngx_http_vod_drm_info_request_finished: result %V", &drm_info);
+static void ngx_http_vod_fanout_request_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length);
 
-	// parse the drm info
-	rc = conf->submodule.parse_drm_info(&ctx->submodule_context, &drm_info, &ctx->cur_sequence->drm_info);
-	if (rc != NGX_OK)
-	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_drm_info_request_finished: invalid drm info response %V", &drm_info);
-		rc = NGX_HTTP_SERVICE_UNAVAILABLE;
-		goto finalize_request;
-	}
+// Note: returns NGX_AGAIN as long as there are pending requests, once all the requests complete, 
+//		the state machine is called again and the responses can be read from fanout->requests
+static ngx_int_t
+ngx_http_vod_fanout_start(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_fanout_request_t* req;
+	ngx_http_vod_fanout_t* fanout = &ctx->fanout;
+	ngx_uint_t concurrency = ctx->submodule_context.conf->subrequest_concurrency;
+	ngx_int_t rc;
 
-	// save to cache
-	if (conf->drm_info_cache != NULL)
+	while (fanout->next < fanout->count && fanout->pending < concurrency)
 	{
-		if (ngx_buffer_cache_store_perf(
-			ctx->perf_counters,
-			conf->drm_info_cache,
-			ctx->cur_sequence->uri_key,
-			drm_info.data,
-			drm_info.len))
+		req = &fanout->requests[fanout->next];
+		fanout->next++;
+
+		if (req->cache_hit)
 		{
-			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_drm_info_request_finished: stored in drm info cache");
+			continue;
 		}
-		else
+
+		rc = ngx_http_vod_alloc_buffer(ctx, &req->response_buffer, req->max_response_size, READER_HTTP);
+		if (rc != NGX_OK)
 		{
-			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_drm_info_request_finished: failed to store drm info in cache");
+			fanout->rc = rc;
+			break;
 		}
-	}
 
-	ctx->cur_sequence++;
+		rc = ngx_child_request_start(
+			ctx->submodule_context.r,
+			ngx_http_vod_fanout_request_finished,
+			req,
+			req->location,
+			&req->child_params,
+			&req->response_buffer);
+		if (rc != NGX_AGAIN)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_fanout_start: ngx_child_request_start failed %i", rc);
+			fanout->rc = rc;
+			break;
+		}
 
-	rc = ngx_http_vod_run_state_machine(ctx);
-	if (rc == NGX_AGAIN)
-	{
-		return;
+		fanout->pending++;
+		fanout->started++;
 	}
 
-	if (rc != NGX_OK && rc != NGX_DONE)
+	// on error, wait for the pending requests to complete before returning the error
+	if (fanout->pending > 0)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_drm_info_request_finished: ngx_http_vod_run_state_machine failed %i", rc);
+		return NGX_AGAIN;
 	}
 
-finalize_request:
-
-	ngx_http_vod_finalize_request(ctx, rc);
+	return fanout->rc;
 }
 
-static ngx_int_t
-ngx_http_vod_state_machine_get_drm_info(ngx_http_vod_ctx_t *ctx)
+static void
+ngx_http_vod_fanout_request_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
 {
-	ngx_child_request_params_t child_params;
-	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
-	ngx_http_request_t* r = ctx->submodule_context.r;
-	ngx_int_t rc;
-	ngx_str_t drm_info;
+	ngx_http_vod_fanout_request_t* req = context;
+	ngx_http_vod_fanout_t* fanout;
+	ngx_http_vod_ctx_t *ctx;
 
-	for (;
-		ctx->cur_sequence < ctx->submodule_context.media_set.sequences_end;
-		ctx->cur_sequence++)
+	ctx = req->ctx;
+	fanout = &ctx->fanout;
+	fanout->pending--;
+
+	if (fanout->rc != NGX_OK)
 	{
-		if (conf->drm_info_cache != NULL)
-		{
-			// try to read the drm info from cache
-			if (ngx_buffer_cache_fetch_copy_perf(
-				r, 
-				ctx->perf_counters, 
-				&conf->drm_info_cache, 
-				1, 
-				ctx->cur_sequence->uri_key, 
-				&drm_info.data, 
-				&drm_info.len) >= 0)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-					"ngx_http_vod_state_machine_get_drm_info: drm info cache hit, size is %uz", drm_info.len);
+		// a previous request failed
+		goto failed;
+	}
 
-				rc = conf->submodule.parse_drm_info(&ctx->submodule_context, &drm_info, &ctx->cur_sequence->drm_info);
-				if (rc != NGX_OK)
-				{
-					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_get_drm_info: invalid drm info in cache %V", &drm_info);
-					return rc;
-				}
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_fanout_request_finished: upstream request failed %i", rc);
+		fanout->rc = rc;
+		goto failed;
+	}
 
-				continue;
-			}
-			else
-			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-					"ngx_http_vod_state_machine_get_drm_info: drm info cache miss");
-			}
-		}
+	if (response->last >= response->end)
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_fanout_request_finished: not enough room in buffer for null terminator");
+		fanout->rc = NGX_HTTP_BAD_GATEWAY;
+		goto failed;
+	}
 
-		r->connection->log->action = "getting drm info";
+	*response->last = '\0';
 
-		rc = ngx_http_vod_alloc_read_buffer(ctx, conf->drm_max_info_length, READER_HTTP);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
+	req->response.data = response->pos;
+	req->response.len = response->last - response->pos;
 
-		ngx_memzero(&child_params, sizeof(child_params));
-		child_params.method = NGX_HTTP_GET;
+	// start the next requests
+	rc = ngx_http_vod_fanout_start(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
 
-		if (conf->drm_request_uri != NULL)
-		{
-			if (ngx_http_complex_value(
-				r,
-				conf->drm_request_uri,
-				&child_params.base_uri) != NGX_OK)
-			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-					"ngx_http_vod_state_machine_get_drm_info: ngx_http_complex_value failed");
-				return NGX_ERROR;
-			}
-		}
-		else
+	if (rc == NGX_OK)
+	{
+		// all requests completed
+		rc = ctx->state_machine(ctx);
+		if (rc == NGX_AGAIN)
 		{
-			child_params.base_uri = ctx->cur_sequence->stripped_uri;
+			return;
 		}
+	}
 
-		ngx_perf_counter_start(ctx->perf_counter_context);
+	ngx_http_vod_finalize_request(ctx, rc);
+	return;
 
-		rc = ngx_child_request_start(
-			r,
-			ngx_http_vod_drm_info_request_finished,
-			r,
-			&conf->drm_upstream_location,
-			&child_params,
-			&ctx->read_buffer);
-		if (rc != NGX_AGAIN)
-		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_state_machine_get_drm_info: ngx_child_request_start failed %i", rc);
-		}
-		return rc;
+failed:
+
+	if (fanout->pending > 0)
+	{
+		return;
 	}
 
-	return NGX_OK;
+	ngx_http_vod_finalize_request(ctx, fanout->rc);
 }
 
-////// Common media processing
-
-static ngx_int_t 
-ngx_http_vod_parse_metadata(
-	ngx_http_vod_ctx_t *ctx, 
-	ngx_flag_t fetched_from_cache)
+static ngx_int_t
+ngx_http_vod_init_upstream_extra_args(ngx_http_vod_ctx_t *ctx)
 {
-	get_clip_ranges_params_t get_ranges_params;
-	media_parse_params_t parse_params;
-	const ngx_http_vod_request_t* request = ctx->request;
-	media_clip_source_t* cur_source = ctx->cur_source;
-	request_context_t* request_context = &ctx->submodule_context.request_context;
-	segmenter_conf_t* segmenter = &ctx->submodule_context.conf->segmenter;
-	get_clip_ranges_result_t clip_ranges;
-	uint64_t last_segment_end;
-	media_range_t range;
-	vod_status_t rc;
-	file_info_t file_info;
-	uint32_t* request_tracks_mask;
-	uint32_t tracks_mask[MEDIA_TYPE_COUNT];
-	uint32_t duration_millis;
-	vod_fraction_t rate;
+	if (ctx->upstream_extra_args.len != 0 ||
+		ctx->submodule_context.conf->upstream_extra_args == NULL)
+	{
+		return NGX_OK;
+	}
 
-	if (request == NULL)
+	if (ngx_http_complex_value(
+		ctx->submodule_context.r,
+		ctx->submodule_context.conf->upstream_extra_args,
+		&ctx->upstream_extra_args) != NGX_OK)
 	{
-		// Note: the other fields in parse_params are not required here
-		parse_params.clip_from = cur_source->clip_from;
-		parse_params.clip_to = cur_source->clip_to;
+		return NGX_ERROR;
+	}
 
-		if (ctx->format->clipper_parse == NULL)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_parse_metadata: clipping not supported for %V", &ctx->format->name);
-			return NGX_HTTP_BAD_REQUEST;
-		}
+	return NGX_OK;
+}
 
-		rc = ctx->format->clipper_parse(
-			request_context,
-			&parse_params,
-			ctx->metadata_parts,
-			ctx->metadata_part_count,
-			fetched_from_cache,
-			&ctx->clipper_parse_result);
-		if (rc != VOD_OK)
-		{
-			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
-				"ngx_http_vod_parse_metadata: clipper_parse(%V) failed %i", &ctx->format->name, rc);
-			return ngx_http_vod_status_to_ngx_error(rc);
-		}
+////// Cache lock
 
-		return NGX_OK;
-	}
+static void
+ngx_http_vod_cache_lock_wait_completed(ngx_event_t* ev)
+{
+	ngx_http_vod_ctx_t* ctx = ev->data;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_connection_t* c = r->connection;
+	ngx_int_t rc;
 
-	ngx_perf_counter_start(ctx->perf_counter_context);
+	r->main->blocked--;
+	r->aio = 0;
 
-	// init the parsing params
-	parse_params.parse_type = request->parse_type;
-	if (request->request_class == REQUEST_CLASS_MANIFEST && 
-		ctx->submodule_context.media_set.durations == NULL)
+	// run the state machine, it will retry the cache fetch
+	rc = ctx->state_machine(ctx);
+	if (rc != NGX_AGAIN)
 	{
-		parse_params.parse_type |= segmenter->parse_type;
+		ngx_http_vod_finalize_request(ctx, rc);
 	}
 
-	if (!ctx->submodule_context.conf->ignore_edit_list)
+	ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_vod_cache_lock_cleanup(void* data)
+{
+	ngx_http_vod_ctx_t* ctx = data;
+
+	if (ctx->cache_lock_event.timer_set)
 	{
-		parse_params.parse_type |= PARSE_FLAG_EDIT_LIST;
+		ngx_del_timer(&ctx->cache_lock_event);
 	}
-	parse_params.codecs_mask = request->codecs_mask;
+}
 
-	if (ctx->submodule_context.request_params.sequence_tracks_mask != NULL)
+// Note: releases the lock taken by ngx_http_vod_cache_lock, must be called once the result was stored,
+//		or when the request decided not to store it
+static void
+ngx_http_vod_cache_unlock(ngx_http_vod_ctx_t* ctx)
+{
+	if (ctx->cache_lock != NULL)
 	{
-		request_tracks_mask = ctx->submodule_context.request_params.sequence_tracks_mask + 
-			cur_source->sequence->index * MEDIA_TYPE_COUNT;
+		ngx_buffer_cache_unlock(ctx->cache_lock);
+		ctx->cache_lock = NULL;
 	}
-	else
+}
+
+// Note: same as ngx_http_vod_cache_lock, the lock is returned to the caller, used when generating
+//		several keys concurrently
+static ngx_int_t
+ngx_http_vod_cache_lock_key(
+	ngx_http_vod_ctx_t* ctx, 
+	ngx_buffer_cache_t* cache, 
+	u_char* key, 
+	ngx_buffer_cache_lock_t** lock)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_pool_cleanup_t* cln;
+	ngx_int_t rc;
+
+	if (!conf->cache_lock || cache == NULL)
 	{
-		request_tracks_mask = ctx->submodule_context.request_params.tracks_mask;
+		return NGX_OK;
 	}
-	tracks_mask[MEDIA_TYPE_VIDEO] = cur_source->tracks_mask[MEDIA_TYPE_VIDEO] & request_tracks_mask[MEDIA_TYPE_VIDEO];
-	tracks_mask[MEDIA_TYPE_AUDIO] = cur_source->tracks_mask[MEDIA_TYPE_AUDIO] & request_tracks_mask[MEDIA_TYPE_AUDIO];
-	parse_params.required_tracks_mask = tracks_mask;
-	parse_params.langs_mask = ctx->submodule_context.request_params.langs_mask;
-	parse_params.clip_from = cur_source->clip_from;
-	parse_params.clip_to = cur_source->clip_to;
-	parse_params.clip_start_time = ctx->submodule_context.media_set.first_clip_time + cur_source->sequence_offset;
-	
-	file_info.source = cur_source;
-	file_info.uri = cur_source->uri;
-	file_info.drm_info = cur_source->sequence->drm_info;
 
-	// parse the basic metadata
-	rc = ctx->format->parse_metadata(
-		&ctx->submodule_context.request_context,
-		&parse_params,
-		ctx->metadata_parts,
-		ctx->metadata_part_count,
-		&file_info,
-		&ctx->base_metadata);
-	if (rc != VOD_OK)
+	rc = ngx_buffer_cache_lock(cache, r->pool, key, conf->cache_lock_timeout, ctx->cache_lock_waiting, lock);
+	if (rc != NGX_BUSY)
 	{
-		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
-			"ngx_http_vod_parse_metadata: parse_metadata(%V) failed %i", &ctx->format->name, rc);
-		return ngx_http_vod_status_to_ngx_error(rc);
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_cache_lock: ngx_buffer_cache_lock returned %i", rc);
+		ctx->cache_lock_waiting = 0;
+		return NGX_OK;
 	}
 
-	if (ctx->base_metadata->tracks.nelts == 0)
+	if (!ctx->cache_lock_waiting)
 	{
-		ngx_memzero(&cur_source->track_array, sizeof(cur_source->track_array));
-		return VOD_OK;
+		ctx->cache_lock_waiting = 1;
+		ctx->cache_lock_start = ngx_current_msec;
 	}
-
-	if (request->request_class != REQUEST_CLASS_SEGMENT)
+	else if (ngx_current_msec - ctx->cache_lock_start >= (ngx_msec_t)conf->cache_lock_timeout * 1000)
 	{
-		request_context->simulation_only = TRUE;
+		ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+			"ngx_http_vod_cache_lock: cache lock timed out, generating without the lock");
+		ctx->cache_lock_waiting = 0;
+		return NGX_OK;
+	}
 
-		parse_params.max_frame_count = 1024 * 1024;
-		range.timescale = 1000;
-		range.start = 0;
-		if (cur_source->clip_to == UINT_MAX)
-		{
-			range.end = ULLONG_MAX;
-		}
-		else
+	if (ctx->cache_lock_event.handler == NULL)
+	{
+		cln = ngx_pool_cleanup_add(r->pool, 0);
+		if (cln == NULL)
 		{
-			range.end = cur_source->clip_to - cur_source->clip_from;
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_cache_lock: ngx_pool_cleanup_add failed");
+			ctx->cache_lock_waiting = 0;
+			return NGX_OK;
 		}
-		parse_params.range = &range;
+
+		cln->handler = ngx_http_vod_cache_lock_cleanup;
+		cln->data = ctx;
+
+		ctx->cache_lock_event.handler = ngx_http_vod_cache_lock_wait_completed;
+		ctx->cache_lock_event.data = ctx;
+		ctx->cache_lock_event.log = r->connection->log;
 	}
-	else
-	{
-		request_context->simulation_only = FALSE;
 
-		parse_params.max_frame_count = 64 * 1024;
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_cache_lock: key is locked by another request, waiting");
 
-		if (cur_source->range != NULL)
-		{
-			// the range was already determined while parsing the media set
-			parse_params.range = cur_source->range;
-		}
-		else
-		{
-			// get the rate
-			if (cur_source->base.parent != NULL && cur_source->base.parent->type == MEDIA_CLIP_RATE_FILTER)
-			{
-				rate = ((media_clip_rate_filter_t*)cur_source->base.parent)->rate;
-			}
-			else
-			{
-				rate.nom = 1;
-				rate.denom = 1;
-			}
+	ngx_add_timer(&ctx->cache_lock_event, CACHE_LOCK_POLL_INTERVAL);
 
-			// get the last segment end
-			if (cur_source->clip_to == UINT_MAX)
-			{
-				last_segment_end = ULLONG_MAX;
-			}
-			else
-			{
-				last_segment_end = ((cur_source->clip_to - cur_source->clip_from) * rate.denom) / rate.nom;
-			}
+	r->main->blocked++;
+	r->aio = 1;
 
-			// get the start/end offsets
-			duration_millis = rescale_time(ctx->base_metadata->duration * rate.denom, ctx->base_metadata->timescale * rate.nom, 1000);
-
-			get_ranges_params.request_context = &ctx->submodule_context.request_context,
-			get_ranges_params.conf = segmenter,
-			get_ranges_params.segment_index = ctx->submodule_context.request_params.segment_index,
-			get_ranges_params.clip_durations = &duration_millis,
-			get_ranges_params.total_clip_count = 1,
-			get_ranges_params.start_time = 0,
-			get_ranges_params.end_time = duration_millis,
-			get_ranges_params.last_segment_end = last_segment_end,
-			get_ranges_params.key_frame_durations = NULL;
-
-			rc = segmenter_get_start_end_ranges_no_discontinuity(
-				&get_ranges_params,
-				&clip_ranges);
-			if (rc != VOD_OK)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
-					"ngx_http_vod_parse_metadata: segmenter_get_start_end_ranges_no_discontinuity failed %i", rc);
-				return ngx_http_vod_status_to_ngx_error(rc);
-			}
-
-			if (clip_ranges.clip_count == 0)
-			{
-				ngx_memzero(&cur_source->track_array, sizeof(cur_source->track_array));
-				return VOD_OK;
-			}
-
-			parse_params.range = clip_ranges.clip_ranges;
-			parse_params.range->start = (parse_params.range->start * rate.nom) / rate.denom;
-			if (parse_params.range->end != ULLONG_MAX)
-			{
-				parse_params.range->end = (parse_params.range->end * rate.nom) / rate.denom;
-			}
-		}
-	}
-
-	parse_params.max_frames_size = ctx->submodule_context.conf->max_frames_size;
-
-	// parse the frames
-	rc = ctx->format->read_frames(
-		&ctx->submodule_context.request_context,
-		ctx->base_metadata,
-		&parse_params,
-		segmenter,
-		&ctx->read_cache_state,
-		NULL,
-		&ctx->frames_read_req,
-		&cur_source->track_array);
-	if (rc != VOD_OK && rc != VOD_AGAIN)
-	{
-		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
-			"ngx_http_vod_parse_metadata: read_frames(%V) failed %i", &ctx->format->name, rc);
-		return ngx_http_vod_status_to_ngx_error(rc);
-	}
-
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_MEDIA_PARSE);
-
-	return rc;
+	return NGX_AGAIN;
 }
 
+// Note: must be called after a cache miss, returns NGX_AGAIN when another request is currently
+//		generating the key, the state machine is called again when the wait interval passes
 static ngx_int_t
-ngx_http_vod_identify_format(ngx_http_vod_ctx_t* ctx)
+ngx_http_vod_cache_lock(ngx_http_vod_ctx_t* ctx, ngx_buffer_cache_t* cache, u_char* key)
 {
-	media_format_t** cur_format_ptr;
-	media_format_t* cur_format;
-	vod_status_t rc;
-	vod_str_t buffer;
+	// a request holds a single lock at a time
+	ngx_http_vod_cache_unlock(ctx);
 
-	buffer.data = ctx->read_buffer.pos;
-	buffer.len = ctx->read_buffer.last - ctx->read_buffer.pos;
+	return ngx_http_vod_cache_lock_key(ctx, cache, key, &ctx->cache_lock);
+}
 
-	for (cur_format_ptr = media_formats; ; cur_format_ptr++)
-	{
-		cur_format = *cur_format_ptr;
-		if (cur_format == NULL)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_identify_format: failed to identify the file format");
-			return ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
-		}
+////// Disk tier promotion
 
-		rc = cur_format->init_metadata_reader(
-			&ctx->submodule_context.request_context,
-			&buffer,
-			ctx->submodule_context.conf->max_metadata_size,
-			&ctx->metadata_reader_context);
-		if (rc == VOD_NOT_FOUND)
-		{
-			continue;
-		}
+static void
+ngx_http_vod_cache_promote_completed(void* context)
+{
+	ngx_http_vod_ctx_t* ctx = context;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_connection_t* c = r->connection;
+	ngx_int_t rc;
 
-		if (rc != VOD_OK)
-		{
-			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_identify_format: init_metadata_reader(%V) failed %i", &cur_format->name, rc);
-			return ngx_http_vod_status_to_ngx_error(rc);
-		}
+	r->main->blocked--;
+	r->aio = 0;
 
-		ctx->format = cur_format;
-		break;
+	// run the state machine, it will retry the cache fetch
+	rc = ctx->state_machine(ctx);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_http_vod_finalize_request(ctx, rc);
 	}
 
-	return NGX_OK;
+	ngx_http_run_posted_requests(c);
 }
 
+// Note: must be called after a cache miss, returns NGX_AGAIN when the key is read from the disk tier of the cache,
+//		the state machine is called again when the read completes. the key is read from disk only once
 static ngx_int_t
-ngx_http_vod_init_format(ngx_http_vod_ctx_t* ctx, uint32_t format_id)
+ngx_http_vod_cache_promote(ngx_http_vod_ctx_t* ctx, ngx_buffer_cache_t* cache, u_char* key)
 {
-	media_format_t** cur_format_ptr;
-	media_format_t* cur_format;
+	ngx_http_request_t* r = ctx->submodule_context.r;
 
-	for (cur_format_ptr = media_formats; ; cur_format_ptr++)
+	if (ctx->promote_done &&
+		ngx_memcmp(ctx->promote_key, key, sizeof(ctx->promote_key)) == 0)
 	{
-		cur_format = *cur_format_ptr;
-		if (cur_format == NULL)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_init_format: format id %uD not found", format_id);
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
-		}
-
-		if (cur_format->id != format_id)
-		{
-			continue;
-		}
+		return NGX_DECLINED;
+	}
 
-		ctx->format = cur_format;
-		break;
+	if (ngx_buffer_cache_promote(cache, r->pool, key, ngx_http_vod_cache_promote_completed, ctx) != NGX_AGAIN)
+	{
+		return NGX_DECLINED;
 	}
 
-	return NGX_OK;
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_cache_promote: reading the key from the disk tier");
+
+	ngx_memcpy(ctx->promote_key, key, sizeof(ctx->promote_key));
+	ctx->promote_done = 1;
+
+	r->main->blocked++;
+	r->aio = 1;
+
+	return NGX_AGAIN;
 }
 
-static ngx_int_t
-ngx_http_vod_async_read(ngx_http_vod_ctx_t* ctx, media_format_read_request_t* read_req)
+////// DRM
+
+static void
+ngx_http_vod_drm_info_request_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
 {
-	size_t prefix_size;
-	size_t buffer_size;
-	size_t read_size;
-	off_t read_offset;
-	ngx_int_t rc;
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_http_vod_ctx_t *ctx;
+	ngx_http_request_t *r = context;
+	ngx_str_t drm_info;
 
-	// align the read size and offset
-	read_offset = read_req->read_offset & (~(ctx->alignment - 1));
-	if (read_req->read_size == 0)
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	conf = ctx->submodule_context.conf;
+
+	if (rc != NGX_OK)
 	{
-		read_size = ctx->submodule_context.conf->initial_read_size;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_drm_info_request_finished: upstream request failed %i", rc);
+		goto finalize_request;
 	}
-	else
+
+	if (response->last >= response->end)
 	{
-		read_size = read_req->read_size + read_req->read_offset - read_offset;
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_drm_info_request_finished: not enough room in buffer for null terminator");
+		rc = NGX_HTTP_BAD_GATEWAY;
+		goto finalize_request;
 	}
 
-	read_size = (read_size + ctx->alignment - 1) & (~(ctx->alignment - 1));
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_GET_DRM_INFO);
 
-	// optimization for the case in which the current range is a prefix of the new range
-	buffer_size = ctx->read_buffer.last - ctx->read_buffer.pos;
-	prefix_size = 0;
+	drm_info.data = response->pos;
+	drm_info.len = content_length;
+	*response->last = '\0';
 
-	if (read_offset >= ctx->read_offset && 
-		read_offset < (off_t)(ctx->read_offset + buffer_size) &&
-		ctx->read_buffer.start != NULL)
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
+		"ngx_http_vod_drm_info_request_finished: result %V", &drm_info);
+
+	// parse the drm info
+	rc = conf->submodule.parse_drm_info(&ctx->submodule_context, &drm_info, &ctx->cur_sequence->drm_info);
+	if (rc != NGX_OK)
 	{
-		prefix_size = ctx->read_offset + buffer_size - read_offset;
-		ctx->prefix_buffer = ctx->read_buffer;
-		ctx->prefix_buffer.pos = ctx->prefix_buffer.last - prefix_size;
-		ctx->free_prefix = !read_req->realloc_buffer;		// should not free the buffer if there are references to it
-		ctx->read_buffer.start = NULL;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_drm_info_request_finished: invalid drm info response %V", &drm_info);
+		rc = NGX_HTTP_SERVICE_UNAVAILABLE;
+		goto finalize_request;
 	}
-	else if (read_req->realloc_buffer)
+
+	// save to cache
+	if (conf->drm_info_cache != NULL)
 	{
-		ctx->read_buffer.start = NULL;
+		if (ngx_buffer_cache_store_perf(
+			ctx->perf_counters,
+			conf->drm_info_cache,
+			ctx->cur_sequence->uri_key,
+			drm_info.data,
+			drm_info.len))
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_drm_info_request_finished: stored in drm info cache");
+		}
+		else
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_drm_info_request_finished: failed to store drm info in cache");
+		}
 	}
 
-	// allocate the read buffer
-	rc = ngx_http_vod_alloc_read_buffer(ctx, read_size, ctx->alloc_params_index);
-	if (rc != NGX_OK)
+	ngx_http_vod_cache_unlock(ctx);
+
+	ctx->cur_sequence++;
+
+	rc = ngx_http_vod_run_state_machine(ctx);
+	if (rc == NGX_AGAIN)
 	{
-		return rc;
+		return;
 	}
 
-	if (ctx->prefix_buffer.start != NULL)
+	if (rc != NGX_OK && rc != NGX_DONE)
 	{
-		ctx->read_buffer.start += prefix_size;
-		ctx->read_buffer.pos = ctx->read_buffer.start;
-		ctx->read_buffer.last = ctx->read_buffer.start;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_drm_info_request_finished: ngx_http_vod_run_state_machine failed %i", rc);
 	}
 
-	// perform the read
-	ctx->read_offset = read_offset;
-	ctx->requested_offset = read_req->read_offset;
+finalize_request:
 
-	ngx_perf_counter_start(ctx->perf_counter_context);
+	ngx_http_vod_finalize_request(ctx, rc);
+}
 
-	rc = ctx->async_read(
-		ctx->cur_source->reader_context,
-		&ctx->read_buffer,
-		read_size - prefix_size,
-		read_offset + prefix_size);
-	if (rc != NGX_OK)
-	{
-		if (rc != NGX_AGAIN)
+////// Cache peers
+
+static ngx_str_t*
+ngx_http_vod_cache_peer_get_owner(ngx_http_vod_loc_conf_t* conf, u_char* key)
+{
+	ngx_str_t* best_peer = NULL;
+	ngx_str_t* cur_peer;
+	ngx_str_t* peers_end;
+	uint32_t best_score = 0;
+	uint32_t score;
+
+	// rendezvous hashing - the peer with the highest score owns the key, this way, adding / removing
+	//		a peer moves only the keys owned by that peer
+	cur_peer = conf->cache_peers->elts;
+	peers_end = cur_peer + conf->cache_peers->nelts;
+	for (; cur_peer < peers_end; cur_peer++)
+	{
+		ngx_crc32_init(score);
+		ngx_crc32_update(&score, cur_peer->data, cur_peer->len);
+		ngx_crc32_update(&score, key, BUFFER_CACHE_KEY_SIZE);
+		ngx_crc32_final(score);
+
+		if (best_peer == NULL || score > best_score)
 		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_async_read: async_read failed %i", rc);
+			best_peer = cur_peer;
+			best_score = score;
 		}
-
-		return rc;
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_READ_FILE);
-
-	return NGX_OK;
+	return best_peer;
 }
 
-static ngx_int_t
-ngx_http_vod_get_async_read_result(ngx_http_vod_ctx_t* ctx, vod_str_t* read_buffer)
+static void
+ngx_http_vod_cache_peer_lookup_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
 {
-	size_t prefix_size;
-	size_t buffer_size;
-	off_t buffer_offset;
+	ngx_http_vod_ctx_t *ctx = context;
 
-	if (ctx->prefix_buffer.start != NULL)
+	if (rc != NGX_OK)
 	{
-		// prepend the prefix buffer
-		prefix_size = ctx->prefix_buffer.last - ctx->prefix_buffer.pos;
-		ctx->read_buffer.start -= prefix_size;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_cache_peer_lookup_finished: peer request failed %i", rc);
+	}
+	else if (response->last >= response->end)
+	{
+		ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_cache_peer_lookup_finished: peer response too big, ignoring");
+	}
+	else
+	{
+		ctx->peer_response.data = response->pos;
+		ctx->peer_response.len = response->last - response->pos;
+	}
 
-		ctx->read_buffer.pos -= prefix_size;
-		ngx_memcpy(ctx->read_buffer.pos, ctx->prefix_buffer.pos, prefix_size);
+	ngx_perf_counter_add(ctx->perf_counters, 
+		ctx->peer_response.len > 0 ? PC_CACHE_PEER_HIT : PC_CACHE_PEER_MISS, 1);
 
-		if (ctx->free_prefix)
-		{
-			ngx_pfree(ctx->submodule_context.r->pool, ctx->prefix_buffer.start);
-		}
-		ctx->prefix_buffer.start = NULL;
+	// Note: the state machine runs again, and consumes the response (a failed lookup is treated as a miss)
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
 	}
 
-	// adjust the buffer pointer following the alignment
-	buffer_offset = ctx->requested_offset - ctx->read_offset;
-	buffer_size = ctx->read_buffer.last - ctx->read_buffer.pos;
-
-	if (buffer_size < (size_t)buffer_offset)
-	{
-		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_get_async_read_result: buffer size %uz is smaller than buffer offset %O", 
-			buffer_size, buffer_offset);
-		return ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
-	}
-
-	read_buffer->data = ctx->read_buffer.pos + buffer_offset;
-	read_buffer->len = buffer_size - buffer_offset;
-
-	return NGX_OK;
-}
+	ngx_http_vod_finalize_request(ctx, rc);
+}
 
+// Note: must be called after a cache miss. returns NGX_AGAIN when a request was issued to the peer that 
+//		owns the key, the state machine is called again once it completes. returns NGX_OK when the entry 
+//		was received from the peer, and NGX_DECLINED when the entry should be generated locally
 static ngx_int_t
-ngx_http_vod_read_metadata(ngx_http_vod_ctx_t* ctx)
+ngx_http_vod_cache_peer_lookup(
+	ngx_http_vod_ctx_t* ctx,
+	ngx_http_vod_peer_cache_t* peer_cache,
+	u_char* key,
+	size_t max_response_size,
+	ngx_str_t* result)
 {
-	media_format_read_metadata_result_t result;
-	vod_str_t read_buffer;
+	ngx_child_request_params_t child_params;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_str_t* peer;
 	ngx_int_t rc;
+	u_char* p;
 
-	if (ctx->metadata_reader_context == NULL)
+	if (conf->cache_peers == NULL || conf->cache_peer_location.len == 0 || ctx->speculative)
 	{
-		// identify the format
-		rc = ngx_http_vod_identify_format(ctx);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
+		return NGX_DECLINED;
 	}
 
-	for (;;)
+	if (ctx->peer_lookup_done && 
+		ngx_memcmp(ctx->peer_key, key, sizeof(ctx->peer_key)) == 0)
 	{
-		rc = ngx_http_vod_get_async_read_result(ctx, &read_buffer);
-		if (rc != NGX_OK)
+		// the key was already looked up, the response is returned only once
+		if (ctx->peer_response.len == 0)
 		{
-			return rc;
+			return NGX_DECLINED;
 		}
 
-		// run the read state machine
-		rc = ctx->format->read_metadata(
-			ctx->metadata_reader_context,
-			ctx->requested_offset,
-			&read_buffer,
-			&result);
-		if (rc == VOD_OK)
-		{
-			ctx->metadata_parts = result.parts;
-			ctx->metadata_part_count = result.part_count;
-			break;
-		}
+		*result = ctx->peer_response;
+		ctx->peer_response.len = 0;
+		return NGX_OK;
+	}
 
-		if (rc != VOD_AGAIN)
-		{
-			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_read_metadata: read_metadata(%V) failed %i", &ctx->format->name, rc);
-			return ngx_http_vod_status_to_ngx_error(rc);
-		}
+	peer = ngx_http_vod_cache_peer_get_owner(conf, key);
+	if (peer->len == conf->cache_peer_self.len &&
+		ngx_strncmp(peer->data, conf->cache_peer_self.data, peer->len) == 0)
+	{
+		return NGX_DECLINED;
+	}
 
-		// issue another read request
-		rc = ngx_http_vod_async_read(ctx, &result.read_req);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_cache_peer_lookup: looking up %V in peer %V", &peer_cache->name, peer);
+
+	// build the uri - /<peer>/<cache name>/<key>
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_GET;
+
+	p = ngx_pnalloc(r->pool, sizeof("///") - 1 + peer->len + peer_cache->name.len + BUFFER_CACHE_KEY_SIZE * 2);
+	if (p == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_cache_peer_lookup: ngx_pnalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 
-	return NGX_OK;
+	child_params.base_uri.data = p;
+	*p++ = '/';
+	p = ngx_copy(p, peer->data, peer->len);
+	*p++ = '/';
+	p = ngx_copy(p, peer_cache->name.data, peer_cache->name.len);
+	*p++ = '/';
+	p = ngx_hex_dump(p, key, BUFFER_CACHE_KEY_SIZE);
+	child_params.base_uri.len = p - child_params.base_uri.data;
+
+	// Note: the buffer only has to hold the response headers, a larger buffer is allocated according to 
+	//		the content length of the response
+	child_params.max_response_size = max_response_size;
+
+	rc = ngx_http_vod_alloc_buffer(
+		ctx, 
+		&ctx->peer_buffer, 
+		ngx_min(max_response_size + 1, CACHE_PEER_INITIAL_BUFFER_SIZE), 
+		READER_HTTP);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	ngx_memcpy(ctx->peer_key, key, sizeof(ctx->peer_key));
+	ctx->peer_lookup_done = 1;
+	ctx->peer_response.len = 0;
+
+	rc = ngx_child_request_start(
+		r,
+		ngx_http_vod_cache_peer_lookup_finished,
+		ctx,
+		&conf->cache_peer_location,
+		&child_params,
+		&ctx->peer_buffer);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_cache_peer_lookup: ngx_child_request_start failed %i", rc);
+	}
+	return rc;
 }
 
-static ngx_int_t
-ngx_http_vod_read_frames(ngx_http_vod_ctx_t *ctx)
+ngx_int_t
+ngx_http_vod_cache_peer_handler(ngx_http_request_t *r)
 {
-	media_format_read_request_t read_req;
-	vod_str_t read_buffer;
+	ngx_http_vod_peer_cache_t* peer_cache;
+	ngx_http_vod_peer_cache_t* peer_caches_end;
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_buffer_cache_t** caches;
+	ngx_str_t cache_name;
+	ngx_str_t response;
+	ngx_int_t value;
 	ngx_int_t rc;
+	ngx_uint_t i;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	u_char* hex_key;
 
-	for (;;)
+	if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
 	{
-		rc = ngx_http_vod_get_async_read_result(ctx, &read_buffer);
-		if (rc != NGX_OK)
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	rc = ngx_http_discard_request_body(r);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	// parse the uri - .../<cache name>/<key>
+	if (r->uri.len < sizeof("//") - 1 + BUFFER_CACHE_KEY_SIZE * 2)
+	{
+		return NGX_HTTP_BAD_REQUEST;
+	}
+
+	hex_key = r->uri.data + r->uri.len - BUFFER_CACHE_KEY_SIZE * 2;
+	if (hex_key[-1] != '/')
+	{
+		return NGX_HTTP_BAD_REQUEST;
+	}
+
+	cache_name.data = hex_key - 1;
+	while (cache_name.data > r->uri.data && cache_name.data[-1] != '/')
+	{
+		cache_name.data--;
+	}
+	cache_name.len = hex_key - 1 - cache_name.data;
+
+	peer_caches_end = peer_caches + sizeof(peer_caches) / sizeof(peer_caches[0]);
+	for (peer_cache = peer_caches; ; peer_cache++)
+	{
+		if (peer_cache >= peer_caches_end)
 		{
-			return rc;
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_cache_peer_handler: unknown cache name \"%V\"", &cache_name);
+			return NGX_HTTP_BAD_REQUEST;
 		}
 
-		// run the read state machine
-		rc = ctx->format->read_frames(
-			&ctx->submodule_context.request_context,
-			ctx->base_metadata,
-			NULL,
-			&ctx->submodule_context.conf->segmenter,
-			&ctx->read_cache_state,
-			&read_buffer,
-			&read_req,
-			&ctx->cur_source->track_array);
-		if (rc == VOD_OK)
+		if (peer_cache->name.len == cache_name.len &&
+			ngx_strncmp(peer_cache->name.data, cache_name.data, cache_name.len) == 0)
 		{
 			break;
 		}
+	}
 
-		if (rc != VOD_AGAIN)
+	for (i = 0; i < BUFFER_CACHE_KEY_SIZE; i++)
+	{
+		value = ngx_hextoi(hex_key + i * 2, 2);
+		if (value == NGX_ERROR)
 		{
-			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_read_frames: read_frames(%V) failed %i", &ctx->format->name, rc);
-			return ngx_http_vod_status_to_ngx_error(rc);
+			return NGX_HTTP_BAD_REQUEST;
 		}
+		key[i] = (u_char)value;
+	}
 
-		// issue another read request
-		rc = ngx_http_vod_async_read(ctx, &read_req);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
+	// fetch the entry
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+	caches = (ngx_buffer_cache_t**)((u_char*)conf + peer_cache->conf_offset);
+
+	if (ngx_buffer_cache_fetch_copy_perf(
+		r,
+		ngx_perf_counter_get_state(conf->perf_counters_zone),
+		caches,
+		peer_cache->cache_count,
+		key,
+		&response.data,
+		&response.len) < 0)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_cache_peer_handler: %V cache miss", &cache_name);
+		return NGX_HTTP_NOT_FOUND;
 	}
 
-	return NGX_OK;
+	return ngx_http_vod_send_response(r, &response, &peer_content_type);
 }
 
 static ngx_int_t
-ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_state_machine_get_drm_info_concurrent(ngx_http_vod_ctx_t *ctx)
 {
+	ngx_http_vod_fanout_request_t* req;
 	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
-	multipart_cache_header_t multipart_header;
-	media_clip_source_t* cur_source;
 	ngx_http_request_t* r = ctx->submodule_context.r;
+	media_sequence_t* first_sequence = ctx->cur_sequence;
+	media_sequence_t* sequences_end = ctx->submodule_context.media_set.sequences_end;
+	media_sequence_t* cur_sequence;
 	ngx_int_t rc;
 
-	if (ctx->cur_source == NULL)
+	if (first_sequence >= sequences_end)
 	{
 		return NGX_OK;
 	}
 
-	for (;;)
+	if (ctx->fanout.requests == NULL)
 	{
-		switch (ctx->state)
+		rc = ngx_http_vod_fanout_init(ctx, sequences_end - first_sequence);
+		if (rc != NGX_OK)
 		{
-		case STATE_READ_METADATA_INITIAL:
-			cur_source = ctx->cur_source;
+			return rc;
+		}
 
-			if (conf->metadata_cache != NULL)
+		for (cur_sequence = first_sequence, req = ctx->fanout.requests;
+			cur_sequence < sequences_end;
+			cur_sequence++, req++)
+		{
+			// try to read the drm info from cache
+			if (conf->drm_info_cache != NULL &&
+				ngx_buffer_cache_fetch_copy_perf(
+					r,
+					ctx->perf_counters,
+					&conf->drm_info_cache,
+					1,
+					cur_sequence->uri_key,
+					&req->response.data,
+					&req->response.len) >= 0)
 			{
-				// try to read the metadata from cache
-				if (ngx_buffer_cache_fetch_multipart_perf(
-					ctx,
-					conf->metadata_cache,
-					cur_source->file_key,
-					&multipart_header,
-					&ctx->metadata_parts))
-				{
-					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: metadata cache hit");
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_state_machine_get_drm_info_concurrent: drm info cache hit, size is %uz", req->response.len);
+				req->cache_hit = 1;
+				continue;
+			}
 
-					rc = ngx_http_vod_init_format(ctx, multipart_header.type);
-					if (rc != NGX_OK)
+			rc = ngx_http_vod_cache_lock_key(ctx, conf->drm_info_cache, cur_sequence->uri_key, &req->cache_lock);
+			if (rc != NGX_OK)
+			{
+				// release the keys that were locked so far, so that other requests are not blocked while this
+				//	request waits, the cache is looked up again when the wait interval passes
+				for (; req > ctx->fanout.requests; req--)
+				{
+					if (req[-1].cache_lock != NULL)
 					{
-						return rc;
+						ngx_buffer_cache_unlock(req[-1].cache_lock);
 					}
+				}
 
-					rc = ngx_http_vod_parse_metadata(ctx, 1);
-					if (rc == NGX_OK)
-					{
-						ctx->cur_source = cur_source->next;
-						if (ctx->cur_source == NULL)
-						{
-							return NGX_OK;
-						}
-						break;
-					}
+				ctx->fanout.requests = NULL;
+				return rc;
+			}
 
-					if (rc != NGX_AGAIN)
-					{
-						ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-							"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_parse_metadata failed %i", rc);
-						return rc;
-					}
+			req->location = &conf->drm_upstream_location;
+			req->max_response_size = conf->drm_max_info_length;
+			req->child_params.method = NGX_HTTP_GET;
 
-					ctx->state = STATE_READ_FRAMES_OPEN_FILE;
-				}
-				else
+			if (conf->drm_request_uri != NULL)
+			{
+				// the uri may reference the sequence variables
+				ctx->cur_sequence = cur_sequence;
+
+				if (ngx_http_complex_value(
+					r,
+					conf->drm_request_uri,
+					&req->child_params.base_uri) != NGX_OK)
 				{
 					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: metadata cache miss");
-					ctx->state = STATE_READ_METADATA_OPEN_FILE;
+						"ngx_http_vod_state_machine_get_drm_info_concurrent: ngx_http_complex_value failed");
+					return NGX_ERROR;
 				}
 			}
 			else
 			{
-				ctx->state = STATE_READ_METADATA_OPEN_FILE;
+				req->child_params.base_uri = cur_sequence->stripped_uri;
 			}
+		}
 
-			// open the file
-			rc = ctx->open_file(r, &cur_source->mapped_uri, &cur_source->reader_context);
-			if (rc != NGX_OK)
-			{
-				if (rc != NGX_AGAIN && rc != NGX_DONE)
-				{
-					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: open_file failed %i", rc);
-				}
-				return rc;
-			}
-			break;
+		ctx->cur_sequence = first_sequence;
 
-		case STATE_READ_METADATA_OPEN_FILE:
-			// allocate the initial read buffer
-			rc = ngx_http_vod_alloc_read_buffer(ctx, conf->initial_read_size, ctx->alloc_params_index);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
+		r->connection->log->action = "getting drm info";
 
-			// read the file header
-			r->connection->log->action = "reading media header";
-			ctx->state = STATE_READ_METADATA_READ;
-			ctx->metadata_reader_context = NULL;
+		ngx_perf_counter_start(ctx->perf_counter_context);
 
-			ctx->read_offset = 0;
-			ctx->requested_offset = 0;
+		rc = ngx_http_vod_fanout_start(ctx);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
 
-			cur_source = ctx->cur_source;
+	if (ctx->fanout.started > 0)
+	{
+		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_GET_DRM_INFO);
+	}
 
-			ngx_perf_counter_start(ctx->perf_counter_context);
+	// parse the drm info in order
+	for (cur_sequence = first_sequence, req = ctx->fanout.requests;
+		cur_sequence < sequences_end;
+		cur_sequence++, req++)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_state_machine_get_drm_info_concurrent: result %V", &req->response);
 
-			rc = ctx->async_read(cur_source->reader_context, &ctx->read_buffer, conf->initial_read_size, 0);
-			if (rc != NGX_OK)
-			{
-				if (rc != NGX_AGAIN)
-				{
-					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: async_read failed %i", rc);
-				}
-				return rc;
-			}
+		rc = conf->submodule.parse_drm_info(&ctx->submodule_context, &req->response, &cur_sequence->drm_info);
+		if (rc != NGX_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_state_machine_get_drm_info_concurrent: invalid drm info %V", &req->response);
+			return req->cache_hit ? rc : NGX_HTTP_SERVICE_UNAVAILABLE;
+		}
 
-			// read completed synchronously
-			ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_READ_FILE);
-			// fallthrough
+		if (req->cache_hit || conf->drm_info_cache == NULL)
+		{
+			continue;
+		}
 
-		case STATE_READ_METADATA_READ:
-			// read the metadata
-			rc = ngx_http_vod_read_metadata(ctx);
-			if (rc != NGX_OK)
-			{
-				if (rc != NGX_AGAIN)
-				{
-					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_read_metadata failed %i", rc);
-				}
-				return rc;
-			}
+		// save to cache
+		if (ngx_buffer_cache_store_perf(
+			ctx->perf_counters,
+			conf->drm_info_cache,
+			cur_sequence->uri_key,
+			req->response.data,
+			req->response.len))
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_state_machine_get_drm_info_concurrent: stored in drm info cache");
+		}
+		else
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_state_machine_get_drm_info_concurrent: failed to store drm info in cache");
+		}
+	}
 
-			// parse the metadata
-			rc = ngx_http_vod_parse_metadata(ctx, 0);
-			if (rc != NGX_OK && rc != NGX_AGAIN)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_parse_metadata failed %i", rc);
-				return rc;
-			}
+	ctx->fanout.requests = NULL;
+	ctx->cur_sequence = sequences_end;
 
-			// save the metadata to cache
-			cur_source = ctx->cur_source;
+	return NGX_OK;
+}
 
-			if (conf->metadata_cache != NULL)
+static ngx_int_t
+ngx_http_vod_state_machine_get_drm_info(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_child_request_params_t child_params;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_int_t rc;
+	ngx_str_t drm_info;
+
+	if (conf->subrequest_concurrency > 1)
+	{
+		return ngx_http_vod_state_machine_get_drm_info_concurrent(ctx);
+	}
+
+	for (;
+		ctx->cur_sequence < ctx->submodule_context.media_set.sequences_end;
+		ctx->cur_sequence++)
+	{
+		if (conf->drm_info_cache != NULL)
+		{
+			// try to read the drm info from cache
+			if (ngx_buffer_cache_fetch_copy_perf(
+				r, 
+				ctx->perf_counters, 
+				&conf->drm_info_cache, 
+				1, 
+				ctx->cur_sequence->uri_key, 
+				&drm_info.data, 
+				&drm_info.len) >= 0)
 			{
-				multipart_header.type = ctx->format->id;
-				multipart_header.part_count = ctx->metadata_part_count;
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_state_machine_get_drm_info: drm info cache hit, size is %uz", drm_info.len);
 
-				if (ngx_buffer_cache_store_multipart_perf(
-					ctx,
-					conf->metadata_cache,
-					cur_source->file_key,
-					&multipart_header,
-					ctx->metadata_parts))
-				{
-					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: stored metadata in cache");
-				}
-				else
+				rc = conf->submodule.parse_drm_info(&ctx->submodule_context, &drm_info, &ctx->cur_sequence->drm_info);
+				if (rc != NGX_OK)
 				{
-					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: failed to store metadata in cache");
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_get_drm_info: invalid drm info in cache %V", &drm_info);
+					return rc;
 				}
-			}
 
-			if (ctx->request != NULL)
-			{
-				// no longer need the metadata buffer
-				ngx_pfree(ctx->submodule_context.r->pool, ctx->read_buffer.start);
-				ctx->read_buffer.start = NULL;
+				continue;
 			}
-
-			if (rc == NGX_OK)
+			else
 			{
-				// move to the next source
-				ctx->state = STATE_READ_METADATA_INITIAL;
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_state_machine_get_drm_info: drm info cache miss");
 
-				ctx->cur_source = cur_source->next;
-				if (ctx->cur_source == NULL)
+				rc = ngx_http_vod_cache_lock(ctx, conf->drm_info_cache, ctx->cur_sequence->uri_key);
+				if (rc != NGX_OK)
 				{
-					return NGX_OK;
+					return rc;
 				}
-				break;
 			}
-			// fallthrough
-
-		case STATE_READ_FRAMES_OPEN_FILE:
-			ctx->state = STATE_READ_FRAMES_READ;
-			ctx->read_buffer.start = NULL;			// don't reuse buffers from the metadata phase
+		}
 
-			rc = ngx_http_vod_async_read(ctx, &ctx->frames_read_req);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
-			// fallthrough
+		r->connection->log->action = "getting drm info";
 
-		case STATE_READ_FRAMES_READ:
-			rc = ngx_http_vod_read_frames(ctx);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
+		rc = ngx_http_vod_alloc_read_buffer(ctx, conf->drm_max_info_length, READER_HTTP);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
 
-			// move to the next source
-			ctx->state = STATE_READ_METADATA_INITIAL;
+		ngx_memzero(&child_params, sizeof(child_params));
+		child_params.method = NGX_HTTP_GET;
 
-			ctx->cur_source = ctx->cur_source->next;
-			if (ctx->cur_source == NULL)
+		if (conf->drm_request_uri != NULL)
+		{
+			if (ngx_http_complex_value(
+				r,
+				conf->drm_request_uri,
+				&child_params.base_uri) != NGX_OK)
 			{
-				return NGX_OK;
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_state_machine_get_drm_info: ngx_http_complex_value failed");
+				return NGX_ERROR;
 			}
-			break;
+		}
+		else
+		{
+			child_params.base_uri = ctx->cur_sequence->stripped_uri;
+		}
 
-		default:
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_state_machine_parse_metadata: invalid state %d", ctx->state);
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		ngx_perf_counter_start(ctx->perf_counter_context);
+
+		rc = ngx_child_request_start(
+			r,
+			ngx_http_vod_drm_info_request_finished,
+			r,
+			&conf->drm_upstream_location,
+			&child_params,
+			&ctx->read_buffer);
+		if (rc != NGX_AGAIN)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_state_machine_get_drm_info: ngx_child_request_start failed %i", rc);
 		}
+		return rc;
 	}
 
 	return NGX_OK;
 }
 
-static ngx_int_t
-ngx_http_vod_validate_streams(ngx_http_vod_ctx_t *ctx)
+////// Common media processing
+
+// Note: the size and modification time of the file are part of the key, so that an index that was built
+//		for a previous version of the file is not used. remote files are identified only by their url
+static void
+ngx_http_vod_get_frame_index_key(
+	ngx_http_vod_ctx_t* ctx,
+	file_info_t* file_info,
+	uint32_t media_type,
+	uint32_t track_index,
+	u_char* key)
 {
-	if (ctx->submodule_context.media_set.total_track_count == 0)
+	ngx_md5_t md5;
+
+	ngx_md5_init(&md5);
+	ngx_md5_update(&md5, file_info->source->file_key, sizeof(file_info->source->file_key));
+	ngx_md5_update(&md5, &ctx->metadata_header.file_size, sizeof(ctx->metadata_header.file_size));
+	ngx_md5_update(&md5, &ctx->metadata_header.file_mtime, sizeof(ctx->metadata_header.file_mtime));
+	ngx_md5_update(&md5, &media_type, sizeof(media_type));
+	ngx_md5_update(&md5, &track_index, sizeof(track_index));
+	ngx_md5_final(key, &md5);
+}
+
+static bool_t
+ngx_http_vod_frame_index_cache_get(
+	void* context,
+	file_info_t* file_info,
+	uint32_t media_type,
+	uint32_t track_index,
+	vod_str_t* result)
+{
+	ngx_http_vod_ctx_t* ctx = context;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+
+	ngx_http_vod_get_frame_index_key(ctx, file_info, media_type, track_index, key);
+
+	// Note: the index is read in place, same as the cached metadata
+	if (!ngx_buffer_cache_fetch_perf(
+		ctx->perf_counters,
+		ctx->submodule_context.conf->frame_index_cache,
+		key,
+		&result->data,
+		&result->len))
 	{
-		if (ctx->request->request_class == REQUEST_CLASS_SEGMENT)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: no matching streams were found, probably invalid segment index");
-			return NGX_HTTP_NOT_FOUND;
-		}
-		else
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: no matching streams were found");
-			return NGX_HTTP_BAD_REQUEST;
-		}
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_frame_index_cache_get: frame index cache miss, media type %uD, track %uD", 
+			media_type, track_index);
+		return FALSE;
 	}
-	
-	if ((ctx->request->flags & REQUEST_FLAG_SINGLE_TRACK) != 0)
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_frame_index_cache_get: frame index cache hit, media type %uD, track %uD", 
+		media_type, track_index);
+	return TRUE;
+}
+
+static void
+ngx_http_vod_frame_index_cache_store(
+	void* context,
+	file_info_t* file_info,
+	uint32_t media_type,
+	uint32_t track_index,
+	vod_str_t* buffer)
+{
+	ngx_http_vod_ctx_t* ctx = context;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+
+	ngx_http_vod_get_frame_index_key(ctx, file_info, media_type, track_index, key);
+
+	if (ngx_buffer_cache_store_perf(
+		ctx->perf_counters,
+		ctx->submodule_context.conf->frame_index_cache,
+		key,
+		buffer->data,
+		buffer->len))
 	{
-		if (ctx->submodule_context.media_set.sequence_count != 1)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: request has more than one sequence while only one is supported");
-			return NGX_HTTP_BAD_REQUEST;
-		}
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_frame_index_cache_store: stored frame index in cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_frame_index_cache_store: failed to store frame index in cache");
+	}
+}
 
-		if (ctx->submodule_context.media_set.total_track_count != 1)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: got %uD streams while only a single stream is supported",
-				ctx->submodule_context.media_set.total_track_count);
-			return NGX_HTTP_BAD_REQUEST;
-		}
+static bool_t
+ngx_http_vod_frame_index_cache_can_store(
+	void* context,
+	file_info_t* file_info,
+	uint32_t media_type,
+	uint32_t track_index,
+	size_t size)
+{
+	ngx_http_vod_loc_conf_t* conf;
+	ngx_http_vod_ctx_t* ctx = context;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+
+	conf = ctx->submodule_context.conf;
+
+	ngx_http_vod_get_frame_index_key(ctx, file_info, media_type, track_index, key);
+
+	if (!ngx_buffer_cache_can_store(conf->frame_index_cache, key, size))
+	{
+		return FALSE;
 	}
-	else if ((ctx->request->flags & REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE) != 0)
+
+	if (!conf->cache_lock)
 	{
-		if (ctx->submodule_context.media_set.sequence_count != 1 && ctx->submodule_context.media_set.sequence_count != 2)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: invalid sequence count %uD", ctx->submodule_context.media_set.sequence_count);
-			return NGX_HTTP_BAD_REQUEST;
-		}
+		return TRUE;
+	}
 
-		if (ctx->submodule_context.media_set.track_count[MEDIA_TYPE_VIDEO] > 1 ||
-			ctx->submodule_context.media_set.track_count[MEDIA_TYPE_AUDIO] > 1)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_validate_streams: one stream at most per media type is allowed video=%uD audio=%uD",
-				ctx->submodule_context.media_set.track_count[MEDIA_TYPE_VIDEO],
-				ctx->submodule_context.media_set.track_count[MEDIA_TYPE_AUDIO]);
-			return NGX_HTTP_BAD_REQUEST;
-		}
+	// Note: a single request builds the index of the track, while it is built, other requests parse only the
+	//		frames they need. the lock is released when the index is stored, or when the request is freed
+	if (ngx_buffer_cache_lock(
+		conf->frame_index_cache,
+		ctx->submodule_context.r->pool,
+		key,
+		conf->cache_lock_timeout,
+		0,
+		NULL) == NGX_BUSY)
+	{
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_frame_index_cache_can_store: index is built by another request, media type %uD, track %uD",
+			media_type, track_index);
+		return FALSE;
 	}
-	
-	return NGX_OK;
+
+	return TRUE;
 }
 
+// Note: sets result to NULL when the segment is outside the clip of the current source
 static ngx_int_t
-ngx_http_vod_update_track_timescale(
-	ngx_http_vod_ctx_t *ctx, 
-	media_track_t* track, 
-	uint32_t new_timescale)
+ngx_http_vod_get_segment_range(
+	ngx_http_vod_ctx_t *ctx,
+	uint32_t segment_index,
+	media_range_t** result)
 {
-	frame_list_part_t* part;
-	input_frame_t* last_frame;
-	input_frame_t* cur_frame;
-	uint64_t next_scaled_dts;
-	uint64_t last_frame_dts;
-	uint64_t clip_start_dts;
-	uint64_t clip_end_dts;
-	uint64_t scaled_dts;
-	uint64_t dts;
-	uint64_t pts;
-	uint32_t cur_timescale = track->media_info.timescale;
-
-	// frames
-	dts = track->first_frame_time_offset;
-	scaled_dts = rescale_time(dts, cur_timescale, new_timescale);
-	clip_start_dts = scaled_dts;
-
-	track->first_frame_time_offset = scaled_dts;
-	track->total_frames_duration = 0;
+	get_clip_ranges_params_t get_ranges_params;
+	get_clip_ranges_result_t clip_ranges;
+	media_clip_source_t* cur_source = ctx->cur_source;
+	request_context_t* request_context = &ctx->submodule_context.request_context;
+	media_range_t* range;
+	uint64_t last_segment_end;
+	uint32_t duration_millis;
+	vod_fraction_t rate;
+	vod_status_t rc;
 
-	part = &track->frames;
-	last_frame = part->last_frame;
-	for (cur_frame = part->first_frame;; cur_frame++)
+	// get the rate
+	if (cur_source->base.parent != NULL && cur_source->base.parent->type == MEDIA_CLIP_RATE_FILTER)
 	{
-		if (cur_frame >= last_frame)
-		{
-			if (part->first_frame < last_frame && part->clip_to != UINT_MAX)
-			{
-				clip_end_dts = rescale_time(part->clip_to, 1000, new_timescale);
-				last_frame_dts = scaled_dts - cur_frame[-1].duration;
-
-				if (clip_end_dts > last_frame_dts)
-				{
-					cur_frame[-1].duration = clip_end_dts - last_frame_dts;
-					scaled_dts = clip_end_dts;
-				}
-				else
-				{
-					ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_update_track_timescale: last frame dts %uL greater than clip end dts %uL",
-						last_frame_dts, clip_end_dts);
-				}
-
-				track->total_frames_duration += scaled_dts - clip_start_dts;
-
-				dts = 0;
-				scaled_dts = 0;
-				clip_start_dts = 0;
-			}
+		rate = ((media_clip_rate_filter_t*)cur_source->base.parent)->rate;
+	}
+	else
+	{
+		rate.nom = 1;
+		rate.denom = 1;
+	}
 
-			if (part->next == NULL)
-			{
-				break;
-			}
+	// get the last segment end
+	if (cur_source->clip_to == UINT_MAX)
+	{
+		last_segment_end = ULLONG_MAX;
+	}
+	else
+	{
+		last_segment_end = ((cur_source->clip_to - cur_source->clip_from) * rate.denom) / rate.nom;
+	}
 
-			part = part->next;
-			cur_frame = part->first_frame;
-			last_frame = part->last_frame;
-		}
+	// get the start/end offsets
+	duration_millis = rescale_time(ctx->base_metadata->duration * rate.denom, ctx->base_metadata->timescale * rate.nom, 1000);
 
-		pts = dts + cur_frame->pts_delay;
-		cur_frame->pts_delay = rescale_time(pts, cur_timescale, new_timescale) - scaled_dts;
+	get_ranges_params.request_context = request_context,
+	get_ranges_params.conf = &ctx->submodule_context.conf->segmenter,
+	get_ranges_params.segment_index = segment_index,
+	get_ranges_params.clip_durations = &duration_millis,
+	get_ranges_params.total_clip_count = 1,
+	get_ranges_params.start_time = 0,
+	get_ranges_params.end_time = duration_millis,
+	get_ranges_params.last_segment_end = last_segment_end,
+	get_ranges_params.key_frame_durations = NULL;
 
-		dts += cur_frame->duration;
-		next_scaled_dts = rescale_time(dts, cur_timescale, new_timescale);
-		cur_frame->duration = next_scaled_dts - scaled_dts;
-		scaled_dts = next_scaled_dts;
+	rc = segmenter_get_start_end_ranges_no_discontinuity(
+		&get_ranges_params,
+		&clip_ranges);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+			"ngx_http_vod_get_segment_range: segmenter_get_start_end_ranges_no_discontinuity failed %i", rc);
+		return ngx_http_vod_status_to_ngx_error(rc);
 	}
 
-	track->total_frames_duration += scaled_dts - clip_start_dts;
-	track->clip_from_frame_offset = rescale_time(track->clip_from_frame_offset, cur_timescale, new_timescale);
-
-	// media info
-	track->media_info.duration = rescale_time(track->media_info.duration, cur_timescale, new_timescale);
-	track->media_info.full_duration = rescale_time(track->media_info.full_duration, cur_timescale, new_timescale);
-	if (track->media_info.full_duration == 0)
+	if (clip_ranges.clip_count == 0)
 	{
-		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_update_track_timescale: full duration is zero following rescale");
-		return ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
+		*result = NULL;
+		return NGX_OK;
 	}
 
-	if (track->media_info.media_type == MEDIA_TYPE_VIDEO && track->media_info.min_frame_duration != 0)
+	range = clip_ranges.clip_ranges;
+	range->start = (range->start * rate.nom) / rate.denom;
+	if (range->end != ULLONG_MAX)
 	{
-		track->media_info.min_frame_duration = rescale_time(track->media_info.min_frame_duration, cur_timescale, new_timescale);
-		if (track->media_info.min_frame_duration == 0)
-		{
-			ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_update_track_timescale: min frame duration is zero following rescale");
-			track->media_info.min_frame_duration = 1;
-		}
+		range->end = (range->end * rate.nom) / rate.denom;
 	}
 
-	track->media_info.timescale = new_timescale;
-	track->media_info.frames_timescale = new_timescale;
-
+	*result = range;
 	return NGX_OK;
 }
 
-static ngx_int_t
-ngx_http_vod_update_timescale(ngx_http_vod_ctx_t *ctx)
+// Note: parses the frames of the segment that follows the requested segment, the frames are used only for
+//		getting the file ranges that should be prefetched. supported only by formats that parse the frames 
+//		from the metadata (mp4), the frame index is used when it is cached
+static void
+ngx_http_vod_parse_next_segment_frames(ngx_http_vod_ctx_t *ctx, media_parse_params_t* parse_params)
 {
-	media_set_t* media_set = &ctx->submodule_context.media_set;
-	media_track_t* track;
-	ngx_int_t rc;
+	media_format_read_request_t read_req;
+	media_parse_params_t next_params;
+	media_clip_source_t* cur_source = ctx->cur_source;
+	request_context_t* request_context = &ctx->submodule_context.request_context;
+	uint64_t last_offset;
+	vod_status_t rc;
 
-	for (track = media_set->filtered_tracks; track < media_set->filtered_tracks_end; track++)
+	ngx_memzero(&cur_source->next_track_array, sizeof(cur_source->next_track_array));
+
+	// Note: when the range was determined while parsing the media set, the next segment may belong 
+	//		to a different clip
+	if (!ctx->submodule_context.conf->segment_prefetch || ctx->speculative || cur_source->range != NULL)
 	{
-		rc = ngx_http_vod_update_track_timescale(ctx, track, ctx->request->timescale);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
+		return;
 	}
 
-	return NGX_OK;
-}
-
-////// Metadata request handling
-
-static ngx_int_t
-ngx_http_vod_handle_metadata_request(ngx_http_vod_ctx_t *ctx)
-{
-	ngx_http_vod_loc_conf_t* conf;
-	ngx_buffer_cache_t* cache;
-	ngx_str_t cache_buffers[3];
-	ngx_str_t content_type;
-	ngx_str_t response = ngx_null_string;
-	ngx_int_t rc;
-	int cache_type;
+	next_params = *parse_params;
+	next_params.parse_type = (parse_params->parse_type & PARSE_FLAG_EDIT_LIST) |
+		PARSE_FLAG_FRAMES_DURATION | PARSE_FLAG_FRAMES_SIZE | PARSE_FLAG_FRAMES_OFFSET | PARSE_FLAG_FRAMES_IS_KEY;
 
-	rc = ngx_http_vod_update_timescale(ctx);
-	if (rc != NGX_OK)
+	if (ngx_http_vod_get_segment_range(
+		ctx,
+		ctx->submodule_context.request_params.segment_index + 1,
+		&next_params.range) != NGX_OK ||
+		next_params.range == NULL)
 	{
-		return rc;
+		// the requested segment is the last segment of the clip
+		return;
 	}
 
-	ngx_perf_counter_start(ctx->perf_counter_context);
+	// Note: the last offset of the source must reflect only the requested segment
+	last_offset = cur_source->last_offset;
 
-	rc = ctx->request->handle_metadata_request(
-		&ctx->submodule_context,
-		&response,
-		&content_type);
-	if (rc != NGX_OK)
-	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_handle_metadata_request: handle_metadata_request failed %i", rc);
-		return rc;
-	}
+	rc = ctx->format->read_frames(
+		request_context,
+		ctx->base_metadata,
+		&next_params,
+		&ctx->submodule_context.conf->segmenter,
+		&ctx->read_cache_state,
+		NULL,
+		&read_req,
+		&cur_source->next_track_array);
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_BUILD_MANIFEST);
+	cur_source->last_offset = last_offset;
 
-	conf = ctx->submodule_context.conf;
-	if (ctx->submodule_context.media_set.type != MEDIA_SET_LIVE ||
-		(ctx->request->flags & REQUEST_FLAG_TIME_DEPENDENT_ON_LIVE) == 0)
-	{
-		cache_type = CACHE_TYPE_VOD;
-	}
-	else
+	if (rc != VOD_OK)
 	{
-		cache_type = CACHE_TYPE_LIVE;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+			"ngx_http_vod_parse_next_segment_frames: read_frames returned %i", rc);
+		ngx_memzero(&cur_source->next_track_array, sizeof(cur_source->next_track_array));
 	}
+}
 
-	cache = conf->response_cache[cache_type];
-	if (cache != NULL && response.data != NULL)
+static ngx_int_t 
+ngx_http_vod_parse_metadata(
+	ngx_http_vod_ctx_t *ctx, 
+	ngx_flag_t fetched_from_cache)
+{
+	media_parse_params_t parse_params;
+	const ngx_http_vod_request_t* request = ctx->request;
+	media_clip_source_t* cur_source = ctx->cur_source;
+	request_context_t* request_context = &ctx->submodule_context.request_context;
+	segmenter_conf_t* segmenter = &ctx->submodule_context.conf->segmenter;
+	media_range_t range;
+	vod_status_t rc;
+	file_info_t file_info;
+	uint32_t* request_tracks_mask;
+	uint32_t tracks_mask[MEDIA_TYPE_COUNT];
+
+	if (request == NULL)
 	{
-		cache_buffers[0].data = (u_char*)&content_type.len;
-		cache_buffers[0].len = sizeof(content_type.len);
-		cache_buffers[1] = content_type;
-		cache_buffers[2] = response;
+		// Note: the other fields in parse_params are not required here
+		parse_params.clip_from = cur_source->clip_from;
+		parse_params.clip_to = cur_source->clip_to;
 
-		if (ngx_buffer_cache_store_gather_perf(ctx->perf_counters, cache, ctx->request_key, cache_buffers, 3))
+		if (ctx->format->clipper_parse == NULL)
 		{
-			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_handle_metadata_request: stored in response cache");
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_parse_metadata: clipping not supported for %V", &ctx->format->name);
+			return NGX_HTTP_BAD_REQUEST;
 		}
-		else
+
+		rc = ctx->format->clipper_parse(
+			request_context,
+			&parse_params,
+			ctx->metadata_parts,
+			ctx->metadata_part_count,
+			fetched_from_cache,
+			&ctx->clipper_parse_result);
+		if (rc != VOD_OK)
 		{
-			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_handle_metadata_request: failed to store response in cache");
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+				"ngx_http_vod_parse_metadata: clipper_parse(%V) failed %i", &ctx->format->name, rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
 		}
+
+		return NGX_OK;
 	}
 
-	rc = ngx_http_vod_send_header(ctx->submodule_context.r, response.len, &content_type, cache_type);
-	if (rc != NGX_OK)
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	// init the parsing params
+	parse_params.parse_type = request->parse_type;
+	if (request->request_class == REQUEST_CLASS_MANIFEST && 
+		ctx->submodule_context.media_set.durations == NULL)
 	{
-		return rc;
+		parse_params.parse_type |= segmenter->parse_type;
 	}
-	
-	return ngx_http_vod_send_response(ctx->submodule_context.r, &response, NULL);
-}
 
-////// Segment request handling
-
-static ngx_int_t
-ngx_http_vod_state_machine_open_files(ngx_http_vod_ctx_t *ctx)
-{
-	media_clip_source_t* cur_source;
-	ngx_str_t* path;
-	ngx_int_t rc;
+	if (!ctx->submodule_context.conf->ignore_edit_list)
+	{
+		parse_params.parse_type |= PARSE_FLAG_EDIT_LIST;
+	}
+	parse_params.codecs_mask = request->codecs_mask;
 
-	for (cur_source = ctx->cur_source;
-		cur_source != NULL;
-		cur_source = cur_source->next)
+	if (ctx->submodule_context.request_params.sequence_tracks_mask != NULL)
 	{
-		// open the file if not already opened
-		if (cur_source->reader_context != NULL)
-		{
-			continue;
-		}
+		request_tracks_mask = ctx->submodule_context.request_params.sequence_tracks_mask + 
+			cur_source->sequence->index * MEDIA_TYPE_COUNT;
+	}
+	else
+	{
+		request_tracks_mask = ctx->submodule_context.request_params.tracks_mask;
+	}
+	tracks_mask[MEDIA_TYPE_VIDEO] = cur_source->tracks_mask[MEDIA_TYPE_VIDEO] & request_tracks_mask[MEDIA_TYPE_VIDEO];
+	tracks_mask[MEDIA_TYPE_AUDIO] = cur_source->tracks_mask[MEDIA_TYPE_AUDIO] & request_tracks_mask[MEDIA_TYPE_AUDIO];
+	parse_params.required_tracks_mask = tracks_mask;
+	parse_params.langs_mask = ctx->submodule_context.request_params.langs_mask;
+	parse_params.clip_from = cur_source->clip_from;
+	parse_params.clip_to = cur_source->clip_to;
+	parse_params.clip_start_time = ctx->submodule_context.media_set.first_clip_time + cur_source->sequence_offset;
+	
+	file_info.source = cur_source;
+	file_info.uri = cur_source->uri;
+	file_info.drm_info = cur_source->sequence->drm_info;
 
-		path = &cur_source->mapped_uri;
+	// parse the basic metadata
+	rc = ctx->format->parse_metadata(
+		&ctx->submodule_context.request_context,
+		&parse_params,
+		ctx->metadata_parts,
+		ctx->metadata_part_count,
+		&file_info,
+		&ctx->base_metadata);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+			"ngx_http_vod_parse_metadata: parse_metadata(%V) failed %i", &ctx->format->name, rc);
+		return ngx_http_vod_status_to_ngx_error(rc);
+	}
 
-		rc = ctx->open_file(ctx->submodule_context.r, path, &cur_source->reader_context);
-		if (rc != NGX_OK)
-		{
-			if (rc != NGX_AGAIN && rc != NGX_DONE)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_state_machine_open_files: open_file failed %i", rc);
-			}
+	if (ctx->base_metadata->tracks.nelts == 0)
+	{
+		ngx_memzero(&cur_source->track_array, sizeof(cur_source->track_array));
+		return VOD_OK;
+	}
 
-			ctx->cur_source = cur_source;
-			return rc;
+	if (request->request_class != REQUEST_CLASS_SEGMENT)
+	{
+		request_context->simulation_only = TRUE;
+
+		parse_params.max_frame_count = 1024 * 1024;
+		range.timescale = 1000;
+		range.start = 0;
+		if (cur_source->clip_to == UINT_MAX)
+		{
+			range.end = ULLONG_MAX;
+		}
+		else
+		{
+			range.end = cur_source->clip_to - cur_source->clip_from;
 		}
+		parse_params.range = &range;
 	}
+	else
+	{
+		request_context->simulation_only = FALSE;
 
-	return NGX_OK;
-}
+		parse_params.max_frame_count = 64 * 1024;
 
-static void
-ngx_http_vod_enable_directio(ngx_http_vod_ctx_t *ctx)
-{
-	media_clip_source_t* cur_source;
+		if (cur_source->range != NULL)
+		{
+			// the range was already determined while parsing the media set
+			parse_params.range = cur_source->range;
+		}
+		else
+		{
+			rc = ngx_http_vod_get_segment_range(
+				ctx, 
+				ctx->submodule_context.request_params.segment_index, 
+				&parse_params.range);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
 
-	for (cur_source = ctx->submodule_context.media_set.sources_head;
-		cur_source != NULL;
-		cur_source = cur_source->next)
-	{
-		ngx_file_reader_enable_directio(cur_source->reader_context);
+			if (parse_params.range == NULL)
+			{
+				ngx_memzero(&cur_source->track_array, sizeof(cur_source->track_array));
+				return VOD_OK;
+			}
+		}
 	}
-}
 
-static vod_status_t
-ngx_http_vod_write_segment_header_buffer(void* ctx, u_char* buffer, uint32_t size)
-{
-	ngx_http_vod_write_segment_context_t* context = (ngx_http_vod_write_segment_context_t*)ctx;
-	ngx_chain_t *chain_head;
-	ngx_chain_t *chain;
-	ngx_buf_t *b;
+	parse_params.max_frames_size = ctx->submodule_context.conf->max_frames_size;
 
-	if (context->r->header_sent)
+	if (ctx->submodule_context.conf->frame_index_cache != NULL)
 	{
-		ngx_log_error(NGX_LOG_ERR, context->r->connection->log, 0,
-			"ngx_http_vod_write_segment_header_buffer: called after the headers were already sent");
-		return VOD_UNEXPECTED;
+		ctx->frame_index_cache.context = ctx;
+		ctx->frame_index_cache.get = ngx_http_vod_frame_index_cache_get;
+		ctx->frame_index_cache.store = ngx_http_vod_frame_index_cache_store;
+		ctx->frame_index_cache.can_store = ngx_http_vod_frame_index_cache_can_store;
+		parse_params.frame_index_cache = &ctx->frame_index_cache;
 	}
-
-	b = ngx_calloc_buf(context->r->pool);
-	if (b == NULL)
+	else
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-			"ngx_http_vod_write_segment_header_buffer: ngx_calloc_buf failed");
-		return VOD_ALLOC_FAILED;
+		parse_params.frame_index_cache = NULL;
 	}
 
-	b->pos = buffer;
-	b->last = buffer + size;
-	b->temporary = 1;
-
-	chain = ngx_alloc_chain_link(context->r->pool);
-	if (chain == NULL)
+	// parse the frames
+	rc = ctx->format->read_frames(
+		&ctx->submodule_context.request_context,
+		ctx->base_metadata,
+		&parse_params,
+		segmenter,
+		&ctx->read_cache_state,
+		NULL,
+		&ctx->frames_read_req,
+		&cur_source->track_array);
+	if (rc != VOD_OK && rc != VOD_AGAIN)
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-			"ngx_http_vod_write_segment_header_buffer: ngx_alloc_chain_link failed");
-		return VOD_ALLOC_FAILED;
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, request_context->log, 0,
+			"ngx_http_vod_parse_metadata: read_frames(%V) failed %i", &ctx->format->name, rc);
+		return ngx_http_vod_status_to_ngx_error(rc);
 	}
 
-	chain_head = context->chain_head;
-
-	chain->buf = chain_head->buf;
-	chain->next = chain_head->next;
-
-	chain_head->buf = b;
-	chain_head->next = chain;
-
-	if (chain_head == context->chain_end)
+	if (rc == VOD_OK && request->request_class == REQUEST_CLASS_SEGMENT)
 	{
-		context->chain_end = chain;
+		ngx_http_vod_parse_next_segment_frames(ctx, &parse_params);
 	}
 
-	context->total_size += size;
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_MEDIA_PARSE);
 
-	return VOD_OK;
+	return rc;
 }
 
-static vod_status_t 
-ngx_http_vod_write_segment_buffer(void* ctx, u_char* buffer, uint32_t size)
+static ngx_int_t
+ngx_http_vod_identify_format(ngx_http_vod_ctx_t* ctx)
 {
-	ngx_http_vod_write_segment_context_t* context = (ngx_http_vod_write_segment_context_t*)ctx;
-	ngx_buf_t *b;
-	ngx_chain_t *chain;
-	ngx_chain_t out;
-	ngx_int_t rc;
-
-	// create a wrapping ngx_buf_t
-	b = ngx_calloc_buf(context->r->pool);
-	if (b == NULL) 
-	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-			"ngx_http_vod_write_segment_buffer: ngx_calloc_buf failed");
-		return VOD_ALLOC_FAILED;
-	}
+	media_format_t** cur_format_ptr;
+	media_format_t* cur_format;
+	vod_status_t rc;
+	vod_str_t buffer;
 
-	b->pos = buffer;
-	b->last = buffer + size;
-	b->temporary = 1;
+	buffer.data = ctx->read_buffer.pos;
+	buffer.len = ctx->read_buffer.last - ctx->read_buffer.pos;
 
-	if (context->r->header_sent)
+	for (cur_format_ptr = media_formats; ; cur_format_ptr++)
 	{
-		// headers already sent, output the chunk
-		out.buf = b;
-		out.next = NULL;
-
-		rc = ngx_http_output_filter(context->r, &out);
-		if (rc != NGX_OK && rc != NGX_AGAIN)
+		cur_format = *cur_format_ptr;
+		if (cur_format == NULL)
 		{
-			// either the connection dropped, or some allocation failed
-			// in case the connection dropped, the error code doesn't matter anyway
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-				"ngx_http_vod_write_segment_buffer: ngx_http_output_filter failed %i", rc);
-			return VOD_ALLOC_FAILED;
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_identify_format: failed to identify the file format");
+			return ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
 		}
-	}
-	else
-	{
-		// headers not sent yet, add the buffer to the chain
-		if (context->chain_end->buf != NULL)
+
+		rc = cur_format->init_metadata_reader(
+			&ctx->submodule_context.request_context,
+			&buffer,
+			ctx->submodule_context.conf->max_metadata_size,
+			&ctx->metadata_reader_context);
+		if (rc == VOD_NOT_FOUND)
 		{
-			chain = ngx_alloc_chain_link(context->r->pool);
-			if (chain == NULL) 
-			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-					"ngx_http_vod_write_segment_buffer: ngx_alloc_chain_link failed");
-				return VOD_ALLOC_FAILED;
-			}
+			continue;
+		}
 
-			context->chain_end->next = chain;
-			context->chain_end = chain;
+		if (rc != VOD_OK)
+		{
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_identify_format: init_metadata_reader(%V) failed %i", &cur_format->name, rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
 		}
-		context->chain_end->buf = b;
-	}
 
-	context->total_size += size;
+		ctx->format = cur_format;
+		break;
+	}
 
-	return VOD_OK;
+	return NGX_OK;
 }
 
-static ngx_int_t 
-ngx_http_vod_init_frame_processing(ngx_http_vod_ctx_t *ctx)
+static ngx_int_t
+ngx_http_vod_init_format(ngx_http_vod_ctx_t* ctx, uint32_t format_id)
 {
-	ngx_http_request_t* r = ctx->submodule_context.r;
-	segment_writer_t segment_writer;
-	ngx_str_t output_buffer = ngx_null_string;
-	ngx_str_t content_type;
-	ngx_int_t rc;
-	off_t range_start;
-	off_t range_end;
+	media_format_t** cur_format_ptr;
+	media_format_t* cur_format;
 
-	rc = ngx_http_vod_update_timescale(ctx);
-	if (rc != NGX_OK)
+	for (cur_format_ptr = media_formats; ; cur_format_ptr++)
 	{
-		return rc;
-	}
-
-	// initialize the response writer
-	ctx->out.buf = NULL;
-	ctx->out.next = NULL;
-	ctx->write_segment_buffer_context.r = r;
-	ctx->write_segment_buffer_context.chain_head = &ctx->out;
-	ctx->write_segment_buffer_context.chain_end = &ctx->out;
-	ctx->write_segment_buffer_context.total_size = 0;
+		cur_format = *cur_format_ptr;
+		if (cur_format == NULL)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_init_format: format id %uD not found", format_id);
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
 
-	segment_writer.write_tail = ngx_http_vod_write_segment_buffer;
-	segment_writer.write_head = ngx_http_vod_write_segment_header_buffer;
-	segment_writer.context = &ctx->write_segment_buffer_context;
+		if (cur_format->id != format_id)
+		{
+			continue;
+		}
 
-	// initialize the protocol specific frame processor
-	ngx_perf_counter_start(ctx->perf_counter_context);
+		ctx->format = cur_format;
+		break;
+	}
 
-	rc = ctx->request->init_frame_processor(
-		&ctx->submodule_context,
-		&segment_writer,
-		&ctx->frame_processor,
-		&ctx->frame_processor_state,
-		&output_buffer,
-		&ctx->content_length,
-		&content_type);
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_async_read(ngx_http_vod_ctx_t* ctx, media_format_read_request_t* read_req)
+{
+	size_t prefix_size;
+	size_t buffer_size;
+	size_t read_size;
+	off_t read_offset;
+	ngx_int_t rc;
+
+	// align the read size and offset
+	read_offset = read_req->read_offset & (~(ctx->alignment - 1));
+	if (read_req->read_size == 0)
+	{
+		read_size = ctx->submodule_context.conf->initial_read_size;
+	}
+	else
+	{
+		read_size = read_req->read_size + read_req->read_offset - read_offset;
+	}
+
+	read_size = (read_size + ctx->alignment - 1) & (~(ctx->alignment - 1));
+
+	// optimization for the case in which the current range is a prefix of the new range
+	buffer_size = ctx->read_buffer.last - ctx->read_buffer.pos;
+	prefix_size = 0;
+
+	if (read_offset >= ctx->read_offset && 
+		read_offset < (off_t)(ctx->read_offset + buffer_size) &&
+		ctx->read_buffer.start != NULL)
+	{
+		prefix_size = ctx->read_offset + buffer_size - read_offset;
+		ctx->prefix_buffer = ctx->read_buffer;
+		ctx->prefix_buffer.pos = ctx->prefix_buffer.last - prefix_size;
+		ctx->free_prefix = !read_req->realloc_buffer;		// should not free the buffer if there are references to it
+		ctx->read_buffer.start = NULL;
+	}
+	else if (read_req->realloc_buffer)
+	{
+		ctx->read_buffer.start = NULL;
+	}
+
+	// allocate the read buffer
+	rc = ngx_http_vod_alloc_read_buffer(ctx, read_size, ctx->alloc_params_index);
 	if (rc != NGX_OK)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_init_frame_processing: init_frame_processor failed %i", rc);
 		return rc;
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_INIT_FRAME_PROCESS);
+	if (ctx->prefix_buffer.start != NULL)
+	{
+		ctx->read_buffer.start += prefix_size;
+		ctx->read_buffer.pos = ctx->read_buffer.start;
+		ctx->read_buffer.last = ctx->read_buffer.start;
+	}
 
-	r->headers_out.content_type_len = content_type.len;
-	r->headers_out.content_type.len = content_type.len;
-	r->headers_out.content_type.data = content_type.data;
+	// perform the read
+	ctx->read_offset = read_offset;
+	ctx->requested_offset = read_req->read_offset;
 
-	// if the frame processor can't determine the size in advance we have to build the whole response before we can start sending it
-	if (ctx->content_length != 0)
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	rc = ctx->async_read(
+		ctx->cur_source->reader_context,
+		&ctx->read_buffer,
+		read_size - prefix_size,
+		read_offset + prefix_size);
+	if (rc != NGX_OK)
 	{
-		// send the response header
-		rc = ngx_http_vod_send_header(r, ctx->content_length, NULL, CACHE_TYPE_VOD);
-		if (rc != NGX_OK)
+		if (rc != NGX_AGAIN)
 		{
-			return rc;
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_async_read: async_read failed %i", rc);
 		}
 
-		if (r->header_only || r->method == NGX_HTTP_HEAD)
-		{
-			return NGX_DONE;
-		}
+		return rc;
 	}
 
-	// write the initial buffer if provided
-	if (output_buffer.len != 0)
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_READ_FILE);
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_get_async_read_result(ngx_http_vod_ctx_t* ctx, vod_str_t* read_buffer)
+{
+	size_t prefix_size;
+	size_t buffer_size;
+	off_t buffer_offset;
+
+	if (ctx->prefix_buffer.start != NULL)
 	{
-		rc = segment_writer.write_tail(segment_writer.context, output_buffer.data, output_buffer.len);
-		if (rc != VOD_OK)
-		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_init_frame_processing: write_tail failed %i", rc);
-			return ngx_http_vod_status_to_ngx_error(rc);
-		}
+		// prepend the prefix buffer
+		prefix_size = ctx->prefix_buffer.last - ctx->prefix_buffer.pos;
+		ctx->read_buffer.start -= prefix_size;
 
-		// in case of a range request that is fully contained in the output buffer (e.g. 0-0), we're done
-		if (ctx->content_length != 0 &&
-			ctx->submodule_context.r->headers_in.range != NULL &&
-			ngx_http_vod_range_parse(
-				&ctx->submodule_context.r->headers_in.range->value,
-				ctx->content_length,
-				&range_start,
-				&range_end) == NGX_OK &&
-			(size_t)range_end <= output_buffer.len)
+		ctx->read_buffer.pos -= prefix_size;
+		ngx_memcpy(ctx->read_buffer.pos, ctx->prefix_buffer.pos, prefix_size);
+
+		if (ctx->free_prefix)
 		{
-			return NGX_DONE;
+			ngx_http_vod_free_buffer(ctx->submodule_context.r->pool, ctx->prefix_buffer.start);
 		}
+		ctx->prefix_buffer.start = NULL;
 	}
 
-	rc = read_cache_allocate_buffer_slots(&ctx->read_cache_state, 0);
-	if (rc != VOD_OK)
+	// adjust the buffer pointer following the alignment
+	buffer_offset = ctx->requested_offset - ctx->read_offset;
+	buffer_size = ctx->read_buffer.last - ctx->read_buffer.pos;
+
+	if (buffer_size < (size_t)buffer_offset)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_init_frame_processing: read_cache_allocate_buffer_slots failed %i", rc);
-		return ngx_http_vod_status_to_ngx_error(rc);
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_get_async_read_result: buffer size %uz is smaller than buffer offset %O", 
+			buffer_size, buffer_offset);
+		return ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
 	}
 
+	read_buffer->data = ctx->read_buffer.pos + buffer_offset;
+	read_buffer->len = buffer_size - buffer_offset;
+
 	return NGX_OK;
 }
 
-static ngx_int_t 
-ngx_http_vod_process_media_frames(ngx_http_vod_ctx_t *ctx)
+static ngx_int_t
+ngx_http_vod_moov_location_get(
+	ngx_http_vod_ctx_t* ctx, 
+	media_clip_source_t* source, 
+	ngx_file_reader_state_t* state,
+	ngx_http_vod_moov_location_t** result)
 {
-	read_cache_get_read_buffer_t read_buf;
-	size_t cache_buffer_size;
-	vod_status_t rc;
+	ngx_http_vod_moov_location_t* location;
+	u_char* buffer;
+	size_t size;
 
-	for (;;)
+	if (!ngx_buffer_cache_fetch_perf(
+		ctx->perf_counters,
+		ctx->submodule_context.conf->moov_location_cache,
+		source->file_key,
+		&buffer,
+		&size))
 	{
-		ngx_perf_counter_start(ctx->perf_counter_context);
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_moov_location_get: moov location cache miss");
+		return NGX_DECLINED;
+	}
 
-		rc = ctx->frame_processor(ctx->frame_processor_state);
+	// validate the entry against the current file
+	location = (ngx_http_vod_moov_location_t*)buffer;
+	if (size < sizeof(*location) ||
+		size != sizeof(*location) + location->ftyp_size ||
+		location->file_size != (uint64_t)state->file_size ||
+		location->file_mtime != (uint64_t)state->file_mtime ||
+		location->moov_offset + location->moov_size > location->file_size)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_moov_location_get: moov location cache entry is stale");
+		return NGX_DECLINED;
+	}
 
-		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_PROCESS_FRAMES);
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_moov_location_get: moov location cache hit, offset %uL, size %uL",
+		location->moov_offset, location->moov_size);
 
-		switch (rc)
-		{
-		case VOD_OK:
-			// we're done
-			return NGX_OK;
+	*result = location;
+	return NGX_OK;
+}
 
-		case VOD_AGAIN:
-			// handled outside the switch
-			break;
+// Note: the read of the moov atom is aligned the same way as ngx_http_vod_async_read. the ftyp atom is saved
+//		at the beginning of the buffer, and is moved next to the moov atom once the read completes
+static ngx_int_t
+ngx_http_vod_moov_location_read(
+	ngx_http_vod_ctx_t* ctx, 
+	ngx_http_vod_moov_location_t* location, 
+	ngx_file_reader_state_t* state, 
+	ngx_buf_t* buf)
+{
+	off_t alignment = ctx->alloc_params[READER_FILE].alignment;
+	off_t read_offset;
+	size_t head_size;
+	size_t read_size;
+	ngx_int_t rc;
 
-		default:
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_process_media_frames: frame_processor failed %i", rc);
-			return ngx_http_vod_status_to_ngx_error(rc);
-		}
+	head_size = (location->ftyp_size + alignment - 1) & (~(alignment - 1));
 
-		// get a buffer to read into
-		read_cache_get_read_buffer(
-			&ctx->read_cache_state,
-			&read_buf);
+	read_offset = location->moov_offset & (~(alignment - 1));
+	read_size = location->moov_offset + location->moov_size - read_offset;
+	read_size = (read_size + alignment - 1) & (~(alignment - 1));
 
-		cache_buffer_size = ctx->submodule_context.conf->cache_buffer_size;
+	rc = ngx_http_vod_alloc_buffer(ctx, buf, head_size + read_size, READER_FILE);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
 
-		ctx->read_buffer.start = read_buf.buffer;
-		if (read_buf.buffer != NULL)
+	ngx_memcpy(buf->start, location + 1, location->ftyp_size);
+
+	buf->pos = buf->start + head_size;
+	buf->last = buf->pos;
+
+	return ngx_async_file_read(state, buf, read_size, read_offset);
+}
+
+static ngx_int_t
+ngx_http_vod_moov_location_read_completed(ngx_http_vod_ctx_t* ctx)
+{
+	ngx_http_vod_moov_location_t* location = ctx->moov_location;
+	off_t alignment = ctx->alloc_params[READER_FILE].alignment;
+	size_t prefix_size;
+	u_char* ftyp;
+
+	// skip the bytes that precede the moov atom in the aligned read
+	prefix_size = location->moov_offset & (alignment - 1);
+
+	if ((size_t)(ctx->read_buffer.last - ctx->read_buffer.pos) < prefix_size + location->moov_size)
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_moov_location_read_completed: read size %uz is smaller than the moov atom end %uL",
+			(size_t)(ctx->read_buffer.last - ctx->read_buffer.pos), prefix_size + location->moov_size);
+		return ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
+	}
+
+	// place the ftyp atom directly before the moov atom, the padding before the read is large enough to hold it
+	ftyp = ctx->read_buffer.pos + prefix_size - location->ftyp_size;
+	ngx_memmove(ftyp, ctx->read_buffer.start, location->ftyp_size);
+
+	ctx->read_buffer.pos = ftyp;
+	ctx->read_buffer.last = ftyp + location->ftyp_size + location->moov_size;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_read_metadata(ngx_http_vod_ctx_t* ctx)
+{
+	media_format_read_metadata_result_t result;
+	vod_str_t read_buffer;
+	ngx_int_t rc;
+
+	if (ctx->metadata_reader_context == NULL)
+	{
+		if (ctx->moov_location != NULL)
 		{
-			ctx->read_buffer.end = read_buf.buffer + cache_buffer_size;
+			rc = ngx_http_vod_moov_location_read_completed(ctx);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
 		}
 
-		rc = ngx_http_vod_alloc_read_buffer(ctx, cache_buffer_size, ctx->alloc_params_index);
+		// identify the format
+		rc = ngx_http_vod_identify_format(ctx);
 		if (rc != NGX_OK)
 		{
 			return rc;
 		}
-		
-		// perform the read
+	}
+
+	for (;;)
+	{
+		rc = ngx_http_vod_get_async_read_result(ctx, &read_buffer);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		// run the read state machine
+		rc = ctx->format->read_metadata(
+			ctx->metadata_reader_context,
+			ctx->requested_offset,
+			&read_buffer,
+			&result);
+		if (rc == VOD_OK)
+		{
+			ctx->metadata_parts = result.parts;
+			ctx->metadata_part_count = result.part_count;
+			break;
+		}
+
+		if (rc != VOD_AGAIN)
+		{
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_read_metadata: read_metadata(%V) failed %i", &ctx->format->name, rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
+		}
+
+		if (ctx->moov_location != NULL)
+		{
+			// the buffer does not map to file offsets, can happen if the file was modified while reading
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_read_metadata: incomplete moov atom read using the moov location cache");
+			return ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
+		}
+
+		// issue another read request
+		ctx->last_metadata_read = result.read_req;
+
+		rc = ngx_http_vod_async_read(ctx, &result.read_req);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+
+	return NGX_OK;
+}
+
+static void
+ngx_http_vod_moov_location_store(ngx_http_vod_ctx_t* ctx)
+{
+	ngx_http_vod_moov_location_t* location;
+	ngx_file_reader_state_t* state = ctx->cur_source->reader_context;
+	ngx_str_t* ftyp = &ctx->metadata_parts[MP4_METADATA_PART_FTYP];
+	size_t size;
+
+	size = sizeof(*location) + ftyp->len;
+
+	location = ngx_palloc(ctx->submodule_context.request_context.pool, size);
+	if (location == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_moov_location_store: ngx_palloc failed");
+		return;
+	}
+
+	location->file_size = state->file_size;
+	location->file_mtime = state->file_mtime;
+	location->moov_offset = ctx->last_metadata_read.read_offset;
+	location->moov_size = ctx->last_metadata_read.read_size;
+	location->ftyp_size = ftyp->len;
+	ngx_memcpy(location + 1, ftyp->data, ftyp->len);
+
+	if (ngx_buffer_cache_store_perf(
+		ctx->perf_counters,
+		ctx->submodule_context.conf->moov_location_cache,
+		ctx->cur_source->file_key,
+		(u_char*)location,
+		size))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_moov_location_store: stored moov location in cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_moov_location_store: failed to store moov location in cache");
+	}
+
+	ngx_pfree(ctx->submodule_context.request_context.pool, location);
+}
+
+static ngx_int_t
+ngx_http_vod_read_frames(ngx_http_vod_ctx_t *ctx)
+{
+	media_format_read_request_t read_req;
+	vod_str_t read_buffer;
+	ngx_int_t rc;
+
+	for (;;)
+	{
+		rc = ngx_http_vod_get_async_read_result(ctx, &read_buffer);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		// run the read state machine
+		rc = ctx->format->read_frames(
+			&ctx->submodule_context.request_context,
+			ctx->base_metadata,
+			NULL,
+			&ctx->submodule_context.conf->segmenter,
+			&ctx->read_cache_state,
+			&read_buffer,
+			&read_req,
+			&ctx->cur_source->track_array);
+		if (rc == VOD_OK)
+		{
+			break;
+		}
+
+		if (rc != VOD_AGAIN)
+		{
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_read_frames: read_frames(%V) failed %i", &ctx->format->name, rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
+		}
+
+		// issue another read request
+		rc = ngx_http_vod_async_read(ctx, &read_req);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_open_source(ngx_http_vod_ctx_t *ctx, media_clip_source_t* source)
+{
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_int_t rc;
+
+	rc = ctx->open_file(r, &source->mapped_uri, &source->reader_context);
+	if (rc != NGX_OK)
+	{
+		if (rc != NGX_AGAIN && rc != NGX_DONE)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_open_source: open_file failed %i", rc);
+		}
+		return rc;
+	}
+
+	return NGX_OK;
+}
+
+////// Parallel metadata read
+
+static ngx_http_vod_prefetch_t*
+ngx_http_vod_prefetch_get(ngx_http_vod_ctx_t *ctx, media_clip_source_t* source)
+{
+	ngx_http_vod_prefetch_t* prefetch_end = ctx->prefetch + ctx->prefetch_count;
+	ngx_http_vod_prefetch_t* prefetch;
+
+	for (prefetch = ctx->prefetch; prefetch < prefetch_end; prefetch++)
+	{
+		if (prefetch->source == source)
+		{
+			return prefetch;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+ngx_http_vod_prefetch_completed(ngx_http_vod_prefetch_t* prefetch, ngx_int_t rc)
+{
+	ngx_http_vod_ctx_t *ctx = prefetch->ctx;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_prefetch_completed: prefetch failed %i", rc);
+	}
+
+	prefetch->rc = rc;
+	prefetch->pending = 0;
+
+	if (ctx->state == STATE_READ_METADATA_PREFETCH && ctx->cur_source == prefetch->source)
+	{
+		// the state machine is waiting for this source
+		rc = ctx->state_machine(ctx);
+		if (rc != NGX_AGAIN)
+		{
+			ngx_http_vod_finalize_request(ctx, rc);
+		}
+	}
+
+	// release the reference that was taken when the operation was started
+	ngx_http_finalize_request(r, NGX_DONE);
+}
+
+static ngx_int_t
+ngx_http_vod_prefetch_read(ngx_http_vod_prefetch_t* prefetch)
+{
+	ngx_http_vod_ctx_t *ctx = prefetch->ctx;
+	size_t read_size = ctx->submodule_context.conf->initial_read_size;
+	ngx_int_t rc;
+
+	// use the memorized moov location, if exists
+	if (ctx->submodule_context.conf->moov_location_cache != NULL &&
+		ngx_http_vod_moov_location_get(ctx, prefetch->source, prefetch->reader_context, &prefetch->moov_location) == NGX_OK)
+	{
+		// Note: the source reader context is set only when the prefetch result is consumed
+		return ngx_http_vod_moov_location_read(
+			ctx, 
+			prefetch->moov_location, 
+			prefetch->reader_context, 
+			&prefetch->read_buffer);
+	}
+
+	rc = ngx_http_vod_alloc_buffer(ctx, &prefetch->read_buffer, read_size, READER_FILE);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	return ngx_async_file_read(prefetch->reader_context, &prefetch->read_buffer, read_size, 0);
+}
+
+static void
+ngx_http_vod_prefetch_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+{
+	if (rc == NGX_OK && bytes_read <= 0)
+	{
+		rc = NGX_ERROR;
+	}
+
+	ngx_http_vod_prefetch_completed(context, rc);
+}
+
+#if (NGX_THREADS)
+static void
+ngx_http_vod_prefetch_open_completed(void* context, ngx_int_t rc)
+{
+	ngx_http_vod_prefetch_t* prefetch = context;
+
+	if (rc == NGX_OK)
+	{
+		rc = ngx_http_vod_prefetch_read(prefetch);
+		if (rc == NGX_AGAIN)
+		{
+			return;
+		}
+	}
+
+	ngx_http_vod_prefetch_completed(prefetch, rc);
+}
+#endif // NGX_THREADS
+
+static ngx_int_t
+ngx_http_vod_prefetch_open(ngx_http_vod_prefetch_t* prefetch)
+{
+	ngx_file_reader_state_t* state;
+	ngx_http_core_loc_conf_t *clcf;
+	ngx_http_vod_loc_conf_t* conf;
+	ngx_http_request_t* r;
+	ngx_int_t rc;
+
+	r = prefetch->ctx->submodule_context.r;
+	conf = prefetch->ctx->submodule_context.conf;
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	state = ngx_pcalloc(r->pool, sizeof(*state));
+	if (state == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_prefetch_open: ngx_pcalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	prefetch->reader_context = state;
+
+#if (NGX_HAVE_IO_URING)
+	state->use_io_uring = conf->io_uring;
+#endif
+
+#if (NGX_THREADS)
+	if (conf->open_file_thread_pool != NULL)
+	{
+		rc = ngx_file_reader_init_async(
+			state,
+			&prefetch->async_open_context,
+			conf->open_file_thread_pool,
+			ngx_http_vod_prefetch_open_completed,
+			ngx_http_vod_prefetch_read_completed,
+			prefetch,
+			r,
+			clcf,
+			&prefetch->source->mapped_uri);
+	}
+	else
+	{
+#endif
+		rc = ngx_file_reader_init(
+			state,
+			ngx_http_vod_prefetch_read_completed,
+			prefetch,
+			r,
+			clcf,
+			&prefetch->source->mapped_uri);
+#if (NGX_THREADS)
+	}
+#endif
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	return ngx_http_vod_prefetch_read(prefetch);
+}
+
+// Note: returns whether the metadata of the source should be prefetched - sources whose metadata is cached
+//		are not prefetched, unless the entry was loaded from the disk tier and has to be validated against the file
+static ngx_flag_t
+ngx_http_vod_prefetch_required(ngx_http_vod_ctx_t *ctx, media_clip_source_t* source)
+{
+	ngx_buffer_cache_t* metadata_cache = ctx->submodule_context.conf->metadata_cache;
+	ngx_flag_t promoted;
+
+	if (metadata_cache == NULL)
+	{
+		return 1;
+	}
+
+	promoted = 0;
+	if (!ngx_buffer_cache_exists(metadata_cache, source->file_key, &promoted))
+	{
+		return 1;
+	}
+
+	return promoted;
+}
+
+// Note: issues the open and initial read of the sources following the current source, whose metadata
+//		is not cached. file errors are not returned - the state machine reopens the file serially when a 
+//		prefetch fails
+static ngx_int_t
+ngx_http_vod_prefetch_start(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_prefetch_t* prefetch;
+	media_clip_source_t* cur_source;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_uint_t count;
+	ngx_int_t rc;
+
+	count = 0;
+	for (cur_source = ctx->cur_source->next; cur_source != NULL; cur_source = cur_source->next)
+	{
+		count++;
+	}
+
+	if (count == 0)
+	{
+		return NGX_OK;
+	}
+
+	prefetch = ngx_pcalloc(r->pool, sizeof(prefetch[0]) * count);
+	if (prefetch == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_prefetch_start: ngx_pcalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	ctx->prefetch = prefetch;
+	ctx->prefetch_count = 0;
+
+	for (cur_source = ctx->cur_source->next; cur_source != NULL; cur_source = cur_source->next)
+	{
+		if (!ngx_http_vod_prefetch_required(ctx, cur_source))
+		{
+			continue;
+		}
+
+		prefetch = &ctx->prefetch[ctx->prefetch_count++];
+		prefetch->ctx = ctx;
+		prefetch->source = cur_source;
+
+		rc = ngx_http_vod_prefetch_open(prefetch);
+		if (rc == NGX_AGAIN)
+		{
+			// keep the request alive until the operation completes, even if the request fails meanwhile
+			prefetch->pending = 1;
+			r->main->count++;
+			continue;
+		}
+
+		if (rc != NGX_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_prefetch_start: ngx_http_vod_prefetch_open failed %i", rc);
+		}
+
+		prefetch->rc = rc;
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_prefetch_start: started prefetch of %ui sources out of %ui", ctx->prefetch_count, count);
+
+	return NGX_OK;
+}
+
+// Note: sets the size and modification time of the file the metadata is read from, they are saved with the cached
+//		metadata, and identify the version of the file in the keys of the entries that are derived from it
+static void
+ngx_http_vod_get_file_identity(ngx_http_vod_ctx_t *ctx, media_clip_source_t* source, multipart_cache_header_t* header)
+{
+	ngx_file_reader_state_t* state;
+
+	if (ctx->async_read != (ngx_http_vod_async_read_func_t)ngx_async_file_read)
+	{
+		header->file_size = 0;
+		header->file_mtime = 0;
+		return;
+	}
+
+	state = source->reader_context;
+	header->file_size = state->file_size;
+	header->file_mtime = state->file_mtime;
+}
+
+static ngx_int_t
+ngx_http_vod_parse_cached_metadata(ngx_http_vod_ctx_t *ctx, multipart_cache_header_t* header)
+{
+	ngx_int_t rc;
+
+	rc = ngx_http_vod_init_format(ctx, header->type);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	rc = ngx_http_vod_parse_metadata(ctx, 1);
+	if (rc != NGX_OK && rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_parse_cached_metadata: ngx_http_vod_parse_metadata failed %i", rc);
+	}
+
+	return rc;
+}
+
+static ngx_int_t
+ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_prefetch_t* prefetch;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	multipart_cache_header_t multipart_header;
+	ngx_file_reader_state_t* state;
+	media_clip_source_t* cur_source;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_str_t peer_response;
+	ngx_flag_t promoted;
+	ngx_int_t rc;
+
+	if (ctx->cur_source == NULL)
+	{
+		return NGX_OK;
+	}
+
+	for (;;)
+	{
+		switch (ctx->state)
+		{
+		case STATE_READ_METADATA_INITIAL:
+			cur_source = ctx->cur_source;
+
+			if (conf->metadata_cache != NULL)
+			{
+				// try to read the metadata from cache
+				if (ngx_buffer_cache_fetch_multipart_perf(
+					ctx,
+					conf->metadata_cache,
+					cur_source->file_key,
+					&multipart_header,
+					&ctx->metadata_parts,
+					&promoted))
+				{
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: metadata cache hit");
+
+					ctx->metadata_header = multipart_header;
+
+					if (promoted &&
+						multipart_header.file_mtime != 0 &&
+						ctx->async_read == (ngx_http_vod_async_read_func_t)ngx_async_file_read)
+					{
+						// the entry was loaded from the disk tier, validate it against the file before using it
+						ctx->state = STATE_READ_METADATA_VALIDATE;
+					}
+					else
+					{
+						rc = ngx_http_vod_parse_cached_metadata(ctx, &multipart_header);
+						if (rc == NGX_OK)
+						{
+							ctx->cur_source = cur_source->next;
+							if (ctx->cur_source == NULL)
+							{
+								return NGX_OK;
+							}
+							break;
+						}
+
+						if (rc != NGX_AGAIN)
+						{
+							return rc;
+						}
+
+						ctx->state = STATE_READ_FRAMES_OPEN_FILE;
+					}
+				}
+				else
+				{
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: metadata cache miss");
+
+					rc = ngx_http_vod_cache_promote(ctx, conf->metadata_cache, cur_source->file_key);
+					if (rc != NGX_DECLINED)
+					{
+						return rc;
+					}
+
+					rc = ngx_http_vod_cache_peer_lookup(
+						ctx,
+						&peer_caches[PEER_CACHE_METADATA],
+						cur_source->file_key,
+						conf->cache_peer_max_response_size,
+						&peer_response);
+					if (rc == NGX_OK)
+					{
+						// store the entry received from the peer, and fetch it again
+						if (!ngx_buffer_cache_store_perf(
+							ctx->perf_counters,
+							conf->metadata_cache,
+							cur_source->file_key,
+							peer_response.data,
+							peer_response.len))
+						{
+							ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+								"ngx_http_vod_state_machine_parse_metadata: failed to store peer response in cache");
+						}
+						break;
+					}
+
+					if (rc != NGX_DECLINED)
+					{
+						return rc;
+					}
+
+					rc = ngx_http_vod_cache_lock(ctx, conf->metadata_cache, cur_source->file_key);
+					if (rc != NGX_OK)
+					{
+						return rc;
+					}
+
+					ctx->state = STATE_READ_METADATA_OPEN_FILE;
+				}
+			}
+			else
+			{
+				ctx->state = STATE_READ_METADATA_OPEN_FILE;
+			}
+
+			// use the prefetched file, if exists
+			prefetch = ngx_http_vod_prefetch_get(ctx, cur_source);
+			if (prefetch != NULL)
+			{
+				ctx->prefetch_next_state = ctx->state;
+				ctx->state = STATE_READ_METADATA_PREFETCH;
+				break;
+			}
+
+			if (conf->parallel_metadata_read &&
+				ctx->prefetch == NULL &&
+				ctx->async_read == (ngx_http_vod_async_read_func_t)ngx_async_file_read)
+			{
+				rc = ngx_http_vod_prefetch_start(ctx);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+			}
+
+			// open the file
+			rc = ngx_http_vod_open_source(ctx, cur_source);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+			break;
+
+		case STATE_READ_METADATA_PREFETCH:
+			cur_source = ctx->cur_source;
+
+			prefetch = ngx_http_vod_prefetch_get(ctx, cur_source);
+			if (prefetch->pending)
+			{
+				return NGX_AGAIN;
+			}
+
+			prefetch->source = NULL;		// the result is consumed
+			ctx->state = ctx->prefetch_next_state;
+
+			if (prefetch->rc != NGX_OK)
+			{
+				// open the file serially, in order to get the standard error handling (e.g. fallback)
+				rc = ngx_http_vod_open_source(ctx, cur_source);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+				break;
+			}
+
+			cur_source->reader_context = prefetch->reader_context;
+			ngx_file_reader_set_read_callback(cur_source->reader_context, ngx_http_vod_handle_read_completed, ctx);
+
+			if (ctx->state != STATE_READ_METADATA_OPEN_FILE)
+			{
+				// metadata was fetched from cache, the file header is not needed
+				ngx_http_vod_free_buffer(r->pool, prefetch->read_buffer.start);
+				break;
+			}
+
+			// the file header was already read
+			r->connection->log->action = "reading media header";
+			ctx->state = STATE_READ_METADATA_READ;
+			ctx->metadata_reader_context = NULL;
+
+			ctx->read_buffer = prefetch->read_buffer;
+			ctx->read_offset = 0;
+			ctx->requested_offset = 0;
+			ctx->last_metadata_read.read_size = 0;
+			ctx->moov_location = prefetch->moov_location;
+			break;
+
+		case STATE_READ_METADATA_VALIDATE:
+			cur_source = ctx->cur_source;
+			state = cur_source->reader_context;
+
+			if (ctx->metadata_header.file_size != (uint64_t)state->file_size ||
+				ctx->metadata_header.file_mtime != (uint64_t)state->file_mtime)
+			{
+				ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+					"ngx_http_vod_state_machine_parse_metadata: cached metadata of \"%V\" is stale", &cur_source->mapped_uri);
+
+				// remove the entry, so that the metadata that is read from the file can be stored
+				// Note: the entries that are derived from the metadata (e.g. the frame index) are keyed by the file size / mtime
+				ngx_buffer_cache_invalidate(conf->metadata_cache, cur_source->file_key);
+				ctx->state = STATE_READ_METADATA_OPEN_FILE;
+				break;
+			}
+
+			// the entry matches the file, no need to validate it again
+			ngx_buffer_cache_mark_validated(conf->metadata_cache, cur_source->file_key);
+
+			rc = ngx_http_vod_parse_cached_metadata(ctx, &ctx->metadata_header);
+			if (rc == NGX_OK)
+			{
+				ctx->state = STATE_READ_METADATA_INITIAL;
+				ctx->cur_source = cur_source->next;
+				if (ctx->cur_source == NULL)
+				{
+					return NGX_OK;
+				}
+				break;
+			}
+
+			if (rc != NGX_AGAIN)
+			{
+				return rc;
+			}
+
+			// the file is already open
+			ctx->state = STATE_READ_FRAMES_OPEN_FILE;
+			break;
+
+		case STATE_READ_METADATA_OPEN_FILE:
+			// read the file header
+			r->connection->log->action = "reading media header";
+			ctx->state = STATE_READ_METADATA_READ;
+			ctx->metadata_reader_context = NULL;
+
+			ctx->read_offset = 0;
+			ctx->requested_offset = 0;
+			ctx->last_metadata_read.read_size = 0;
+			ctx->moov_location = NULL;
+
+			cur_source = ctx->cur_source;
+
+			// use the memorized moov location, if exists
+			rc = NGX_DECLINED;
+
+			if (conf->moov_location_cache != NULL &&
+				ctx->async_read == (ngx_http_vod_async_read_func_t)ngx_async_file_read)
+			{
+				rc = ngx_http_vod_moov_location_get(ctx, cur_source, cur_source->reader_context, &ctx->moov_location);
+				if (rc == NGX_OK)
+				{
+					ngx_perf_counter_start(ctx->perf_counter_context);
+
+					rc = ngx_http_vod_moov_location_read(
+						ctx, 
+						ctx->moov_location, 
+						cur_source->reader_context, 
+						&ctx->read_buffer);
+				}
+			}
+
+			if (rc == NGX_DECLINED)
+			{
+				// allocate the initial read buffer
+				rc = ngx_http_vod_alloc_read_buffer(ctx, conf->initial_read_size, ctx->alloc_params_index);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+
+				ngx_perf_counter_start(ctx->perf_counter_context);
+
+				rc = ctx->async_read(cur_source->reader_context, &ctx->read_buffer, conf->initial_read_size, 0);
+			}
+
+			if (rc != NGX_OK)
+			{
+				if (rc != NGX_AGAIN)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: async_read failed %i", rc);
+				}
+				return rc;
+			}
+
+			// read completed synchronously
+			ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_READ_FILE);
+			// fallthrough
+
+		case STATE_READ_METADATA_READ:
+			// read the metadata
+			rc = ngx_http_vod_read_metadata(ctx);
+			if (rc != NGX_OK)
+			{
+				if (rc != NGX_AGAIN)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_read_metadata failed %i", rc);
+				}
+				return rc;
+			}
+
+			// parse the metadata
+			ngx_http_vod_get_file_identity(ctx, ctx->cur_source, &ctx->metadata_header);
+
+			rc = ngx_http_vod_parse_metadata(ctx, 0);
+			if (rc != NGX_OK && rc != NGX_AGAIN)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_parse_metadata failed %i", rc);
+				return rc;
+			}
+
+			// save the metadata to cache
+			cur_source = ctx->cur_source;
+
+			if (conf->moov_location_cache != NULL &&
+				ctx->async_read == (ngx_http_vod_async_read_func_t)ngx_async_file_read &&
+				ctx->format->id == FORMAT_ID_MP4 &&
+				ctx->last_metadata_read.read_size != 0 &&
+				ctx->moov_location == NULL)
+			{
+				ngx_http_vod_moov_location_store(ctx);
+			}
+
+			if (conf->metadata_cache != NULL)
+			{
+				multipart_header.type = ctx->format->id;
+				multipart_header.part_count = ctx->metadata_part_count;
+
+				// Note: entries of a persistent cache may outlive the file, the file info is used to validate them
+				multipart_header.file_size = ctx->metadata_header.file_size;
+				multipart_header.file_mtime = ctx->metadata_header.file_mtime;
+
+				if (ngx_buffer_cache_store_multipart_perf(
+					ctx,
+					conf->metadata_cache,
+					cur_source->file_key,
+					&multipart_header,
+					ctx->metadata_parts))
+				{
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: stored metadata in cache");
+				}
+				else
+				{
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: failed to store metadata in cache");
+				}
+			}
+
+			ngx_http_vod_cache_unlock(ctx);
+
+			if (ctx->request != NULL)
+			{
+				// no longer need the metadata buffer
+				ngx_http_vod_free_buffer(ctx->submodule_context.r->pool, ctx->read_buffer.start);
+				ctx->read_buffer.start = NULL;
+			}
+
+			if (rc == NGX_OK)
+			{
+				// move to the next source
+				ctx->state = STATE_READ_METADATA_INITIAL;
+
+				ctx->cur_source = cur_source->next;
+				if (ctx->cur_source == NULL)
+				{
+					return NGX_OK;
+				}
+				break;
+			}
+			// fallthrough
+
+		case STATE_READ_FRAMES_OPEN_FILE:
+			ctx->state = STATE_READ_FRAMES_READ;
+			ctx->read_buffer.start = NULL;			// don't reuse buffers from the metadata phase
+
+			rc = ngx_http_vod_async_read(ctx, &ctx->frames_read_req);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+			// fallthrough
+
+		case STATE_READ_FRAMES_READ:
+			rc = ngx_http_vod_read_frames(ctx);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+
+			// move to the next source
+			ctx->state = STATE_READ_METADATA_INITIAL;
+
+			ctx->cur_source = ctx->cur_source->next;
+			if (ctx->cur_source == NULL)
+			{
+				return NGX_OK;
+			}
+			break;
+
+		default:
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_state_machine_parse_metadata: invalid state %d", ctx->state);
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_validate_streams(ngx_http_vod_ctx_t *ctx)
+{
+	if (ctx->submodule_context.media_set.total_track_count == 0)
+	{
+		if (ctx->request->request_class == REQUEST_CLASS_SEGMENT)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: no matching streams were found, probably invalid segment index");
+			return NGX_HTTP_NOT_FOUND;
+		}
+		else
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: no matching streams were found");
+			return NGX_HTTP_BAD_REQUEST;
+		}
+	}
+	
+	if ((ctx->request->flags & REQUEST_FLAG_SINGLE_TRACK) != 0)
+	{
+		if (ctx->submodule_context.media_set.sequence_count != 1)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: request has more than one sequence while only one is supported");
+			return NGX_HTTP_BAD_REQUEST;
+		}
+
+		if (ctx->submodule_context.media_set.total_track_count != 1)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: got %uD streams while only a single stream is supported",
+				ctx->submodule_context.media_set.total_track_count);
+			return NGX_HTTP_BAD_REQUEST;
+		}
+	}
+	else if ((ctx->request->flags & REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE) != 0)
+	{
+		if (ctx->submodule_context.media_set.sequence_count != 1 && ctx->submodule_context.media_set.sequence_count != 2)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: invalid sequence count %uD", ctx->submodule_context.media_set.sequence_count);
+			return NGX_HTTP_BAD_REQUEST;
+		}
+
+		if (ctx->submodule_context.media_set.track_count[MEDIA_TYPE_VIDEO] > 1 ||
+			ctx->submodule_context.media_set.track_count[MEDIA_TYPE_AUDIO] > 1)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_validate_streams: one stream at most per media type is allowed video=%uD audio=%uD",
+				ctx->submodule_context.media_set.track_count[MEDIA_TYPE_VIDEO],
+				ctx->submodule_context.media_set.track_count[MEDIA_TYPE_AUDIO]);
+			return NGX_HTTP_BAD_REQUEST;
+		}
+	}
+	
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_update_track_timescale(
+	ngx_http_vod_ctx_t *ctx, 
+	media_track_t* track, 
+	uint32_t new_timescale)
+{
+	frame_list_part_t* part;
+	input_frame_t* last_frame;
+	input_frame_t* cur_frame;
+	uint64_t next_scaled_dts;
+	uint64_t last_frame_dts;
+	uint64_t clip_start_dts;
+	uint64_t clip_end_dts;
+	uint64_t scaled_dts;
+	uint64_t dts;
+	uint64_t pts;
+	uint32_t cur_timescale = track->media_info.timescale;
+
+	// frames
+	dts = track->first_frame_time_offset;
+	scaled_dts = rescale_time(dts, cur_timescale, new_timescale);
+	clip_start_dts = scaled_dts;
+
+	track->first_frame_time_offset = scaled_dts;
+	track->total_frames_duration = 0;
+
+	part = &track->frames;
+	last_frame = part->last_frame;
+	for (cur_frame = part->first_frame;; cur_frame++)
+	{
+		if (cur_frame >= last_frame)
+		{
+			if (part->first_frame < last_frame && part->clip_to != UINT_MAX)
+			{
+				clip_end_dts = rescale_time(part->clip_to, 1000, new_timescale);
+				last_frame_dts = scaled_dts - cur_frame[-1].duration;
+
+				if (clip_end_dts > last_frame_dts)
+				{
+					cur_frame[-1].duration = clip_end_dts - last_frame_dts;
+					scaled_dts = clip_end_dts;
+				}
+				else
+				{
+					ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_update_track_timescale: last frame dts %uL greater than clip end dts %uL",
+						last_frame_dts, clip_end_dts);
+				}
+
+				track->total_frames_duration += scaled_dts - clip_start_dts;
+
+				dts = 0;
+				scaled_dts = 0;
+				clip_start_dts = 0;
+			}
+
+			if (part->next == NULL)
+			{
+				break;
+			}
+
+			part = part->next;
+			cur_frame = part->first_frame;
+			last_frame = part->last_frame;
+		}
+
+		pts = dts + cur_frame->pts_delay;
+		cur_frame->pts_delay = rescale_time(pts, cur_timescale, new_timescale) - scaled_dts;
+
+		dts += cur_frame->duration;
+		next_scaled_dts = rescale_time(dts, cur_timescale, new_timescale);
+		cur_frame->duration = next_scaled_dts - scaled_dts;
+		scaled_dts = next_scaled_dts;
+	}
+
+	track->total_frames_duration += scaled_dts - clip_start_dts;
+	track->clip_from_frame_offset = rescale_time(track->clip_from_frame_offset, cur_timescale, new_timescale);
+
+	// media info
+	track->media_info.duration = rescale_time(track->media_info.duration, cur_timescale, new_timescale);
+	track->media_info.full_duration = rescale_time(track->media_info.full_duration, cur_timescale, new_timescale);
+	if (track->media_info.full_duration == 0)
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_update_track_timescale: full duration is zero following rescale");
+		return ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
+	}
+
+	if (track->media_info.media_type == MEDIA_TYPE_VIDEO && track->media_info.min_frame_duration != 0)
+	{
+		track->media_info.min_frame_duration = rescale_time(track->media_info.min_frame_duration, cur_timescale, new_timescale);
+		if (track->media_info.min_frame_duration == 0)
+		{
+			ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_update_track_timescale: min frame duration is zero following rescale");
+			track->media_info.min_frame_duration = 1;
+		}
+	}
+
+	track->media_info.timescale = new_timescale;
+	track->media_info.frames_timescale = new_timescale;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_update_timescale(ngx_http_vod_ctx_t *ctx)
+{
+	media_set_t* media_set = &ctx->submodule_context.media_set;
+	media_track_t* track;
+	ngx_int_t rc;
+
+	for (track = media_set->filtered_tracks; track < media_set->filtered_tracks_end; track++)
+	{
+		rc = ngx_http_vod_update_track_timescale(ctx, track, ctx->request->timescale);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+
+	return NGX_OK;
+}
+
+////// Metadata request handling
+
+static ngx_int_t
+ngx_http_vod_handle_metadata_request(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_loc_conf_t* conf;
+	ngx_buffer_cache_t* cache;
+	ngx_str_t cache_buffers[3];
+	ngx_str_t content_type;
+	ngx_str_t response = ngx_null_string;
+	ngx_int_t rc;
+	int cache_type;
+
+	rc = ngx_http_vod_update_timescale(ctx);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	rc = ctx->request->handle_metadata_request(
+		&ctx->submodule_context,
+		&response,
+		&content_type);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_handle_metadata_request: handle_metadata_request failed %i", rc);
+		return rc;
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_BUILD_MANIFEST);
+
+	conf = ctx->submodule_context.conf;
+	if (ctx->submodule_context.media_set.type != MEDIA_SET_LIVE ||
+		(ctx->request->flags & REQUEST_FLAG_TIME_DEPENDENT_ON_LIVE) == 0)
+	{
+		cache_type = CACHE_TYPE_VOD;
+	}
+	else
+	{
+		cache_type = CACHE_TYPE_LIVE;
+	}
+
+	cache = conf->response_cache[cache_type];
+	if (cache != NULL && response.data != NULL)
+	{
+		cache_buffers[0].data = (u_char*)&content_type.len;
+		cache_buffers[0].len = sizeof(content_type.len);
+		cache_buffers[1] = content_type;
+		cache_buffers[2] = response;
+
+		if (ngx_buffer_cache_store_gather_perf(ctx->perf_counters, cache, ctx->request_key, cache_buffers, 3))
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_handle_metadata_request: stored in response cache");
+		}
+		else
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_handle_metadata_request: failed to store response in cache");
+		}
+	}
+
+	rc = ngx_http_vod_send_header(ctx->submodule_context.r, response.len, &content_type, cache_type);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+	
+	return ngx_http_vod_send_response(ctx->submodule_context.r, &response, NULL);
+}
+
+////// Segment request collapsing
+
+static void
+ngx_http_vod_collapse_release(ngx_http_vod_collapse_t* collapse)
+{
+	collapse->refs--;
+	if (collapse->refs > 0)
+	{
+		return;
+	}
+
+	ngx_destroy_pool(collapse->pool);
+}
+
+static void
+ngx_http_vod_collapse_follower_cleanup(void* data)
+{
+	ngx_http_vod_collapse_follower_t* follower = data;
+
+	if (follower->attached)
+	{
+		ngx_queue_remove(&follower->queue);
+		follower->attached = 0;
+	}
+
+	ngx_http_vod_collapse_release(follower->collapse);
+}
+
+static void
+ngx_http_vod_collapse_leader_cleanup(void* data)
+{
+	ngx_http_vod_ctx_t* ctx = data;
+	ngx_http_vod_collapse_t* collapse = ctx->collapse;
+
+	// the leader request was terminated before completing the segment (a disconnect of its client does not 
+	//	terminate it while followers are attached, see ngx_http_vod_write_segment_buf)
+	ngx_http_vod_collapse_finish(ctx, NGX_ERROR);
+
+	ctx->collapse = NULL;
+	ngx_http_vod_collapse_release(collapse);
+}
+
+// Note: new requests for the segment will not attach to the request
+static void
+ngx_http_vod_collapse_close(ngx_http_vod_collapse_t* collapse)
+{
+	collapse->done = 1;
+	ngx_queue_remove(&collapse->queue);
+}
+
+static ngx_http_vod_collapse_t*
+ngx_http_vod_collapse_get(u_char* key)
+{
+	ngx_http_vod_collapse_t* collapse;
+	ngx_queue_t* q;
+
+	for (q = ngx_queue_head(&collapsed_segments);
+		q != ngx_queue_sentinel(&collapsed_segments);
+		q = ngx_queue_next(q))
+	{
+		collapse = ngx_queue_data(q, ngx_http_vod_collapse_t, queue);
+		if (ngx_memcmp(collapse->key, key, sizeof(collapse->key)) == 0)
+		{
+			return collapse;
+		}
+	}
+
+	return NULL;
+}
+
+// Note: returns NGX_DECLINED if the request should not be collapsed
+static ngx_int_t
+ngx_http_vod_collapse_start(ngx_http_vod_ctx_t* ctx)
+{
+	ngx_http_vod_collapse_t* collapse;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_pool_cleanup_t* cln;
+	ngx_pool_t* pool;
+
+	// Note: HEAD and range requests may complete without generating the whole segment
+	if (r->method != NGX_HTTP_GET || r->headers_in.range != NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_collapse_start: ngx_pool_cleanup_add failed");
+		return NGX_ERROR;
+	}
+
+	// Note: using a separate pool, since the output may be referenced by the followers after the leader completes
+	pool = ngx_create_pool(1024, ngx_cycle->log);
+	if (pool == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_collapse_start: ngx_create_pool failed");
+		return NGX_ERROR;
+	}
+
+	collapse = ngx_pcalloc(pool, sizeof(*collapse));
+	if (collapse == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_collapse_start: ngx_pcalloc failed");
+		ngx_destroy_pool(pool);
+		return NGX_ERROR;
+	}
+
+	ngx_memcpy(collapse->key, ctx->request_key, sizeof(collapse->key));
+	collapse->pool = pool;
+	collapse->out_end = &collapse->out;
+	collapse->refs = 1;
+	ngx_queue_init(&collapse->followers);
+	ngx_queue_insert_tail(&collapsed_segments, &collapse->queue);
+
+	ctx->collapse = collapse;
+
+	cln->handler = ngx_http_vod_collapse_leader_cleanup;
+	cln->data = ctx;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_collapse_send(ngx_http_request_t* r, ngx_chain_t* cl)
+{
+	ngx_chain_t* out;
+	ngx_chain_t** last;
+	ngx_buf_t* b;
+
+	if (r->header_only || cl == NULL)
+	{
+		return NGX_OK;
+	}
+
+	// Note: the buffers are shared by all the followers, must allocate new buffer structs per request
+	last = &out;
+	for (; cl != NULL; cl = cl->next)
+	{
+		b = ngx_calloc_buf(r->pool);
+		if (b == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_collapse_send: ngx_calloc_buf failed");
+			return NGX_ERROR;
+		}
+
+		b->pos = cl->buf->pos;
+		b->last = cl->buf->last;
+		b->memory = 1;
+
+		*last = ngx_alloc_chain_link(r->pool);
+		if (*last == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_collapse_send: ngx_alloc_chain_link failed");
+			return NGX_ERROR;
+		}
+
+		(*last)->buf = b;
+		last = &(*last)->next;
+	}
+
+	*last = NULL;
+
+	return ngx_http_output_filter(r, out);
+}
+
+static ngx_int_t
+ngx_http_vod_collapse_send_header(ngx_http_vod_collapse_follower_t* follower)
+{
+	ngx_http_vod_collapse_t* collapse = follower->collapse;
+	ngx_http_request_t* r = follower->r;
+	ngx_int_t rc;
+
+	r->root_tested = !r->error_page;
+	r->allow_ranges = 1;
+
+	rc = ngx_http_vod_send_header(r, collapse->content_length, &collapse->content_type, CACHE_TYPE_VOD);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	return ngx_http_vod_collapse_send(r, collapse->out);
+}
+
+static void
+ngx_http_vod_collapse_detach(ngx_http_vod_collapse_follower_t* follower, ngx_int_t rc)
+{
+	ngx_http_request_t* r = follower->r;
+
+	ngx_queue_remove(&follower->queue);
+	follower->attached = 0;
+
+	if (r->header_sent && rc != NGX_OK)
+	{
+		rc = NGX_ERROR;
+	}
+
+	ngx_http_finalize_request(r, rc);
+}
+
+// Note: called by the leader after the response header was sent
+static void
+ngx_http_vod_collapse_header_sent(ngx_http_vod_ctx_t* ctx)
+{
+	ngx_http_vod_collapse_follower_t* follower;
+	ngx_http_vod_collapse_t* collapse = ctx->collapse;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_queue_t* next;
+	ngx_queue_t* q;
+	ngx_int_t rc;
+
+	if (collapse == NULL || collapse->header_sent)
+	{
+		return;
+	}
+
+	collapse->content_type.data = ngx_pstrdup(collapse->pool, &r->headers_out.content_type);
+	if (collapse->content_type.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_collapse_header_sent: ngx_pstrdup failed");
+		ngx_http_vod_collapse_finish(ctx, NGX_ERROR);
+		return;
+	}
+
+	collapse->content_type.len = r->headers_out.content_type.len;
+	collapse->content_length = r->headers_out.content_length_n;
+	collapse->header_sent = 1;
+
+	for (q = ngx_queue_head(&collapse->followers);
+		q != ngx_queue_sentinel(&collapse->followers);
+		q = next)
+	{
+		next = ngx_queue_next(q);
+		follower = ngx_queue_data(q, ngx_http_vod_collapse_follower_t, queue);
+
+		rc = ngx_http_vod_collapse_send_header(follower);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
+		{
+			ngx_http_vod_collapse_detach(follower, rc);
+		}
+	}
+}
+
+// Note: called by the leader on every chain it outputs, the buffers are copied since the leader may reuse them,
+//		the copy is made only as long as followers are attached
+static ngx_int_t
+ngx_http_vod_collapse_write(ngx_http_vod_collapse_t* collapse, ngx_http_request_t* r, ngx_chain_t* in)
+{
+	ngx_http_vod_collapse_follower_t* follower;
+	ngx_chain_t* first = NULL;
+	ngx_chain_t* cl;
+	ngx_queue_t* next;
+	ngx_queue_t* q;
+	ngx_int_t rc;
+	ngx_buf_t* b;
+	size_t size;
+
+	if (collapse == NULL || collapse->done)
+	{
+		return NGX_OK;
+	}
+
+	if (ngx_queue_empty(&collapse->followers))
+	{
+		// no request is attached (none attached before the output started, or all of them detached), 
+		//	the output is copied only while there are requests that consume it, let requests that arrive 
+		//	later generate / fetch the segment on their own
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_collapse_write: no attached requests, closing");
+		ngx_http_vod_collapse_close(collapse);
+		return NGX_OK;
+	}
+
+	for (; in != NULL; in = in->next)
+	{
+		size = in->buf->last - in->buf->pos;
+		if (size == 0)
+		{
+			continue;
+		}
+
+		b = ngx_create_temp_buf(collapse->pool, size);
+		if (b == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_collapse_write: ngx_create_temp_buf failed");
+			return NGX_ERROR;
+		}
+
+		b->last = ngx_copy(b->pos, in->buf->pos, size);
+
+		cl = ngx_alloc_chain_link(collapse->pool);
+		if (cl == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_collapse_write: ngx_alloc_chain_link failed");
+			return NGX_ERROR;
+		}
+
+		cl->buf = b;
+		cl->next = NULL;
+		*collapse->out_end = cl;
+		collapse->out_end = &cl->next;
+
+		if (first == NULL)
+		{
+			first = cl;
+		}
+	}
+
+	if (first == NULL)
+	{
+		return NGX_OK;
+	}
+
+	for (q = ngx_queue_head(&collapse->followers);
+		q != ngx_queue_sentinel(&collapse->followers);
+		q = next)
+	{
+		next = ngx_queue_next(q);
+		follower = ngx_queue_data(q, ngx_http_vod_collapse_follower_t, queue);
+
+		rc = ngx_http_vod_collapse_send(follower->r, first);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, follower->r->connection->log, 0,
+				"ngx_http_vod_collapse_write: ngx_http_vod_collapse_send failed %i", rc);
+			ngx_http_vod_collapse_detach(follower, rc);
+		}
+	}
+
+	return NGX_OK;
+}
+
+static void
+ngx_http_vod_collapse_finish(ngx_http_vod_ctx_t* ctx, ngx_int_t rc)
+{
+	ngx_http_vod_collapse_follower_t* follower;
+	ngx_http_vod_collapse_t* collapse = ctx->collapse;
+	ngx_http_request_t* r;
+	ngx_queue_t* q;
+	ngx_int_t follower_rc;
+
+	if (collapse == NULL || collapse->done)
+	{
+		return;
+	}
+
+	// new requests for the segment will be served from cache
+	ngx_http_vod_collapse_close(collapse);
+
+	while (!ngx_queue_empty(&collapse->followers))
+	{
+		q = ngx_queue_head(&collapse->followers);
+		follower = ngx_queue_data(q, ngx_http_vod_collapse_follower_t, queue);
+		r = follower->r;
+
+		if (!r->header_sent)
+		{
+			// the leader did not produce a segment (e.g. error / redirect / fallback), handle the request independently
+			ngx_queue_remove(&follower->queue);
+			follower->attached = 0;
+
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_collapse_finish: leader completed with %i, restarting the request", rc);
+
+			ngx_http_finalize_request(r, ngx_http_vod_handler(r));
+			continue;
+		}
+
+		follower_rc = rc;
+		if (follower_rc == NGX_OK && !r->header_only)
+		{
+			follower_rc = ngx_http_send_special(r, NGX_HTTP_LAST);
+			if (follower_rc == NGX_AGAIN)
+			{
+				follower_rc = NGX_OK;
+			}
+		}
+
+		ngx_http_vod_collapse_detach(follower, follower_rc);
+	}
+}
+
+// Note: the request is finalized by the leader, until then, the output of the follower is only flushed
+// Note: sends the buffered output of a request whose write events are handled by the module,
+//		returns NGX_OK when all the output was sent and NGX_AGAIN when some of it is still buffered
+static ngx_int_t
+ngx_http_vod_flush_output(ngx_http_request_t* r)
+{
+	ngx_http_core_loc_conf_t* clcf;
+	ngx_event_t* wev = r->connection->write;
+
+	if (wev->timedout)
+	{
+		ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT, 
+			"ngx_http_vod_flush_output: client timed out");
+		r->connection->timedout = 1;
+		return NGX_HTTP_REQUEST_TIME_OUT;
+	}
+
+	if (wev->delayed || r->aio)
+	{
+		return NGX_AGAIN;
+	}
+
+	if (ngx_http_output_filter(r, NULL) == NGX_ERROR)
+	{
+		return NGX_ERROR;
+	}
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	if (r->buffered || r->connection->buffered)
+	{
+		ngx_add_timer(wev, clcf->send_timeout);
+	}
+	else if (wev->timer_set)
+	{
+		ngx_del_timer(wev);
+	}
+
+	if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	if (r->buffered || r->connection->buffered)
+	{
+		return NGX_AGAIN;
+	}
+
+	return NGX_OK;
+}
+
+static void
+ngx_http_vod_collapse_follower_write_handler(ngx_http_request_t* r)
+{
+	ngx_int_t rc;
+
+	rc = ngx_http_vod_flush_output(r);
+	if (rc != NGX_OK && rc != NGX_AGAIN)
+	{
+		ngx_http_finalize_request(r, rc);
+	}
+}
+
+// Note: returns NGX_DECLINED if there is no request that generates the segment
+static ngx_int_t
+ngx_http_vod_collapse_attach(ngx_http_request_t* r, u_char* key)
+{
+	ngx_http_vod_collapse_follower_t* follower;
+	ngx_http_vod_collapse_t* collapse;
+	ngx_pool_cleanup_t* cln;
+	ngx_int_t rc;
+
+	collapse = ngx_http_vod_collapse_get(key);
+	if (collapse == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, sizeof(*follower));
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_collapse_attach: ngx_pool_cleanup_add failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	follower = cln->data;
+	follower->r = r;
+	follower->collapse = collapse;
+	follower->attached = 1;
+	ngx_queue_insert_tail(&collapse->followers, &follower->queue);
+	collapse->refs++;
+
+	cln->handler = ngx_http_vod_collapse_follower_cleanup;
+
+	if (collapse->header_sent)
+	{
+		rc = ngx_http_vod_collapse_send_header(follower);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
+		{
+			ngx_queue_remove(&follower->queue);
+			follower->attached = 0;
+			return r->header_sent ? NGX_ERROR : rc;
+		}
+	}
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_collapse_attach: attached to a pending request");
+
+	// the request will be finalized by the leader, must not run the phases again when the connection is writable
+	r->write_event_handler = ngx_http_vod_collapse_follower_write_handler;
+	r->main->count++;
+	return NGX_DONE;
+}
+
+////// Segment request handling
+
+static ngx_int_t
+ngx_http_vod_state_machine_open_files(ngx_http_vod_ctx_t *ctx)
+{
+	media_clip_source_t* cur_source;
+	ngx_str_t* path;
+	ngx_int_t rc;
+
+	for (cur_source = ctx->cur_source;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		// open the file if not already opened
+		if (cur_source->reader_context != NULL)
+		{
+			continue;
+		}
+
+		path = &cur_source->mapped_uri;
+
+		rc = ctx->open_file(ctx->submodule_context.r, path, &cur_source->reader_context);
+		if (rc != NGX_OK)
+		{
+			if (rc != NGX_AGAIN && rc != NGX_DONE)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_state_machine_open_files: open_file failed %i", rc);
+			}
+
+			ctx->cur_source = cur_source;
+			return rc;
+		}
+	}
+
+	return NGX_OK;
+}
+
+static void
+ngx_http_vod_enable_directio(ngx_http_vod_ctx_t *ctx)
+{
+	media_clip_source_t* cur_source;
+
+	for (cur_source = ctx->submodule_context.media_set.sources_head;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		ngx_file_reader_enable_directio(cur_source->reader_context);
+	}
+}
+
+static void
+ngx_http_vod_write_segment_cache_buffer(
+	ngx_http_vod_write_segment_context_t* context,
+	u_char* buffer,
+	uint32_t size,
+	ngx_flag_t head,
+	ngx_flag_t copy)
+{
+	ngx_str_t* cur_buffer;
+	ngx_str_t* elts;
+
+	if (context->cache_buffers == NULL)
+	{
+		return;
+	}
+
+	if (context->total_size + size > context->cache_max_size)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_cache_buffer: response exceeds the max segment cache entry size %uz",
+			context->cache_max_size);
+		context->cache_buffers = NULL;
+		return;
+	}
+
+	cur_buffer = ngx_array_push(context->cache_buffers);
+	if (cur_buffer == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_cache_buffer: ngx_array_push failed");
+		context->cache_buffers = NULL;
+		return;
+	}
+
+	if (head)
+	{
+		// Note: the first 2 elements are reserved for the content type
+		elts = context->cache_buffers->elts;
+		cur_buffer = elts + 2;
+		ngx_memmove(cur_buffer + 1, cur_buffer, (context->cache_buffers->nelts - 3) * sizeof(*cur_buffer));
+	}
+
+	if (copy)
+	{
+		cur_buffer->data = ngx_pnalloc(context->r->pool, size);
+		if (cur_buffer->data == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+				"ngx_http_vod_write_segment_cache_buffer: ngx_pnalloc failed");
+			context->cache_buffers = NULL;
+			return;
+		}
+
+		ngx_memcpy(cur_buffer->data, buffer, size);
+	}
+	else
+	{
+		cur_buffer->data = buffer;
+	}
+
+	cur_buffer->len = size;
+}
+
+static vod_status_t
+ngx_http_vod_write_segment_header_buffer(void* ctx, u_char* buffer, uint32_t size)
+{
+	ngx_http_vod_write_segment_context_t* context = (ngx_http_vod_write_segment_context_t*)ctx;
+	ngx_chain_t *chain_head;
+	ngx_chain_t *chain;
+	ngx_buf_t *b;
+
+	if (context->r->header_sent)
+	{
+		ngx_log_error(NGX_LOG_ERR, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_header_buffer: called after the headers were already sent");
+		return VOD_UNEXPECTED;
+	}
+
+	b = ngx_calloc_buf(context->r->pool);
+	if (b == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_header_buffer: ngx_calloc_buf failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	b->pos = buffer;
+	b->last = buffer + size;
+	b->temporary = 1;
+
+	chain = ngx_alloc_chain_link(context->r->pool);
+	if (chain == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_header_buffer: ngx_alloc_chain_link failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	chain_head = context->chain_head;
+
+	chain->buf = chain_head->buf;
+	chain->next = chain_head->next;
+
+	chain_head->buf = b;
+	chain_head->next = chain;
+
+	if (chain_head == context->chain_end)
+	{
+		context->chain_end = chain;
+	}
+
+	// Note: the buffer is kept in the chain until the response is complete, no need to copy it
+	ngx_http_vod_write_segment_cache_buffer(context, buffer, size, 1, 0);
+
+	context->total_size += size;
+
+	return VOD_OK;
+}
+
+static vod_status_t 
+ngx_http_vod_write_segment_buf(ngx_http_vod_write_segment_context_t* context, ngx_buf_t* b, uint32_t size)
+{
+	ngx_chain_t *chain;
+	ngx_chain_t out;
+	ngx_int_t rc;
+
+	if (context->r->header_sent)
+	{
+		// headers already sent, output the chunk
+		out.buf = b;
+		out.next = NULL;
+
+		if (ngx_http_vod_collapse_write(context->collapse, context->r, &out) != NGX_OK)
+		{
+			return VOD_ALLOC_FAILED;
+		}
+
+		if (context->client_failed)
+		{
+			// the buffer was copied to the followers, mark it as consumed
+			b->pos = b->last;
+			context->total_size += size;
+			return VOD_OK;
+		}
+
+		rc = ngx_http_output_filter(context->r, &out);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
+		{
+			if (context->collapse != NULL && !context->collapse->done && 
+				!ngx_queue_empty(&context->collapse->followers))
+			{
+				// the client of the leader is gone, keep generating the segment for the attached requests
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+					"ngx_http_vod_write_segment_buf: ngx_http_output_filter failed %i, continuing for the followers", rc);
+				context->client_failed = 1;
+				b->pos = b->last;
+				context->total_size += size;
+				return VOD_OK;
+			}
+
+			// either the connection dropped, or some allocation failed
+			// in case the connection dropped, the error code doesn't matter anyway
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+				"ngx_http_vod_write_segment_buf: ngx_http_output_filter failed %i", rc);
+			return VOD_ALLOC_FAILED;
+		}
+	}
+	else
+	{
+		// headers not sent yet, add the buffer to the chain
+		if (context->chain_end->buf != NULL)
+		{
+			chain = ngx_alloc_chain_link(context->r->pool);
+			if (chain == NULL) 
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+					"ngx_http_vod_write_segment_buf: ngx_alloc_chain_link failed");
+				return VOD_ALLOC_FAILED;
+			}
+
+			context->chain_end->next = chain;
+			context->chain_end = chain;
+		}
+		context->chain_end->buf = b;
+	}
+
+	context->total_size += size;
+
+	return VOD_OK;
+}
+
+static vod_status_t 
+ngx_http_vod_write_segment_buffer(void* ctx, u_char* buffer, uint32_t size)
+{
+	ngx_http_vod_write_segment_context_t* context = (ngx_http_vod_write_segment_context_t*)ctx;
+	ngx_buf_t *b;
+
+	// create a wrapping ngx_buf_t
+	b = ngx_calloc_buf(context->r->pool);
+	if (b == NULL) 
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_buffer: ngx_calloc_buf failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	b->pos = buffer;
+	b->last = buffer + size;
+	b->temporary = 1;
+
+	// Note: once the headers are sent, the buffer may be reused after it is sent, must copy it
+	ngx_http_vod_write_segment_cache_buffer(context, buffer, size, 0, context->r->header_sent);
+
+	return ngx_http_vod_write_segment_buf(context, b, size);
+}
+
+static vod_status_t 
+ngx_http_vod_write_segment_file_range(void* ctx, void* source, uint64_t offset, uint32_t size)
+{
+	ngx_http_vod_write_segment_context_t* context = (ngx_http_vod_write_segment_context_t*)ctx;
+	media_clip_source_t* clip_source = source;
+	ngx_file_reader_state_t* state = clip_source->reader_context;
+	ngx_buf_t *b;
+
+	if ((off_t)(offset + size) > state->file_size)
+	{
+		ngx_log_error(NGX_LOG_ERR, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_file_range: end offset %uL exceeds file size %O, probably a truncated file",
+			offset + size, state->file_size);
+		return VOD_BAD_DATA;
+	}
+
+	b = ngx_file_reader_create_file_buf(state, offset, offset + size);
+	if (b == NULL)
+	{
+		return VOD_ALLOC_FAILED;
+	}
+
+	// the buffer references the file, can't save the response to cache
+	context->cache_buffers = NULL;
+
+	return ngx_http_vod_write_segment_buf(context, b, size);
+}
+
+static ngx_int_t 
+ngx_http_vod_init_frame_processing(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_http_vod_loc_conf_t* conf;
+	segment_writer_t segment_writer;
+	ngx_str_t output_buffer = ngx_null_string;
+	ngx_str_t content_type;
+	ngx_int_t rc;
+	off_t range_start;
+	off_t range_end;
+
+	rc = ngx_http_vod_update_timescale(ctx);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	// initialize the response writer
+	ctx->out.buf = NULL;
+	ctx->out.next = NULL;
+	ctx->write_segment_buffer_context.r = r;
+	ctx->write_segment_buffer_context.chain_head = &ctx->out;
+	ctx->write_segment_buffer_context.chain_end = &ctx->out;
+	ctx->write_segment_buffer_context.total_size = 0;
+	ctx->write_segment_buffer_context.cache_buffers = NULL;
+	ctx->write_segment_buffer_context.collapse = ctx->collapse;
+
+	conf = ctx->submodule_context.conf;
+	if (conf->segment_cache != NULL && 
+		ngx_http_vod_segment_shareable(conf) &&
+		ngx_buffer_cache_can_store(conf->segment_cache, ctx->request_key, 0))
+	{
+		// Note: once the headers are sent, the buffers are copied, the admission policy is checked
+		//		in advance in order to avoid copying a response that will not be stored. the size of 
+		//		the response is not known at this point
+		ctx->write_segment_buffer_context.cache_buffers = ngx_array_create(r->pool, 8, sizeof(ngx_str_t));
+		if (ctx->write_segment_buffer_context.cache_buffers == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_init_frame_processing: ngx_array_create failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		// reserve room for the content type
+		ctx->write_segment_buffer_context.cache_buffers->nelts = 2;
+		ctx->write_segment_buffer_context.cache_max_size = conf->segment_cache_max_entry_size;
+	}
+
+	segment_writer.write_tail = ngx_http_vod_write_segment_buffer;
+	segment_writer.write_head = ngx_http_vod_write_segment_header_buffer;
+	segment_writer.write_file_range = NULL;
+	segment_writer.context = &ctx->write_segment_buffer_context;
+
+	if (conf->zero_copy_segments &&
+		!ctx->speculative &&
+		ctx->collapse == NULL &&
+		ctx->async_read == (ngx_http_vod_async_read_func_t)ngx_async_file_read)
+	{
+		segment_writer.write_file_range = ngx_http_vod_write_segment_file_range;
+	}
+
+	// initialize the protocol specific frame processor
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	rc = ctx->request->init_frame_processor(
+		&ctx->submodule_context,
+		&segment_writer,
+		&ctx->frame_processor,
+		&ctx->frame_processor_state,
+		&output_buffer,
+		&ctx->content_length,
+		&content_type);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_init_frame_processing: init_frame_processor failed %i", rc);
+		return rc;
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_INIT_FRAME_PROCESS);
+
+	if (ctx->speculative)
+	{
+		// nothing is sent, build the whole response in memory, as if the size is unknown
+		ctx->content_length = 0;
+	}
+
+	r->headers_out.content_type_len = content_type.len;
+	r->headers_out.content_type.len = content_type.len;
+	r->headers_out.content_type.data = content_type.data;
+
+	// if the frame processor can't determine the size in advance we have to build the whole response before we can start sending it
+	if (ctx->content_length != 0)
+	{
+		// send the response header
+		rc = ngx_http_vod_send_header(r, ctx->content_length, NULL, CACHE_TYPE_VOD);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		ngx_http_vod_collapse_header_sent(ctx);
+
+		if (r->header_only || r->method == NGX_HTTP_HEAD)
+		{
+			return NGX_DONE;
+		}
+	}
+
+	// write the initial buffer if provided
+	if (output_buffer.len != 0)
+	{
+		rc = segment_writer.write_tail(segment_writer.context, output_buffer.data, output_buffer.len);
+		if (rc != VOD_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_init_frame_processing: write_tail failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
+		}
+
+		// in case of a range request that is fully contained in the output buffer (e.g. 0-0), we're done
+		if (ctx->content_length != 0 &&
+			ctx->submodule_context.r->headers_in.range != NULL &&
+			ngx_http_vod_range_parse(
+				&ctx->submodule_context.r->headers_in.range->value,
+				ctx->content_length,
+				&range_start,
+				&range_end) == NGX_OK &&
+			(size_t)range_end <= output_buffer.len)
+		{
+			return NGX_DONE;
+		}
+	}
+
+	rc = read_cache_allocate_buffer_slots(&ctx->read_cache_state, 0);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_init_frame_processing: read_cache_allocate_buffer_slots failed %i", rc);
+		return ngx_http_vod_status_to_ngx_error(rc);
+	}
+
+#if (NGX_HAVE_IO_URING)
+	if (conf->io_uring && 
+		ctx->async_read == (ngx_http_vod_async_read_func_t)ngx_async_file_read)
+	{
+		// the planned ranges of all tracks are read in a single submission
+		rc = read_cache_allocate_readahead_slots(&ctx->read_cache_state, IO_URING_READAHEAD_COUNT);
+		if (rc != VOD_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_init_frame_processing: read_cache_allocate_readahead_slots failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
+		}
+	}
+#endif // NGX_HAVE_IO_URING
+
+	return NGX_OK;
+}
+
+#if (NGX_HAVE_IO_URING)
+static void
+ngx_http_vod_handle_batch_read_completed(void* context, ngx_file_reader_read_t* reads, ngx_uint_t count)
+{
+	ngx_http_vod_ctx_t *ctx = (ngx_http_vod_ctx_t *)context;
+	ngx_uint_t i;
+	ngx_int_t rc;
+
+	if (reads[0].bytes_read == NGX_ERROR)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_handle_batch_read_completed: read failed");
+		rc = NGX_ERROR;
+		goto finalize_request;
+	}
+
+	if (reads[0].bytes_read == 0)
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_handle_batch_read_completed: bytes read is zero");
+		rc = ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
+		goto finalize_request;
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, ctx->perf_counter_async_read);
+
+	read_cache_read_completed(&ctx->read_cache_state, &ctx->read_buffer);
+
+	// Note: failed read ahead reads are ignored, the ranges are read again when they are needed
+	for (i = 1; i < count; i++)
+	{
+		if (reads[i].bytes_read > 0)
+		{
+			read_cache_readahead_completed(&ctx->read_cache_state, &ctx->readahead_reads[i - 1], reads[i].buf);
+		}
+	}
+
+	// run the state machine
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
+
+finalize_request:
+
+	ngx_http_vod_finalize_request(ctx, rc);
+}
+
+// Note: reads the planned ranges that were not read yet, together with the pending read of the read cache.
+//		returns NGX_DECLINED if there is nothing to read ahead, and the read should be performed alone
+static ngx_int_t
+ngx_http_vod_read_batch(ngx_http_vod_ctx_t *ctx, read_cache_get_read_buffer_t* read_buf)
+{
+	ngx_file_reader_read_t* cur_read;
+	ngx_pool_t* pool = ctx->submodule_context.request_context.pool;
+	ngx_buf_t* buf;
+	ngx_uint_t count;
+	ngx_uint_t i;
+	ngx_int_t rc;
+
+	if (ctx->readahead_reads == NULL)
+	{
+		ctx->readahead_reads = ngx_palloc(pool, sizeof(ctx->readahead_reads[0]) * IO_URING_READAHEAD_COUNT);
+		ctx->readahead_bufs = ngx_palloc(pool, sizeof(ctx->readahead_bufs[0]) * IO_URING_READAHEAD_COUNT);
+		ctx->batch_reads = ngx_palloc(pool, sizeof(ctx->batch_reads[0]) * (IO_URING_READAHEAD_COUNT + 1));
+		if (ctx->readahead_reads == NULL || ctx->readahead_bufs == NULL || ctx->batch_reads == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_read_batch: ngx_palloc failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+	}
+
+	count = read_cache_get_readahead_buffers(&ctx->read_cache_state, ctx->readahead_reads, IO_URING_READAHEAD_COUNT);
+	if (count == 0)
+	{
+		return NGX_DECLINED;
+	}
+
+	cur_read = ctx->batch_reads;
+	cur_read->state = read_buf->source->reader_context;
+	cur_read->buf = &ctx->read_buffer;
+	cur_read->size = read_buf->size;
+	cur_read->offset = read_buf->offset;
+
+	for (i = 0; i < count; i++)
+	{
+		cur_read++;
+		cur_read->state = ctx->readahead_reads[i].source->reader_context;
+		if (!cur_read->state->use_io_uring)
+		{
+			return NGX_DECLINED;
+		}
+
+		// Note: always allocating a new buffer, the data of the previous reads may still be referenced
+		buf = &ctx->readahead_bufs[i];
+		ngx_memzero(buf, sizeof(*buf));
+
+		rc = ngx_http_vod_alloc_buffer(ctx, buf, ctx->readahead_reads[i].size, ctx->alloc_params_index);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		cur_read->buf = buf;
+		cur_read->size = ctx->readahead_reads[i].size;
+		cur_read->offset = ctx->readahead_reads[i].offset;
+	}
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	return ngx_file_reader_io_uring_read_batch(
+		ctx->submodule_context.r, 
+		ctx->batch_reads, 
+		count + 1, 
+		ngx_http_vod_handle_batch_read_completed, 
+		ctx);
+}
+#endif // NGX_HAVE_IO_URING
+
+static ngx_int_t 
+ngx_http_vod_process_media_frames(ngx_http_vod_ctx_t *ctx)
+{
+	read_cache_get_read_buffer_t read_buf;
+	size_t cache_buffer_size;
+	vod_status_t rc;
+
+	for (;;)
+	{
+		ngx_perf_counter_start(ctx->perf_counter_context);
+
+		rc = ctx->frame_processor(ctx->frame_processor_state);
+
+		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_PROCESS_FRAMES);
+
+		switch (rc)
+		{
+		case VOD_OK:
+			// we're done
+			return NGX_OK;
+
+		case VOD_AGAIN:
+			// handled outside the switch
+			break;
+
+		default:
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_process_media_frames: frame_processor failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
+		}
+
+		// get a buffer to read into
+		read_cache_get_read_buffer(
+			&ctx->read_cache_state,
+			&read_buf);
+
+		cache_buffer_size = ctx->submodule_context.conf->cache_buffer_size;
+
+		ctx->read_buffer.start = read_buf.buffer;
+		if (read_buf.buffer != NULL)
+		{
+			ctx->read_buffer.end = read_buf.buffer + cache_buffer_size;
+		}
+
+		// coalesced reads may be larger than the cache buffer size
+		rc = ngx_http_vod_alloc_read_buffer(ctx, ngx_max(cache_buffer_size, read_buf.size), ctx->alloc_params_index);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+#if (NGX_HAVE_IO_URING)
+		if (ctx->read_cache_state.readahead_count > 0 &&
+			((ngx_file_reader_state_t*)read_buf.source->reader_context)->use_io_uring)
+		{
+			rc = ngx_http_vod_read_batch(ctx, &read_buf);
+			if (rc != NGX_DECLINED)
+			{
+				return rc;
+			}
+		}
+#endif // NGX_HAVE_IO_URING
+		
+		// perform the read
 		ngx_perf_counter_start(ctx->perf_counter_context);
 
-		rc = ctx->async_read(
-			read_buf.source->reader_context, 
-			&ctx->read_buffer, 
-			read_buf.size, 
-			read_buf.offset);
+		rc = ctx->async_read(
+			read_buf.source->reader_context, 
+			&ctx->read_buffer, 
+			read_buf.size, 
+			read_buf.offset);
+		if (rc != NGX_OK)
+		{
+			if (rc != NGX_AGAIN)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_process_media_frames: async_read failed %i", rc);
+			}
+			return rc;
+		}
+
+		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_READ_FILE);
+
+		// read completed synchronously, update the read cache
+		read_cache_read_completed(&ctx->read_cache_state, &ctx->read_buffer);
+	}
+}
+
+static void
+ngx_http_vod_store_segment_response(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_write_segment_context_t* context = &ctx->write_segment_buffer_context;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_str_t* cache_buffers;
+
+	if (context->cache_buffers == NULL || context->total_size == 0)
+	{
+		return;
+	}
+
+	cache_buffers = context->cache_buffers->elts;
+	cache_buffers[0].data = (u_char*)&r->headers_out.content_type.len;
+	cache_buffers[0].len = sizeof(r->headers_out.content_type.len);
+	cache_buffers[1] = r->headers_out.content_type;
+
+	if (ngx_buffer_cache_store_gather_perf(
+		ctx->perf_counters,
+		ctx->submodule_context.conf->segment_cache,
+		ctx->request_key,
+		cache_buffers,
+		context->cache_buffers->nelts))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_store_segment_response: stored in segment cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_store_segment_response: failed to store segment in cache");
+	}
+}
+
+static ngx_int_t
+ngx_http_vod_finalize_segment_response(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_int_t rc;
+
+	ngx_perf_counter_add(ctx->perf_counters, PC_SEGMENT_BYTES_READ, ctx->read_cache_state.bytes_read);
+	ngx_perf_counter_add(ctx->perf_counters, PC_SEGMENT_BYTES_USED, ctx->read_cache_state.bytes_used);
+
+	ngx_http_vod_segment_prefetch(ctx);
+
+	ngx_http_vod_speculate_next_segment(ctx);
+
+	// if we already sent the headers and all the buffers, just signal completion and return
+	if (r->header_sent)
+	{
+		if (ctx->write_segment_buffer_context.total_size != ctx->content_length)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_finalize_segment_response: actual content length %uz is different than reported length %uz",
+				ctx->write_segment_buffer_context.total_size, ctx->content_length);
+		}
+		else
+		{
+			ngx_http_vod_store_segment_response(ctx);
+		}
+
+		ngx_http_vod_collapse_finish(ctx, NGX_OK);
+
+		if (ctx->write_segment_buffer_context.client_failed)
+		{
+			return NGX_ERROR;
+		}
+
+		rc = ngx_http_send_special(r, NGX_HTTP_LAST);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_finalize_segment_response: ngx_http_send_special failed %i", rc);
+			return rc;
+		}
+		return NGX_OK;
+	}
+
+	// mark the current buffer as last
+	if (ctx->write_segment_buffer_context.chain_end->buf == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_finalize_segment_response: no buffers were written");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	ctx->write_segment_buffer_context.chain_end->next = NULL;
+	ctx->write_segment_buffer_context.chain_end->buf->last_buf = 1;
+
+	ngx_http_vod_store_segment_response(ctx);
+
+	if (ctx->speculative)
+	{
+		return NGX_OK;
+	}
+
+	// send the response header
+	rc = ngx_http_vod_send_header(r, ctx->write_segment_buffer_context.total_size, NULL, CACHE_TYPE_VOD);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	ngx_http_vod_collapse_header_sent(ctx);
+
+	rc = ngx_http_vod_collapse_write(ctx->collapse, r, &ctx->out);
+	if (rc != NGX_OK)
+	{
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	ngx_http_vod_collapse_finish(ctx, NGX_OK);
+
+	if (r->header_only || r->method == NGX_HTTP_HEAD)
+	{
+		return NGX_OK;
+	}
+
+	// send the response buffer chain
+	rc = ngx_http_output_filter(r, &ctx->out);
+	if (rc != NGX_OK && rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_finalize_segment_response: ngx_http_output_filter failed %i", rc);
+		return rc;
+	}
+	return NGX_OK;
+}
+
+////// Audio filtering
+
+static void
+ngx_http_vod_master_exit(ngx_cycle_t *cycle)
+{
+	// save the caches that have a disk tier, so that they are loaded when nginx starts
+	ngx_buffer_cache_snapshot(cycle);
+}
+
+static ngx_int_t
+ngx_http_vod_process_init(ngx_cycle_t *cycle)
+{
+	vod_status_t rc;
+
+	audio_filter_process_init(cycle->log);
+
+	ngx_queue_init(&collapsed_segments);
+	
+	rc = language_code_process_init(cycle->pool, cycle->log);
+	if (rc != VOD_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+////// Clipping
+
+static ngx_int_t
+ngx_http_vod_send_clip_header(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_chain_t* out;
+	uint64_t first_offset;
+	uint64_t last_offset;
+	size_t response_size;
+	ngx_str_t content_type;
+	ngx_int_t rc;
+	off_t range_start;
+	off_t range_end;
+	off_t header_size;
+	off_t mdat_size;
+
+	rc = ctx->format->clipper_build_header(
+		&ctx->submodule_context.request_context,
+		ctx->metadata_parts,
+		ctx->metadata_part_count,
+		ctx->clipper_parse_result,
+		&out,
+		&response_size, 
+		&content_type);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_send_clip_header: clipper_build_header(%V) failed %i", &ctx->format->name, rc);
+		return ngx_http_vod_status_to_ngx_error(rc);
+	}
+
+	// send the response header
+	rc = ngx_http_vod_send_header(r, response_size, &content_type, CACHE_TYPE_VOD);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	if (r->header_only || r->method == NGX_HTTP_HEAD)
+	{
+		return NGX_DONE;
+	}
+
+	rc = ngx_http_output_filter(r, out);
+	if (rc != NGX_OK && rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_send_clip_header: ngx_http_output_filter failed %i", rc);
+		return rc;
+	}
+
+	if (ctx->submodule_context.conf->request_handler == ngx_http_vod_remote_request_handler && 
+		ctx->submodule_context.r->headers_in.range)
+	{
+		// in case of range request in remote mode, apply the requested range to the mdat dump offsets.
+		// nginx's range filter module does not touch the dumped part since it is written in the context
+		// a subrequest. 
+
+		// TODO: apply the range on the mp4 header as well and return 206, to avoid making assumptions on
+		//		nginx subrequest/range filter implementations
+
+		rc = ngx_http_vod_range_parse(
+			&ctx->submodule_context.r->headers_in.range->value,
+			response_size,
+			&range_start,
+			&range_end);
+		if (rc != NGX_OK)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_http_vod_send_clip_header: failed to parse range header \"%V\"",
+				&ctx->submodule_context.r->headers_in.range->value);
+			return rc;
+		}
+
+		first_offset = ctx->clipper_parse_result->first_offset;
+		last_offset = ctx->clipper_parse_result->last_offset;
+
+		mdat_size = last_offset - first_offset;
+		header_size = response_size - mdat_size;
+
+		if (range_end < header_size)
+		{
+			last_offset = 0;
+		}
+		else if (mdat_size > range_end - header_size)
+		{
+			last_offset = first_offset + range_end - header_size;
+		}
+
+		if (range_start > header_size)
+		{
+			first_offset += range_start - header_size;
+		}
+
+		ctx->clipper_parse_result->first_offset = first_offset;
+		ctx->clipper_parse_result->last_offset = last_offset;
+	}
+
+	return NGX_OK;
+}
+
+////// Common
+
+static ngx_int_t
+ngx_http_vod_run_state_machine(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_int_t rc;
+
+	switch (ctx->state)
+	{
+	case STATE_READ_DRM_INFO:
+		rc = ngx_http_vod_state_machine_get_drm_info(ctx);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		ctx->state = STATE_READ_METADATA_INITIAL;
+		ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
+		// fallthrough
+
+	case STATE_READ_METADATA_INITIAL:
+	case STATE_READ_METADATA_OPEN_FILE:
+	case STATE_READ_METADATA_READ:
+	case STATE_READ_METADATA_PREFETCH:
+	case STATE_READ_METADATA_VALIDATE:
+	case STATE_READ_FRAMES_OPEN_FILE:
+	case STATE_READ_FRAMES_READ:
+
+		rc = ngx_http_vod_state_machine_parse_metadata(ctx);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		if (ctx->request == NULL)
+		{
+			rc = ngx_http_vod_send_clip_header(ctx);
+			if (rc != NGX_OK)
+			{
+				if (rc == NGX_DONE)
+				{
+					rc = NGX_OK;
+				}
+				else
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_run_state_machine: ngx_http_vod_send_clip_header failed %i", rc);
+				}
+				return rc;
+			}
+		}
+		else
+		{
+			rc = filter_init_filtered_clips(
+				&ctx->submodule_context.request_context,
+				&ctx->submodule_context.media_set);
+			if (rc != VOD_OK)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_run_state_machine: filter_init_filtered_clips failed %i", rc);
+				return ngx_http_vod_status_to_ngx_error(rc);
+			}
+
+			rc = ngx_http_vod_validate_streams(ctx);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+
+			// handle metadata requests
+			if (ctx->request->handle_metadata_request != NULL)
+			{
+				return ngx_http_vod_handle_metadata_request(ctx);
+			}
+
+			// initialize the read cache
+			read_cache_init(
+				&ctx->read_cache_state,
+				&ctx->submodule_context.request_context,
+				ctx->submodule_context.conf->cache_buffer_size,
+				ctx->alignment);
+
+			if (ctx->submodule_context.conf->coalesce_reads)
+			{
+				rc = read_cache_plan_reads(
+					&ctx->read_cache_state,
+					ctx->submodule_context.media_set.sources_head,
+					ctx->submodule_context.conf->coalesce_reads_max_gap,
+					ctx->submodule_context.conf->coalesce_reads_max_size);
+				if (rc != VOD_OK)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_run_state_machine: read_cache_plan_reads failed %i", rc);
+					return ngx_http_vod_status_to_ngx_error(rc);
+				}
+			}
+		}
+
+		ctx->state = STATE_OPEN_FILE;
+		ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+		// fallthrough
+
+	case STATE_OPEN_FILE:
+		rc = ngx_http_vod_state_machine_open_files(ctx);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		// use the frames directly from the file mapping, if enabled
+		// Note: must be done before enabling directio
+		if (ctx->request != NULL &&
+			ctx->submodule_context.conf->mmap_frames &&
+			!ctx->submodule_context.conf->zero_copy_segments &&
+			ctx->async_read == (ngx_http_vod_async_read_func_t)ngx_async_file_read)
+		{
+			rc = ngx_http_vod_mmap_frames(ctx);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+
+		// enable directio if enabled in the configuration (ignore errors)
+		// Note that directio is set on transfer only to allow the kernel to cache the "moov" atom
+		if (ctx->submodule_context.conf->request_handler != ngx_http_vod_remote_request_handler)
+		{
+			ngx_http_vod_enable_directio(ctx);
+		}
+
+		if (ctx->request == NULL)
+		{
+			if (ctx->clipper_parse_result->first_offset < ctx->clipper_parse_result->last_offset)
+			{
+				ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+
+				ctx->state = STATE_DUMP_FILE_PART;
+
+				rc = ctx->dump_part(
+					ctx->cur_source->reader_context,
+					ctx->clipper_parse_result->first_offset,
+					ctx->clipper_parse_result->last_offset);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+			}
+
+			rc = ngx_http_send_special(ctx->submodule_context.r, NGX_HTTP_LAST);
+			if (rc != NGX_OK && rc != NGX_AGAIN)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_run_state_machine: ngx_http_send_special failed %i", rc);
+				return rc;
+			}
+
+			return NGX_OK;
+		}
+
+		if (ctx->submodule_context.media_set.audio_filtering_needed)
+		{
+			// initialize the filtering of audio frames
+			ctx->state = STATE_FILTER_FRAMES;
+			ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+
+			rc = filter_init_state(
+				&ctx->submodule_context.request_context,
+				&ctx->read_cache_state,
+				&ctx->submodule_context.media_set, 
+				&ctx->frame_processor_state);
+			if (rc != VOD_OK)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_run_state_machine: filter_init_state failed %i", rc);
+				return ngx_http_vod_status_to_ngx_error(rc);
+			}
+
+			ctx->frame_processor = filter_run_state_machine;
+		}
+
+		// fallthrough
+
+	case STATE_FILTER_FRAMES:
+		// if audio filtering already started, process frames
+		if (ctx->frame_processor != NULL)
+		{
+			rc = ngx_http_vod_process_media_frames(ctx);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+
+		// initialize the processing of the video/audio frames
+		rc = ngx_http_vod_init_frame_processing(ctx);
+		if (rc != NGX_OK)
+		{
+			if (rc == NGX_DONE)
+			{
+				rc = NGX_OK;
+			}
+			else
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_run_state_machine: ngx_http_vod_init_frame_processing failed %i", rc);
+			}
+			return rc;
+		}
+
+		if (ctx->frame_processor_state == NULL)
+		{
+			return ngx_http_vod_finalize_segment_response(ctx);
+		}
+
+		ctx->submodule_context.request_context.log->action = "processing frames";
+		ctx->state = STATE_PROCESS_FRAMES;
+		// fallthrough
+
+	case STATE_PROCESS_FRAMES:
+		rc = ngx_http_vod_process_media_frames(ctx);
+		if (rc != NGX_OK)
+		{
+			if (rc != NGX_AGAIN)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_run_state_machine: ngx_http_vod_process_media_frames failed %i", rc);
+			}
+			return rc;
+		}
+
+		return ngx_http_vod_finalize_segment_response(ctx);
+
+	case STATE_DUMP_OPEN_FILE:
+		return ctx->dump_request(ctx);
+
+	case STATE_DUMP_FILE_PART:
+		rc = ngx_http_send_special(ctx->submodule_context.r, NGX_HTTP_LAST);
+		if (rc != NGX_OK && rc != NGX_AGAIN)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_run_state_machine: ngx_http_send_special failed %i", rc);
+			return rc;
+		}
+
+		return NGX_OK;
+	}
+
+	ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_run_state_machine: invalid state %d", ctx->state);
+	return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
+static void
+ngx_http_vod_handle_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+{
+	ngx_http_vod_ctx_t *ctx = (ngx_http_vod_ctx_t *)context;
+	ssize_t expected_size;
+
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_handle_read_completed: read failed %i", rc);
+		goto finalize_request;
+	}
+
+	if (ctx->state == STATE_DUMP_FILE_PART)
+	{
+		expected_size = ctx->clipper_parse_result->last_offset - ctx->clipper_parse_result->first_offset;
+		if (bytes_read != expected_size)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_handle_read_completed: read size %z different than expected %z, probably a truncated file", 
+				bytes_read, expected_size);
+			rc = ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
+			goto finalize_request;
+		}
+	}
+	else if (bytes_read <= 0 && ctx->state != STATE_MAP_READ)		// Note: the mapping state machine handles the case of empty mapping
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_handle_read_completed: bytes read is zero");
+		rc = ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
+		goto finalize_request;
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, ctx->perf_counter_async_read);
+
+	switch (ctx->state)
+	{
+	case STATE_FILTER_FRAMES:
+	case STATE_PROCESS_FRAMES:
+		if (buf == NULL)
+		{
+			buf = &ctx->read_buffer;
+		}
+		read_cache_read_completed(&ctx->read_cache_state, buf);
+		break;
+
+	default:
+		if (buf != NULL)
+		{
+			ctx->read_buffer = *buf;
+		}
+		break;
+	}
+
+	// run the state machine
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
+
+finalize_request:
+
+	ngx_http_vod_finalize_request(ctx, rc);
+}
+
+static void
+ngx_http_vod_init_uri_key(media_sequence_t* cur_sequence, ngx_str_t* prefix)
+{
+	ngx_md5_t md5;
+
+	ngx_md5_init(&md5);
+	if (prefix != NULL)
+	{
+		ngx_md5_update(&md5, prefix->data, prefix->len);
+	}
+	ngx_md5_update(&md5, cur_sequence->stripped_uri.data, cur_sequence->stripped_uri.len);
+	ngx_md5_final(cur_sequence->uri_key, &md5);
+}
+
+static void
+ngx_http_vod_init_file_key(media_clip_source_t* cur_source, ngx_str_t* prefix)
+{
+	ngx_md5_t md5;
+
+	ngx_md5_init(&md5);
+	if (prefix != NULL)
+	{
+		ngx_md5_update(&md5, prefix->data, prefix->len);
+	}
+	ngx_md5_update(&md5, cur_source->mapped_uri.data, cur_source->mapped_uri.len);
+	ngx_md5_final(cur_source->file_key, &md5);
+}
+
+static ngx_int_t
+ngx_http_vod_init_encryption_key(
+	ngx_http_request_t *r, 
+	ngx_http_vod_loc_conf_t* conf, 
+	media_sequence_t* cur_sequence)
+{
+	ngx_str_t encryption_key_seed;
+	ngx_md5_t md5;
+
+	if (conf->secret_key != NULL)
+	{
+		// calculate the encryption key seed
+		if (ngx_http_complex_value(
+			r,
+			conf->secret_key,
+			&encryption_key_seed) != NGX_OK)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_init_encryption_key: ngx_http_complex_value failed");
+			return NGX_ERROR;
+		}
+	}
+	else
+	{
+		encryption_key_seed = cur_sequence->mapped_uri;
+	}
+
+	// hash the seed to get the key
+	ngx_md5_init(&md5);
+	ngx_md5_update(&md5, encryption_key_seed.data, encryption_key_seed.len);
+	ngx_md5_final(cur_sequence->encryption_key, &md5);
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_start_processing_media_file(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_loc_conf_t* conf;
+	media_clip_source_t* cur_source;
+	ngx_http_request_t *r;
+	ngx_int_t rc;
+
+	// update request flags
+	r = ctx->submodule_context.r;
+	r->root_tested = !r->error_page;
+	r->allow_ranges = 1;
+
+	// set the state machine
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	ctx->state_machine = ngx_http_vod_run_state_machine;
+
+	// handle serve requests
+	if (ctx->request == NULL &&
+		ctx->submodule_context.media_set.sources_head->clip_from == 0 &&
+		ctx->submodule_context.media_set.sources_head->clip_to == UINT_MAX)
+	{
+		ctx->state = STATE_DUMP_OPEN_FILE;
+
+		cur_source = ctx->submodule_context.media_set.sources_head;
+		ctx->cur_source = cur_source;
+
+		rc = ctx->open_file(r, &cur_source->mapped_uri, &cur_source->reader_context);
 		if (rc != NGX_OK)
 		{
+			if (rc != NGX_AGAIN && rc != NGX_DONE)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_start_processing_media_file: open_file failed %i", rc);
+			}
+			return rc;
+		}
+
+		return ctx->dump_request(ctx);
+	}
+
+	// initialize the file keys
+	conf = ctx->submodule_context.conf;
+
+	for (cur_source = ctx->submodule_context.media_set.sources_head;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		ngx_http_vod_init_file_key(cur_source, ctx->file_key_prefix);
+	}
+
+	// initialize the uri / encryption keys
+	if (conf->drm_enabled || conf->secret_key != NULL)
+	{
+		for (ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
+			ctx->cur_sequence < ctx->submodule_context.media_set.sequences_end;
+			ctx->cur_sequence++)
+		{
+			if (conf->drm_enabled)
+			{
+				ngx_http_vod_init_uri_key(ctx->cur_sequence, ctx->file_key_prefix);
+			}
+
+			rc = ngx_http_vod_init_encryption_key(r, conf, ctx->cur_sequence);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+	}
+
+	// restart the file index/uri params
+	ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+
+	if (ctx->submodule_context.conf->drm_enabled)
+	{
+		ctx->state = STATE_READ_DRM_INFO;
+		ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
+	}
+	else
+	{
+		ctx->state = STATE_READ_METADATA_INITIAL;
+	}
+
+	return ngx_http_vod_run_state_machine(ctx);
+}
+
+////// Local & mapped modes
+
+static ngx_int_t
+ngx_http_vod_map_uris_to_paths(ngx_http_vod_ctx_t *ctx)
+{
+	media_clip_source_t* cur_source;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_str_t original_uri;
+	u_char *last;
+	size_t root;
+	ngx_str_t path;
+
+	original_uri = r->uri;
+	for (cur_source = ctx->submodule_context.media_set.sources_head;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		r->uri = cur_source->stripped_uri;
+		last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+		r->uri = original_uri;
+		if (last == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_map_uris_to_paths: ngx_http_map_uri_to_path failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		path.len = last - path.data;
+
+		cur_source->mapped_uri = path;
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_dump_request_to_fallback(ngx_http_request_t *r)
+{
+	ngx_http_vod_loc_conf_t* conf;
+	ngx_child_request_params_t child_params;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+
+	if (conf->fallback_upstream_location.len == 0)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_dump_request_to_fallback: no fallback configured");
+		return NGX_ERROR;
+	}
+
+	if (ngx_http_vod_header_exists(r, &conf->proxy_header.key))
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_dump_request_to_fallback: proxy header exists");
+		return NGX_ERROR;
+	}
+
+	// dump the request to the fallback upstream
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = r->method;
+	child_params.base_uri = r->uri;
+	child_params.extra_args = r->args;
+	child_params.extra_header = conf->proxy_header;
+	child_params.proxy_range = 1;
+	child_params.proxy_all_headers = 1;
+
+	return ngx_child_request_start(
+		r,
+		NULL,
+		NULL,
+		&conf->fallback_upstream_location,
+		&child_params,
+		NULL);
+}
+
+#if (NGX_THREADS)
+static void
+ngx_http_vod_file_open_completed_internal(void* context, ngx_int_t rc, ngx_flag_t fallback)
+{
+	ngx_http_vod_ctx_t *ctx = (ngx_http_vod_ctx_t *)context;
+
+	if (rc != NGX_OK)
+	{
+		if (fallback && rc == NGX_HTTP_NOT_FOUND)
+		{
+			// try the fallback
+			rc = ngx_http_vod_dump_request_to_fallback(ctx->submodule_context.r);
+			if (rc != NGX_AGAIN)
+			{
+				rc = NGX_HTTP_NOT_FOUND;
+			}
+			goto finalize_request;
+		}
+
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.r->connection->log, 0,
+			"ngx_http_vod_file_open_completed_internal: read failed %i", rc);
+		goto finalize_request;
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_ASYNC_OPEN_FILE);
+
+	// run the state machine
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
+
+finalize_request:
+
+	ngx_http_vod_finalize_request(ctx, rc);
+}
+
+static void
+ngx_http_vod_file_open_completed(void* context, ngx_int_t rc)
+{
+	ngx_http_vod_file_open_completed_internal(context, rc, 0);
+}
+
+static void
+ngx_http_vod_file_open_completed_with_fallback(void* context, ngx_int_t rc)
+{
+	ngx_http_vod_file_open_completed_internal(context, rc, 1);
+}
+#endif // NGX_THREADS
+
+static ngx_int_t
+ngx_http_vod_init_file_reader_internal(ngx_http_request_t *r, ngx_str_t* path, void** context, ngx_flag_t fallback)
+{
+	ngx_file_reader_state_t* state;
+	ngx_http_core_loc_conf_t *clcf;
+	ngx_http_vod_ctx_t *ctx;
+	ngx_int_t rc;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	state = ngx_pcalloc(r->pool, sizeof(*state));
+	if (state == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_init_file_reader_internal: ngx_pcalloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	*context = state;
+
+#if (NGX_HAVE_IO_URING)
+	state->use_io_uring = ctx->submodule_context.conf->io_uring;
+#endif
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+#if (NGX_THREADS)
+	if (ctx->submodule_context.conf->open_file_thread_pool != NULL)
+	{
+		rc = ngx_file_reader_init_async(
+			state,
+			&ctx->async_open_context,
+			ctx->submodule_context.conf->open_file_thread_pool,
+			fallback ? ngx_http_vod_file_open_completed_with_fallback : ngx_http_vod_file_open_completed,
+			ngx_http_vod_handle_read_completed,
+			ctx,
+			r,
+			clcf,
+			path);
+	}
+	else
+	{
+#endif
+		rc = ngx_file_reader_init(
+			state,
+			ngx_http_vod_handle_read_completed,
+			ctx,
+			r,
+			clcf,
+			path);
+#if (NGX_THREADS)
+	}
+#endif
+	if (rc != NGX_OK)
+	{
+		if (fallback && rc == NGX_HTTP_NOT_FOUND)
+		{
+			// try the fallback
+			rc = ngx_http_vod_dump_request_to_fallback(r);
 			if (rc != NGX_AGAIN)
 			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_process_media_frames: async_read failed %i", rc);
+				return NGX_HTTP_NOT_FOUND;
 			}
 			return rc;
 		}
 
-		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_READ_FILE);
-
-		// read completed synchronously, update the read cache
-		read_cache_read_completed(&ctx->read_cache_state, &ctx->read_buffer);
+		if (rc != NGX_AGAIN)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_init_file_reader_internal: ngx_file_reader_init failed %i", rc);
+		}
+		return rc;
 	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_OPEN_FILE);
+
+	return NGX_OK;
 }
 
 static ngx_int_t
-ngx_http_vod_finalize_segment_response(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_init_file_reader(ngx_http_request_t *r, ngx_str_t* path, void** context)
 {
-	ngx_http_request_t *r = ctx->submodule_context.r;
-	ngx_int_t rc;
+	return ngx_http_vod_init_file_reader_internal(r, path, context, 0);
+}
 
-	// if we already sent the headers and all the buffers, just signal completion and return
-	if (r->header_sent)
-	{
-		if (ctx->write_segment_buffer_context.total_size != ctx->content_length)
-		{
-			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-				"ngx_http_vod_finalize_segment_response: actual content length %uz is different than reported length %uz",
-				ctx->write_segment_buffer_context.total_size, ctx->content_length);
-		}
+static ngx_int_t
+ngx_http_vod_init_file_reader_with_fallback(ngx_http_request_t *r, ngx_str_t* path, void** context)
+{
+	return ngx_http_vod_init_file_reader_internal(r, path, context, 1);
+}
+
+// Note: this function initializes r->exten in order to have nginx select the correct mime type for the request
+//		the code was copied from nginx's ngx_http_set_exten
+static void
+ngx_http_vod_set_request_extension(ngx_http_request_t *r, ngx_str_t* path)
+{
+	ngx_int_t  i;
+
+	ngx_str_null(&r->exten);
+
+	for (i = path->len - 1; i > 1; i--) {
+		if (path->data[i] == '.' && path->data[i - 1] != '/') {
+
+			r->exten.len = path->len - i - 1;
+			r->exten.data = &path->data[i + 1];
+
+			return;
 
-		rc = ngx_http_send_special(r, NGX_HTTP_LAST);
-		if (rc != NGX_OK && rc != NGX_AGAIN)
-		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_finalize_segment_response: ngx_http_send_special failed %i", rc);
-			return rc;
 		}
-		return NGX_OK;
+		else if (path->data[i] == '/') {
+			return;
+		}
 	}
 
-	// mark the current buffer as last
-	if (ctx->write_segment_buffer_context.chain_end->buf == NULL)
+	return;
+}
+
+static ngx_int_t
+ngx_http_vod_dump_file(ngx_http_vod_ctx_t* ctx)
+{
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_file_reader_state_t* state = ctx->cur_source->reader_context;
+	ngx_int_t                  rc;
+
+	ngx_http_vod_set_request_extension(r, &state->file.name);
+
+	rc = ngx_http_set_content_type(r);
+	if (rc != NGX_OK)
 	{
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-			"ngx_http_vod_finalize_segment_response: no buffers were written");
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0,
+			"ngx_http_vod_dump_file: ngx_http_set_content_type failed %i", rc);
 		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 
-	ctx->write_segment_buffer_context.chain_end->next = NULL;
-	ctx->write_segment_buffer_context.chain_end->buf->last_buf = 1;
-
 	// send the response header
-	rc = ngx_http_vod_send_header(r, ctx->write_segment_buffer_context.total_size, NULL, CACHE_TYPE_VOD);
+	rc = ngx_http_vod_send_header(r, state->file_size, NULL, CACHE_TYPE_VOD);
 	if (rc != NGX_OK)
 	{
 		return rc;
@@ -2381,875 +6206,1054 @@ ngx_http_vod_finalize_segment_response(ngx_http_vod_ctx_t *ctx)
 		return NGX_OK;
 	}
 
-	// send the response buffer chain
-	rc = ngx_http_output_filter(r, &ctx->out);
-	if (rc != NGX_OK && rc != NGX_AGAIN)
-	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_finalize_segment_response: ngx_http_output_filter failed %i", rc);
-		return rc;
-	}
-	return NGX_OK;
+	ngx_file_reader_enable_directio(state);		// ignore errors
+
+	return ngx_file_reader_dump_file_part(state, 0, 0);
 }
 
-////// Audio filtering
+////// Remote & mapped modes
 
-static ngx_int_t
-ngx_http_vod_process_init(ngx_cycle_t *cycle)
+static int ngx_libc_cdecl
+ngx_http_vod_compare_msec(const void *one, const void *two)
 {
-	vod_status_t rc;
+	ngx_msec_t first = *(ngx_msec_t*)one;
+	ngx_msec_t second = *(ngx_msec_t*)two;
 
-	audio_filter_process_init(cycle->log);
-	
-	rc = language_code_process_init(cycle->pool, cycle->log);
-	if (rc != VOD_OK)
+	return first < second ? -1 : (first > second ? 1 : 0);
+}
+
+static ngx_msec_t
+ngx_http_vod_get_hedge_delay(ngx_http_vod_loc_conf_t* conf)
+{
+	ngx_msec_t latencies[HEDGE_LATENCY_SAMPLE_COUNT];
+	ngx_msec_t result;
+	ngx_uint_t count;
+
+	count = ngx_min(hedge_latency_count, HEDGE_LATENCY_SAMPLE_COUNT);
+	if (count < HEDGE_LATENCY_SAMPLE_COUNT / 8)
 	{
-		return NGX_ERROR;
+		return conf->upstream_hedge_min_delay;
 	}
 
-	return NGX_OK;
-}
+	ngx_memcpy(latencies, hedge_latencies, count * sizeof(latencies[0]));
+	ngx_sort(latencies, count, sizeof(latencies[0]), ngx_http_vod_compare_msec);
 
-////// Clipping
+	result = latencies[(count * conf->upstream_hedge_percentile) / 100];
 
-static ngx_int_t
-ngx_http_vod_send_clip_header(ngx_http_vod_ctx_t *ctx)
+	return ngx_max(result, conf->upstream_hedge_min_delay);
+}
+
+static void
+ngx_http_vod_hedged_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
 {
-	ngx_http_request_t* r = ctx->submodule_context.r;
-	ngx_chain_t* out;
-	uint64_t first_offset;
-	uint64_t last_offset;
-	size_t response_size;
-	ngx_str_t content_type;
-	ngx_int_t rc;
-	off_t range_start;
-	off_t range_end;
-	off_t header_size;
-	off_t mdat_size;
+	ngx_http_vod_http_reader_state_t* state = context;
+	ngx_http_vod_ctx_t *ctx;
 
-	rc = ctx->format->clipper_build_header(
-		&ctx->submodule_context.request_context,
-		ctx->metadata_parts,
-		ctx->metadata_part_count,
-		ctx->clipper_parse_result,
-		&out,
-		&response_size, 
-		&content_type);
-	if (rc != VOD_OK)
+	ctx = ngx_http_get_module_ctx(state->r, ngx_http_vod_module);
+
+	if (rc == NGX_OK)
 	{
-		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_send_clip_header: clipper_build_header(%V) failed %i", &ctx->format->name, rc);
-		return ngx_http_vod_status_to_ngx_error(rc);
+		hedge_latencies[hedge_latency_count % HEDGE_LATENCY_SAMPLE_COUNT] = ngx_current_msec - state->read_start_time;
+		hedge_latency_count++;
 	}
 
-	// send the response header
-	rc = ngx_http_vod_send_header(r, response_size, &content_type, CACHE_TYPE_VOD);
-	if (rc != NGX_OK)
+	if (state->hedge.issued)
 	{
-		return rc;
+		ngx_perf_counter_add(ctx->perf_counters, PC_HEDGE_ISSUED, 1);
 	}
 
-	if (r->header_only || r->method == NGX_HTTP_HEAD)
+	if (state->hedge.won)
 	{
-		return NGX_DONE;
+		ngx_perf_counter_add(ctx->perf_counters, PC_HEDGE_WON, 1);
 	}
 
-	rc = ngx_http_output_filter(r, out);
-	if (rc != NGX_OK && rc != NGX_AGAIN)
+	state->read_callback(state->read_callback_context, rc, buf, bytes_read);
+}
+
+static ngx_int_t
+ngx_http_vod_http_reader_start(
+	ngx_http_vod_http_reader_state_t *state,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_child_request_params_t* child_params,
+	ngx_buf_t *buf)
+{
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_http_vod_ctx_t *ctx;
+
+	ctx = ngx_http_get_module_ctx(state->r, ngx_http_vod_module);
+	conf = ctx->submodule_context.conf;
+
+	if (!conf->upstream_hedge || conf->request_handler != ngx_http_vod_remote_request_handler)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_send_clip_header: ngx_http_output_filter failed %i", rc);
-		return rc;
+		return ngx_child_request_start(
+			state->r,
+			callback,
+			callback_context,
+			&conf->upstream_location,
+			child_params,
+			buf);
 	}
 
-	if (ctx->submodule_context.conf->request_handler == ngx_http_vod_remote_request_handler && 
-		ctx->submodule_context.r->headers_in.range)
-	{
-		// in case of range request in remote mode, apply the requested range to the mdat dump offsets.
-		// nginx's range filter module does not touch the dumped part since it is written in the context
-		// a subrequest. 
+	state->hedge.location = conf->fallback_upstream_location.len != 0 ? 
+		&conf->fallback_upstream_location : &conf->upstream_location;
+	state->hedge.delay = ngx_http_vod_get_hedge_delay(conf);
+	state->read_callback = callback;
+	state->read_callback_context = callback_context;
+	state->read_start_time = ngx_current_msec;
 
-		// TODO: apply the range on the mp4 header as well and return 206, to avoid making assumptions on
-		//		nginx subrequest/range filter implementations
+	return ngx_child_request_start_hedged(
+		state->r,
+		ngx_http_vod_hedged_read_completed,
+		state,
+		&conf->upstream_location,
+		child_params,
+		buf,
+		&state->hedge);
+}
 
-		rc = ngx_http_vod_range_parse(
-			&ctx->submodule_context.r->headers_in.range->value,
-			response_size,
-			&range_start,
-			&range_end);
-		if (rc != NGX_OK)
-		{
-			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-				"ngx_http_vod_send_clip_header: failed to parse range header \"%V\"",
-				&ctx->submodule_context.r->headers_in.range->value);
-			return rc;
-		}
+static ngx_int_t
+ngx_http_vod_async_http_read(ngx_http_vod_http_reader_state_t *state, ngx_buf_t *buf, size_t size, off_t offset)
+{
+	ngx_http_vod_ctx_t *ctx;
+	ngx_child_request_params_t child_params;
 
-		first_offset = ctx->clipper_parse_result->first_offset;
-		last_offset = ctx->clipper_parse_result->last_offset;
+	ctx = ngx_http_get_module_ctx(state->r, ngx_http_vod_module);
 
-		mdat_size = last_offset - first_offset;
-		header_size = response_size - mdat_size;
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_GET;
+	child_params.base_uri = state->cur_remote_suburi;
+	child_params.extra_args = ctx->upstream_extra_args;
+	child_params.range_start = offset;
+	child_params.range_end = offset + size;
 
-		if (range_end < header_size)
-		{
-			last_offset = 0;
-		}
-		else if (mdat_size > range_end - header_size)
-		{
-			last_offset = first_offset + range_end - header_size;
-		}
+	return ngx_http_vod_http_reader_start(
+		state,
+		ngx_http_vod_handle_read_completed,
+		ctx,
+		&child_params,
+		buf);
+}
 
-		if (range_start > header_size)
-		{
-			first_offset += range_start - header_size;
-		}
+// Note: when validator is null, returns the key of the entry that holds the validator of the file
+static void
+ngx_http_vod_get_remote_block_key(
+	ngx_http_vod_ctx_t* ctx,
+	ngx_http_vod_http_reader_state_t* state,
+	ngx_str_t* validator,
+	uint64_t block_index,
+	u_char* key)
+{
+	ngx_md5_t md5;
 
-		ctx->clipper_parse_result->first_offset = first_offset;
-		ctx->clipper_parse_result->last_offset = last_offset;
+	ngx_md5_init(&md5);
+	if (ctx->file_key_prefix != NULL)
+	{
+		ngx_md5_update(&md5, ctx->file_key_prefix->data, ctx->file_key_prefix->len);
+	}
+	ngx_md5_update(&md5, state->cur_remote_suburi.data, state->cur_remote_suburi.len);
+	if (validator != NULL)
+	{
+		ngx_md5_update(&md5, validator->data, validator->len);
+		ngx_md5_update(&md5, &block_index, sizeof(block_index));
+	}
+	ngx_md5_final(key, &md5);
+}
+
+static void
+ngx_http_vod_get_remote_validator(ngx_http_vod_ctx_t* ctx, ngx_http_vod_http_reader_state_t* state)
+{
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	u_char* validator;
+	size_t size;
+
+	if (state->block_validator.len != 0)
+	{
+		return;
+	}
+
+	ngx_http_vod_get_remote_block_key(ctx, state, NULL, 0, key);
+
+	if (!ngx_buffer_cache_fetch_perf(
+		ctx->perf_counters,
+		ctx->submodule_context.conf->remote_block_cache,
+		key,
+		&validator,
+		&size) || size == 0)
+	{
+		return;
+	}
+
+	// Note: the validator is used by the following reads of the request, copy it
+	state->block_validator.data = ngx_pnalloc(state->r->pool, size);
+	if (state->block_validator.data == NULL)
+	{
+		return;
 	}
 
-	return NGX_OK;
+	ngx_memcpy(state->block_validator.data, validator, size);
+	state->block_validator.len = size;
 }
 
-////// Common
+static void
+ngx_http_vod_copy_remote_block(
+	ngx_http_vod_http_reader_state_t* state,
+	off_t block_start,
+	u_char* data,
+	size_t size)
+{
+	off_t start;
+	off_t end;
 
-static ngx_int_t
-ngx_http_vod_run_state_machine(ngx_http_vod_ctx_t *ctx)
+	start = ngx_max(block_start, state->block_read_offset);
+	end = ngx_min(block_start + (off_t)size, state->block_read_end);
+	if (start >= end)
+	{
+		return;
+	}
+
+	state->block_read_buf->last = ngx_copy(
+		state->block_read_buf->last,
+		data + (start - block_start),
+		end - start);
+	state->block_read_offset = end;
+}
+
+// Note: the buffer must start on a block boundary. a partial block is stored only if it is the last block 
+//		of the file, and the blocks are stored only if the response has a validator
+static void
+ngx_http_vod_store_remote_blocks(
+	ngx_http_vod_ctx_t* ctx,
+	ngx_http_vod_http_reader_state_t* state,
+	ngx_child_request_response_info_t* response_info,
+	off_t block_start,
+	ngx_buf_t* buf,
+	ngx_flag_t copy)
 {
-	ngx_int_t rc;
+	ngx_http_vod_loc_conf_t *conf = ctx->submodule_context.conf;
+	uint64_t block_index;
+	size_t block_size;
+	size_t cur_size;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	u_char* cur_pos;
+	ngx_flag_t store;
 
-	switch (ctx->state)
+	block_size = conf->remote_block_size;
+	block_index = block_start / block_size;
+
+	store = response_info->validator.len != 0;
+	if (store && 
+		(state->block_validator.len != response_info->validator.len ||
+		ngx_memcmp(state->block_validator.data, response_info->validator.data, response_info->validator.len) != 0))
 	{
-	case STATE_READ_DRM_INFO:
-		rc = ngx_http_vod_state_machine_get_drm_info(ctx);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
+		// the file changed or the validator was not cached, store the new validator
+		ngx_http_vod_get_remote_block_key(ctx, state, NULL, 0, key);
 
-		ctx->state = STATE_READ_METADATA_INITIAL;
-		ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
-		// fallthrough
+		store = ngx_buffer_cache_store_perf(
+			ctx->perf_counters,
+			conf->remote_block_cache,
+			key,
+			response_info->validator.data,
+			response_info->validator.len);
+	}
 
-	case STATE_READ_METADATA_INITIAL:
-	case STATE_READ_METADATA_OPEN_FILE:
-	case STATE_READ_METADATA_READ:
-	case STATE_READ_FRAMES_OPEN_FILE:
-	case STATE_READ_FRAMES_READ:
+	if (!store)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_store_remote_blocks: the response validator is not available, not caching");
+	}
 
-		rc = ngx_http_vod_state_machine_parse_metadata(ctx);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
+	for (cur_pos = buf->pos; cur_pos < buf->last; cur_pos += cur_size)
+	{
+		cur_size = ngx_min((size_t)(buf->last - cur_pos), block_size);
 
-		if (ctx->request == NULL)
+		if (store && cur_size < block_size && block_start + (off_t)cur_size != response_info->total_size)
 		{
-			rc = ngx_http_vod_send_clip_header(ctx);
-			if (rc != NGX_OK)
-			{
-				if (rc == NGX_DONE)
-				{
-					rc = NGX_OK;
-				}
-				else
-				{
-					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_run_state_machine: ngx_http_vod_send_clip_header failed %i", rc);
-				}
-				return rc;
-			}
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_store_remote_blocks: block %uL is partial and not the end of the file", block_index);
 		}
-		else
+		else if (store)
 		{
-			rc = filter_init_filtered_clips(
-				&ctx->submodule_context.request_context,
-				&ctx->submodule_context.media_set);
-			if (rc != VOD_OK)
+			ngx_http_vod_get_remote_block_key(ctx, state, &response_info->validator, block_index, key);
+
+			if (!ngx_buffer_cache_store_perf(
+				ctx->perf_counters,
+				conf->remote_block_cache,
+				key,
+				cur_pos,
+				cur_size))
 			{
 				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_run_state_machine: filter_init_filtered_clips failed %i", rc);
-				return ngx_http_vod_status_to_ngx_error(rc);
+					"ngx_http_vod_store_remote_blocks: failed to store block %uL in cache", block_index);
 			}
+		}
 
-			rc = ngx_http_vod_validate_streams(ctx);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
+		if (copy)
+		{
+			ngx_http_vod_copy_remote_block(state, block_start, cur_pos, cur_size);
+		}
 
-			// handle metadata requests
-			if (ctx->request->handle_metadata_request != NULL)
-			{
-				return ngx_http_vod_handle_metadata_request(ctx);
-			}
+		block_start += block_size;
+		block_index++;
+	}
+}
 
-			// initialize the read cache
-			read_cache_init(
-				&ctx->read_cache_state,
-				&ctx->submodule_context.request_context,
-				ctx->submodule_context.conf->cache_buffer_size,
-				ctx->alignment);
-		}
+static void
+ngx_http_vod_remote_block_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+{
+	ngx_http_vod_http_reader_state_t* state = context;
+	ngx_str_t* validator = &state->block_response_info.validator;
+	ngx_http_vod_ctx_t *ctx;
+	ngx_flag_t changed;
 
-		ctx->state = STATE_OPEN_FILE;
-		ctx->cur_source = ctx->submodule_context.media_set.sources_head;
-		// fallthrough
+	ctx = ngx_http_get_module_ctx(state->r, ngx_http_vod_module);
 
-	case STATE_OPEN_FILE:
-		rc = ngx_http_vod_state_machine_open_files(ctx);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
+	changed = 0;
 
-		// enable directio if enabled in the configuration (ignore errors)
-		// Note that directio is set on transfer only to allow the kernel to cache the "moov" atom
-		if (ctx->submodule_context.conf->request_handler != ngx_http_vod_remote_request_handler)
+	if (rc == NGX_OK && bytes_read > 0)
+	{
+		// check whether the cached blocks that were already copied belong to an older version of the file
+		changed = state->block_read_offset > state->block_read_start &&
+			validator->len != 0 &&
+			(state->block_validator.len != validator->len ||
+			ngx_memcmp(state->block_validator.data, validator->data, validator->len) != 0);
+
+		ngx_http_vod_store_remote_blocks(ctx, state, &state->block_response_info, state->block_range_start, buf, !changed);
+
+		if (validator->len != 0)
 		{
-			ngx_http_vod_enable_directio(ctx);
+			state->block_validator = *validator;
 		}
+	}
 
-		if (ctx->request == NULL)
-		{
-			if (ctx->clipper_parse_result->first_offset < ctx->clipper_parse_result->last_offset)
-			{
-				ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+	ngx_pfree(state->r->pool, state->block_buffer.start);
+	state->block_buffer.start = NULL;
 
-				ctx->state = STATE_DUMP_FILE_PART;
+	buf = state->block_read_buf;
 
-				rc = ctx->dump_part(
-					ctx->cur_source->reader_context,
-					ctx->clipper_parse_result->first_offset,
-					ctx->clipper_parse_result->last_offset);
-				if (rc != NGX_OK)
-				{
-					return rc;
-				}
-			}
+	if (changed)
+	{
+		ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_remote_block_read_completed: the file changed while reading, reading offset %O again", 
+			state->block_read_start);
 
-			rc = ngx_http_send_special(ctx->submodule_context.r, NGX_HTTP_LAST);
-			if (rc != NGX_OK && rc != NGX_AGAIN)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_run_state_machine: ngx_http_send_special failed %i", rc);
-				return rc;
-			}
+		buf->last = state->block_read_last;
 
-			return NGX_OK;
+		rc = ngx_http_vod_async_http_block_read(
+			state, 
+			buf, 
+			state->block_read_end - state->block_read_start, 
+			state->block_read_start);
+		if (rc == NGX_AGAIN)
+		{
+			return;
 		}
+	}
 
-		if (ctx->submodule_context.media_set.audio_filtering_needed)
-		{
-			// initialize the filtering of audio frames
-			ctx->state = STATE_FILTER_FRAMES;
-			ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+	ngx_http_vod_handle_read_completed(ctx, rc, buf, buf->last - buf->pos);
+}
 
-			rc = filter_init_state(
-				&ctx->submodule_context.request_context,
-				&ctx->read_cache_state,
-				&ctx->submodule_context.media_set, 
-				&ctx->frame_processor_state);
-			if (rc != VOD_OK)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_run_state_machine: filter_init_state failed %i", rc);
-				return ngx_http_vod_status_to_ngx_error(rc);
-			}
+static ngx_int_t
+ngx_http_vod_async_http_block_read(ngx_http_vod_http_reader_state_t *state, ngx_buf_t *buf, size_t size, off_t offset)
+{
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_http_vod_ctx_t *ctx;
+	ngx_child_request_params_t child_params;
+	uint64_t block_index;
+	uint64_t last_block;
+	size_t block_size;
+	size_t range_size;
+	size_t cached_size;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	u_char* cached_data;
+	off_t block_start;
 
-			ctx->frame_processor = filter_run_state_machine;
-		}
+	ctx = ngx_http_get_module_ctx(state->r, ngx_http_vod_module);
+	conf = ctx->submodule_context.conf;
+	block_size = conf->remote_block_size;
 
-		// fallthrough
+	if (size == 0)
+	{
+		return ngx_http_vod_async_http_read(state, buf, size, offset);
+	}
 
-	case STATE_FILTER_FRAMES:
-		// if audio filtering already started, process frames
-		if (ctx->frame_processor != NULL)
-		{
-			rc = ngx_http_vod_process_media_frames(ctx);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
-		}
+	state->block_read_buf = buf;
+	state->block_read_last = buf->last;
+	state->block_read_start = offset;
+	state->block_read_offset = offset;
+	state->block_read_end = offset + size;
 
-		// initialize the processing of the video/audio frames
-		rc = ngx_http_vod_init_frame_processing(ctx);
-		if (rc != NGX_OK)
-		{
-			if (rc == NGX_DONE)
-			{
-				rc = NGX_OK;
-			}
-			else
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_run_state_machine: ngx_http_vod_init_frame_processing failed %i", rc);
-			}
-			return rc;
-		}
+	// Note: the cached blocks are not used when the validator of the file is not cached
+	ngx_http_vod_get_remote_validator(ctx, state);
 
-		if (ctx->frame_processor_state == NULL)
-		{
-			return ngx_http_vod_finalize_segment_response(ctx);
-		}
+	// serve the blocks that exist in the cache
+	block_index = offset / block_size;
+	last_block = (offset + size - 1) / block_size;
 
-		ctx->submodule_context.request_context.log->action = "processing frames";
-		ctx->state = STATE_PROCESS_FRAMES;
-		// fallthrough
+	for (; state->block_validator.len != 0 && block_index <= last_block; block_index++)
+	{
+		ngx_http_vod_get_remote_block_key(ctx, state, &state->block_validator, block_index, key);
 
-	case STATE_PROCESS_FRAMES:
-		rc = ngx_http_vod_process_media_frames(ctx);
-		if (rc != NGX_OK)
+		if (!ngx_buffer_cache_fetch_perf(
+			ctx->perf_counters,
+			conf->remote_block_cache,
+			key,
+			&cached_data,
+			&cached_size))
 		{
-			if (rc != NGX_AGAIN)
-			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_run_state_machine: ngx_http_vod_process_media_frames failed %i", rc);
-			}
-			return rc;
+			break;
 		}
 
-		return ngx_http_vod_finalize_segment_response(ctx);
-
-	case STATE_DUMP_OPEN_FILE:
-		return ctx->dump_request(ctx);
+		ngx_http_vod_copy_remote_block(state, block_index * block_size, cached_data, cached_size);
 
-	case STATE_DUMP_FILE_PART:
-		rc = ngx_http_send_special(ctx->submodule_context.r, NGX_HTTP_LAST);
-		if (rc != NGX_OK && rc != NGX_AGAIN)
+		if (cached_size < block_size)
 		{
+			// reached the end of the file
 			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_run_state_machine: ngx_http_send_special failed %i", rc);
-			return rc;
+				"ngx_http_vod_async_http_block_read: block %uL is the last block of the file", block_index);
+			return NGX_OK;
 		}
+	}
 
+	if (block_index > last_block)
+	{
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_async_http_block_read: served offset %O size %uz from cache", offset, size);
 		return NGX_OK;
 	}
 
-	ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-		"ngx_http_vod_run_state_machine: invalid state %d", ctx->state);
-	return NGX_HTTP_INTERNAL_SERVER_ERROR;
-}
+	// fetch the missing blocks using a single range request
+	block_start = block_index * block_size;
+	range_size = (last_block + 1 - block_index) * block_size;
 
-static void
-ngx_http_vod_handle_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
-{
-	ngx_http_vod_ctx_t *ctx = (ngx_http_vod_ctx_t *)context;
-	ssize_t expected_size;
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_async_http_block_read: fetching %uL blocks from offset %O, requested offset %O",
+		last_block + 1 - block_index, block_start, offset);
 
-	if (rc != NGX_OK)
-	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_handle_read_completed: read failed %i", rc);
-		goto finalize_request;
-	}
+	state->block_range_start = block_start;
 
-	if (ctx->state == STATE_DUMP_FILE_PART)
-	{
-		expected_size = ctx->clipper_parse_result->last_offset - ctx->clipper_parse_result->first_offset;
-		if (bytes_read != expected_size)
-		{
-			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_handle_read_completed: read size %z different than expected %z, probably a truncated file", 
-				bytes_read, expected_size);
-			rc = ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
-			goto finalize_request;
-		}
-	}
-	else if (bytes_read <= 0 && ctx->state != STATE_MAP_READ)		// Note: the mapping state machine handles the case of empty mapping
+	ngx_memzero(&state->block_buffer, sizeof(state->block_buffer));
+	state->block_buffer.start = ngx_palloc(state->r->pool, range_size + ctx->alloc_params[READER_HTTP].extra_size);
+	if (state->block_buffer.start == NULL)
 	{
-		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_handle_read_completed: bytes read is zero");
-		rc = ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
-		goto finalize_request;
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_async_http_block_read: ngx_palloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, ctx->perf_counter_async_read);
+	state->block_buffer.pos = state->block_buffer.start;
+	state->block_buffer.last = state->block_buffer.start;
+	state->block_buffer.end = state->block_buffer.start + range_size + ctx->alloc_params[READER_HTTP].extra_size;
+	state->block_buffer.temporary = 1;
 
-	switch (ctx->state)
-	{
-	case STATE_FILTER_FRAMES:
-	case STATE_PROCESS_FRAMES:
-		if (buf == NULL)
-		{
-			buf = &ctx->read_buffer;
-		}
-		read_cache_read_completed(&ctx->read_cache_state, buf);
-		break;
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_GET;
+	child_params.base_uri = state->cur_remote_suburi;
+	child_params.extra_args = ctx->upstream_extra_args;
+	child_params.range_start = block_start;
+	child_params.range_end = block_start + range_size;
+	child_params.response_info = &state->block_response_info;
+
+	return ngx_http_vod_http_reader_start(
+		state,
+		ngx_http_vod_remote_block_read_completed,
+		state,
+		&child_params,
+		&state->block_buffer);
+}
 
-	default:
-		if (buf != NULL)
-		{
-			ctx->read_buffer = *buf;
-		}
-		break;
-	}
+////// Pending background requests
 
-	// run the state machine
-	rc = ctx->state_machine(ctx);
-	if (rc == NGX_AGAIN)
+static void
+ngx_http_vod_pending_release(ngx_http_vod_pending_t* pending)
+{
+	if (!pending->pending)
 	{
 		return;
 	}
 
-finalize_request:
-
-	ngx_http_vod_finalize_request(ctx, rc);
+	pending->pending = 0;
+	(void)ngx_atomic_fetch_add(pending->counter, -1);
 }
 
 static void
-ngx_http_vod_init_uri_key(media_sequence_t* cur_sequence, ngx_str_t* prefix)
+ngx_http_vod_pending_cleanup(void* data)
 {
-	ngx_md5_t md5;
+	ngx_http_vod_pending_release(data);
+}
 
-	ngx_md5_init(&md5);
-	if (prefix != NULL)
+// Note: the returned object is released when the pool is destroyed, in case the request
+//		is terminated before its completion handler is called. the counter may be in shared memory
+static ngx_http_vod_pending_t*
+ngx_http_vod_pending_create(ngx_pool_t* pool, ngx_atomic_t* counter)
+{
+	ngx_http_vod_pending_t* pending;
+	ngx_pool_cleanup_t* cln;
+
+	cln = ngx_pool_cleanup_add(pool, sizeof(*pending));
+	if (cln == NULL)
 	{
-		ngx_md5_update(&md5, prefix->data, prefix->len);
+		return NULL;
 	}
-	ngx_md5_update(&md5, cur_sequence->stripped_uri.data, cur_sequence->stripped_uri.len);
-	ngx_md5_final(cur_sequence->uri_key, &md5);
+
+	pending = cln->data;
+	pending->counter = counter;
+	pending->pending = 0;
+
+	cln->handler = ngx_http_vod_pending_cleanup;
+
+	return pending;
 }
 
 static void
-ngx_http_vod_init_file_key(media_clip_source_t* cur_source, ngx_str_t* prefix)
+ngx_http_vod_pending_start(ngx_http_vod_pending_t* pending)
 {
-	ngx_md5_t md5;
+	pending->pending = 1;
+	(void)ngx_atomic_fetch_add(pending->counter, 1);
+}
 
-	ngx_md5_init(&md5);
-	if (prefix != NULL)
+////// Segment prefetch
+
+static void
+ngx_http_vod_get_frames_range(frame_list_part_t* part, uint64_t* start, uint64_t* end)
+{
+	input_frame_t* cur_frame;
+
+	for (cur_frame = part->first_frame; cur_frame < part->last_frame; cur_frame++)
 	{
-		ngx_md5_update(&md5, prefix->data, prefix->len);
+		if (cur_frame->size == 0)
+		{
+			continue;
+		}
+
+		if (cur_frame->offset < *start)
+		{
+			*start = cur_frame->offset;
+		}
+
+		if (cur_frame->offset + cur_frame->size > *end)
+		{
+			*end = cur_frame->offset + cur_frame->size;
+		}
 	}
-	ngx_md5_update(&md5, cur_source->mapped_uri.data, cur_source->mapped_uri.len);
-	ngx_md5_final(cur_source->file_key, &md5);
 }
 
-static ngx_int_t
-ngx_http_vod_init_encryption_key(
-	ngx_http_request_t *r, 
-	ngx_http_vod_loc_conf_t* conf, 
-	media_sequence_t* cur_sequence)
+static bool_t
+ngx_http_vod_get_source_range(media_clip_source_t* source, uint64_t* start_offset, uint64_t* end_offset)
 {
-	ngx_str_t encryption_key_seed;
-	ngx_md5_t md5;
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	uint64_t start = (uint64_t)-1;
+	uint64_t end = 0;
 
-	if (conf->secret_key != NULL)
+	for (cur_track = source->track_array.first_track; cur_track < source->track_array.last_track; cur_track++)
 	{
-		// calculate the encryption key seed
-		if (ngx_http_complex_value(
-			r,
-			conf->secret_key,
-			&encryption_key_seed) != NGX_OK)
+		for (part = &cur_track->frames; part != NULL; part = part->next)
 		{
-			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_init_encryption_key: ngx_http_complex_value failed");
-			return NGX_ERROR;
+			if (part->frames_source != &frames_source_cache &&
+				part->frames_source != &frames_source_mmap)
+			{
+				continue;
+			}
+
+			ngx_http_vod_get_frames_range(part, &start, &end);
 		}
 	}
-	else
+
+	if (start >= end)
 	{
-		encryption_key_seed = cur_sequence->mapped_uri;
+		return FALSE;
 	}
 
-	// hash the seed to get the key
-	ngx_md5_init(&md5);
-	ngx_md5_update(&md5, encryption_key_seed.data, encryption_key_seed.len);
-	ngx_md5_final(cur_sequence->encryption_key, &md5);
-
-	return NGX_OK;
+	*start_offset = start;
+	*end_offset = end;
+	return TRUE;
 }
 
 static ngx_int_t
-ngx_http_vod_start_processing_media_file(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_mmap_frames(ngx_http_vod_ctx_t *ctx)
 {
-	ngx_http_vod_loc_conf_t* conf;
+	ngx_file_reader_state_t* state;
 	media_clip_source_t* cur_source;
-	ngx_http_request_t *r;
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	uint64_t start_offset;
+	uint64_t end_offset;
 	ngx_int_t rc;
+	u_char* data;
 
-	// update request flags
-	r = ctx->submodule_context.r;
-	r->root_tested = !r->error_page;
-	r->allow_ranges = 1;
-
-	// set the state machine
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
-	ctx->state_machine = ngx_http_vod_run_state_machine;
-
-	// handle serve requests
-	if (ctx->request == NULL &&
-		ctx->submodule_context.media_set.sources_head->clip_from == 0 &&
-		ctx->submodule_context.media_set.sources_head->clip_to == UINT_MAX)
+	for (cur_source = ctx->submodule_context.media_set.sources_head; cur_source != NULL; cur_source = cur_source->next)
 	{
-		ctx->state = STATE_DUMP_OPEN_FILE;
-
-		cur_source = ctx->submodule_context.media_set.sources_head;
-		ctx->cur_source = cur_source;
+		state = cur_source->reader_context;
+		if (state == NULL ||
+			!ngx_http_vod_get_source_range(cur_source, &start_offset, &end_offset))
+		{
+			continue;
+		}
 
-		rc = ctx->open_file(r, &cur_source->mapped_uri, &cur_source->reader_context);
+		rc = ngx_file_reader_mmap(
+			state,
+			ctx->submodule_context.r->pool,
+			ctx->submodule_context.conf->mmap_frames_max_files,
+			start_offset,
+			end_offset - start_offset,
+			&data);
 		if (rc != NGX_OK)
 		{
-			if (rc != NGX_AGAIN && rc != NGX_DONE)
+			if (rc == NGX_DECLINED)
 			{
-				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-					"ngx_http_vod_start_processing_media_file: open_file failed %i", rc);
+				continue;
 			}
-			return rc;
-		}
-
-		return ctx->dump_request(ctx);
-	}
-
-	// initialize the file keys
-	conf = ctx->submodule_context.conf;
 
-	for (cur_source = ctx->submodule_context.media_set.sources_head;
-		cur_source != NULL;
-		cur_source = cur_source->next)
-	{
-		ngx_http_vod_init_file_key(cur_source, ctx->file_key_prefix);
-	}
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_mmap_frames: ngx_file_reader_mmap failed %i", rc);
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
 
-	// initialize the uri / encryption keys
-	if (conf->drm_enabled || conf->secret_key != NULL)
-	{
-		for (ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
-			ctx->cur_sequence < ctx->submodule_context.media_set.sequences_end;
-			ctx->cur_sequence++)
+		// replace the read cache frames sources with the mapping
+		for (cur_track = cur_source->track_array.first_track; cur_track < cur_source->track_array.last_track; cur_track++)
 		{
-			if (conf->drm_enabled)
+			for (part = &cur_track->frames; part != NULL; part = part->next)
 			{
-				ngx_http_vod_init_uri_key(ctx->cur_sequence, ctx->file_key_prefix);
-			}
+				if (part->frames_source != &frames_source_cache)
+				{
+					continue;
+				}
 
-			rc = ngx_http_vod_init_encryption_key(r, conf, ctx->cur_sequence);
-			if (rc != NGX_OK)
-			{
-				return rc;
+				rc = frames_source_mmap_init(
+					&ctx->submodule_context.request_context,
+					data,
+					state->file_size,
+					&part->frames_source_context);
+				if (rc != VOD_OK)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_mmap_frames: frames_source_mmap_init failed %i", rc);
+					return ngx_http_vod_status_to_ngx_error(rc);
+				}
+
+				part->frames_source = &frames_source_mmap;
 			}
 		}
+
+		ngx_perf_counter_add(ctx->perf_counters, PC_MMAP_FRAMES, 1);
 	}
 
-	// restart the file index/uri params
-	ctx->cur_source = ctx->submodule_context.media_set.sources_head;
+	return NGX_OK;
+}
 
-	if (ctx->submodule_context.conf->drm_enabled)
+static ngx_http_vod_prefetched_range_t*
+ngx_http_vod_get_prefetched_range(u_char* file_key)
+{
+	uint32_t index;
+
+	ngx_memcpy(&index, file_key, sizeof(index));
+	return &prefetched_ranges[index % SEGMENT_PREFETCH_HISTORY_SIZE];
+}
+
+static void
+ngx_http_vod_segment_prefetch_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+{
+	ngx_http_vod_segment_prefetch_t* prefetch = context;
+	ngx_http_vod_ctx_t* ctx = prefetch->ctx;
+
+	ngx_http_vod_pending_release(prefetch->pending);
+
+	if (rc != NGX_OK)
 	{
-		ctx->state = STATE_READ_DRM_INFO;
-		ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_segment_prefetch_completed: prefetch request failed %i", rc);
 	}
-	else
+	else if (bytes_read > 0)
 	{
-		ctx->state = STATE_READ_METADATA_INITIAL;
+		ngx_http_vod_store_remote_blocks(ctx, prefetch->state, &prefetch->response_info, prefetch->block_start, buf, 0);
 	}
 
-	return ngx_http_vod_run_state_machine(ctx);
+	ngx_pfree(ctx->submodule_context.r->pool, prefetch->buffer.start);
+	prefetch->buffer.start = NULL;
 }
 
-////// Local & mapped modes
-
 static ngx_int_t
-ngx_http_vod_map_uris_to_paths(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_segment_prefetch_remote(
+	ngx_http_vod_ctx_t* ctx, 
+	ngx_http_vod_http_reader_state_t* state, 
+	off_t offset, 
+	size_t size)
 {
-	media_clip_source_t* cur_source;
-	ngx_http_request_t *r = ctx->submodule_context.r;
-	ngx_str_t original_uri;
-	u_char *last;
-	size_t root;
-	ngx_str_t path;
+	ngx_http_vod_segment_prefetch_t* prefetch;
+	ngx_child_request_params_t child_params;
+	ngx_http_vod_loc_conf_t *conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	size_t block_size = conf->remote_block_size;
+	size_t range_size;
+	size_t cached_size;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	u_char* cached_data;
+	off_t block_start;
+	ngx_int_t rc;
 
-	original_uri = r->uri;
-	for (cur_source = ctx->submodule_context.media_set.sources_head;
-		cur_source != NULL;
-		cur_source = cur_source->next)
+	if (segment_prefetch_pending >= conf->segment_prefetch_max_pending)
 	{
-		r->uri = cur_source->stripped_uri;
-		last = ngx_http_map_uri_to_path(r, &path, &root, 0);
-		r->uri = original_uri;
-		if (last == NULL)
-		{
-			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_map_uris_to_paths: ngx_http_map_uri_to_path failed");
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
-		}
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_segment_prefetch_remote: %uA prefetch requests are pending, skipping", segment_prefetch_pending);
+		return NGX_DECLINED;
+	}
 
-		path.len = last - path.data;
+	block_start = offset / block_size * block_size;
+	range_size = ((offset + size - 1) / block_size + 1) * block_size - block_start;
 
-		cur_source->mapped_uri = path;
-	}
+	// skip the range if it was already fetched
+	ngx_http_vod_get_remote_validator(ctx, state);
+	ngx_http_vod_get_remote_block_key(ctx, state, &state->block_validator, block_start / block_size, key);
 
-	return NGX_OK;
-}
+	if (state->block_validator.len != 0 &&
+		ngx_buffer_cache_fetch_perf(
+		ctx->perf_counters,
+		conf->remote_block_cache,
+		key,
+		&cached_data,
+		&cached_size))
+	{
+		return NGX_DECLINED;
+	}
 
-static ngx_int_t
-ngx_http_vod_dump_request_to_fallback(ngx_http_request_t *r)
-{
-	ngx_http_vod_loc_conf_t* conf;
-	ngx_child_request_params_t child_params;
+	prefetch = ngx_pcalloc(r->pool, sizeof(*prefetch));
+	if (prefetch == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_segment_prefetch_remote: ngx_pcalloc failed");
+		return NGX_ERROR;
+	}
 
-	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+	prefetch->ctx = ctx;
+	prefetch->state = state;
+	prefetch->block_start = block_start;
 
-	if (conf->fallback_upstream_location.len == 0)
+	prefetch->pending = ngx_http_vod_pending_create(r->pool, &segment_prefetch_pending);
+	if (prefetch->pending == NULL)
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_dump_request_to_fallback: no fallback configured");
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_segment_prefetch_remote: ngx_http_vod_pending_create failed");
 		return NGX_ERROR;
 	}
 
-	if (ngx_http_vod_header_exists(r, &conf->proxy_header.key))
+	prefetch->buffer.start = ngx_palloc(r->pool, range_size + ctx->alloc_params[READER_HTTP].extra_size);
+	if (prefetch->buffer.start == NULL)
 	{
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-			"ngx_http_vod_dump_request_to_fallback: proxy header exists");
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_segment_prefetch_remote: ngx_palloc failed");
 		return NGX_ERROR;
 	}
 
-	// dump the request to the fallback upstream
+	prefetch->buffer.pos = prefetch->buffer.start;
+	prefetch->buffer.last = prefetch->buffer.start;
+	prefetch->buffer.end = prefetch->buffer.start + range_size + ctx->alloc_params[READER_HTTP].extra_size;
+	prefetch->buffer.temporary = 1;
+
 	ngx_memzero(&child_params, sizeof(child_params));
-	child_params.method = r->method;
-	child_params.base_uri = r->uri;
-	child_params.extra_args = r->args;
-	child_params.extra_header = conf->proxy_header;
-	child_params.proxy_range = 1;
-	child_params.proxy_all_headers = 1;
+	child_params.method = NGX_HTTP_GET;
+	child_params.base_uri = state->cur_remote_suburi;
+	child_params.extra_args = ctx->upstream_extra_args;
+	child_params.range_start = block_start;
+	child_params.range_end = block_start + range_size;
+	child_params.response_info = &prefetch->response_info;
 
-	return ngx_child_request_start(
+	rc = ngx_child_request_start_background(
 		r,
-		NULL,
-		NULL,
-		&conf->fallback_upstream_location,
+		ngx_http_vod_segment_prefetch_completed,
+		prefetch,
+		&conf->upstream_location,
 		&child_params,
-		NULL);
+		&prefetch->buffer);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_segment_prefetch_remote: ngx_child_request_start_background failed %i", rc);
+		ngx_pfree(r->pool, prefetch->buffer.start);
+		return rc;
+	}
+
+	ngx_http_vod_pending_start(prefetch->pending);
+
+	return NGX_OK;
 }
 
-#if (NGX_THREADS)
-static void
-ngx_http_vod_file_open_completed_internal(void* context, ngx_int_t rc, ngx_flag_t fallback)
+// Note: returns the file ranges of the frames of the next segment, one range per track, tracks whose
+//		ranges overlap (e.g. interleaved audio / video) are merged to a single range
+static ngx_uint_t
+ngx_http_vod_get_next_segment_ranges(media_clip_source_t* source, ngx_http_vod_prefetched_range_t* ranges)
 {
-	ngx_http_vod_ctx_t *ctx = (ngx_http_vod_ctx_t *)context;
+	ngx_http_vod_prefetched_range_t* cur_range;
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	ngx_uint_t count = 0;
+	ngx_uint_t i;
+	uint64_t start;
+	uint64_t end;
 
-	if (rc != NGX_OK)
+	for (cur_track = source->next_track_array.first_track; cur_track < source->next_track_array.last_track; cur_track++)
 	{
-		if (fallback && rc == NGX_HTTP_NOT_FOUND)
+		start = (uint64_t)-1;
+		end = 0;
+
+		for (part = &cur_track->frames; part != NULL; part = part->next)
 		{
-			// try the fallback
-			rc = ngx_http_vod_dump_request_to_fallback(ctx->submodule_context.r);
-			if (rc != NGX_AGAIN)
+			ngx_http_vod_get_frames_range(part, &start, &end);
+		}
+
+		if (start >= end)
+		{
+			continue;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			cur_range = &ranges[i];
+			if (start <= cur_range->end_offset && end >= cur_range->start_offset)
 			{
-				rc = NGX_HTTP_NOT_FOUND;
+				cur_range->start_offset = ngx_min(cur_range->start_offset, start);
+				cur_range->end_offset = ngx_max(cur_range->end_offset, end);
+				break;
 			}
-			goto finalize_request;
 		}
 
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.r->connection->log, 0,
-			"ngx_http_vod_file_open_completed_internal: read failed %i", rc);
-		goto finalize_request;
-	}
-
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_ASYNC_OPEN_FILE);
+		if (i < count || count >= SEGMENT_PREFETCH_MAX_RANGES)
+		{
+			continue;
+		}
 
-	// run the state machine
-	rc = ctx->state_machine(ctx);
-	if (rc == NGX_AGAIN)
-	{
-		return;
+		ranges[count].start_offset = start;
+		ranges[count].end_offset = end;
+		count++;
 	}
 
-finalize_request:
-
-	ngx_http_vod_finalize_request(ctx, rc);
-}
-
-static void
-ngx_http_vod_file_open_completed(void* context, ngx_int_t rc)
-{
-	ngx_http_vod_file_open_completed_internal(context, rc, 0);
+	return count;
 }
 
+// Note: the ranges of the next segment are taken from its frames, which are parsed along with the frames 
+//		of the current segment, using the segmenter (see ngx_http_vod_parse_next_segment_frames). nothing is
+//		prefetched when the current segment is the last segment of the clip
 static void
-ngx_http_vod_file_open_completed_with_fallback(void* context, ngx_int_t rc)
-{
-	ngx_http_vod_file_open_completed_internal(context, rc, 1);
-}
-#endif // NGX_THREADS
-
-static ngx_int_t
-ngx_http_vod_init_file_reader_internal(ngx_http_request_t *r, ngx_str_t* path, void** context, ngx_flag_t fallback)
+ngx_http_vod_segment_prefetch(ngx_http_vod_ctx_t *ctx)
 {
-	ngx_file_reader_state_t* state;
-	ngx_http_core_loc_conf_t *clcf;
-	ngx_http_vod_ctx_t *ctx;
+	ngx_http_vod_prefetched_range_t next_ranges[SEGMENT_PREFETCH_MAX_RANGES];
+	ngx_http_vod_prefetched_range_t* range;
+	ngx_http_vod_loc_conf_t *conf = ctx->submodule_context.conf;
+	media_clip_source_t* cur_source;
+	ngx_uint_t range_count;
+	ngx_uint_t i;
+	uint64_t start_offset;
+	uint64_t end_offset;
+	uint64_t prefetch_start;
+	uint64_t prefetch_end;
 	ngx_int_t rc;
+	size_t remaining;
+	size_t size;
 
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
-
-	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-
-	state = ngx_pcalloc(r->pool, sizeof(*state));
-	if (state == NULL)
+	if (!conf->segment_prefetch || ctx->speculative)
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_init_file_reader_internal: ngx_pcalloc failed");
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		return;
 	}
 
-	*context = state;
+	for (cur_source = ctx->submodule_context.media_set.sources_head; cur_source != NULL; cur_source = cur_source->next)
+	{
+		if (cur_source->reader_context == NULL ||
+			!ngx_http_vod_get_source_range(cur_source, &start_offset, &end_offset))
+		{
+			continue;
+		}
 
-	ngx_perf_counter_start(ctx->perf_counter_context);
+		// check whether the current segment was prefetched
+		range = ngx_http_vod_get_prefetched_range(cur_source->file_key);
+		if (ngx_memcmp(range->file_key, cur_source->file_key, sizeof(range->file_key)) == 0)
+		{
+			ngx_perf_counter_add(ctx->perf_counters, 
+				start_offset >= range->start_offset && start_offset < range->end_offset ? 
+				PC_SEGMENT_PREFETCH_HIT : PC_SEGMENT_PREFETCH_MISS, 1);
+		}
 
-#if (NGX_THREADS)
-	if (ctx->submodule_context.conf->open_file_thread_pool != NULL)
-	{
-		rc = ngx_file_reader_init_async(
-			state,
-			&ctx->async_open_context,
-			ctx->submodule_context.conf->open_file_thread_pool,
-			fallback ? ngx_http_vod_file_open_completed_with_fallback : ngx_http_vod_file_open_completed,
-			ngx_http_vod_handle_read_completed,
-			ctx,
-			r,
-			clcf,
-			path);
-	}
-	else
-	{
-#endif
-		rc = ngx_file_reader_init(
-			state,
-			ngx_http_vod_handle_read_completed,
-			ctx,
-			r,
-			clcf,
-			path);
-#if (NGX_THREADS)
-	}
-#endif
-	if (rc != NGX_OK)
-	{
-		if (fallback && rc == NGX_HTTP_NOT_FOUND)
+		range_count = ngx_http_vod_get_next_segment_ranges(cur_source, next_ranges);
+
+		prefetch_start = (uint64_t)-1;
+		prefetch_end = 0;
+		remaining = conf->segment_prefetch_max_size;
+
+		for (i = 0; i < range_count && remaining > 0; i++)
 		{
-			// try the fallback
-			rc = ngx_http_vod_dump_request_to_fallback(r);
-			if (rc != NGX_AGAIN)
+			start_offset = next_ranges[i].start_offset;
+			size = ngx_min(next_ranges[i].end_offset - start_offset, remaining);
+
+			if (ctx->async_read == (ngx_http_vod_async_read_func_t)ngx_async_file_read)
 			{
-				return NGX_HTTP_NOT_FOUND;
+				rc = ngx_file_reader_prefetch(cur_source->reader_context, start_offset, size);
 			}
-			return rc;
+			else if (ctx->async_read == (ngx_http_vod_async_read_func_t)ngx_http_vod_async_http_block_read)
+			{
+				rc = ngx_http_vod_segment_prefetch_remote(ctx, cur_source->reader_context, start_offset, size);
+			}
+			else
+			{
+				return;
+			}
+
+			if (rc != NGX_OK)
+			{
+				continue;
+			}
+
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_segment_prefetch: prefetching offset %uL size %uz", start_offset, size);
+
+			remaining -= size;
+			prefetch_start = ngx_min(prefetch_start, start_offset);
+			prefetch_end = ngx_max(prefetch_end, start_offset + size);
 		}
 
-		if (rc != NGX_AGAIN)
+		if (prefetch_start >= prefetch_end)
 		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_init_file_reader_internal: ngx_file_reader_init failed %i", rc);
+			continue;
 		}
-		return rc;
-	}
-
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_OPEN_FILE);
 
-	return NGX_OK;
+		ngx_memcpy(range->file_key, cur_source->file_key, sizeof(range->file_key));
+		range->start_offset = prefetch_start;
+		range->end_offset = prefetch_end;
+	}
 }
 
-static ngx_int_t
-ngx_http_vod_init_file_reader(ngx_http_request_t *r, ngx_str_t* path, void** context)
-{
-	return ngx_http_vod_init_file_reader_internal(r, path, context, 0);
-}
+////// Speculative segment generation
 
 static ngx_int_t
-ngx_http_vod_init_file_reader_with_fallback(ngx_http_request_t *r, ngx_str_t* path, void** context)
-{
-	return ngx_http_vod_init_file_reader_internal(r, path, context, 1);
-}
-
-// Note: this function initializes r->exten in order to have nginx select the correct mime type for the request
-//		the code was copied from nginx's ngx_http_set_exten
-static void
-ngx_http_vod_set_request_extension(ngx_http_request_t *r, ngx_str_t* path)
+ngx_http_vod_speculative_segment_finished(ngx_http_request_t *r, void *data, ngx_int_t rc)
 {
-	ngx_int_t  i;
+	// make sure we are not called twice for the same request
+	r->post_subrequest = NULL;
 
-	ngx_str_null(&r->exten);
-
-	for (i = path->len - 1; i > 1; i--) {
-		if (path->data[i] == '.' && path->data[i - 1] != '/') {
+	ngx_http_vod_pending_release(data);
 
-			r->exten.len = path->len - i - 1;
-			r->exten.data = &path->data[i + 1];
-
-			return;
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_speculative_segment_finished: completed, rc %i", rc);
 
-		}
-		else if (path->data[i] == '/') {
-			return;
-		}
+	// Note: an error would terminate the main request, the failure of a speculative segment must not affect it
+	if (rc == NGX_ERROR)
+	{
+		return NGX_OK;
 	}
 
-	return;
+	return rc;
 }
 
-static ngx_int_t
-ngx_http_vod_dump_file(ngx_http_vod_ctx_t* ctx)
+// Note: generates the next segment using a background subrequest to the uri of the next segment, 
+//		the subrequest saves the segment to the cache without sending it
+static void
+ngx_http_vod_speculate_next_segment(ngx_http_vod_ctx_t *ctx)
 {
+#if defined(NGX_HTTP_SUBREQUEST_BACKGROUND)
+	ngx_http_post_subrequest_t* psr;
+	ngx_http_vod_loc_conf_t *conf = ctx->submodule_context.conf;
+	ngx_http_vod_pending_t* pending;
 	ngx_http_request_t* r = ctx->submodule_context.r;
-	ngx_file_reader_state_t* state = ctx->cur_source->reader_context;
-	ngx_int_t                  rc;
+	ngx_http_request_t* sr;
+	ngx_str_t* index_str = &ctx->submodule_context.request_params.segment_index_str;
+	ngx_atomic_t* speculative_pending;
+	ngx_uint_t active_connections;
+	ngx_str_t uri;
+	ngx_int_t segment_index;
+	ngx_int_t rc;
+	u_char* uri_end = r->uri.data + r->uri.len;
+	u_char* p;
 
-	ngx_http_vod_set_request_extension(r, &state->file.name);
+	if (!conf->speculative_segments ||
+		ctx->speculative ||
+		conf->segment_cache == NULL ||
+		conf->request_handler != ngx_http_vod_local_request_handler ||
+		!ngx_http_vod_segment_shareable(conf) ||
+		index_str->len == 0 ||
+		index_str->data < r->uri.data ||
+		index_str->data + index_str->len > uri_end)
+	{
+		return;
+	}
 
-	rc = ngx_http_set_content_type(r);
-	if (rc != NGX_OK)
+	// never delay real requests
+	// Note: the pending count is kept in the shared memory of the segment cache, so that the limit applies
+	//		to all the workers. it is not decremented for requests of a worker that crashed, until the zone is recreated
+	speculative_pending = ngx_buffer_cache_get_pending(conf->segment_cache);
+	if (*speculative_pending >= conf->speculative_segments_max_pending)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0,
-			"ngx_http_vod_dump_file: ngx_http_set_content_type failed %i", rc);
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_speculate_next_segment: %uA requests are pending, skipping", *speculative_pending);
+		return;
 	}
 
-	// send the response header
-	rc = ngx_http_vod_send_header(r, state->file_size, NULL, CACHE_TYPE_VOD);
-	if (rc != NGX_OK)
+#if (NGX_STAT_STUB)
+	// the active connections of all the workers
+	active_connections = *ngx_stat_active;
+#else
+	active_connections = ngx_cycle->connection_n - ngx_cycle->free_connection_n;
+#endif // NGX_STAT_STUB
+	if (active_connections > conf->speculative_segments_max_connections)
 	{
-		return rc;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_speculate_next_segment: %ui connections are active, skipping", active_connections);
+		return;
 	}
 
-	if (r->header_only || r->method == NGX_HTTP_HEAD)
+	segment_index = ngx_atoi(index_str->data, index_str->len);
+	if (segment_index == NGX_ERROR)
 	{
-		return NGX_OK;
+		return;
 	}
 
-	ngx_file_reader_enable_directio(state);		// ignore errors
+	// build the uri of the next segment
+	uri.data = ngx_pnalloc(r->pool, r->uri.len + NGX_INT_T_LEN);
+	if (uri.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_speculate_next_segment: ngx_pnalloc failed");
+		return;
+	}
 
-	return ngx_file_reader_dump_file_part(state, 0, 0);
-}
+	p = ngx_copy(uri.data, r->uri.data, index_str->data - r->uri.data);
+	p = ngx_sprintf(p, "%i", segment_index + 1);
+	p = ngx_copy(p, index_str->data + index_str->len, uri_end - (index_str->data + index_str->len));
+	uri.len = p - uri.data;
 
-////// Remote & mapped modes
+	psr = ngx_palloc(r->pool, sizeof(*psr));
+	if (psr == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_speculate_next_segment: ngx_palloc failed");
+		return;
+	}
 
-static ngx_int_t
-ngx_http_vod_async_http_read(ngx_http_vod_http_reader_state_t *state, ngx_buf_t *buf, size_t size, off_t offset)
-{
-	ngx_http_vod_loc_conf_t *conf;
-	ngx_http_vod_ctx_t *ctx;
-	ngx_child_request_params_t child_params;
+	pending = ngx_http_vod_pending_create(r->pool, speculative_pending);
+	if (pending == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_speculate_next_segment: ngx_http_vod_pending_create failed");
+		return;
+	}
 
-	ctx = ngx_http_get_module_ctx(state->r, ngx_http_vod_module);
-	conf = ctx->submodule_context.conf;
+	psr->handler = ngx_http_vod_speculative_segment_finished;
+	psr->data = pending;
 
-	ngx_memzero(&child_params, sizeof(child_params));
-	child_params.method = NGX_HTTP_GET;
-	child_params.base_uri = state->cur_remote_suburi;
-	child_params.extra_args = ctx->upstream_extra_args;
-	child_params.range_start = offset;
-	child_params.range_end = offset + size;
+	rc = ngx_http_subrequest(r, &uri, &r->args, &sr, psr, NGX_HTTP_SUBREQUEST_BACKGROUND);
+	if (rc != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_speculate_next_segment: ngx_http_subrequest failed %i", rc);
+		return;
+	}
 
-	return ngx_child_request_start(
-		state->r,
-		ngx_http_vod_handle_read_completed,
-		ctx,
-		&conf->upstream_location,
-		&child_params,
-		buf);
+	// Note: the response of the subrequest is not sent, same as nginx's own background requests
+	sr->header_only = 1;
+
+	ngx_http_vod_pending_start(pending);
+	ngx_perf_counter_add(ctx->perf_counters, PC_SPECULATIVE_SEGMENT, 1);
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_speculate_next_segment: generating %V", &uri);
+#endif // NGX_HTTP_SUBREQUEST_BACKGROUND
 }
 
 static ngx_int_t
@@ -3311,18 +7315,11 @@ ngx_http_vod_http_reader_open_file(ngx_http_request_t* r, ngx_str_t* path, void*
 	ngx_http_vod_ctx_t *ctx;
 
 	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
-
-	// initialize the upstream variables
-	if (ctx->upstream_extra_args.len == 0 &&
-		ctx->submodule_context.conf->upstream_extra_args != NULL)
-	{
-		if (ngx_http_complex_value(
-			ctx->submodule_context.r,
-			ctx->submodule_context.conf->upstream_extra_args,
-			&ctx->upstream_extra_args) != NGX_OK)
-		{
-			return NGX_ERROR;
-		}
+
+	// initialize the upstream variables
+	if (ngx_http_vod_init_upstream_extra_args(ctx) != NGX_OK)
+	{
+		return NGX_ERROR;
 	}
 
 	state = ngx_palloc(r->pool, sizeof(*state));
@@ -3362,7 +7359,8 @@ ngx_http_vod_local_request_handler(ngx_http_request_t *r)
 	ctx->alloc_params_index = READER_FILE;
 	ctx->alignment = ctx->alloc_params[READER_FILE].alignment;
 
-	ctx->open_file = ngx_http_vod_init_file_reader_with_fallback;
+	// Note: speculative requests can't proxy the request to the fallback upstream
+	ctx->open_file = ctx->speculative ? ngx_http_vod_init_file_reader : ngx_http_vod_init_file_reader_with_fallback;
 	ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_async_file_read;
 	ctx->dump_part = (ngx_http_vod_dump_part_t)ngx_file_reader_dump_file_part;
 	ctx->dump_request = ngx_http_vod_dump_file;
@@ -3442,6 +7440,92 @@ ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 				"ngx_http_vod_map_run_step: mapping cache miss");
 		}
 
+		// try loading the mapping from the disk tier of the caches
+		for (cache_index = 0; cache_index < (int)ctx->mapping.cache_count; cache_index++)
+		{
+			cache = ctx->mapping.caches[cache_index];
+			if (cache == NULL)
+			{
+				continue;
+			}
+
+			rc = ngx_http_vod_cache_promote(ctx, cache, ctx->mapping.cache_key);
+			if (rc != NGX_DECLINED)
+			{
+				return rc;
+			}
+		}
+
+		// try getting the mapping from the peer that owns the key
+		if (ctx->mapping.peer_cache != NULL)
+		{
+			rc = ngx_http_vod_cache_peer_lookup(
+				ctx,
+				ctx->mapping.peer_cache,
+				ctx->mapping.cache_key,
+				ctx->mapping.max_response_size,
+				&mapping);
+			if (rc == NGX_OK)
+			{
+				// the peer returns the cache entry, including the null terminator
+				if (mapping.data[mapping.len - 1] != '\0')
+				{
+					ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_map_run_step: peer response is not null terminated");
+					return NGX_HTTP_BAD_GATEWAY;
+				}
+
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_map_run_step: mapping peer hit %s", mapping.data);
+
+				mapping.len--;		// remove the null
+
+				rc = ctx->mapping.apply(ctx, &mapping, &cache_index);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+
+				cache = ctx->mapping.caches[cache_index];
+				if (cache != NULL &&
+					!ngx_buffer_cache_store_perf(
+						ctx->perf_counters,
+						cache,
+						ctx->mapping.cache_key,
+						mapping.data,
+						mapping.len + 1))		// store with the null
+				{
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_map_run_step: failed to store peer response in cache");
+				}
+
+				break;
+			}
+
+			if (rc != NGX_DECLINED)
+			{
+				return rc;
+			}
+		}
+
+		// lock the key in the first cache, the waiting requests fetch from all caches
+		for (cache_index = 0; cache_index < (int)ctx->mapping.cache_count; cache_index++)
+		{
+			cache = ctx->mapping.caches[cache_index];
+			if (cache == NULL)
+			{
+				continue;
+			}
+
+			rc = ngx_http_vod_cache_lock(ctx, cache, ctx->mapping.cache_key);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+
+			break;
+		}
+
 		// open the mapping file
 		ctx->submodule_context.request_context.log->action = "getting mapping";
 
@@ -3502,85 +7586,319 @@ ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 		if (response->last >= response->end)
 		{
 			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_map_run_step: not enough room in buffer for null terminator");
-			return NGX_HTTP_BAD_GATEWAY;
+				"ngx_http_vod_map_run_step: not enough room in buffer for null terminator");
+			return NGX_HTTP_BAD_GATEWAY;
+		}
+
+		*response->last = '\0';
+
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_run_step: mapping result %s", response->pos);
+
+		mapping.data = response->pos;
+		mapping.len = response->last - response->pos;
+		rc = ctx->mapping.apply(ctx, &mapping, &cache_index);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		// save to cache
+		cache = ctx->mapping.caches[cache_index];
+		if (cache != NULL)
+		{
+			if (ngx_buffer_cache_store_perf(
+				ctx->perf_counters,
+				cache,
+				ctx->mapping.cache_key,
+				response->pos,
+				response->last + 1 - response->pos))		// store with the null
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_map_run_step: stored in mapping cache");
+			}
+			else
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_map_run_step: failed to store mapping in cache");
+			}
+		}
+
+		ngx_http_vod_cache_unlock(ctx);
+
+		ctx->state = STATE_MAP_INITIAL;
+		break;
+
+	default:
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_run_step: invalid state %d", ctx->state);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+/// map source clip
+
+static ngx_int_t
+ngx_http_vod_map_source_clip_done(ngx_http_vod_ctx_t *ctx)
+{
+	// initialize for reading files
+	ctx->alloc_params_index = READER_FILE;
+	ctx->alignment = ctx->alloc_params[READER_FILE].alignment;
+
+	ctx->open_file = ngx_http_vod_init_file_reader;
+	ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_async_file_read;
+	ctx->dump_part = (ngx_http_vod_dump_part_t)ngx_file_reader_dump_file_part;
+	ctx->dump_request = ngx_http_vod_dump_file;
+	ctx->perf_counter_async_read = PC_ASYNC_READ_FILE;
+
+	// run the main state machine
+	return ngx_http_vod_start_processing_media_file(ctx);
+}
+
+static ngx_int_t
+ngx_http_vod_map_source_clip_get_uri(ngx_http_vod_ctx_t *ctx, ngx_str_t* uri)
+{
+	if (ngx_http_complex_value(
+		ctx->submodule_context.r,
+		ctx->submodule_context.conf->source_clip_map_uri,
+		uri) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_source_clip_get_uri: ngx_http_complex_value failed");
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_map_source_clip_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, int* cache_index)
+{
+	media_clip_source_t* cur_clip = vod_container_of(ctx->cur_clip, media_clip_source_t, base);
+	vod_status_t rc;
+
+	rc = media_set_map_source(&ctx->submodule_context.request_context, mapping->data, cur_clip);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_map_source_clip_apply: media_set_map_source failed %i", rc);
+		return ngx_http_vod_status_to_ngx_error(rc);
+	}
+
+	*cache_index = 0;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_map_source_clip_finish(ngx_http_vod_ctx_t *ctx, media_clip_source_t* last_clip)
+{
+	// merge the mapped sources list with the sources list
+	last_clip->next = ctx->submodule_context.media_set.sources_head;
+	ctx->submodule_context.media_set.sources_head = ctx->submodule_context.media_set.mapped_sources_head;
+	ctx->cur_clip = NULL;
+
+	return ngx_http_vod_map_source_clip_done(ctx);
+}
+
+static ngx_int_t
+ngx_http_vod_map_source_clip_state_machine(ngx_http_vod_ctx_t *ctx)
+{
+	media_clip_source_t* cur_clip;
+	ngx_int_t rc;
+
+	// map the uris
+	for (;;)
+	{
+		rc = ngx_http_vod_map_run_step(ctx);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		cur_clip = (media_clip_source_t*)ctx->cur_clip;
+		if (cur_clip->next == NULL)
+		{
+			break;
+		}
+
+		ctx->cur_clip = &cur_clip->next->base;
+	}
+
+	return ngx_http_vod_map_source_clip_finish(ctx, cur_clip);
+}
+
+static ngx_int_t
+ngx_http_vod_map_source_clip_concurrent_state_machine(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_fanout_request_t* req;
+	media_clip_source_t* mapped_sources_head = ctx->submodule_context.media_set.mapped_sources_head;
+	media_clip_source_t* last_clip = NULL;
+	media_clip_source_t* cur_clip;
+	ngx_buffer_cache_t* cache;
+	ngx_str_t* prefix;
+	ngx_str_t uri;
+	ngx_uint_t count;
+	ngx_md5_t md5;
+	ngx_int_t rc;
+	int cache_index;
+
+	if (ctx->fanout.requests == NULL)
+	{
+		count = 0;
+		for (cur_clip = mapped_sources_head; cur_clip != NULL; cur_clip = cur_clip->next)
+		{
+			count++;
+		}
+
+		rc = ngx_http_vod_fanout_init(ctx, count);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		if (ngx_http_vod_init_upstream_extra_args(ctx) != NGX_OK)
+		{
+			return NGX_ERROR;
+		}
+
+		prefix = ctx->mapping.cache_key_prefix;
+
+		for (cur_clip = mapped_sources_head, req = ctx->fanout.requests;
+			cur_clip != NULL;
+			cur_clip = cur_clip->next, req++)
+		{
+			// get the uri
+			ctx->cur_clip = &cur_clip->base;
+
+			rc = ctx->mapping.get_uri(ctx, &uri);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+
+			// calculate the cache key
+			ngx_md5_init(&md5);
+			if (prefix != NULL)
+			{
+				ngx_md5_update(&md5, prefix->data, prefix->len);
+			}
+			ngx_md5_update(&md5, uri.data, uri.len);
+			ngx_md5_final(req->cache_key, &md5);
+
+			// try getting the mapping from cache
+			if (ngx_buffer_cache_fetch_copy_perf(
+				ctx->submodule_context.r,
+				ctx->perf_counters,
+				ctx->mapping.caches,
+				ctx->mapping.cache_count,
+				req->cache_key,
+				&req->response.data,
+				&req->response.len) >= 0)
+			{
+				req->response.len--;		// remove the null
+
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_map_source_clip_concurrent_state_machine: mapping cache hit %V", &req->response);
+				req->cache_hit = 1;
+				continue;
+			}
+
+			req->location = &ctx->submodule_context.conf->upstream_location;
+			req->max_response_size = ctx->mapping.max_response_size;
+			req->child_params.method = NGX_HTTP_GET;
+			req->child_params.base_uri = uri;
+			req->child_params.extra_args = ctx->upstream_extra_args;
+			req->child_params.range_start = 0;
+			req->child_params.range_end = ctx->mapping.max_response_size;
+		}
+
+		ctx->cur_clip = &mapped_sources_head->base;
+
+		ctx->submodule_context.request_context.log->action = "getting mapping";
+
+		ngx_perf_counter_start(ctx->perf_counter_context);
+
+		rc = ngx_http_vod_fanout_start(ctx);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+
+	if (ctx->fanout.started > 0)
+	{
+		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_MAP_PATH);
+	}
+
+	// apply the mappings in order
+	for (cur_clip = mapped_sources_head, req = ctx->fanout.requests;
+		cur_clip != NULL;
+		cur_clip = cur_clip->next, req++)
+	{
+		if (req->response.len == 0)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_map_source_clip_concurrent_state_machine: empty mapping response");
+			return NGX_HTTP_NOT_FOUND;
 		}
 
-		*response->last = '\0';
-
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_map_run_step: mapping result %s", response->pos);
+		ctx->cur_clip = &cur_clip->base;
 
-		mapping.data = response->pos;
-		mapping.len = response->last - response->pos;
-		rc = ctx->mapping.apply(ctx, &mapping, &cache_index);
+		rc = ngx_http_vod_map_source_clip_apply(ctx, &req->response, &cache_index);
 		if (rc != NGX_OK)
 		{
 			return rc;
 		}
 
+		last_clip = cur_clip;
+
+		if (req->cache_hit)
+		{
+			continue;
+		}
+
 		// save to cache
 		cache = ctx->mapping.caches[cache_index];
-		if (cache != NULL)
+		if (cache == NULL)
 		{
-			if (ngx_buffer_cache_store_perf(
-				ctx->perf_counters,
-				cache,
-				ctx->mapping.cache_key,
-				response->pos,
-				response->last + 1 - response->pos))		// store with the null
-			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_map_run_step: stored in mapping cache");
-			}
-			else
-			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-					"ngx_http_vod_map_run_step: failed to store mapping in cache");
-			}
+			continue;
 		}
 
-		ctx->state = STATE_MAP_INITIAL;
-		break;
-
-	default:
-		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_map_run_step: invalid state %d", ctx->state);
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		if (ngx_buffer_cache_store_perf(
+			ctx->perf_counters,
+			cache,
+			req->cache_key,
+			req->response.data,
+			req->response.len + 1))		// store with the null
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_map_source_clip_concurrent_state_machine: stored in mapping cache");
+		}
+		else
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_map_source_clip_concurrent_state_machine: failed to store mapping in cache");
+		}
 	}
 
-	return NGX_OK;
-}
-
-/// map source clip
-
-static ngx_int_t
-ngx_http_vod_map_source_clip_done(ngx_http_vod_ctx_t *ctx)
-{
-	// initialize for reading files
-	ctx->alloc_params_index = READER_FILE;
-	ctx->alignment = ctx->alloc_params[READER_FILE].alignment;
-
-	ctx->open_file = ngx_http_vod_init_file_reader;
-	ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_async_file_read;
-	ctx->dump_part = (ngx_http_vod_dump_part_t)ngx_file_reader_dump_file_part;
-	ctx->dump_request = ngx_http_vod_dump_file;
-	ctx->perf_counter_async_read = PC_ASYNC_READ_FILE;
+	ctx->fanout.requests = NULL;
 
-	// run the main state machine
-	return ngx_http_vod_start_processing_media_file(ctx);
+	return ngx_http_vod_map_source_clip_finish(ctx, last_clip);
 }
 
 static ngx_int_t
-ngx_http_vod_map_source_clip_get_uri(ngx_http_vod_ctx_t *ctx, ngx_str_t* uri)
+ngx_http_vod_map_source_clip_batch_get_uri(ngx_http_vod_ctx_t *ctx, ngx_str_t* uri)
 {
 	if (ngx_http_complex_value(
 		ctx->submodule_context.r,
-		ctx->submodule_context.conf->source_clip_map_uri,
+		ctx->submodule_context.conf->source_clip_map_batch_uri,
 		uri) != NGX_OK)
 	{
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_map_source_clip_get_uri: ngx_http_complex_value failed");
+			"ngx_http_vod_map_source_clip_batch_get_uri: ngx_http_complex_value failed");
 		return NGX_ERROR;
 	}
 
@@ -3588,16 +7906,18 @@ ngx_http_vod_map_source_clip_get_uri(ngx_http_vod_ctx_t *ctx, ngx_str_t* uri)
 }
 
 static ngx_int_t
-ngx_http_vod_map_source_clip_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, int* cache_index)
+ngx_http_vod_map_source_clip_batch_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, int* cache_index)
 {
-	media_clip_source_t* cur_clip = vod_container_of(ctx->cur_clip, media_clip_source_t, base);
 	vod_status_t rc;
 
-	rc = media_set_map_source(&ctx->submodule_context.request_context, mapping->data, cur_clip);
+	rc = media_set_map_sources(
+		&ctx->submodule_context.request_context, 
+		mapping->data, 
+		ctx->submodule_context.media_set.mapped_sources_head);
 	if (rc != VOD_OK)
 	{
 		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_map_source_clip_apply: media_set_map_source failed %i", rc);
+			"ngx_http_vod_map_source_clip_batch_apply: media_set_map_sources failed %i", rc);
 		return ngx_http_vod_status_to_ngx_error(rc);
 	}
 
@@ -3607,35 +7927,23 @@ ngx_http_vod_map_source_clip_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping,
 }
 
 static ngx_int_t
-ngx_http_vod_map_source_clip_state_machine(ngx_http_vod_ctx_t *ctx)
+ngx_http_vod_map_source_clip_batch_state_machine(ngx_http_vod_ctx_t *ctx)
 {
-	media_clip_source_t* cur_clip;
+	media_clip_source_t* last_clip;
 	ngx_int_t rc;
 
-	// map the uris
-	for (;;)
+	// map all the uris in a single request
+	rc = ngx_http_vod_map_run_step(ctx);
+	if (rc != NGX_OK)
 	{
-		rc = ngx_http_vod_map_run_step(ctx);
-		if (rc != NGX_OK)
-		{
-			return rc;
-		}
-
-		cur_clip = (media_clip_source_t*)ctx->cur_clip;
-		if (cur_clip->next == NULL)
-		{
-			break;
-		}
-
-		ctx->cur_clip = &cur_clip->next->base;
+		return rc;
 	}
 
-	// merge the mapped sources list with the sources list
-	cur_clip->next = ctx->submodule_context.media_set.sources_head;
-	ctx->submodule_context.media_set.sources_head = ctx->submodule_context.media_set.mapped_sources_head;
-	ctx->cur_clip = NULL;
+	for (last_clip = ctx->submodule_context.media_set.mapped_sources_head; 
+		last_clip->next != NULL; 
+		last_clip = last_clip->next);
 
-	return ngx_http_vod_map_source_clip_done(ctx);
+	return ngx_http_vod_map_source_clip_finish(ctx, last_clip);
 }
 
 static ngx_int_t
@@ -3643,7 +7951,7 @@ ngx_http_vod_map_source_clip_start(ngx_http_vod_ctx_t *ctx)
 {
 	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
 
-	if (conf->source_clip_map_uri == NULL)
+	if (conf->source_clip_map_uri == NULL && conf->source_clip_map_batch_uri == NULL)
 	{
 		vod_log_error(VOD_LOG_ERR, ctx->submodule_context.request_context.log, 0,
 			"ngx_http_vod_map_source_clip_start: media set contains mapped source clips and \"vod_source_clip_map_uri\" was not configured");
@@ -3652,13 +7960,36 @@ ngx_http_vod_map_source_clip_start(ngx_http_vod_ctx_t *ctx)
 
 	ctx->mapping.caches = conf->mapping_cache;
 	ctx->mapping.cache_count = 1;
-	ctx->mapping.get_uri = ngx_http_vod_map_source_clip_get_uri;
-	ctx->mapping.apply = ngx_http_vod_map_source_clip_apply;
+	ctx->mapping.peer_cache = &peer_caches[PEER_CACHE_MAPPING];
+
+	if (conf->source_clip_map_batch_uri != NULL)
+	{
+		ctx->mapping.get_uri = ngx_http_vod_map_source_clip_batch_get_uri;
+		ctx->mapping.apply = ngx_http_vod_map_source_clip_batch_apply;
+
+		ctx->cur_clip = NULL;
+		ctx->state_machine = ngx_http_vod_map_source_clip_batch_state_machine;
+	}
+	else if (conf->subrequest_concurrency > 1 && 
+		ctx->open_file == ngx_http_vod_http_reader_open_file)
+	{
+		// the mappings are fetched using concurrent subrequests to the upstream location
+		// Note: testing the reader and not the read function, since the remote block cache replaces the read function
+		ctx->mapping.get_uri = ngx_http_vod_map_source_clip_get_uri;
+		ctx->mapping.apply = ngx_http_vod_map_source_clip_apply;
 
-	ctx->cur_clip = &ctx->submodule_context.media_set.mapped_sources_head->base;
-	ctx->state_machine = ngx_http_vod_map_source_clip_state_machine;
+		ctx->state_machine = ngx_http_vod_map_source_clip_concurrent_state_machine;
+	}
+	else
+	{
+		ctx->mapping.get_uri = ngx_http_vod_map_source_clip_get_uri;
+		ctx->mapping.apply = ngx_http_vod_map_source_clip_apply;
+
+		ctx->cur_clip = &ctx->submodule_context.media_set.mapped_sources_head->base;
+		ctx->state_machine = ngx_http_vod_map_source_clip_state_machine;
+	}
 
-	return ngx_http_vod_map_source_clip_state_machine(ctx);
+	return ctx->state_machine(ctx);
 }
 
 /// map dynamic clip
@@ -3759,6 +8090,7 @@ ngx_http_vod_map_dynamic_clip_start(ngx_http_vod_ctx_t *ctx)
 
 	ctx->mapping.caches = &conf->dynamic_mapping_cache;
 	ctx->mapping.cache_count = 1;
+	ctx->mapping.peer_cache = &peer_caches[PEER_CACHE_DYNAMIC_MAPPING];
 	ctx->mapping.get_uri = ngx_http_vod_map_dynamic_clip_get_uri;
 	ctx->mapping.apply = ngx_http_vod_map_dynamic_clip_apply;
 
@@ -4061,6 +8393,7 @@ ngx_http_vod_mapped_request_handler(ngx_http_request_t *r)
 	ctx->mapping.cache_key_prefix = (r->headers_in.host != NULL ? &r->headers_in.host->value : NULL);
 	ctx->mapping.caches = conf->mapping_cache;
 	ctx->mapping.cache_count = CACHE_TYPE_COUNT;
+	ctx->mapping.peer_cache = &peer_caches[PEER_CACHE_MAPPING];
 	ctx->mapping.max_response_size = conf->max_mapping_response_size;
 	ctx->mapping.get_uri = ngx_http_vod_map_media_set_get_uri;
 	ctx->mapping.apply = ngx_http_vod_map_media_set_apply;
@@ -4092,7 +8425,14 @@ ngx_http_vod_remote_request_handler(ngx_http_request_t *r)
 	ctx->alignment = ctx->alloc_params[READER_HTTP].alignment;
 
 	ctx->open_file = ngx_http_vod_http_reader_open_file;
-	ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_http_vod_async_http_read;
+	if (ctx->submodule_context.conf->remote_block_cache != NULL)
+	{
+		ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_http_vod_async_http_block_read;
+	}
+	else
+	{
+		ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_http_vod_async_http_read;
+	}
 	ctx->dump_part = (ngx_http_vod_dump_part_t)ngx_http_vod_dump_http_part;
 	ctx->dump_request = ngx_http_vod_dump_http_request;
 	ctx->perf_counter_async_read = PC_ASYNC_READ_FILE;
@@ -4178,6 +8518,68 @@ ngx_http_vod_parse_uri(
 	return NGX_OK;
 }
 
+static void
+ngx_http_vod_cache_hit_write_handler(ngx_http_request_t* r)
+{
+	ngx_http_vod_ctx_t* ctx;
+	ngx_int_t rc;
+
+	rc = ngx_http_vod_flush_output(r);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
+
+	if (rc == NGX_OK)
+	{
+		// the last buffer was sent, the shared memory is no longer referenced
+		ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+		ngx_buffer_cache_unpin(ctx->cache_pin);
+	}
+
+	ngx_http_finalize_request(r, rc);
+}
+
+// Note: the response of a cache hit is sent directly from the shared memory, the entry remains pinned 
+//		until the last buffer is sent. when the response could not be sent in full, the module handles
+//		the write events of the request, in order to release the pin as soon as the sending completes
+static ngx_int_t
+ngx_http_vod_cache_hit_sent(ngx_http_vod_ctx_t* ctx)
+{
+	ngx_http_core_loc_conf_t* clcf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_event_t* wev = r->connection->write;
+
+	if (!r->buffered && !r->connection->buffered && r->postponed == NULL)
+	{
+		ngx_buffer_cache_unpin(ctx->cache_pin);
+		return NGX_OK;
+	}
+
+	if (r != r->connection->data)
+	{
+		// the output of a subrequest is flushed by its parent, the pin is released when the pool is destroyed
+		return NGX_OK;
+	}
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	if (!wev->delayed)
+	{
+		ngx_add_timer(wev, clcf->send_timeout);
+	}
+
+	if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	r->write_event_handler = ngx_http_vod_cache_hit_write_handler;
+	r->main->count++;
+
+	return NGX_DONE;
+}
+
 ngx_int_t
 ngx_http_vod_handler(ngx_http_request_t *r)
 {
@@ -4190,17 +8592,26 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 	ngx_http_core_loc_conf_t *clcf;
 	ngx_http_vod_loc_conf_t *conf;
 	u_char request_key[BUFFER_CACHE_KEY_SIZE];
+	ngx_buffer_cache_t** caches;
+	uint32_t cache_count;
 	u_char* cache_buffer;
 	size_t cache_buffer_size;
 	ngx_md5_t md5;
 	ngx_str_t content_type;
 	ngx_str_t response;
 	ngx_str_t base_url;
+	ngx_flag_t speculative;
 	ngx_int_t rc;
 	int cache_type;
 
 	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_vod_handler: started");
 
+#if defined(NGX_HTTP_SUBREQUEST_BACKGROUND)
+	speculative = r->background;
+#else
+	speculative = 0;
+#endif // NGX_HTTP_SUBREQUEST_BACKGROUND
+
 	ngx_perf_counter_start(pcctx);
 	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
 	perf_counters = ngx_perf_counter_get_state(conf->perf_counters_zone);
@@ -4281,8 +8692,48 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 		}
 	}
 
+	if (speculative && (request == NULL || request->handle_metadata_request != NULL))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_handler: background request is not a segment request, ignoring");
+		rc = NGX_OK;
+		goto done;
+	}
+
+	// initialize the context
+	ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_vod_ctx_t));
+	if (ctx == NULL) 
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_handler: ngx_pcalloc failed");
+		rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+		goto done;
+	}
+
+	ctx->speculative = speculative;
+	ctx->submodule_context.r = r;
+	ctx->submodule_context.conf = conf;
+	ctx->submodule_context.request_params = request_params;
+	ctx->submodule_context.media_set = media_set;
+	ctx->submodule_context.media_set.segmenter_conf = &conf->segmenter;
+	ctx->request = request;
+	ctx->cur_source = media_set.sources_head;
+	ctx->submodule_context.request_context.pool = r->pool;
+	ctx->submodule_context.request_context.log = r->connection->log;
+	ctx->submodule_context.request_context.output_buffer_pool = conf->output_buffer_pool;
+	ctx->perf_counters = perf_counters;
+	ngx_perf_counter_copy(ctx->total_perf_counter_context, pcctx);
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+	ctx->alloc_params[READER_FILE].alignment = clcf->directio_alignment;
+	ctx->alloc_params[READER_HTTP].alignment = 1;	// don't care about alignment in case of remote
+	ctx->alloc_params[READER_HTTP].extra_size = conf->max_upstream_headers_size + 1;	// the + 1 is discussed here: http://trac.nginx.org/nginx/ticket/680
+
+	ngx_http_set_ctx(r, ctx, ngx_http_vod_module);
+
 	if (request != NULL && 
-		request->handle_metadata_request != NULL)
+		(request->handle_metadata_request != NULL || 
+		(ngx_http_vod_segment_shareable(conf) && (conf->segment_cache != NULL || conf->segment_collapse))))
 	{
 		// calc request key from host + uri
 		ngx_md5_init(&md5);
@@ -4309,22 +8760,41 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 		ngx_md5_update(&md5, r->uri.data, r->uri.len);
 
 		ngx_md5_final(request_key, &md5);
+		ngx_memcpy(ctx->request_key, request_key, sizeof(request_key));
 
 		// try to fetch from cache
-		cache_type = ngx_buffer_cache_fetch_copy_perf(
+		if (request->handle_metadata_request != NULL)
+		{
+			caches = conf->response_cache;
+			cache_count = CACHE_TYPE_COUNT;
+		}
+		else
+		{
+			caches = &conf->segment_cache;
+			cache_count = 1;
+		}
+
+		cache_type = ngx_buffer_cache_fetch_pinned_perf(
 			r,
 			perf_counters,
-			conf->response_cache,
-			CACHE_TYPE_COUNT,
+			caches,
+			cache_count,
 			request_key,
 			&cache_buffer,
-			&cache_buffer_size);
+			&cache_buffer_size,
+			&ctx->cache_pin);
 		if (cache_type >= 0 &&
 			cache_buffer_size > sizeof(size_t))
 		{
 			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 				"ngx_http_vod_handler: response cache hit, size is %uz", cache_buffer_size);
 
+			if (speculative)
+			{
+				rc = NGX_OK;
+				goto done;
+			}
+
 			// extract the content type
 			content_type.len = *(size_t*)cache_buffer;
 			cache_buffer += sizeof(size_t);
@@ -4349,6 +8819,10 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 				}
 
 				rc = ngx_http_vod_send_response(r, &response, NULL);
+				if (rc == NGX_OK)
+				{
+					rc = ngx_http_vod_cache_hit_sent(ctx);
+				}
 				goto done;
 			}
 		}
@@ -4357,42 +8831,62 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 				"ngx_http_vod_handler: response cache miss");
 		}
+
+		// try to attach to a pending request for the same segment
+		if (conf->segment_collapse && ngx_http_vod_segment_shareable(conf) && request->handle_metadata_request == NULL)
+		{
+			if (speculative)
+			{
+				// the segment is already being generated
+				if (ngx_http_vod_collapse_get(request_key) != NULL)
+				{
+					rc = NGX_OK;
+					goto done;
+				}
+			}
+			else
+			{
+				rc = ngx_http_vod_collapse_attach(r, request_key);
+				if (rc != NGX_DECLINED)
+				{
+					if (rc == NGX_DONE)
+					{
+						ngx_perf_counter_add(perf_counters, PC_SEGMENT_COLLAPSED, 1);
+					}
+					goto done;
+				}
+			}
+		}
 	}
 
-	// initialize the context
-	ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_vod_ctx_t));
-	if (ctx == NULL) 
+	// let concurrent requests for the same segment attach to this request
+	if (conf->segment_collapse && ngx_http_vod_segment_shareable(conf) && 
+		request != NULL && request->handle_metadata_request == NULL && !speculative)
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_handler: ngx_pcalloc failed");
-		rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-		goto done;
+		rc = ngx_http_vod_collapse_start(ctx);
+		if (rc == NGX_ERROR)
+		{
+			rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+			goto done;
+		}
 	}
 
-	ngx_memcpy(ctx->request_key, request_key, sizeof(request_key));
-	ctx->submodule_context.r = r;
-	ctx->submodule_context.conf = conf;
-	ctx->submodule_context.request_params = request_params;
-	ctx->submodule_context.media_set = media_set;
-	ctx->submodule_context.media_set.segmenter_conf = &conf->segmenter;
-	ctx->request = request;
-	ctx->cur_source = media_set.sources_head;
-	ctx->submodule_context.request_context.pool = r->pool;
-	ctx->submodule_context.request_context.log = r->connection->log;
-	ctx->submodule_context.request_context.output_buffer_pool = conf->output_buffer_pool;
-	ctx->perf_counters = perf_counters;
-	ngx_perf_counter_copy(ctx->total_perf_counter_context, pcctx);
-
-	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-	ctx->alloc_params[READER_FILE].alignment = clcf->directio_alignment;
-	ctx->alloc_params[READER_HTTP].alignment = 1;	// don't care about alignment in case of remote
-	ctx->alloc_params[READER_HTTP].extra_size = conf->max_upstream_headers_size + 1;	// the + 1 is discussed here: http://trac.nginx.org/nginx/ticket/680
-
-	ngx_http_set_ctx(r, ctx, ngx_http_vod_module);
-
 	// call the mode specific handler (remote/mapped/local)
 	rc = conf->request_handler(r);
 
+	if (rc != NGX_AGAIN)
+	{
+		ngx_http_vod_collapse_finish(ctx, rc);
+	}
+
+	if (speculative && rc == NGX_AGAIN)
+	{
+		// Note: background subrequests are finalized by the first ngx_http_finalize_request call,
+		//		increment the count and return done, the request is finalized when the processing completes
+		r->main->count++;
+		rc = NGX_DONE;
+	}
+
 done:
 
 	if (rc != NGX_AGAIN)
@@ -154,6 +154,11 @@ ngx_http_vod_mss_init_frame_processor(
 			return ngx_http_vod_status_to_ngx_error(rc);
 		}
 
+		if (!conf->drm_enabled && segment_writer->write_file_range != NULL)
+		{
+			mp4_builder_frame_writer_enable_file_ranges(state, segment_writer->write_file_range);
+		}
+
 		*frame_processor = (ngx_http_vod_frame_processor_t)mp4_builder_frame_writer_process;
 		*frame_processor_state = state;
 	}
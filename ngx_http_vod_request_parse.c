@@ -245,6 +245,7 @@ ngx_http_vod_parse_uri_file_name(
 			start_pos++;		// skip the -
 		}
 
+		result->segment_index_str.data = start_pos;
 		start_pos = parse_utils_extract_uint32_token(start_pos, end_pos, &result->segment_index);
 		if (result->segment_index <= 0)
 		{
@@ -252,6 +253,7 @@ ngx_http_vod_parse_uri_file_name(
 				"ngx_http_vod_parse_uri_file_name: failed to parse segment index");
 			return NGX_HTTP_BAD_REQUEST;
 		}
+		result->segment_index_str.len = start_pos - result->segment_index_str.data;
 		result->segment_index--;		// convert to 0-based
 	}
 
@@ -50,8 +50,21 @@ static ngx_http_vod_stat_def_t buffer_cache_stat_defs[] = {
 	DEFINE_STAT(evicted),
 	DEFINE_STAT(evicted_bytes),
 	DEFINE_STAT(reset),
+	DEFINE_STAT(lock_ok),
+	DEFINE_STAT(lock_wait),
+	DEFINE_STAT(lock_expired),
+	DEFINE_STAT(admit_ok),
+	DEFINE_STAT(admit_reject),
 	DEFINE_STAT(entries),
 	DEFINE_STAT(data_size),
+	DEFINE_STAT(shards),
+	DEFINE_STAT(disk_store_ok),
+	DEFINE_STAT(disk_store_bytes),
+	DEFINE_STAT(disk_store_err),
+	DEFINE_STAT(disk_fetch_hit),
+	DEFINE_STAT(disk_fetch_bytes),
+	DEFINE_STAT(disk_fetch_miss),
+	DEFINE_STAT(disk_fetch_invalid),
 	{ NULL, 0, 0 }
 };
 
@@ -61,6 +74,16 @@ static ngx_http_vod_cache_info_t cache_infos[] = {
 		ngx_string("<metadata_cache>\r\n"),
 		ngx_string("</metadata_cache>\r\n"),
 	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, frame_index_cache),
+		ngx_string("<frame_index_cache>\r\n"),
+		ngx_string("</frame_index_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, moov_location_cache),
+		ngx_string("<moov_location_cache>\r\n"),
+		ngx_string("</moov_location_cache>\r\n"),
+	},
 	{
 		offsetof(ngx_http_vod_loc_conf_t, response_cache[CACHE_TYPE_VOD]),
 		ngx_string("<response_cache>\r\n"),
@@ -71,6 +94,16 @@ static ngx_http_vod_cache_info_t cache_infos[] = {
 		ngx_string("<live_response_cache>\r\n"),
 		ngx_string("</live_response_cache>\r\n"),
 	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, segment_cache),
+		ngx_string("<segment_cache>\r\n"),
+		ngx_string("</segment_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, remote_block_cache),
+		ngx_string("<remote_block_cache>\r\n"),
+		ngx_string("</remote_block_cache>\r\n"),
+	},
 	{
 		offsetof(ngx_http_vod_loc_conf_t, mapping_cache[CACHE_TYPE_VOD]),
 		ngx_string("<mapping_cache>\r\n"),
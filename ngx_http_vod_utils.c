@@ -61,7 +61,7 @@ ngx_http_vod_send_response(ngx_http_request_t *r, ngx_str_t *response, ngx_str_t
 	b->last = response->data + response->len;
 	if (response->len > 0)
 	{
-		b->temporary = 1;
+		b->memory = 1;		// the response may point to shared memory (cache hit), must not be modified
 	}
 	b->last_buf = 1;  // this is the last buffer in the buffer chain
 
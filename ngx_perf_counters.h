@@ -44,15 +44,12 @@ typedef struct timeval ngx_tick_count_t;
 //		and the assignment are not performed atomically. however, the value of max is expected to
 //		converge quickly so that its updates will be performed less and less frequently, so it 
 //		should be accurate enough.
-#define ngx_perf_counter_end(state, ctx, type)						\
+#define ngx_perf_counter_add(state, type, value)					\
 	if (state != NULL)												\
 	{																\
-		ngx_tick_count_t __end;										\
 		ngx_atomic_t __delta;										\
 																	\
-		ngx_get_tick_count(&__end);									\
-																	\
-		__delta = ngx_tick_count_diff(ctx.start, __end);			\
+		__delta = value;											\
 		(void)ngx_atomic_fetch_add(&state->counters[type].sum, __delta);	\
 		(void)ngx_atomic_fetch_add(&state->counters[type].count, 1);		\
 		if (__delta > state->counters[type].max)					\
@@ -65,6 +62,16 @@ typedef struct timeval ngx_tick_count_t;
 		}															\
 	}
 
+#define ngx_perf_counter_end(state, ctx, type)						\
+	if (state != NULL)												\
+	{																\
+		ngx_tick_count_t __end;										\
+																	\
+		ngx_get_tick_count(&__end);									\
+																	\
+		ngx_perf_counter_add(state, type, ngx_tick_count_diff(ctx.start, __end));	\
+	}
+
 #define ngx_perf_counter_copy(target, source)	target = source
 
 // typedefs
@@ -87,6 +94,7 @@ typedef struct {
 #define ngx_perf_counter_context(ctx)
 #define ngx_perf_counter_start(ctx)
 #define ngx_perf_counter_end(state, ctx, type)
+#define ngx_perf_counter_add(state, type, value)
 #define ngx_perf_counter_copy(target, source)
 
 #define PC_COUNT (0)
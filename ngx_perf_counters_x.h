@@ -11,4 +11,15 @@ PC(MEDIA_PARSE,				media_parse)
 PC(BUILD_MANIFEST,			build_manifest)
 PC(INIT_FRAME_PROCESS,		init_frame_processing)
 PC(PROCESS_FRAMES,			process_frames)
+PC(SEGMENT_BYTES_READ,		segment_bytes_read)
+PC(SEGMENT_BYTES_USED,		segment_bytes_used)
+PC(HEDGE_ISSUED,			hedge_issued)
+PC(HEDGE_WON,				hedge_won)
+PC(CACHE_PEER_HIT,		cache_peer_hit)
+PC(CACHE_PEER_MISS,		cache_peer_miss)
+PC(SEGMENT_PREFETCH_HIT,	segment_prefetch_hit)
+PC(SEGMENT_PREFETCH_MISS,	segment_prefetch_miss)
+PC(SPECULATIVE_SEGMENT,		speculative_segment)
+PC(SEGMENT_COLLAPSED,		segment_collapsed)
+PC(MMAP_FRAMES,		mmap_frames)
 PC(TOTAL,					total)
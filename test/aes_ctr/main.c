@@ -0,0 +1,280 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+#include <ngx_core.h>
+#include <vod/mp4/mp4_aes_ctr.h>
+
+// constants
+#define LEGACY_COUNTER_BUFFER_SIZE (AES_BLOCK_SIZE * 64)
+#define BENCHMARK_TOTAL_SIZE (256 * 1024 * 1024)
+#define VERIFY_BUFFER_SIZE (64 * 1024)
+#define VERIFY_ITERATIONS (1000)
+
+// macros
+#define RAND(min, max) (rand() % ((max) - (min) + 1) + (min))
+
+// typedefs
+typedef struct {
+	EVP_CIPHER_CTX cipher;
+	u_char counter[LEGACY_COUNTER_BUFFER_SIZE];
+	u_char encrypted_counter[LEGACY_COUNTER_BUFFER_SIZE];
+	u_char* encrypted_pos;
+	u_char* encrypted_end;
+} legacy_aes_ctr_state_t;
+
+// globals
+volatile ngx_cycle_t  *ngx_cycle;
+ngx_pool_t *pool;
+ngx_log_t ngx_log;
+
+#if (NGX_HAVE_VARIADIC_MACROS)
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+
+#else
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, va_list args)
+
+#endif
+{
+}
+
+// the previous implementation - counter blocks built by hand, encrypted with aes ecb and xored
+static void
+legacy_aes_ctr_init(legacy_aes_ctr_state_t* state, u_char* key)
+{
+	EVP_CIPHER_CTX_init(&state->cipher);
+	EVP_EncryptInit_ex(&state->cipher, EVP_aes_128_ecb(), NULL, key, NULL);
+}
+
+static void
+legacy_aes_ctr_set_iv(legacy_aes_ctr_state_t* state, u_char* iv)
+{
+	vod_memcpy(state->counter, iv, MP4_AES_CTR_IV_SIZE);
+	vod_memzero(state->counter + MP4_AES_CTR_IV_SIZE, sizeof(state->counter) - MP4_AES_CTR_IV_SIZE);
+	state->encrypted_pos = NULL;
+	state->encrypted_end = NULL;
+}
+
+static void
+legacy_aes_ctr_process(legacy_aes_ctr_state_t* state, u_char* dest, const u_char* src, uint32_t size)
+{
+	const u_char* src_end = src + size;
+	const u_char* cur_end_pos;
+	u_char* encrypted_counter_pos;
+	u_char* cur_block;
+	u_char* next_block;
+	u_char* end_block;
+	size_t encrypted_size;
+	int out_size;
+
+	while (src < src_end)
+	{
+		if (state->encrypted_pos >= state->encrypted_end)
+		{
+			encrypted_size = aes_round_up_to_block_exact(src_end - src);
+			if (encrypted_size > sizeof(state->counter))
+			{
+				encrypted_size = sizeof(state->counter);
+			}
+
+			end_block = state->counter + encrypted_size - AES_BLOCK_SIZE;
+			for (cur_block = state->counter; cur_block < end_block; cur_block = next_block)
+			{
+				next_block = cur_block + AES_BLOCK_SIZE;
+				vod_memcpy(next_block, cur_block, AES_BLOCK_SIZE);
+				mp4_aes_ctr_increment_be64(next_block + 8);
+			}
+
+			EVP_EncryptUpdate(&state->cipher, state->encrypted_counter, &out_size, state->counter, encrypted_size);
+
+			if (encrypted_size > AES_BLOCK_SIZE)
+			{
+				vod_memcpy(state->counter, end_block, AES_BLOCK_SIZE);
+			}
+			mp4_aes_ctr_increment_be64(state->counter + 8);
+
+			state->encrypted_end = state->encrypted_counter + encrypted_size;
+
+			encrypted_counter_pos = state->encrypted_counter;
+			cur_end_pos = src + encrypted_size;
+		}
+		else
+		{
+			encrypted_counter_pos = state->encrypted_pos;
+			cur_end_pos = src + (state->encrypted_end - encrypted_counter_pos);
+		}
+
+		if (src_end < cur_end_pos)
+		{
+			cur_end_pos = src_end;
+		}
+
+		while (src < cur_end_pos)
+		{
+			*dest++ = *src++ ^ *encrypted_counter_pos++;
+		}
+
+		state->encrypted_pos = encrypted_counter_pos;
+	}
+}
+
+static void
+random_bytes(u_char* buffer, size_t size)
+{
+	u_char* end = buffer + size;
+
+	for (; buffer < end; buffer++)
+	{
+		*buffer = rand();
+	}
+}
+
+static double
+get_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// verifies that both implementations produce the same output, when the frame is processed in random chunks
+static void
+verify(request_context_t* request_context)
+{
+	static u_char src[VERIFY_BUFFER_SIZE];
+	static u_char legacy_dest[VERIFY_BUFFER_SIZE];
+	static u_char dest[VERIFY_BUFFER_SIZE];
+	legacy_aes_ctr_state_t legacy;
+	mp4_aes_ctr_state_t state;
+	u_char key[MP4_AES_CTR_KEY_SIZE];
+	u_char iv[MP4_AES_CTR_IV_SIZE];
+	uint32_t frame_size;
+	uint32_t chunk_size;
+	uint32_t offset;
+	int i;
+
+	random_bytes(key, sizeof(key));
+	legacy_aes_ctr_init(&legacy, key);
+	if (mp4_aes_ctr_init(&state, request_context, key) != VOD_OK)
+	{
+		printf("Error: mp4_aes_ctr_init failed\n");
+		return;
+	}
+
+	for (i = 0; i < VERIFY_ITERATIONS; i++)
+	{
+		random_bytes(iv, sizeof(iv));
+		frame_size = RAND(1, VERIFY_BUFFER_SIZE);
+		random_bytes(src, frame_size);
+
+		legacy_aes_ctr_set_iv(&legacy, iv);
+		legacy_aes_ctr_process(&legacy, legacy_dest, src, frame_size);
+
+		// process the frame in chunks, in place
+		mp4_aes_ctr_set_iv(&state, iv);
+		vod_memcpy(dest, src, frame_size);
+		for (offset = 0; offset < frame_size; offset += chunk_size)
+		{
+			chunk_size = RAND(1, 100) <= 50 ? RAND(1, 32) : RAND(1, 4096);
+			if (chunk_size > frame_size - offset)
+			{
+				chunk_size = frame_size - offset;
+			}
+
+			if (mp4_aes_ctr_process(&state, dest + offset, dest + offset, chunk_size) != VOD_OK)
+			{
+				printf("Error: mp4_aes_ctr_process failed\n");
+				return;
+			}
+		}
+
+		if (vod_memcmp(dest, legacy_dest, frame_size) != 0)
+		{
+			printf("Error: output mismatch, iteration=%d size=%u\n", i, frame_size);
+			return;
+		}
+	}
+
+	printf("verify: ok\n");
+}
+
+static void
+benchmark(request_context_t* request_context, uint32_t frame_size)
+{
+	legacy_aes_ctr_state_t legacy;
+	mp4_aes_ctr_state_t state;
+	u_char key[MP4_AES_CTR_KEY_SIZE];
+	u_char iv[MP4_AES_CTR_IV_SIZE];
+	u_char* buffer;
+	double legacy_time;
+	double start;
+	double time;
+	int count = BENCHMARK_TOTAL_SIZE / frame_size;
+	int i;
+
+	buffer = malloc(frame_size);
+	if (buffer == NULL)
+	{
+		return;
+	}
+
+	random_bytes(key, sizeof(key));
+	random_bytes(iv, sizeof(iv));
+	random_bytes(buffer, frame_size);
+
+	legacy_aes_ctr_init(&legacy, key);
+	start = get_time();
+	for (i = 0; i < count; i++)
+	{
+		legacy_aes_ctr_set_iv(&legacy, iv);
+		legacy_aes_ctr_process(&legacy, buffer, buffer, frame_size);
+	}
+	legacy_time = get_time() - start;
+
+	mp4_aes_ctr_init(&state, request_context, key);
+	start = get_time();
+	for (i = 0; i < count; i++)
+	{
+		mp4_aes_ctr_set_iv(&state, iv);
+		mp4_aes_ctr_process(&state, buffer, buffer, frame_size);
+	}
+	time = get_time() - start;
+
+	printf("frame size %8u: legacy %8.1f MB/s, evp ctr %8.1f MB/s\n", 
+		frame_size,
+		BENCHMARK_TOTAL_SIZE / legacy_time / (1024 * 1024),
+		BENCHMARK_TOTAL_SIZE / time / (1024 * 1024));
+
+	free(buffer);
+}
+
+int main()
+{
+	static uint32_t frame_sizes[] = { 16, 100, 1024, 16 * 1024, 256 * 1024, 0 };
+	request_context_t request_context;
+	uint32_t* cur_size;
+
+	pool = ngx_create_pool(1024 * 1024, &ngx_log);
+
+	ngx_memzero(&request_context, sizeof(request_context));
+	request_context.pool = pool;
+	request_context.log = &ngx_log;
+
+	srand(time(NULL));
+
+	verify(&request_context);
+
+	for (cur_size = frame_sizes; *cur_size != 0; cur_size++)
+	{
+		benchmark(&request_context, *cur_size);
+	}
+
+	ngx_destroy_pool(pool);
+	return 0;
+}
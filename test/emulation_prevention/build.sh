@@ -0,0 +1,14 @@
+#!/bin/bash
+
+if [ -z "$NGX_ROOT" ]; then 
+	echo "NGX_ROOT not set"
+	exit 1
+fi
+
+if [ -z "$VOD_ROOT" ]; then 
+	echo "VOD_ROOT not set"
+	exit 1
+fi
+
+# Note: add -mavx2 to CFLAGS to test the avx2 scanner, the default is sse2 on x86_64
+cc -Wall -O2 -g $CFLAGS -oeptest $VOD_ROOT/vod/hls/emulation_prevention.c $VOD_ROOT/test/emulation_prevention/main.c -I $NGX_ROOT/src/core -I $NGX_ROOT/src/event -I $NGX_ROOT/src/event/modules -I $NGX_ROOT/src/os/unix -I $NGX_ROOT/objs -I $VOD_ROOT
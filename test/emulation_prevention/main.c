@@ -0,0 +1,225 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ngx_core.h>
+#include <vod/hls/emulation_prevention.h>
+
+// constants
+#define VERIFY_BUFFER_SIZE (4096)
+#define VERIFY_ITERATIONS (100000)
+#define BENCHMARK_BUFFER_SIZE (64 * 1024)
+#define BENCHMARK_TOTAL_SIZE (1024 * 1024 * 1024)
+
+// macros
+#define RAND(min, max) (rand() % ((max) - (min) + 1) + (min))
+
+// typedefs
+typedef struct {
+	u_char* pos;
+	u_char* end;
+} output_buffer_t;
+
+// globals
+static u_char emulation_prevention_byte[] = { 0x03 };
+
+// the previous implementation - a byte by byte scan
+static vod_status_t
+legacy_write_emulation_prevention(
+	uint32_t* last_three_bytes,
+	media_filter_write_t write_callback,
+	void* write_context,
+	const u_char* buffer,
+	uint32_t size)
+{
+	const u_char* last_output_pos = buffer;
+	const u_char* buffer_end = buffer + size;
+	const u_char* cur_pos;
+	vod_status_t rc;
+
+	for (cur_pos = buffer; cur_pos < buffer_end; cur_pos++)
+	{
+		*last_three_bytes = ((*last_three_bytes << 8) | *cur_pos) & 0xffffff;
+		if (*last_three_bytes > 3)
+		{
+			continue;
+		}
+
+		*last_three_bytes = 1;
+
+		if (cur_pos > last_output_pos)
+		{
+			rc = write_callback(write_context, last_output_pos, cur_pos - last_output_pos);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			last_output_pos = cur_pos;
+		}
+
+		rc = write_callback(write_context, emulation_prevention_byte, sizeof(emulation_prevention_byte));
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	return write_callback(write_context, last_output_pos, buffer_end - last_output_pos);
+}
+
+static vod_status_t
+output_buffer_write(void* context, const u_char* buffer, uint32_t size)
+{
+	output_buffer_t* output = context;
+
+	if (output->pos + size > output->end)
+	{
+		return VOD_UNEXPECTED;
+	}
+
+	memcpy(output->pos, buffer, size);
+	output->pos += size;
+	return VOD_OK;
+}
+
+static vod_status_t
+null_write(void* context, const u_char* buffer, uint32_t size)
+{
+	return VOD_OK;
+}
+
+static void
+fill_random(u_char* buffer, size_t size, int zero_percent)
+{
+	u_char* end = buffer + size;
+	u_char* cur_pos;
+
+	for (cur_pos = buffer; cur_pos < end; cur_pos++)
+	{
+		if (RAND(1, 100) <= zero_percent)
+		{
+			*cur_pos = RAND(0, 3) == 0 ? RAND(1, 3) : 0;
+		}
+		else
+		{
+			*cur_pos = rand();
+		}
+	}
+}
+
+static int
+verify()
+{
+	static u_char input[VERIFY_BUFFER_SIZE];
+	static u_char expected[VERIFY_BUFFER_SIZE * 2];
+	static u_char actual[VERIFY_BUFFER_SIZE * 2];
+	output_buffer_t expected_output;
+	output_buffer_t actual_output;
+	uint32_t expected_state;
+	uint32_t actual_state;
+	uint32_t offset;
+	uint32_t chunk_size;
+	uint32_t size;
+	int i;
+
+	for (i = 0; i < VERIFY_ITERATIONS; i++)
+	{
+		size = RAND(0, VERIFY_BUFFER_SIZE);
+		fill_random(input, size, RAND(0, 100));
+
+		expected_output.pos = expected;
+		expected_output.end = expected + sizeof(expected);
+		expected_state = 1;
+
+		actual_output.pos = actual;
+		actual_output.end = actual + sizeof(actual);
+		actual_state = 1;
+
+		// process the input in random chunks, to test the state that is kept between calls
+		for (offset = 0; offset < size; offset += chunk_size)
+		{
+			chunk_size = RAND(1, 256);
+			if (chunk_size > size - offset)
+			{
+				chunk_size = size - offset;
+			}
+
+			if (legacy_write_emulation_prevention(&expected_state, output_buffer_write, &expected_output, input + offset, chunk_size) != VOD_OK ||
+				emulation_prevention_write(&actual_state, output_buffer_write, &actual_output, input + offset, chunk_size) != VOD_OK)
+			{
+				printf("Error: write failed, iteration %d\n", i);
+				return 0;
+			}
+		}
+
+		if (expected_output.pos - expected != actual_output.pos - actual ||
+			memcmp(expected, actual, expected_output.pos - expected) != 0)
+		{
+			printf("Error: output mismatch, iteration %d, size %u\n", i, size);
+			return 0;
+		}
+	}
+
+	printf("verify: ok\n");
+	return 1;
+}
+
+static double
+get_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+benchmark()
+{
+	static u_char input[BENCHMARK_BUFFER_SIZE];
+	uint32_t state;
+	double start;
+	double legacy_time;
+	double new_time;
+	size_t processed;
+
+	// Note: encrypted data is random, so zero pairs are rare
+	fill_random(input, sizeof(input), 0);
+
+	state = 1;
+	start = get_time();
+	for (processed = 0; processed < BENCHMARK_TOTAL_SIZE; processed += sizeof(input))
+	{
+		legacy_write_emulation_prevention(&state, null_write, NULL, input, sizeof(input));
+	}
+	legacy_time = get_time() - start;
+
+	state = 1;
+	start = get_time();
+	for (processed = 0; processed < BENCHMARK_TOTAL_SIZE; processed += sizeof(input))
+	{
+		emulation_prevention_write(&state, null_write, NULL, input, sizeof(input));
+	}
+	new_time = get_time() - start;
+
+	printf("benchmark: legacy %.1f MB/s, new %.1f MB/s\n",
+		BENCHMARK_TOTAL_SIZE / legacy_time / (1024 * 1024),
+		BENCHMARK_TOTAL_SIZE / new_time / (1024 * 1024));
+}
+
+int
+main()
+{
+	srand(time(NULL));
+
+	if (!verify())
+	{
+		return 1;
+	}
+
+	benchmark();
+
+	return 0;
+}
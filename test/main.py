@@ -30,6 +30,9 @@ KEEPALIVE_PREFIX = '/self'
 NGINX_LOCAL = NGINX_HOST + '/tlocal'
 NGINX_MAPPED = NGINX_HOST + '/tmapped'
 NGINX_REMOTE = NGINX_HOST + '/tremote'
+NGINX_HEDGED = NGINX_HOST + '/thedged'
+HEDGE_UPSTREAM_DELAY = 1        # must be larger than vod_upstream_hedge_min_delay
+NGINX_PEER_HOST = 'http://localhost:8005'       # a second instance that looks up its cache misses in NGINX_HOST
 
 DASH_PREFIX = '/dash'
 DASH_MANIFEST_FILE = '/manifest.mpd'
@@ -397,6 +400,29 @@ def serveFile(s, path, mimeType):
     except IOError:
         pass
 
+class DelayedSocket(object):
+    '''sends the first delayOffset bytes immediately, and the rest after the delay'''
+    def __init__(self, s, delay, delayOffset):
+        self.s = s
+        self.delay = delay
+        self.delayOffset = delayOffset
+
+    def send(self, msg):
+        if self.delayOffset > 0:
+            sent = self.s.send(msg[:self.delayOffset])
+            self.delayOffset -= sent
+            return sent
+        if self.delay > 0:
+            time.sleep(self.delay)
+            self.delay = 0
+        return self.s.send(msg)
+
+    def shutdown(self, how):
+        self.s.shutdown(how)
+
+def serveFileDelayed(s, path, mimeType, delay, delayOffset):
+    serveFile(DelayedSocket(s, delay, delayOffset), path, mimeType)
+
 ### TCP server
 class TcpServer(Thread):
 
@@ -1107,6 +1133,77 @@ class RemoteTestSuite(ModeTestSuite):
         assertRequestFails(self.getUrl(HLS_PREFIX, HLS_PLAYLIST_FILE), 404)
         self.logTracker.assertContains('bytes read is zero')
 
+class HedgeTestSuite(TestSuite):
+    def __init__(self, baseUrl):
+        super(HedgeTestSuite, self).__init__()
+        self.baseUrl = baseUrl
+
+    def validateHedgedResponse(self, delayOffset):
+        TcpServer(API_SERVER_PORT, lambda s: serveFileDelayed(s, TEST_FILES_ROOT + TEST_FLAVOR_FILE, TEST_FILE_TYPE, HEDGE_UPSTREAM_DELAY, delayOffset))
+        TcpServer(FALLBACK_PORT, lambda s: serveFile(s, TEST_FILES_ROOT + TEST_FLAVOR_FILE, TEST_FILE_TYPE))
+        url = getUniqueUrl(self.baseUrl + HLS_PREFIX + TEST_FLAVOR_URI, HLS_SEGMENT_FILE)
+
+        logTracker = LogTracker()
+        hedgedResponse = urllib2.urlopen(url).read()
+        logTracker.assertContains('the hedged request won')
+
+        # the primary upstream completes after the hedged request won, its response must be discarded
+        time.sleep(HEDGE_UPSTREAM_DELAY * 2)
+        logTracker.assertContains('discarding the response')
+        cleanupStack.resetAndDestroy()
+
+        # compare to a response that is not hedged
+        TcpServer(API_SERVER_PORT, lambda s: serveFile(s, TEST_FILES_ROOT + TEST_FLAVOR_FILE, TEST_FILE_TYPE))
+        assertEquals(urllib2.urlopen(url.replace(NGINX_HEDGED, NGINX_REMOTE)).read(), hedgedResponse)
+
+    def testPrimaryDelayedWhileReadingHeaders(self):
+        self.validateHedgedResponse(10)
+
+    def testPrimaryDelayedWhileReadingBody(self):
+        self.validateHedgedResponse(1024)
+
+    def testPrimaryDelayedBeforeResponse(self):
+        self.validateHedgedResponse(0)
+
+class CachePeerTestSuite(TestSuite):
+    def __init__(self, ownerBaseUrl, peerBaseUrl):
+        super(CachePeerTestSuite, self).__init__()
+        self.ownerBaseUrl = ownerBaseUrl
+        self.peerBaseUrl = peerBaseUrl
+
+    def getUrl(self, baseUrl, linkPath, request):
+        return baseUrl + HLS_PREFIX + linkPath + request
+
+    def testPeerHit(self):
+        for curRequest in [HLS_PLAYLIST_FILE, HLS_SEGMENT_FILE]:
+            linkPath = createRandomSymLink(TEST_FILES_ROOT + TEST_FLAVOR_FILE)
+
+            logTracker = LogTracker()
+            ownerResponse = urllib2.urlopen(self.getUrl(self.ownerBaseUrl, linkPath, curRequest)).read()
+            logTracker.assertContains('metadata cache miss')
+
+            # the entry is larger than the initial buffer, the body buffer is allocated according to the content length
+            logTracker = LogTracker()
+            peerResponse = urllib2.urlopen(self.getUrl(self.peerBaseUrl, linkPath, curRequest)).read()
+            logTracker.assertContains('looking up metadata in peer peer_a')
+            logTracker.assertContains('allocating a response buffer')
+            logTracker.assertContains('metadata cache hit')
+
+            assert(ownerResponse == peerResponse)
+
+            cleanupStack.resetAndDestroy()
+
+    def testPeerMiss(self):
+        linkPath = createRandomSymLink(TEST_FILES_ROOT + TEST_FLAVOR_FILE)
+
+        # the owner does not have the entry, the peer reads the file
+        logTracker = LogTracker()
+        peerResponse = urllib2.urlopen(self.getUrl(self.peerBaseUrl, linkPath, HLS_PLAYLIST_FILE)).read()
+        logTracker.assertContains('peer request failed')
+
+        ownerResponse = urllib2.urlopen(self.getUrl(self.ownerBaseUrl, linkPath, HLS_PLAYLIST_FILE)).read()
+        assert(ownerResponse == peerResponse)
+
 class DrmTestSuite(ModeTestSuite):
     def runChildSuites(self):
         requestHandler = lambda s,h: socketSendAndShutdown(s, getHttpResponse(DRM_SERVICE_RESPONSE))
@@ -1137,6 +1234,8 @@ class DrmTestSuite(ModeTestSuite):
 class MainTestSuite(TestSuite):
     def runChildSuites(self):        
         DrmTestSuite(NGINX_REMOTE).run()
+        HedgeTestSuite(NGINX_HEDGED).run()
+        CachePeerTestSuite(NGINX_HOST + '/tpeer', NGINX_PEER_HOST + '/tpeer').run()
 
         # all combinations of (encrypted, non encrypted) x (keep alive, no keep alive)
         for encryptionPrefix in [ENCRYPTED_PREFIX, '']:
@@ -0,0 +1,191 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ngx_core.h>
+#include <vod/mp4/mp4_table_decode.h>
+#include <vod/read_stream.h>
+#include <vod/write_stream.h>
+
+// constants
+#define SAMPLE_COUNT (500000)
+#define BENCHMARK_ITERATIONS (100)
+#define VERIFY_ITERATIONS (1000)
+
+// macros
+#define RAND(min, max) (rand() % ((max) - (min) + 1) + (min))
+
+// the previous implementation - the per entry loop of mp4_parser
+static vod_status_t
+legacy_parse_stsz32(input_frame_t* cur_frame, input_frame_t* last_frame, const u_char* cur_pos, uint64_t* total_size)
+{
+	uint32_t cur_size;
+
+	for (; cur_frame < last_frame; cur_frame++)
+	{
+		read_be32(cur_pos, cur_size);
+		if (cur_size > MAX_FRAME_SIZE)
+		{
+			return VOD_BAD_DATA;
+		}
+		*total_size += cur_size;
+		cur_frame->size = cur_size;
+	}
+
+	return VOD_OK;
+}
+
+// the current implementation - the simd kernel followed by the per entry loop
+static vod_status_t
+parse_stsz32(input_frame_t* cur_frame, input_frame_t* last_frame, const u_char* cur_pos, uint64_t* total_size)
+{
+	uint32_t decoded;
+
+	decoded = mp4_table_decode_stsz32(cur_frame, last_frame, cur_pos, total_size);
+	return legacy_parse_stsz32(cur_frame + decoded, last_frame, cur_pos + decoded * sizeof(uint32_t), total_size);
+}
+
+// Note: builds the entries of a synthetic stsz atom, must be freed by the caller
+static u_char*
+build_stsz_entries(uint32_t count)
+{
+	u_char* result;
+	u_char* p;
+	uint32_t i;
+
+	result = malloc(count * sizeof(uint32_t) + 1);
+	if (result == NULL)
+	{
+		printf("Error: malloc failed\n");
+		exit(1);
+	}
+
+	p = result;
+	for (i = 0; i < count; i++)
+	{
+		write_be32(p, RAND(1, 200000));
+	}
+
+	return result;
+}
+
+static int
+verify()
+{
+	static input_frame_t expected[1024];
+	static input_frame_t actual[1024];
+	uint64_t expected_total;
+	uint64_t actual_total;
+	vod_status_t expected_rc;
+	vod_status_t actual_rc;
+	uint32_t count;
+	u_char* stsz;
+	u_char* p;
+	int i;
+
+	for (i = 0; i < VERIFY_ITERATIONS; i++)
+	{
+		count = RAND(0, 1024);
+		stsz = build_stsz_entries(count);
+
+		// corrupt a size, in some of the iterations
+		if (count > 0 && RAND(0, 3) == 0)
+		{
+			p = stsz + RAND(0, count - 1) * sizeof(uint32_t);
+			write_be32(p, RAND(0, 1) ? MAX_FRAME_SIZE + 1 : 0x80000000);
+		}
+
+		memset(expected, 0, sizeof(expected));
+		memset(actual, 0, sizeof(actual));
+		expected_total = actual_total = 0;
+
+		expected_rc = legacy_parse_stsz32(expected, expected + count, stsz, &expected_total);
+		actual_rc = parse_stsz32(actual, actual + count, stsz, &actual_total);
+		if (expected_rc != actual_rc)
+		{
+			printf("Error: status mismatch, iteration %d, count %u\n", i, count);
+			return 0;
+		}
+
+		if (expected_rc == VOD_OK && 
+			(expected_total != actual_total || memcmp(expected, actual, count * sizeof(actual[0])) != 0))
+		{
+			printf("Error: output mismatch, iteration %d, count %u\n", i, count);
+			return 0;
+		}
+
+		free(stsz);
+	}
+
+	printf("verify: ok\n");
+	return 1;
+}
+
+static double
+get_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+benchmark()
+{
+	input_frame_t* frames;
+	uint64_t total_size = 0;
+	double legacy_time;
+	double new_time;
+	double start;
+	u_char* stsz;
+	int i;
+
+	stsz = build_stsz_entries(SAMPLE_COUNT);
+
+	frames = calloc(SAMPLE_COUNT, sizeof(frames[0]));
+	if (frames == NULL)
+	{
+		printf("Error: calloc failed\n");
+		exit(1);
+	}
+
+	start = get_time();
+	for (i = 0; i < BENCHMARK_ITERATIONS; i++)
+	{
+		legacy_parse_stsz32(frames, frames + SAMPLE_COUNT, stsz, &total_size);
+	}
+	legacy_time = get_time() - start;
+
+	start = get_time();
+	for (i = 0; i < BENCHMARK_ITERATIONS; i++)
+	{
+		parse_stsz32(frames, frames + SAMPLE_COUNT, stsz, &total_size);
+	}
+	new_time = get_time() - start;
+
+	printf("benchmark: %d samples, legacy %.1f usec, new %.1f usec (%" PRIu64 ")\n",
+		SAMPLE_COUNT,
+		legacy_time * 1e6 / BENCHMARK_ITERATIONS,
+		new_time * 1e6 / BENCHMARK_ITERATIONS,
+		total_size);
+
+	free(frames);
+	free(stsz);
+}
+
+int
+main()
+{
+	srand(time(NULL));
+
+	if (!verify())
+	{
+		return 1;
+	}
+
+	benchmark();
+
+	return 0;
+}
@@ -44,6 +44,7 @@ aes_cbc_encrypt_init(
 	state->callback = callback;
 	state->callback_context = callback_context;
 	state->request_context = request_context;
+	state->carry_size = 0;
 
 	EVP_CIPHER_CTX_init(&state->cipher);
 	
@@ -67,6 +68,7 @@ aes_cbc_encrypt(
 	bool_t flush)
 {
 	u_char* output;
+	size_t size;
 	int out_size;
 
 	output = vod_alloc(state->request_context->pool, aes_round_up_to_block(src->len) + AES_BLOCK_SIZE);
@@ -77,7 +79,15 @@ aes_cbc_encrypt(
 		return VOD_ALLOC_FAILED;
 	}
 
-	if (1 != EVP_EncryptUpdate(&state->cipher, output, &out_size, src->data, src->len))
+	// Note: the partial block is kept in carry (and not in the cipher) so that later writes can be encrypted in place
+	size = flush ? src->len : aes_round_down_to_block(src->len);
+	if (!flush)
+	{
+		state->carry_size = src->len - size;
+		vod_memcpy(state->carry, src->data + size, state->carry_size);
+	}
+
+	if (1 != EVP_EncryptUpdate(&state->cipher, output, &out_size, src->data, size))
 	{
 		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
 			"aes_cbc_encrypt: EVP_EncryptUpdate failed");
@@ -108,44 +118,68 @@ aes_cbc_encrypt_write(
 	u_char* buffer,
 	uint32_t size)
 {
-	u_char* encrypted_buffer;
-	size_t required_size = aes_round_up_to_block(size);
-	size_t buffer_size = required_size;
+	u_char* block;
+	uint32_t cur_size;
+	vod_status_t rc;
 	int out_size;
 
-	encrypted_buffer = buffer_pool_alloc(
-		state->request_context,
-		state->request_context->output_buffer_pool,
-		&buffer_size);
-	if (encrypted_buffer == NULL)
+	// complete the partial block of the previous write
+	if (state->carry_size > 0)
 	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
-			"aes_cbc_encrypt_write: buffer_pool_alloc failed");
-		return VOD_ALLOC_FAILED;
+		cur_size = vod_min(AES_BLOCK_SIZE - state->carry_size, size);
+		vod_memcpy(state->carry + state->carry_size, buffer, cur_size);
+		state->carry_size += cur_size;
+		buffer += cur_size;
+		size -= cur_size;
+
+		if (state->carry_size < AES_BLOCK_SIZE)
+		{
+			return VOD_OK;
+		}
+
+		block = vod_alloc(state->request_context->pool, AES_BLOCK_SIZE);
+		if (block == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+				"aes_cbc_encrypt_write: vod_alloc failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		if (1 != EVP_EncryptUpdate(&state->cipher, block, &out_size, state->carry, AES_BLOCK_SIZE))
+		{
+			vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+				"aes_cbc_encrypt_write: EVP_EncryptUpdate failed (1)");
+			return VOD_UNEXPECTED;
+		}
+
+		state->carry_size = 0;
+
+		rc = state->callback(state->callback_context, block, AES_BLOCK_SIZE);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
 	}
 
-	if (buffer_size < required_size)
+	// save the partial block at the end of the buffer
+	cur_size = aes_round_down_to_block(size);
+	state->carry_size = size - cur_size;
+	vod_memcpy(state->carry, buffer + cur_size, state->carry_size);
+
+	if (cur_size == 0)
 	{
-		// Note: this should never happen since the buffer pool size is a multiple of 16
-		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
-			"aes_cbc_encrypt_write: allocated size %uz smaller than required size %uz", 
-			buffer_size, required_size);
-		return VOD_UNEXPECTED;
+		return VOD_OK;
 	}
 
-	if (1 != EVP_EncryptUpdate(&state->cipher, encrypted_buffer, &out_size, buffer, size))
+	// encrypt the whole blocks in place
+	if (1 != EVP_EncryptUpdate(&state->cipher, buffer, &out_size, buffer, cur_size))
 	{
 		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
-			"aes_cbc_encrypt_write: EVP_EncryptUpdate failed");
+			"aes_cbc_encrypt_write: EVP_EncryptUpdate failed (2)");
 		return VOD_UNEXPECTED;
 	}
 
-	if (out_size == 0)
-	{
-		return VOD_OK;
-	}
-
-	return state->callback(state->callback_context, encrypted_buffer, out_size);
+	return state->callback(state->callback_context, buffer, cur_size);
 }
 
 vod_status_t 
@@ -153,6 +187,16 @@ aes_cbc_encrypt_flush(aes_cbc_encrypt_context_t* state)
 {
 	int last_block_len;
 
+	// Note: the carry is smaller than a block, nothing is written until the final call
+	if (1 != EVP_EncryptUpdate(&state->cipher, state->last_block, &last_block_len, state->carry, state->carry_size))
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"aes_cbc_encrypt_flush: EVP_EncryptUpdate failed");
+		return VOD_UNEXPECTED;
+	}
+
+	state->carry_size = 0;
+
 	if (1 != EVP_EncryptFinal_ex(&state->cipher, state->last_block, &last_block_len))
 	{
 		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
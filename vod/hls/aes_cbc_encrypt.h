@@ -13,6 +13,8 @@ typedef struct {
 	EVP_CIPHER_CTX cipher;
 #endif //(VOD_HAVE_OPENSSL_EVP)
 	u_char last_block[AES_BLOCK_SIZE];
+	u_char carry[AES_BLOCK_SIZE];		// the bytes of the last partial block, not encrypted yet
+	uint32_t carry_size;
 } aes_cbc_encrypt_context_t;
 
 // functions
@@ -30,6 +32,7 @@ vod_status_t aes_cbc_encrypt(
 	vod_str_t* src, 
 	bool_t flush);
 
+// Note: encrypts the buffer in place, the buffer must not be used by the caller after the call
 vod_status_t aes_cbc_encrypt_write(
 	aes_cbc_encrypt_context_t* ctx, 
 	u_char* buffer, 
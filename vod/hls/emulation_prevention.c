@@ -0,0 +1,130 @@
+#include "emulation_prevention.h"
+
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static u_char emulation_prevention_byte[] = { 0x03 };
+
+// Note: returns the position of the first pair of zero bytes, a zero on the last byte of the buffer is also
+//		returned since it may be followed by a zero on the next buffer. returns end_pos if there is no match.
+static const u_char*
+emulation_prevention_find_zero_pair(const u_char* cur_pos, const u_char* end_pos)
+{
+#if defined(__GNUC__) && defined(__AVX2__)
+	__m256i zero = _mm256_setzero_si256();
+	__m256i pairs;
+	uint32_t mask;
+
+	// Note: comparing the vector and the vector shifted by one byte, so that the loop reads one byte past the vector
+	for (; cur_pos + sizeof(__m256i) + 1 <= end_pos; cur_pos += sizeof(__m256i))
+	{
+		pairs = _mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)cur_pos), zero),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(cur_pos + 1)), zero));
+		mask = (uint32_t)_mm256_movemask_epi8(pairs);
+		if (mask != 0)
+		{
+			return cur_pos + __builtin_ctz(mask);
+		}
+	}
+#elif defined(__GNUC__) && defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	__m128i pairs;
+	uint32_t mask;
+
+	// Note: comparing the vector and the vector shifted by one byte, so that the loop reads one byte past the vector
+	for (; cur_pos + sizeof(__m128i) + 1 <= end_pos; cur_pos += sizeof(__m128i))
+	{
+		pairs = _mm_and_si128(
+			_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)cur_pos), zero),
+			_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(cur_pos + 1)), zero));
+		mask = (uint32_t)_mm_movemask_epi8(pairs);
+		if (mask != 0)
+		{
+			return cur_pos + __builtin_ctz(mask);
+		}
+	}
+#endif
+
+	for (; cur_pos + 1 < end_pos; cur_pos++)
+	{
+		if (cur_pos[0] == 0 && cur_pos[1] == 0)
+		{
+			return cur_pos;
+		}
+	}
+
+	if (cur_pos < end_pos && *cur_pos == 0)
+	{
+		return cur_pos;
+	}
+
+	return end_pos;
+}
+
+vod_status_t
+emulation_prevention_write(
+	uint32_t* last_three_bytes,
+	media_filter_write_t write_callback,
+	void* write_context,
+	const u_char* buffer,
+	uint32_t size)
+{
+	const u_char* last_output_pos = buffer;
+	const u_char* buffer_end = buffer + size;
+	const u_char* cur_pos = buffer;
+	uint32_t state = *last_three_bytes;
+	vod_status_t rc;
+
+	while (cur_pos < buffer_end)
+	{
+		if ((state & 0xff) != 0)
+		{
+			// the last byte is not zero, the bytes up to the next pair of zeros can be written as is
+			cur_pos = emulation_prevention_find_zero_pair(cur_pos, buffer_end);
+
+			// Note: the byte before cur_pos is not zero, it has the same effect as the value 1
+			state = 1;
+
+			if (cur_pos >= buffer_end)
+			{
+				break;
+			}
+		}
+
+		state = ((state << 8) | *cur_pos) & 0xffffff;
+		if (state > 3)
+		{
+			cur_pos++;
+			continue;
+		}
+
+		state = 1;
+
+		if (cur_pos > last_output_pos)
+		{
+			rc = write_callback(write_context, last_output_pos, cur_pos - last_output_pos);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			last_output_pos = cur_pos;
+		}
+
+		rc = write_callback(write_context, emulation_prevention_byte, sizeof(emulation_prevention_byte));
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		cur_pos++;
+	}
+
+	*last_three_bytes = state;
+
+	return write_callback(write_context, last_output_pos, buffer_end - last_output_pos);
+}
@@ -0,0 +1,17 @@
+#ifndef __EMULATION_PREVENTION_H__
+#define __EMULATION_PREVENTION_H__
+
+// includes
+#include "media_filter.h"
+
+// functions
+
+// Note: last_three_bytes holds the state between calls, should be initialized to 1 on the beginning of a nal unit
+vod_status_t emulation_prevention_write(
+	uint32_t* last_three_bytes,
+	media_filter_write_t write_callback,
+	void* write_context,
+	const u_char* buffer,
+	uint32_t size);
+
+#endif //__EMULATION_PREVENTION_H__
@@ -217,7 +217,6 @@ hls_muxer_init_base(
 	const media_filter_t* next_filter;
 	void* next_filter_context;
 	vod_status_t rc;
-	bool_t reuse_buffers;
 
 	*simulation_supported = hls_muxer_simulation_supported(media_set, encryption_params);
 
@@ -239,14 +238,13 @@ hls_muxer_init_base(
 			encryption_params->key,
 			encryption_params->iv);
 
+		// Note: the queue buffers are encrypted in place and passed on, so they can't be reused
 		write_callback = (write_callback_t)aes_cbc_encrypt_write;
 		write_context = state->encrypted_write_context;
-		reuse_buffers = TRUE;		// aes_cbc_encrypt allocates new buffers
 	}
 	else
 	{
 		state->encrypted_write_context = NULL;
-		reuse_buffers = FALSE;
 	}
 
 	// init the write queue
@@ -255,7 +253,7 @@ hls_muxer_init_base(
 		request_context,
 		write_callback,
 		write_context,
-		reuse_buffers);
+		FALSE);
 
 	// init the packetizer streams and get the packet ids / stream ids
 	rc = mpegts_encoder_init_streams(
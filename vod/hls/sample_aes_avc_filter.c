@@ -4,6 +4,7 @@
 
 #include <openssl/evp.h>
 #include "aes_cbc_encrypt.h"
+#include "emulation_prevention.h"
 #include "../avc_defs.h"
 
 #define SAMPLE_AES_KEY_SIZE (16)
@@ -29,8 +30,6 @@ typedef struct
 	uint32_t last_three_bytes;
 } sample_aes_avc_filter_state_t;
 
-static u_char emulation_prevention_byte[] = { 0x03 };
-
 static void
 sample_aes_avc_cleanup(sample_aes_avc_filter_state_t* state)
 {
@@ -89,40 +88,12 @@ sample_aes_avc_write_emulation_prevention(
 	const u_char* buffer, 
 	uint32_t size)
 {
-	const u_char* last_output_pos = buffer;
-	const u_char* buffer_end = buffer + size;
-	const u_char* cur_pos;
-	vod_status_t rc;
-
-	for (cur_pos = buffer; cur_pos < buffer_end; cur_pos++)
-	{
-		state->last_three_bytes = ((state->last_three_bytes << 8) | *cur_pos) & 0xffffff;
-		if (state->last_three_bytes > 3)
-		{
-			continue;
-		}
-
-		state->last_three_bytes = 1;
-
-		if (cur_pos > last_output_pos)
-		{
-			rc = state->write_callback(state->write_context, last_output_pos, cur_pos - last_output_pos);
-			if (rc != VOD_OK)
-			{
-				return rc;
-			}
-
-			last_output_pos = cur_pos;
-		}
-
-		rc = state->write_callback(state->write_context, emulation_prevention_byte, sizeof(emulation_prevention_byte));
-		if (rc != VOD_OK)
-		{
-			return rc;
-		}
-	}
-
-	return state->write_callback(state->write_context, last_output_pos, buffer_end - last_output_pos);
+	return emulation_prevention_write(
+		&state->last_three_bytes,
+		state->write_callback,
+		state->write_context,
+		buffer,
+		size);
 }
 
 vod_status_t
@@ -45,6 +45,8 @@ frames_source_cache_start_frame(void* ctx, input_frame_t* frame, uint64_t min_of
 	state->req.end_offset = frame->offset + frame->size;
 	state->req.min_offset = min_offset;
 
+	state->read_cache_state->bytes_used += frame->size;
+
 	return VOD_OK;
 }
 
@@ -0,0 +1,86 @@
+#include "frames_source_mmap.h"
+#include "../media_format.h"
+
+// typedefs
+typedef struct {
+	request_context_t* request_context;
+	u_char* buffer;
+	uint64_t size;
+	u_char* cur_pos;
+	uint32_t cur_size;
+} frames_source_mmap_state_t;
+
+vod_status_t
+frames_source_mmap_init(
+	request_context_t* request_context,
+	u_char* buffer,
+	uint64_t size,
+	void** result)
+{
+	frames_source_mmap_state_t* state;
+
+	state = vod_alloc(request_context->pool, sizeof(*state));
+	if (state == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"frames_source_mmap_init: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	state->request_context = request_context;
+	state->buffer = buffer;
+	state->size = size;
+
+	*result = state;
+
+	return VOD_OK;
+}
+
+static void
+frames_source_mmap_set_cache_slot_id(void* ctx, int cache_slot_id)
+{
+}
+
+static vod_status_t
+frames_source_mmap_start_frame(void* ctx, input_frame_t* frame, uint64_t min_offset)
+{
+	frames_source_mmap_state_t* state = ctx;
+
+	if (frame->offset > state->size || frame->size > state->size - frame->offset)
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"frames_source_mmap_start_frame: frame end offset %uL exceeds file size %uL, probably a truncated file",
+			frame->offset + frame->size, state->size);
+		return VOD_BAD_DATA;
+	}
+
+	state->cur_pos = state->buffer + frame->offset;
+	state->cur_size = frame->size;
+
+	return VOD_OK;
+}
+
+static vod_status_t
+frames_source_mmap_read(void* ctx, u_char** buffer, uint32_t* size, bool_t* frame_done)
+{
+	frames_source_mmap_state_t* state = ctx;
+
+	*buffer = state->cur_pos;
+	*size = state->cur_size;
+	*frame_done = TRUE;
+
+	return VOD_OK;
+}
+
+static void
+frames_source_mmap_disable_buffer_reuse(void* ctx)
+{
+}
+
+// globals
+frames_source_t frames_source_mmap = {
+	frames_source_mmap_set_cache_slot_id,
+	frames_source_mmap_start_frame,
+	frames_source_mmap_read,
+	frames_source_mmap_disable_buffer_reuse,
+};
@@ -0,0 +1,19 @@
+#ifndef __FRAMES_SOURCE_MMAP_H__
+#define __FRAMES_SOURCE_MMAP_H__
+
+// includes
+#include "frames_source.h"
+
+// globals
+extern frames_source_t frames_source_mmap;
+
+// functions
+
+// Note: the buffer is a mapping of the whole source file, the frame offsets are used as offsets into it
+vod_status_t frames_source_mmap_init(
+	request_context_t* request_context,
+	u_char* buffer,
+	uint64_t size,
+	void** result);
+
+#endif //__FRAMES_SOURCE_MMAP_H__
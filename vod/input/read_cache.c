@@ -1,4 +1,5 @@
 #include "read_cache.h"
+#include "frames_source_cache.h"
 #include "../media_clip.h"
 
 #define MIN_BUFFER_COUNT (2)
@@ -11,6 +12,13 @@ read_cache_init(read_cache_state_t* state, request_context_t* request_context, s
 	state->alignment = alignment;
 	state->buffer_count = 0;
 	state->reuse_buffers = TRUE;
+	state->plan = NULL;
+	state->plan_end = NULL;
+	state->readahead_buffers = NULL;
+	state->readahead_count = 0;
+	state->readahead_next = 0;
+	state->bytes_read = 0;
+	state->bytes_used = 0;
 }
 
 vod_status_t
@@ -46,6 +54,204 @@ read_cache_allocate_buffer_slots(read_cache_state_t* state, size_t buffer_count)
 	return VOD_OK;
 }
 
+vod_status_t
+read_cache_allocate_readahead_slots(read_cache_state_t* state, size_t count)
+{
+	cache_buffer_t* buffers;
+	size_t alloc_size;
+
+	if (state->plan == NULL || count == 0)
+	{
+		return VOD_OK;
+	}
+
+	// Note: the read ahead slots are placed after the regular slots, so that the cache lookups find them
+	alloc_size = sizeof(state->buffers[0]) * (state->buffer_count + count);
+
+	buffers = vod_alloc(state->request_context->pool, alloc_size);
+	if (buffers == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"read_cache_allocate_readahead_slots: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	vod_memzero(buffers, alloc_size);
+	vod_memcpy(buffers, state->buffers, sizeof(state->buffers[0]) * state->buffer_count);
+
+	state->buffers = buffers;
+	state->buffers_end = buffers + state->buffer_count + count;
+	state->readahead_buffers = buffers + state->buffer_count;
+	state->readahead_count = count;
+
+	return VOD_OK;
+}
+static int
+read_cache_compare_ranges(const void *s1, const void *s2)
+{
+	read_cache_range_t* range1 = (read_cache_range_t*)s1;
+	read_cache_range_t* range2 = (read_cache_range_t*)s2;
+
+	if (range1->start_offset != range2->start_offset)
+	{
+		return range1->start_offset < range2->start_offset ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static uint32_t
+read_cache_get_source_frame_count(media_clip_source_t* source)
+{
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	uint32_t result = 0;
+
+	for (cur_track = source->track_array.first_track; cur_track < source->track_array.last_track; cur_track++)
+	{
+		for (part = &cur_track->frames; part != NULL; part = part->next)
+		{
+			if (part->frames_source == &frames_source_cache)
+			{
+				result += part->last_frame - part->first_frame;
+			}
+		}
+	}
+
+	return result;
+}
+
+// Note: the plan is built from the frames of all the source tracks, the frames of each source are sorted
+//		by offset and merged into ranges, as long as the gap between them is smaller than max_gap
+vod_status_t
+read_cache_plan_reads(
+	read_cache_state_t* state,
+	media_clip_source_t* sources_head,
+	size_t max_gap,
+	size_t max_read_size)
+{
+	read_cache_range_t* source_ranges;
+	read_cache_range_t* cur_range;
+	read_cache_range_t* last_range;
+	read_cache_range_t* plan_end;
+	read_cache_range_t* plan;
+	media_clip_source_t* cur_source;
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	input_frame_t* cur_frame;
+	uint32_t total_frame_count;
+	uint32_t frame_count;
+
+	total_frame_count = 0;
+	for (cur_source = sources_head; cur_source != NULL; cur_source = cur_source->next)
+	{
+		total_frame_count += read_cache_get_source_frame_count(cur_source);
+	}
+
+	if (total_frame_count == 0)
+	{
+		return VOD_OK;
+	}
+
+	plan = vod_alloc(state->request_context->pool, sizeof(plan[0]) * total_frame_count);
+	if (plan == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"read_cache_plan_reads: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	plan_end = plan;
+
+	for (cur_source = sources_head; cur_source != NULL; cur_source = cur_source->next)
+	{
+		// get the ranges of all the frames of the source
+		source_ranges = plan_end;
+		cur_range = plan_end;
+
+		for (cur_track = cur_source->track_array.first_track; cur_track < cur_source->track_array.last_track; cur_track++)
+		{
+			for (part = &cur_track->frames; part != NULL; part = part->next)
+			{
+				if (part->frames_source != &frames_source_cache)
+				{
+					continue;
+				}
+
+				for (cur_frame = part->first_frame; cur_frame < part->last_frame; cur_frame++)
+				{
+					if (cur_frame->size == 0)
+					{
+						continue;
+					}
+
+					cur_range->start_offset = cur_frame->offset;
+					cur_range->end_offset = cur_frame->offset + cur_frame->size;
+					cur_range++;
+				}
+			}
+		}
+
+		frame_count = cur_range - source_ranges;
+		if (frame_count == 0)
+		{
+			continue;
+		}
+
+		qsort(source_ranges, frame_count, sizeof(source_ranges[0]), read_cache_compare_ranges);
+
+		// merge the ranges in place
+		last_range = source_ranges;
+		last_range->source = cur_source;
+		last_range->issued = FALSE;
+
+		for (cur_range = source_ranges + 1; cur_range < source_ranges + frame_count; cur_range++)
+		{
+			if (cur_range->start_offset <= last_range->end_offset + max_gap &&
+				cur_range->end_offset <= last_range->start_offset + max_read_size)
+			{
+				if (cur_range->end_offset > last_range->end_offset)
+				{
+					last_range->end_offset = cur_range->end_offset;
+				}
+				continue;
+			}
+
+			last_range++;
+			*last_range = *cur_range;
+			last_range->source = cur_source;
+			last_range->issued = FALSE;
+		}
+
+		plan_end = last_range + 1;
+	}
+
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+		"read_cache_plan_reads: planned %uD reads for %uD frames", (uint32_t)(plan_end - plan), total_frame_count);
+
+	state->plan = plan;
+	state->plan_end = plan_end;
+
+	return VOD_OK;
+}
+
+static read_cache_range_t*
+read_cache_get_planned_range(read_cache_state_t* state, void* source, uint64_t offset)
+{
+	read_cache_range_t* cur_range;
+
+	for (cur_range = state->plan; cur_range < state->plan_end; cur_range++)
+	{
+		if (cur_range->source == source &&
+			offset >= cur_range->start_offset && offset < cur_range->end_offset)
+		{
+			return cur_range;
+		}
+	}
+
+	return NULL;
+}
+
 bool_t 
 read_cache_get_from_cache(
 	read_cache_state_t* state, 
@@ -54,6 +260,7 @@ read_cache_get_from_cache(
 	uint32_t* size)
 {
 	media_clip_source_t* source = request->source;
+	read_cache_range_t* planned_range;
 	cache_buffer_t* target_buffer;
 	cache_buffer_t* cur_buffer;
 	uint32_t read_size;
@@ -76,20 +283,42 @@ read_cache_get_from_cache(
 	alignment = state->alignment - 1;
 	target_buffer = &state->buffers[request->cache_slot_id % state->buffer_count];
 
-	// start reading from the min offset, if that would contain the whole frame
-	// Note: this condition is intended to optimize the case in which the frame order 
-	//		in the output segment is <video1><audio1> while on disk it's <audio1><video1>. 
-	//		in this case it would be better to start reading from the beginning, even 
-	//		though the first frame that is requested is the second one
-	if (request->min_offset < offset && 
-		request->end_offset < (request->min_offset & ~alignment) + state->buffer_size)
+	planned_range = read_cache_get_planned_range(state, source, offset);
+	if (planned_range != NULL)
 	{
-		offset = request->min_offset;
+		planned_range->issued = TRUE;
+
+		// read the whole planned range, skipping the frames that were already processed
+		if (request->min_offset < offset)
+		{
+			offset = request->min_offset;
+		}
+
+		if (offset < planned_range->start_offset)
+		{
+			offset = planned_range->start_offset;
+		}
+		offset &= ~alignment;
+
+		read_size = ((planned_range->end_offset + alignment) & ~alignment) - offset;
 	}
-	offset &= ~alignment;
+	else
+	{
+		// start reading from the min offset, if that would contain the whole frame
+		// Note: this condition is intended to optimize the case in which the frame order 
+		//		in the output segment is <video1><audio1> while on disk it's <audio1><video1>. 
+		//		in this case it would be better to start reading from the beginning, even 
+		//		though the first frame that is requested is the second one
+		if (request->min_offset < offset && 
+			request->end_offset < (request->min_offset & ~alignment) + state->buffer_size)
+		{
+			offset = request->min_offset;
+		}
+		offset &= ~alignment;
 
-	// calculate the read size
-	read_size = state->buffer_size;
+		// calculate the read size
+		read_size = state->buffer_size;
+	}
 
 	// don't read anything that is already in the cache
 	for (cur_buffer = state->buffers; cur_buffer < state->buffers_end; cur_buffer++)
@@ -141,6 +370,8 @@ read_cache_read_completed(read_cache_state_t* state, vod_buf_t* buf)
 {
 	cache_buffer_t* target_buffer = state->target_buffer;
 
+	state->bytes_read += buf->last - buf->pos;
+
 	// update the buffer size
 	target_buffer->buffer_start = buf->start;
 	target_buffer->buffer_pos = buf->pos;
@@ -150,3 +381,124 @@ read_cache_read_completed(read_cache_state_t* state, vod_buf_t* buf)
 	// no longer have an active request
 	state->target_buffer = NULL;
 }
+
+uint32_t
+read_cache_get_readahead_buffers(
+	read_cache_state_t* state,
+	read_cache_get_read_buffer_t* result,
+	uint32_t max_count)
+{
+	media_clip_source_t* source;
+	read_cache_range_t* cur_range;
+	cache_buffer_t* target_buffer;
+	cache_buffer_t* cur_buffer;
+	uint64_t offset;
+	uint32_t read_size;
+	uint32_t count;
+	size_t alignment;
+
+	if (max_count > state->readahead_count)
+	{
+		max_count = state->readahead_count;
+	}
+
+	alignment = state->alignment - 1;
+	count = 0;
+
+	for (cur_range = state->plan; cur_range < state->plan_end && count < max_count; cur_range++)
+	{
+		if (cur_range->issued)
+		{
+			continue;
+		}
+
+		source = cur_range->source;
+		offset = cur_range->start_offset & ~alignment;
+		read_size = ((cur_range->end_offset + alignment) & ~alignment) - offset;
+
+		// don't read anything that is already in the cache
+		for (cur_buffer = state->buffers; cur_buffer < state->buffers_end; cur_buffer++)
+		{
+			if (cur_buffer->source != source)
+			{
+				continue;
+			}
+
+			if (cur_buffer->start_offset > offset)
+			{
+				read_size = vod_min(read_size, cur_buffer->start_offset - offset);
+			}
+			else if (cur_range->start_offset < cur_buffer->end_offset)
+			{
+				read_size = 0;
+			}
+		}
+
+		// don't read past the max required offset
+		if (offset + read_size > source->last_offset)
+		{
+			read_size = ((source->last_offset + alignment) & ~alignment) - offset;
+		}
+
+		cur_range->issued = TRUE;
+
+		if (offset + read_size < cur_range->end_offset)
+		{
+			// the range is partially in the cache, leave it to the regular reads
+			continue;
+		}
+
+		// Note: the slots are used round robin, in order to keep the data of recent reads
+		target_buffer = &state->readahead_buffers[state->readahead_next];
+		state->readahead_next = (state->readahead_next + 1) % state->readahead_count;
+
+		target_buffer->source = source;
+		target_buffer->start_offset = offset;
+		target_buffer->end_offset = offset;		// the slot is empty until the read completes
+		target_buffer->buffer_size = read_size;
+
+		result->source = source;
+		result->offset = offset;
+		result->buffer = NULL;
+		result->size = read_size;
+		result++;
+		count++;
+	}
+
+	return count;
+}
+
+void
+read_cache_readahead_completed(
+	read_cache_state_t* state, 
+	read_cache_get_read_buffer_t* read_buffer, 
+	vod_buf_t* buf)
+{
+	cache_buffer_t* target_buffer;
+	cache_buffer_t* buffers_end;
+
+	// find the slot of the read
+	target_buffer = state->readahead_buffers;
+	buffers_end = target_buffer + state->readahead_count;
+	for (;; target_buffer++)
+	{
+		if (target_buffer >= buffers_end)
+		{
+			return;
+		}
+
+		if (target_buffer->source == read_buffer->source &&
+			target_buffer->start_offset == read_buffer->offset &&
+			target_buffer->end_offset == target_buffer->start_offset)
+		{
+			break;
+		}
+	}
+
+	state->bytes_read += buf->last - buf->pos;
+
+	target_buffer->buffer_start = buf->start;
+	target_buffer->buffer_pos = buf->pos;
+	target_buffer->buffer_size = buf->last - buf->pos;
+	target_buffer->end_offset = target_buffer->start_offset + target_buffer->buffer_size;
+}
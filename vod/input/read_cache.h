@@ -16,6 +16,13 @@ typedef struct {
 	uint64_t end_offset;
 } cache_buffer_t;
 
+typedef struct {
+	void* source;
+	uint64_t start_offset;
+	uint64_t end_offset;
+	bool_t issued;				// a read of the range was already issued
+} read_cache_range_t;
+
 typedef struct {
 	request_context_t* request_context;
 	cache_buffer_t* buffers;
@@ -25,6 +32,13 @@ typedef struct {
 	size_t buffer_size;
 	size_t alignment;
 	bool_t reuse_buffers;
+	read_cache_range_t* plan;		// optional, the ranges that should be read, sorted by offset per source
+	read_cache_range_t* plan_end;
+	cache_buffer_t* readahead_buffers;	// optional, slots for reading planned ranges ahead of time
+	size_t readahead_count;
+	size_t readahead_next;
+	uint64_t bytes_read;
+	uint64_t bytes_used;
 } read_cache_state_t;
 
 typedef struct {
@@ -53,6 +67,12 @@ vod_status_t read_cache_allocate_buffer_slots(
 	read_cache_state_t* state,
 	size_t buffer_count);
 
+vod_status_t read_cache_plan_reads(
+	read_cache_state_t* state,
+	struct media_clip_source_s* sources_head,
+	size_t max_gap,
+	size_t max_read_size);
+
 bool_t read_cache_get_from_cache(
 	read_cache_state_t* state, 
 	read_cache_request_t* request,
@@ -68,4 +88,22 @@ void read_cache_get_read_buffer(
 	
 void read_cache_read_completed(read_cache_state_t* state, vod_buf_t* buf);
 
+// Note: must be called after read_cache_allocate_buffer_slots, effective only when the reads are planned
+vod_status_t read_cache_allocate_readahead_slots(
+	read_cache_state_t* state,
+	size_t count);
+
+// Note: must be called after read_cache_get_from_cache returned FALSE, returns the planned ranges that were
+//		not read yet, up to max_count. the buffers of the results are always NULL, the reads must be performed
+//		into new buffers, since the data of the previous reads may still be referenced
+uint32_t read_cache_get_readahead_buffers(
+	read_cache_state_t* state,
+	read_cache_get_read_buffer_t* result,
+	uint32_t max_count);
+
+void read_cache_readahead_completed(
+	read_cache_state_t* state, 
+	read_cache_get_read_buffer_t* read_buffer, 
+	vod_buf_t* buf);
+
 #endif // __READ_CACHE_H__
@@ -52,6 +52,7 @@ struct media_clip_source_s {
 	void* reader_context;
 	media_range_t* range;
 	media_track_array_t track_array;
+	media_track_array_t next_track_array;		// the frames of the following segment, used for prefetching
 	struct media_sequence_s* sequence;
 	media_clip_source_t* next;
 	uint64_t last_offset;
@@ -84,6 +84,8 @@ enum {			// mp4 only
 };
 
 // parse params
+struct media_frame_index_cache_s;
+
 typedef struct {
 	uint64_t start;			// relative to clip_from
 	uint64_t end;			// relative to clip_from
@@ -101,6 +103,7 @@ typedef struct {
 	size_t max_frames_size;
 	int parse_type;
 	int codecs_mask;
+	struct media_frame_index_cache_s* frame_index_cache;
 } media_parse_params_t;
 
 // typedefs
@@ -158,6 +161,31 @@ typedef struct {
 	void* drm_info;
 } file_info_t;
 
+typedef struct media_frame_index_cache_s {
+	void* context;
+
+	bool_t(*get)(
+		void* context, 
+		file_info_t* file_info, 
+		uint32_t media_type, 
+		uint32_t track_index, 
+		vod_str_t* result);
+
+	void(*store)(
+		void* context, 
+		file_info_t* file_info, 
+		uint32_t media_type, 
+		uint32_t track_index, 
+		vod_str_t* buffer);
+
+	bool_t(*can_store)(
+		void* context, 
+		file_info_t* file_info, 
+		uint32_t media_type, 
+		uint32_t track_index, 
+		size_t size);
+} media_frame_index_cache_t;
+
 struct input_frame_s {
 	uint64_t offset;
 	uint32_t size;
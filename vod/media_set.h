@@ -108,6 +108,7 @@ typedef struct {
 typedef struct {
 	uint64_t segment_time;		// used in mss
 	uint32_t segment_index;
+	vod_str_t segment_index_str;	// the segment index as it appears in the request uri
 	uint32_t clip_index;
 	uint32_t sequences_mask;
 	vod_str_t sequence_id;
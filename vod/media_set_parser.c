@@ -362,15 +362,52 @@ media_set_parse_clips_array(
 	return VOD_OK;
 }
 
+static vod_status_t
+media_set_map_source_object(
+	request_context_t* request_context,
+	vod_json_object_t* object,
+	media_clip_source_t* source)
+{
+	media_filter_parse_context_t context;
+	uint32_t duration = source->clip_to - source->clip_from;
+	vod_status_t rc;
+
+	context.request_context = request_context;
+
+	source->mapped_uri.len = (size_t)-1;
+
+	rc = vod_json_parse_object_values(object, &media_clip_source_hash, &context, source);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	switch (source->mapped_uri.len)
+	{
+	case (size_t)-1:
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"media_set_map_source_object: missing path in source object");
+		return VOD_BAD_MAPPING;
+
+	case 0:
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"media_set_map_source_object: empty path in source object");
+		return VOD_NOT_FOUND;
+	}
+
+	source->clip_to = source->clip_from + duration;
+	source->stripped_uri = source->mapped_uri;
+
+	return VOD_OK;
+}
+
 vod_status_t
 media_set_map_source(
 	request_context_t* request_context,
 	u_char* string,
 	media_clip_source_t* source)
 {
-	media_filter_parse_context_t context;
 	vod_json_value_t json;
-	uint32_t duration = source->clip_to - source->clip_from;
 	u_char error[128];
 	vod_status_t rc;
 
@@ -389,31 +426,71 @@ media_set_map_source(
 		return VOD_BAD_MAPPING;
 	}
 
-	context.request_context = request_context;
+	return media_set_map_source_object(request_context, &json.v.obj, source);
+}
 
-	source->mapped_uri.len = (size_t)-1;
+vod_status_t
+media_set_map_sources(
+	request_context_t* request_context,
+	u_char* string,
+	media_clip_source_t* sources_head)
+{
+	media_clip_source_t* cur_source;
+	vod_array_part_t* part;
+	vod_json_object_t* cur_object;
+	vod_json_value_t json;
+	u_char error[128];
+	vod_status_t rc;
 
-	rc = vod_json_parse_object_values(&json.v.obj, &media_clip_source_hash, &context, source);
-	if (rc != VOD_OK)
+	rc = vod_json_parse(request_context->pool, string, &json, error, sizeof(error));
+	if (rc != VOD_JSON_OK)
 	{
-		return rc;
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"media_set_map_sources: failed to parse json %i: %s", rc, error);
+		return VOD_BAD_MAPPING;
 	}
 
-	switch (source->mapped_uri.len)
+	if (json.type != VOD_JSON_ARRAY)
 	{
-	case (size_t)-1:
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"media_set_map_source: missing path in source object");
+			"media_set_map_sources: invalid root element type %d expected array", json.type);
 		return VOD_BAD_MAPPING;
+	}
 
-	case 0:
+	if (json.v.arr.count > 0 && json.v.arr.type != VOD_JSON_OBJECT)
+	{
 		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
-			"media_set_map_source: empty path in source object");
-		return VOD_NOT_FOUND;
+			"media_set_map_sources: invalid source type %d expected object", json.v.arr.type);
+		return VOD_BAD_MAPPING;
 	}
 
-	source->clip_to = source->clip_from + duration;
-	source->stripped_uri = source->mapped_uri;
+	// the array elements are matched to the sources by their order
+	part = &json.v.arr.part;
+	cur_object = part->first;
+
+	for (cur_source = sources_head; cur_source != NULL; cur_source = cur_source->next)
+	{
+		if ((void*)cur_object >= part->last)
+		{
+			if (part->next == NULL)
+			{
+				vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+					"media_set_map_sources: source count %uz is smaller than the number of clips", json.v.arr.count);
+				return VOD_BAD_MAPPING;
+			}
+
+			part = part->next;
+			cur_object = part->first;
+		}
+
+		rc = media_set_map_source_object(request_context, cur_object, cur_source);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		cur_object++;
+	}
 
 	return VOD_OK;
 }
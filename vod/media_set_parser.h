@@ -35,6 +35,11 @@ vod_status_t media_set_map_source(
 	u_char* string,
 	media_clip_source_t* source);
 
+vod_status_t media_set_map_sources(
+	request_context_t* request_context,
+	u_char* string,
+	media_clip_source_t* sources_head);
+
 // filter utility functions
 vod_status_t media_set_parse_null_term_string(
 	void* ctx, 
@@ -6,7 +6,6 @@
 
 #define MP4_AES_CTR_KEY_SIZE (16)
 #define MP4_AES_CTR_IV_SIZE (8)
-#define MP4_AES_CTR_COUNTER_BUFFER_SIZE (AES_BLOCK_SIZE * 64)
 
 // typedefs
 typedef struct {
@@ -14,10 +13,6 @@ typedef struct {
 #if (VOD_HAVE_OPENSSL_EVP)
 	EVP_CIPHER_CTX cipher;
 #endif //(VOD_HAVE_OPENSSL_EVP)
-	u_char counter[MP4_AES_CTR_COUNTER_BUFFER_SIZE];
-	u_char encrypted_counter[MP4_AES_CTR_COUNTER_BUFFER_SIZE];
-	u_char* encrypted_pos;
-	u_char* encrypted_end;
 } mp4_aes_ctr_state_t;
 
 // functions
@@ -30,6 +25,8 @@ void mp4_aes_ctr_set_iv(
 	mp4_aes_ctr_state_t* state,
 	u_char* iv);
 
+// Note: the key stream continues from the position where the previous call ended (until the iv is set),
+//		dest may be equal to src for processing the buffer in place
 vod_status_t mp4_aes_ctr_process(
 	mp4_aes_ctr_state_t* state,
 	u_char* dest,
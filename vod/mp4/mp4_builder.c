@@ -1,5 +1,6 @@
 #include "mp4_builder.h"
 #include "mp4_defs.h"
+#include "../input/frames_source_cache.h"
 
 u_char*
 mp4_builder_write_mfhd_atom(u_char* p, uint32_t segment_index)
@@ -170,6 +171,7 @@ mp4_builder_frame_writer_init(
 
 	state->request_context = request_context;
 	state->write_callback = write_callback;
+	state->write_file_range = NULL;
 	state->write_context = write_context;
 	state->reuse_buffers = reuse_buffers;
 	state->frame_started = FALSE;
@@ -207,6 +209,80 @@ mp4_builder_move_to_next_frame(fragment_writer_state_t* state)
 	return TRUE;
 }
 
+// Note: file ranges can be used only when all the frames are read from the source files as is,
+//		e.g. not when the frames are decrypted or generated by an audio filter
+bool_t
+mp4_builder_frame_writer_enable_file_ranges(
+	fragment_writer_state_t* state,
+	write_file_range_callback_t write_file_range)
+{
+	media_clip_filtered_t* cur_clip;
+	frame_list_part_t* part;
+
+	for (cur_clip = state->sequence->filtered_clips; cur_clip < state->sequence->filtered_clips_end; cur_clip++)
+	{
+		for (part = &cur_clip->first_track->frames; part != NULL; part = part->next)
+		{
+			if (get_frame_part_source_clip((*part)) == NULL)
+			{
+				return FALSE;
+			}
+		}
+	}
+
+	state->write_file_range = write_file_range;
+	return TRUE;
+}
+
+static vod_status_t
+mp4_builder_frame_writer_write_file_ranges(fragment_writer_state_t* state)
+{
+	media_clip_source_t* cur_source = NULL;
+	media_clip_source_t* source;
+	input_frame_t* cur_frame;
+	uint64_t start_offset = 0;
+	uint64_t end_offset = 0;
+	vod_status_t rc;
+
+	// write contiguous frames as a single range
+	while (mp4_builder_move_to_next_frame(state))
+	{
+		source = get_frame_part_source_clip(state->cur_frame_part);
+		cur_frame = state->cur_frame;
+		state->cur_frame++;
+
+		if (source == cur_source && cur_frame->offset == end_offset)
+		{
+			end_offset += cur_frame->size;
+			continue;
+		}
+
+		if (end_offset > start_offset)
+		{
+			rc = state->write_file_range(state->write_context, cur_source, start_offset, end_offset - start_offset);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+		}
+
+		cur_source = source;
+		start_offset = cur_frame->offset;
+		end_offset = start_offset + cur_frame->size;
+	}
+
+	if (end_offset > start_offset)
+	{
+		rc = state->write_file_range(state->write_context, cur_source, start_offset, end_offset - start_offset);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	return VOD_OK;
+}
+
 vod_status_t
 mp4_builder_frame_writer_process(fragment_writer_state_t* state)
 {
@@ -217,6 +293,11 @@ mp4_builder_frame_writer_process(fragment_writer_state_t* state)
 	vod_status_t rc;
 	bool_t frame_done;
 
+	if (state->write_file_range != NULL)
+	{
+		return mp4_builder_frame_writer_write_file_ranges(state);
+	}
+
 	if (!state->frame_started)
 	{
 		if (!mp4_builder_move_to_next_frame(state))
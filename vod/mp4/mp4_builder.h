@@ -39,6 +39,7 @@ typedef struct {
 typedef struct {
 	request_context_t* request_context;
 	write_callback_t write_callback;
+	write_file_range_callback_t write_file_range;
 	void* write_context;
 	bool_t reuse_buffers;
 
@@ -69,6 +70,10 @@ vod_status_t mp4_builder_frame_writer_init(
 	bool_t reuse_buffers,
 	fragment_writer_state_t** result);
 
+bool_t mp4_builder_frame_writer_enable_file_ranges(
+	fragment_writer_state_t* state,
+	write_file_range_callback_t write_file_range);
+
 vod_status_t mp4_builder_frame_writer_process(fragment_writer_state_t* state);
 
 #endif // __MP4_BUILDER_H__
@@ -10,6 +10,7 @@
 // constants
 #define BUFFER_SIZE (65536)
 #define MIN_BUFFER_SIZE (16)
+#define TRANSCRYPT_TILE_SIZE (4096)
 
 // tyepdefs
 typedef struct {
@@ -29,6 +30,11 @@ typedef struct {
 	uint16_t clear_bytes;
 	uint32_t encrypted_bytes;
 
+	// transcrypt state
+	bool_t transcrypt;
+	mp4_aes_ctr_state_t reencrypt_cipher;
+	u_char reencrypt_iv[MP4_AES_CTR_IV_SIZE];
+
 	// input buffer
 	u_char* input_pos;
 	uint32_t input_size;
@@ -114,6 +120,12 @@ mp4_decrypt_start_frame(void* ctx, input_frame_t* frame, uint64_t min_offset)
 	mp4_aes_ctr_set_iv(&state->cipher, state->auxiliary_info_pos);
 	state->auxiliary_info_pos += MP4_AES_CTR_IV_SIZE;
 
+	if (state->transcrypt)
+	{
+		mp4_aes_ctr_set_iv(&state->reencrypt_cipher, state->reencrypt_iv);
+		mp4_aes_ctr_increment_be64(state->reencrypt_iv);
+	}
+
 	if (!state->use_subsamples)
 	{
 		state->encrypted_bytes = UINT_MAX;
@@ -144,6 +156,49 @@ mp4_decrypt_start_frame(void* ctx, input_frame_t* frame, uint64_t min_offset)
 	return VOD_OK;
 }
 
+static vod_status_t
+mp4_decrypt_transcrypt(
+	mp4_decrypt_state_t* state,
+	u_char* dest,
+	u_char* src,
+	size_t size,
+	bool_t encrypted)
+{
+	vod_status_t rc;
+	size_t cur_size;
+
+	if (!encrypted)
+	{
+		// clear bytes are only encrypted with the output key
+		return mp4_aes_ctr_process(&state->reencrypt_cipher, dest, src, size);
+	}
+
+	// Note: processing in tiles, so that the output of the decryption is still in the cpu cache
+	//		when it is re-encrypted, the memory is read and written only once
+	while (size > 0)
+	{
+		cur_size = vod_min(size, TRANSCRYPT_TILE_SIZE);
+
+		rc = mp4_aes_ctr_process(&state->cipher, dest, src, cur_size);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		rc = mp4_aes_ctr_process(&state->reencrypt_cipher, dest, dest, cur_size);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		dest += cur_size;
+		src += cur_size;
+		size -= cur_size;
+	}
+
+	return VOD_OK;
+}
+
 static vod_status_t
 mp4_decrypt_process(
 	mp4_decrypt_state_t* state, 
@@ -183,7 +238,20 @@ mp4_decrypt_process(
 		{
 			// copy clear bytes
 			cur_size = vod_min(state->clear_bytes, size);
-			dest = vod_copy(dest, src, cur_size);
+			if (state->transcrypt)
+			{
+				rc = mp4_decrypt_transcrypt(state, dest, src, cur_size, FALSE);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
+
+				dest += cur_size;
+			}
+			else
+			{
+				dest = vod_copy(dest, src, cur_size);
+			}
 			src += cur_size;
 			size -= cur_size;
 			state->clear_bytes -= cur_size;
@@ -191,7 +259,14 @@ mp4_decrypt_process(
 
 		// decrypt encrypted bytes
 		cur_size = vod_min(state->encrypted_bytes, size);
-		rc = mp4_aes_ctr_process(&state->cipher, dest, src, cur_size);
+		if (state->transcrypt)
+		{
+			rc = mp4_decrypt_transcrypt(state, dest, src, cur_size, TRUE);
+		}
+		else
+		{
+			rc = mp4_aes_ctr_process(&state->cipher, dest, src, cur_size);
+		}
 		if (rc != VOD_OK)
 		{
 			return rc;
@@ -279,6 +354,30 @@ mp4_decrypt_disable_buffer_reuse(void* ctx)
 	state->reuse_buffers = FALSE;
 }
 
+vod_status_t
+mp4_decrypt_set_transcrypt(
+	void* ctx,
+	u_char* key,
+	u_char* iv)
+{
+	mp4_decrypt_state_t* state = ctx;
+	vod_status_t rc;
+
+	rc = mp4_aes_ctr_init(&state->reencrypt_cipher, state->request_context, key);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	vod_memcpy(state->reencrypt_iv, iv, sizeof(state->reencrypt_iv));
+	state->transcrypt = TRUE;
+
+	// the output buffers are passed as is to the segment writer
+	state->reuse_buffers = FALSE;
+
+	return VOD_OK;
+}
+
 u_char* 
 mp4_decrypt_get_key(void* ctx)
 {
@@ -329,4 +428,13 @@ mp4_decrypt_init(
 	return VOD_UNEXPECTED;
 }
 
+vod_status_t
+mp4_decrypt_set_transcrypt(
+	void* ctx,
+	u_char* key,
+	u_char* iv)
+{
+	return VOD_UNEXPECTED;
+}
+
 #endif //(VOD_HAVE_OPENSSL_EVP)
@@ -16,6 +16,13 @@ vod_status_t mp4_decrypt_init(
 	media_encryption_t* encryption,
 	void** result);
 
+// Note: re-encrypts the whole frames with the provided key instead of returning clear data,
+//		the iv is incremented on every frame
+vod_status_t mp4_decrypt_set_transcrypt(
+	void* context,
+	u_char* key,
+	u_char* iv);
+
 u_char* mp4_decrypt_get_key(void* context);
 
 void mp4_decrypt_get_original_source(
@@ -834,6 +834,7 @@ mp4_encrypt_video_get_fragment_writer(
 	}
 
 	result->write_head = NULL;
+	result->write_file_range = NULL;
 	result->context = state;
 
 	return VOD_OK;
@@ -938,6 +939,62 @@ mp4_encrypt_audio_write_buffer(void* context, u_char* buffer, uint32_t size)
 	return VOD_OK;
 }
 
+static vod_status_t
+mp4_encrypt_audio_transcrypt_write_buffer(void* context, u_char* buffer, uint32_t size)
+{
+	mp4_encrypt_state_t* state = (mp4_encrypt_state_t*)context;
+
+	// the frames were already re-encrypted by the decryption frames source
+	return state->segment_writer.write_tail(state->segment_writer.context, buffer, size);
+}
+
+// Note: returns VOD_DONE in case the frames can't be transcrypted
+static vod_status_t
+mp4_encrypt_audio_init_transcrypt(mp4_encrypt_state_t* state)
+{
+	media_clip_filtered_t* cur_clip;
+	frame_list_part_t* part;
+	drm_info_t* drm_info = (drm_info_t*)state->sequence->drm_info;
+	vod_status_t rc;
+	uint64_t iv_int;
+	u_char iv[MP4_AES_CTR_IV_SIZE];
+	u_char* p;
+
+	// can only transcrypt if all the frames are read from cenc encrypted sources
+	for (cur_clip = state->sequence->filtered_clips; cur_clip < state->sequence->filtered_clips_end; cur_clip++)
+	{
+		for (part = &cur_clip->first_track->frames; part != NULL; part = part->next)
+		{
+			if (part->frames_source != &mp4_decrypt_frames_source)
+			{
+				return VOD_DONE;
+			}
+		}
+	}
+
+	// set the key and the iv of the first frame of each frame part
+	iv_int = parse_be64(state->iv);
+
+	for (cur_clip = state->sequence->filtered_clips; cur_clip < state->sequence->filtered_clips_end; cur_clip++)
+	{
+		for (part = &cur_clip->first_track->frames; part != NULL; part = part->next)
+		{
+			p = iv;
+			write_be64(p, iv_int);
+
+			rc = mp4_decrypt_set_transcrypt(part->frames_source_context, drm_info->key, iv);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			iv_int += part->last_frame - part->first_frame;
+		}
+	}
+
+	return VOD_OK;
+}
+
 vod_status_t
 mp4_encrypt_audio_get_fragment_writer(
 	segment_writer_t* result,
@@ -967,8 +1024,24 @@ mp4_encrypt_audio_get_fragment_writer(
 		return rc;
 	}
 
-	result->write_tail = mp4_encrypt_audio_write_buffer;
+	rc = mp4_encrypt_audio_init_transcrypt(state);
+	switch (rc)
+	{
+	case VOD_OK:
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_encrypt_audio_get_fragment_writer: using transcrypt");
+		result->write_tail = mp4_encrypt_audio_transcrypt_write_buffer;
+		break;
+
+	case VOD_DONE:
+		result->write_tail = mp4_encrypt_audio_write_buffer;
+		break;
+
+	default:
+		return rc;
+	}
 	result->write_head = NULL;
+	result->write_file_range = NULL;
 	result->context = state;
 
 	return VOD_OK;
@@ -240,6 +240,24 @@ done:
 		state->parts[MP4_METADATA_PART_MOOV].len = moov_size;
 	}
 
+	// build the sample table checkpoints, they are saved to the metadata cache along with the moov atom
+	rc = mp4_parser_build_table_index(
+		state->request_context,
+		state->parts[MP4_METADATA_PART_MOOV].data,
+		state->parts[MP4_METADATA_PART_MOOV].len,
+		&state->parts[MP4_METADATA_PART_INDEX]);
+	if (rc != VOD_OK)
+	{
+		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"mp4_metadata_reader_read: mp4_parser_build_table_index failed %i", rc);
+		if (rc == VOD_ALLOC_FAILED)
+		{
+			return rc;
+		}
+
+		state->parts[MP4_METADATA_PART_INDEX].len = 0;
+	}
+
 	result->parts = state->parts;
 	result->part_count = MP4_METADATA_PART_COUNT;
 
@@ -8,6 +8,7 @@
 enum {
 	MP4_METADATA_PART_FTYP,
 	MP4_METADATA_PART_MOOV,
+	MP4_METADATA_PART_INDEX,		// sample table checkpoints, built by mp4_parser_build_table_index
 	MP4_METADATA_PART_COUNT
 };
 
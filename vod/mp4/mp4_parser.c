@@ -5,6 +5,7 @@
 #include "mp4_format.h"
 #include "mp4_parser.h"
 #include "mp4_defs.h"
+#include "mp4_table_decode.h"
 #include "../media_format.h"
 #include "../input/frames_source_cache.h"
 #include "../read_stream.h"
@@ -27,6 +28,18 @@
 // constants
 #define MAX_FRAMERATE_TEST_SAMPLES (20)
 #define MAX_TOTAL_SIZE_TEST_SAMPLES (100000)
+#define TABLE_INDEX_VERSION (1)
+#define TABLE_CHECKPOINT_INTERVAL (256)		// in table entries
+#define FRAME_INDEX_VERSION (1)
+#define FRAME_INDEX_CHECKPOINT_INTERVAL (1024)
+#define FRAME_INDEX_MAX_FRAMES (1024 * 1024)
+#define FRAME_INDEX_FLAGS (PARSE_FLAG_FRAMES_PTS_DELAY | PARSE_FLAG_FRAMES_OFFSET | PARSE_FLAG_FRAMES_SIZE | PARSE_FLAG_FRAMES_IS_KEY)
+
+#define frame_index_get_size(frame_count, checkpoint_count)		\
+	(sizeof(frame_index_header_t) +								\
+	(frame_count) * (sizeof(uint64_t) + 2 * sizeof(uint32_t)) +	\
+	(checkpoint_count) * sizeof(uint32_t) +						\
+	vod_div_ceil(frame_count, 8))
 
 // typedefs
 typedef struct {
@@ -34,6 +47,35 @@ typedef struct {
 	uint32_t mvhd_timescale;
 } mp4_base_metadata_t;
 
+// sample table checkpoints
+enum {
+	TABLE_STTS,
+	TABLE_CTTS,
+	TABLE_STSC,
+	TABLE_COUNT
+};
+
+typedef struct {
+	uint32_t entry_index;
+	uint32_t frame_index;		// index of the first frame of the entry
+	uint64_t value;				// stts - accumulated duration, ctts - dts shift of the preceding entries
+} table_checkpoint_t;
+
+typedef struct {
+	const table_checkpoint_t* elts;
+	uint32_t count;
+} table_checkpoints_t;
+
+// table index layout (native byte order, saved as a metadata part next to the moov atom):
+//	table_index_header_t
+//	uint32_t counts[trak_count][TABLE_COUNT]
+//	padding to 8 bytes
+//	table_checkpoint_t checkpoints[]			(by trak and table, in the order of the counts)
+typedef struct {
+	uint32_t version;
+	uint32_t trak_count;
+} table_index_header_t;
+
 // trak atom parsing
 typedef struct {
 	atom_info_t stco;
@@ -59,6 +101,12 @@ typedef struct {
 	file_info_t* file_info;
 	vod_str_t ftyp_atom;
 	mp4_base_metadata_t* result;
+
+	// table index
+	const uint32_t* index_counts;
+	const uint32_t* index_counts_end;
+	const table_checkpoint_t* index_checkpoints;
+	const table_checkpoint_t* index_checkpoints_end;
 } process_moov_context_t;
 
 typedef struct {
@@ -76,6 +124,9 @@ typedef struct {
 	uint64_t clip_from;
 	uint32_t mvhd_timescale;
 
+	// input - set per track
+	table_checkpoints_t* checkpoints;		// optional
+
 	// input - reset between tracks
 	const uint32_t* stss_start_pos;			// initialized only when aligning keyframes
 	uint32_t stss_entries;					// initialized only when aligning keyframes
@@ -107,8 +158,23 @@ typedef struct {
 	atom_info_t sinf_atom;
 	file_info_t file_info;
 	uint32_t track_index;
+	table_checkpoints_t checkpoints[TABLE_COUNT];
 } mp4_track_base_metadata_t;
 
+// frame index layout (native byte order, position independent):
+//	frame_index_header_t
+//	uint64_t offsets[frame_count]
+//	uint32_t sizes[frame_count]
+//	uint32_t pts_delays[frame_count]			(before applying the dts shift)
+//	uint32_t dts_shifts[checkpoint_count]		(max negative pts delay of the frames preceding each checkpoint)
+//	u_char key_frames[ceil(frame_count / 8)]	(bitmap)
+typedef struct {
+	uint32_t version;
+	uint32_t frame_count;
+	uint32_t checkpoint_interval;
+	uint32_t checkpoint_count;
+} frame_index_header_t;
+
 typedef struct {
 	vod_status_t(*parse)(atom_info_t* atom_info, frames_parse_context_t* context);
 	int offset;
@@ -155,6 +221,11 @@ static const relevant_atom_t relevant_atoms_trak[] = {
 	{ ATOM_NAME_NULL, 0, NULL }
 };
 
+typedef struct {
+	request_context_t* request_context;
+	vod_array_t traks;			// trak_atom_infos_t
+} build_table_index_context_t;
+
 typedef struct {
 	int raw_atom_index;
 	int atom_info_offset;
@@ -531,10 +602,65 @@ mp4_parser_parse_stts_atom_frame_duration_only(atom_info_t* atom_info, frames_pa
 	return VOD_OK;
 }
 
+static const table_checkpoint_t*
+mp4_parser_find_frame_checkpoint(table_checkpoints_t* checkpoints, uint32_t frame_index)
+{
+	const table_checkpoint_t* result = NULL;
+	uint32_t left = 0;
+	uint32_t right = checkpoints->count;
+	uint32_t middle;
+
+	// find the last checkpoint that starts at or before the frame
+	while (left < right)
+	{
+		middle = (left + right) / 2;
+		if (checkpoints->elts[middle].frame_index <= frame_index)
+		{
+			result = &checkpoints->elts[middle];
+			left = middle + 1;
+		}
+		else
+		{
+			right = middle;
+		}
+	}
+
+	return result;
+}
+
+static const table_checkpoint_t*
+mp4_parser_find_time_checkpoint(table_checkpoints_t* checkpoints, uint64_t time)
+{
+	const table_checkpoint_t* result = NULL;
+	uint32_t left = 0;
+	uint32_t right = checkpoints->count;
+	uint32_t middle;
+
+	// find the last checkpoint that starts at or before the time
+	while (left < right)
+	{
+		middle = (left + right) / 2;
+		if (checkpoints->elts[middle].value <= time)
+		{
+			result = &checkpoints->elts[middle];
+			left = middle + 1;
+		}
+		else
+		{
+			right = middle;
+		}
+	}
+
+	return result;
+}
+
 static vod_status_t 
 mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* context)
 {
 	uint32_t timescale = context->media_info->timescale;
+	const table_checkpoint_t* checkpoint;
+	table_checkpoints_t* checkpoints = NULL;
+	const stts_entry_t* first_entry;
 	const stts_entry_t* last_entry;
 	const stts_entry_t* cur_entry;
 	media_range_t* range = context->parse_params.range;
@@ -546,6 +672,7 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	uint64_t end_time;
 	uint64_t clip_to;
 	uint64_t clip_from_accum_duration = 0;
+	uint64_t initial_duration;
 	uint64_t accum_duration;
 	uint64_t next_accum_duration;
 	int64_t empty_duration;
@@ -581,8 +708,16 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		accum_duration = 0;
 	}
 
+	initial_duration = accum_duration;
+
+	if (context->checkpoints != NULL && context->checkpoints[TABLE_STTS].count > 0)
+	{
+		checkpoints = &context->checkpoints[TABLE_STTS];
+	}
+
 	// parse the first sample
-	cur_entry = (const stts_entry_t*)(atom_info->ptr + sizeof(stts_atom_t));
+	first_entry = (const stts_entry_t*)(atom_info->ptr + sizeof(stts_atom_t));
+	cur_entry = first_entry;
 	last_entry = cur_entry + entries;
 	if (cur_entry >= last_entry)
 	{
@@ -602,6 +737,24 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	{
 		clip_from = (((uint64_t)context->parse_params.clip_from * timescale) / 1000);
 
+		// jump to the nearest checkpoint
+		if (checkpoints != NULL && clip_from > initial_duration)
+		{
+			checkpoint = mp4_parser_find_time_checkpoint(checkpoints, clip_from - initial_duration);
+			if (checkpoint != NULL && 
+				checkpoint->entry_index < entries && 
+				first_entry + checkpoint->entry_index > cur_entry)
+			{
+				cur_entry = first_entry + checkpoint->entry_index;
+				frame_index = checkpoint->frame_index;
+				accum_duration = initial_duration + checkpoint->value;
+
+				sample_duration = parse_be32(cur_entry->duration);
+				sample_count = parse_be32(cur_entry->count);
+				next_accum_duration = accum_duration + (uint64_t)sample_duration * sample_count;
+			}
+		}
+
 		for (;;)
 		{
 			if (sample_duration > 0 &&
@@ -640,6 +793,24 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	// skip to the sample containing the start time
 	start_time = ((range->start + context->clip_from) * timescale) / range->timescale;
 
+	// jump to the nearest checkpoint
+	if (checkpoints != NULL && start_time > initial_duration)
+	{
+		checkpoint = mp4_parser_find_time_checkpoint(checkpoints, start_time - initial_duration);
+		if (checkpoint != NULL && 
+			checkpoint->entry_index < entries && 
+			first_entry + checkpoint->entry_index > cur_entry)
+		{
+			cur_entry = first_entry + checkpoint->entry_index;
+			frame_index = checkpoint->frame_index;
+			accum_duration = initial_duration + checkpoint->value;
+
+			sample_duration = parse_be32(cur_entry->duration);
+			sample_count = parse_be32(cur_entry->count);
+			next_accum_duration = accum_duration + (uint64_t)sample_duration * sample_count;
+		}
+	}
+
 	for (;;)
 	{
 		if (sample_duration > 0 && 
@@ -700,6 +871,24 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		stss_entry = context->stss_start_pos + context->stss_start_index;
 		key_frame_index = parse_be32(stss_entry) - 1;
 
+		// jump to the nearest checkpoint
+		if (checkpoints != NULL && key_frame_index >= frame_index + sample_count)
+		{
+			checkpoint = mp4_parser_find_frame_checkpoint(checkpoints, key_frame_index);
+			if (checkpoint != NULL && 
+				checkpoint->entry_index < entries && 
+				first_entry + checkpoint->entry_index > cur_entry)
+			{
+				cur_entry = first_entry + checkpoint->entry_index;
+				frame_index = checkpoint->frame_index;
+				accum_duration = initial_duration + checkpoint->value;
+
+				sample_duration = parse_be32(cur_entry->duration);
+				sample_count = parse_be32(cur_entry->count);
+				next_accum_duration = accum_duration + (uint64_t)sample_duration * sample_count;
+			}
+		}
+
 		// skip to the sample containing the key frame
 		while (key_frame_index >= frame_index + sample_count)
 		{
@@ -966,6 +1155,8 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 static vod_status_t 
 mp4_parser_parse_ctts_atom(atom_info_t* atom_info, frames_parse_context_t* context)
 {
+	const table_checkpoint_t* checkpoint;
+	const ctts_entry_t* first_entry;
 	const ctts_entry_t* last_entry;
 	const ctts_entry_t* cur_entry;
 	input_frame_t* cur_frame = context->frames;
@@ -989,7 +1180,8 @@ mp4_parser_parse_ctts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		return rc;
 	}
 
-	cur_entry = (const ctts_entry_t*)(atom_info->ptr + sizeof(ctts_atom_t));
+	first_entry = (const ctts_entry_t*)(atom_info->ptr + sizeof(ctts_atom_t));
+	cur_entry = first_entry;
 	last_entry = cur_entry + entries;
 
 	// parse the first entry
@@ -1006,6 +1198,26 @@ mp4_parser_parse_ctts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 
 	sample_count = parse_be32(cur_entry->count);
 
+	// jump to the nearest checkpoint
+	if (context->checkpoints != NULL && context->first_frame >= sample_count)
+	{
+		checkpoint = mp4_parser_find_frame_checkpoint(&context->checkpoints[TABLE_CTTS], context->first_frame);
+		if (checkpoint != NULL && checkpoint->entry_index < entries)
+		{
+			cur_entry = first_entry + checkpoint->entry_index;
+			frame_index = checkpoint->frame_index;
+			dts_shift = vod_max(dts_shift, (uint32_t)checkpoint->value);
+
+			sample_duration = parse_be32(cur_entry->duration);
+			if (sample_duration < 0 && (uint32_t)-sample_duration > dts_shift)
+			{
+				dts_shift = (uint32_t)-sample_duration;
+			}
+
+			sample_count = parse_be32(cur_entry->count);
+		}
+	}
+
 	// jump to the first entry
 	while (context->first_frame >= frame_index + sample_count)
 	{
@@ -1174,6 +1386,8 @@ mp4_parser_parse_stsc_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 {
 	input_frame_t* cur_frame = context->frames;
 	input_frame_t* last_frame = cur_frame + context->frame_count;
+	const table_checkpoint_t* checkpoint;
+	const stsc_entry_t* first_entry;
 	const stsc_entry_t* last_entry;
 	const stsc_entry_t* cur_entry;
 	uint64_t cur_entry_samples;
@@ -1202,7 +1416,8 @@ mp4_parser_parse_stsc_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		return VOD_OK;
 	}
 
-	cur_entry = (const stsc_entry_t*)(atom_info->ptr + sizeof(stsc_atom_t));
+	first_entry = (const stsc_entry_t*)(atom_info->ptr + sizeof(stsc_atom_t));
+	cur_entry = first_entry;
 	last_entry = cur_entry + entries;
 
 	next_chunk = parse_be32(cur_entry->first_chunk);
@@ -1213,6 +1428,18 @@ mp4_parser_parse_stsc_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		return VOD_BAD_DATA;
 	}
 
+	// jump to the nearest checkpoint
+	if (context->checkpoints != NULL && context->first_frame > 0)
+	{
+		checkpoint = mp4_parser_find_frame_checkpoint(&context->checkpoints[TABLE_STSC], context->first_frame);
+		if (checkpoint != NULL && checkpoint->entry_index < entries)
+		{
+			cur_entry = first_entry + checkpoint->entry_index;
+			frame_index = checkpoint->frame_index;
+			next_chunk = parse_be32(cur_entry->first_chunk);
+		}
+	}
+
 	if (frame_index < context->first_frame)
 	{
 		// skip to the relevant entry
@@ -1435,6 +1662,7 @@ mp4_parser_parse_stsz_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	uint32_t uniform_size;
 	uint32_t cur_size;
 	uint32_t entries;
+	uint32_t decoded;
 	unsigned field_size;
 	vod_status_t rc;
 
@@ -1463,6 +1691,12 @@ mp4_parser_parse_stsz_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		{
 			context->first_frame_chunk_offset += parse_be32(cur_pos);
 		}
+
+		// Note: entries that were not decoded (including invalid sizes) are handled by the loop below
+		decoded = mp4_table_decode_stsz32(cur_frame, last_frame, cur_pos, &context->total_frames_size);
+		cur_frame += decoded;
+		cur_pos += decoded * sizeof(uint32_t);
+
 		for (; cur_frame < last_frame; cur_frame++)
 		{
 			read_be32(cur_pos, cur_size);
@@ -2150,6 +2384,354 @@ mp4_parser_parse_mvhd_atom(process_moov_context_t* context, atom_info_t* atom_in
 	return VOD_OK;
 }
 
+static uint32_t
+mp4_parser_build_stts_checkpoints(
+	request_context_t* request_context, 
+	atom_info_t* atom_info, 
+	table_checkpoint_t* result)
+{
+	table_checkpoint_t* cur_checkpoint = result;
+	const stts_entry_t* first_entry;
+	const stts_entry_t* cur_entry;
+	const stts_entry_t* last_entry;
+	uint64_t accum_duration = 0;
+	uint64_t frame_index = 0;
+	uint32_t sample_count;
+	uint32_t entries;
+
+	if (mp4_parser_validate_stts_data(request_context, atom_info, &entries) != VOD_OK)
+	{
+		return 0;
+	}
+
+	first_entry = (const stts_entry_t*)(atom_info->ptr + sizeof(stts_atom_t));
+	last_entry = first_entry + entries;
+	for (cur_entry = first_entry; cur_entry < last_entry; cur_entry++)
+	{
+		if (cur_entry > first_entry && ((cur_entry - first_entry) % TABLE_CHECKPOINT_INTERVAL) == 0)
+		{
+			cur_checkpoint->entry_index = cur_entry - first_entry;
+			cur_checkpoint->frame_index = frame_index;
+			cur_checkpoint->value = accum_duration;
+			cur_checkpoint++;
+		}
+
+		sample_count = parse_be32(cur_entry->count);
+		frame_index += sample_count;
+		if (frame_index > UINT_MAX)
+		{
+			break;
+		}
+
+		accum_duration += (uint64_t)parse_be32(cur_entry->duration) * sample_count;
+	}
+
+	return cur_checkpoint - result;
+}
+
+static uint32_t
+mp4_parser_build_ctts_checkpoints(
+	request_context_t* request_context, 
+	atom_info_t* atom_info, 
+	table_checkpoint_t* result)
+{
+	table_checkpoint_t* cur_checkpoint = result;
+	const ctts_entry_t* first_entry;
+	const ctts_entry_t* cur_entry;
+	const ctts_entry_t* last_entry;
+	uint64_t frame_index = 0;
+	uint32_t dts_shift = 0;
+	uint32_t entries;
+	int32_t sample_duration;
+
+	if (atom_info->size == 0)		// optional atom
+	{
+		return 0;
+	}
+
+	if (mp4_parser_validate_ctts_atom(request_context, atom_info, &entries) != VOD_OK)
+	{
+		return 0;
+	}
+
+	first_entry = (const ctts_entry_t*)(atom_info->ptr + sizeof(ctts_atom_t));
+	last_entry = first_entry + entries;
+	for (cur_entry = first_entry; cur_entry < last_entry; cur_entry++)
+	{
+		if (cur_entry > first_entry && ((cur_entry - first_entry) % TABLE_CHECKPOINT_INTERVAL) == 0)
+		{
+			cur_checkpoint->entry_index = cur_entry - first_entry;
+			cur_checkpoint->frame_index = frame_index;
+			cur_checkpoint->value = dts_shift;
+			cur_checkpoint++;
+		}
+
+		frame_index += parse_be32(cur_entry->count);
+		if (frame_index > UINT_MAX)
+		{
+			break;
+		}
+
+		sample_duration = parse_be32(cur_entry->duration);
+		if (sample_duration < 0 && (uint32_t)-sample_duration > dts_shift)
+		{
+			dts_shift = (uint32_t)-sample_duration;
+		}
+	}
+
+	return cur_checkpoint - result;
+}
+
+static uint32_t
+mp4_parser_build_stsc_checkpoints(
+	request_context_t* request_context, 
+	atom_info_t* atom_info, 
+	table_checkpoint_t* result)
+{
+	table_checkpoint_t* cur_checkpoint = result;
+	const stsc_entry_t* first_entry;
+	const stsc_entry_t* cur_entry;
+	const stsc_entry_t* last_entry;
+	uint64_t frame_index = 0;
+	uint32_t samples_per_chunk;
+	uint32_t next_chunk;
+	uint32_t cur_chunk;
+	uint32_t entries;
+
+	if (mp4_parser_validate_stsc_atom(request_context, atom_info, &entries) != VOD_OK)
+	{
+		return 0;
+	}
+
+	first_entry = (const stsc_entry_t*)(atom_info->ptr + sizeof(stsc_atom_t));
+	last_entry = first_entry + entries;
+	if (first_entry >= last_entry || parse_be32(first_entry->first_chunk) != 1)
+	{
+		return 0;
+	}
+
+	// Note: stopping on the first invalid entry, the frames parser will report the error
+	for (cur_entry = first_entry; cur_entry + 1 < last_entry; cur_entry++)
+	{
+		if (cur_entry > first_entry && ((cur_entry - first_entry) % TABLE_CHECKPOINT_INTERVAL) == 0)
+		{
+			cur_checkpoint->entry_index = cur_entry - first_entry;
+			cur_checkpoint->frame_index = frame_index;
+			cur_checkpoint->value = 0;
+			cur_checkpoint++;
+		}
+
+		cur_chunk = parse_be32(cur_entry->first_chunk);
+		next_chunk = parse_be32(cur_entry[1].first_chunk);
+		samples_per_chunk = parse_be32(cur_entry->samples_per_chunk);
+		if (next_chunk <= cur_chunk || samples_per_chunk == 0)
+		{
+			break;
+		}
+
+		frame_index += (uint64_t)(next_chunk - cur_chunk) * samples_per_chunk;
+		if (frame_index > UINT_MAX)
+		{
+			break;
+		}
+	}
+
+	return cur_checkpoint - result;
+}
+
+static vod_status_t
+mp4_parser_save_trak_atoms_callback(void* ctx, atom_info_t* atom_info)
+{
+	save_relevant_atoms_context_t save_atoms_context;
+	build_table_index_context_t* context = ctx;
+	trak_atom_infos_t* trak_atom_infos;
+
+	if (atom_info->name != ATOM_NAME_TRAK)
+	{
+		return VOD_OK;
+	}
+
+	trak_atom_infos = vod_array_push(&context->traks);
+	if (trak_atom_infos == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, context->request_context->log, 0,
+			"mp4_parser_save_trak_atoms_callback: vod_array_push failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	vod_memzero(trak_atom_infos, sizeof(*trak_atom_infos));
+	save_atoms_context.relevant_atoms = relevant_atoms_trak;
+	save_atoms_context.result = trak_atom_infos;
+	save_atoms_context.request_context = context->request_context;
+	return mp4_parser_parse_atoms(context->request_context, atom_info->ptr, atom_info->size, TRUE, &mp4_parser_save_relevant_atoms_callback, &save_atoms_context);
+}
+
+vod_status_t
+mp4_parser_build_table_index(
+	request_context_t* request_context,
+	const u_char* moov,
+	size_t moov_size,
+	vod_str_t* result)
+{
+	build_table_index_context_t context;
+	trak_atom_infos_t* first_trak;
+	trak_atom_infos_t* last_trak;
+	trak_atom_infos_t* cur_trak;
+	table_checkpoint_t* cur_checkpoint;
+	table_index_header_t* header;
+	uint32_t* counts;
+	size_t max_checkpoints = 0;
+	size_t counts_size;
+	u_char* p;
+	vod_status_t rc;
+
+	// collect the sample tables of all traks
+	context.request_context = request_context;
+	if (vod_array_init(&context.traks, request_context->pool, 2, sizeof(trak_atom_infos_t)) != VOD_OK)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_parser_build_table_index: vod_array_init failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	rc = mp4_parser_parse_atoms(request_context, moov, moov_size, TRUE, &mp4_parser_save_trak_atoms_callback, &context);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	first_trak = context.traks.elts;
+	last_trak = first_trak + context.traks.nelts;
+	for (cur_trak = first_trak; cur_trak < last_trak; cur_trak++)
+	{
+		// upper bound on the number of checkpoints, the entry counts are validated when building them
+		max_checkpoints += (cur_trak->stts.size + cur_trak->ctts.size + cur_trak->stsc.size) /
+			(sizeof(ctts_entry_t) * TABLE_CHECKPOINT_INTERVAL);
+	}
+
+	// allocate the index
+	counts_size = vod_align(sizeof(*header) + sizeof(counts[0]) * TABLE_COUNT * context.traks.nelts, sizeof(uint64_t));
+
+	p = vod_alloc(request_context->pool, counts_size + sizeof(*cur_checkpoint) * max_checkpoints);
+	if (p == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_parser_build_table_index: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	header = (table_index_header_t*)p;
+	header->version = TABLE_INDEX_VERSION;
+	header->trak_count = context.traks.nelts;
+
+	counts = (uint32_t*)(header + 1);
+	cur_checkpoint = (table_checkpoint_t*)(p + counts_size);
+
+	for (cur_trak = first_trak; cur_trak < last_trak; cur_trak++)
+	{
+		counts[TABLE_STTS] = mp4_parser_build_stts_checkpoints(request_context, &cur_trak->stts, cur_checkpoint);
+		cur_checkpoint += counts[TABLE_STTS];
+
+		counts[TABLE_CTTS] = mp4_parser_build_ctts_checkpoints(request_context, &cur_trak->ctts, cur_checkpoint);
+		cur_checkpoint += counts[TABLE_CTTS];
+
+		counts[TABLE_STSC] = mp4_parser_build_stsc_checkpoints(request_context, &cur_trak->stsc, cur_checkpoint);
+		cur_checkpoint += counts[TABLE_STSC];
+
+		counts += TABLE_COUNT;
+	}
+
+	result->data = p;
+	result->len = (u_char*)cur_checkpoint - p;
+
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+		"mp4_parser_build_table_index: built index for %uD traks, size %uz", header->trak_count, result->len);
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_parser_init_table_index(
+	process_moov_context_t* context,
+	vod_str_t* index)
+{
+	table_index_header_t* header;
+	uint64_t total_count = 0;
+	const uint32_t* cur_count;
+	size_t counts_size;
+	u_char* p;
+
+	if (index->len < sizeof(*header))
+	{
+		return VOD_BAD_DATA;
+	}
+
+	p = index->data;
+	if (((uintptr_t)p & (sizeof(uint64_t) - 1)) != 0)
+	{
+		// the part is not aligned inside the cache buffer, copy it
+		p = vod_alloc(context->request_context->pool, index->len);
+		if (p == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, context->request_context->log, 0,
+				"mp4_parser_init_table_index: vod_alloc failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		vod_memcpy(p, index->data, index->len);
+	}
+
+	header = (table_index_header_t*)p;
+	if (header->version != TABLE_INDEX_VERSION || 
+		header->trak_count > (index->len - sizeof(*header)) / (sizeof(uint32_t) * TABLE_COUNT))
+	{
+		return VOD_BAD_DATA;
+	}
+
+	counts_size = vod_align(sizeof(*header) + sizeof(uint32_t) * TABLE_COUNT * header->trak_count, sizeof(uint64_t));
+
+	context->index_counts = (uint32_t*)(header + 1);
+	context->index_counts_end = context->index_counts + TABLE_COUNT * header->trak_count;
+
+	for (cur_count = context->index_counts; cur_count < context->index_counts_end; cur_count++)
+	{
+		total_count += *cur_count;
+	}
+
+	if (counts_size + total_count * sizeof(table_checkpoint_t) != index->len)
+	{
+		return VOD_BAD_DATA;
+	}
+
+	context->index_checkpoints = (table_checkpoint_t*)(p + counts_size);
+	context->index_checkpoints_end = context->index_checkpoints + total_count;
+
+	return VOD_OK;
+}
+
+static void
+mp4_parser_get_trak_checkpoints(
+	process_moov_context_t* context,
+	table_checkpoints_t* result)
+{
+	uint32_t i;
+
+	if (context->index_counts >= context->index_counts_end)
+	{
+		vod_memzero(result, sizeof(result[0]) * TABLE_COUNT);
+		return;
+	}
+
+	for (i = 0; i < TABLE_COUNT; i++)
+	{
+		result[i].elts = context->index_checkpoints;
+		result[i].count = context->index_counts[i];
+		context->index_checkpoints += context->index_counts[i];
+	}
+
+	context->index_counts += TABLE_COUNT;
+}
+
 static vod_status_t
 mp4_parser_process_moov_atom_callback(void* ctx, atom_info_t* atom_info)
 {
@@ -2159,6 +2741,7 @@ mp4_parser_process_moov_atom_callback(void* ctx, atom_info_t* atom_info)
 	mp4_track_base_metadata_t* result_track;
 	mp4_base_metadata_t* result = context->result;
 	trak_atom_infos_t trak_atom_infos;
+	table_checkpoints_t checkpoints[TABLE_COUNT];
 	media_sequence_t* sequence;
 	uint32_t duration_millis;
 	uint32_t track_index;
@@ -2179,6 +2762,9 @@ mp4_parser_process_moov_atom_callback(void* ctx, atom_info_t* atom_info)
 		return VOD_OK;
 	}
 
+	// Note: must be called for every trak, including traks that end up being skipped
+	mp4_parser_get_trak_checkpoints(context, checkpoints);
+
 	// find required trak atoms
 	vod_memzero(&trak_atom_infos, sizeof(trak_atom_infos));
 	save_atoms_context.relevant_atoms = relevant_atoms_trak;
@@ -2391,6 +2977,7 @@ mp4_parser_process_moov_atom_callback(void* ctx, atom_info_t* atom_info)
 	result_track->sinf_atom = metadata_parse_context.sinf_atom;
 	result_track->file_info = *context->file_info;
 	result_track->track_index = track_index;
+	vod_memcpy(result_track->checkpoints, checkpoints, sizeof(result_track->checkpoints));
 
 	// update max duration / track index
 	if (result->base.duration == 0 ||
@@ -2493,6 +3080,27 @@ mp4_parser_parse_basic_metadata(
 	context.file_info = file_info;
 	context.ftyp_atom = metadata_parts[MP4_METADATA_PART_FTYP];
 	context.result = metadata;
+	context.index_counts = NULL;
+	context.index_counts_end = NULL;
+
+	// Note: metadata that was cached before the index was added has no index part
+	if (metadata_part_count > MP4_METADATA_PART_INDEX && 
+		metadata_parts[MP4_METADATA_PART_INDEX].len > 0)
+	{
+		rc = mp4_parser_init_table_index(&context, &metadata_parts[MP4_METADATA_PART_INDEX]);
+		if (rc != VOD_OK)
+		{
+			if (rc == VOD_ALLOC_FAILED)
+			{
+				return rc;
+			}
+
+			vod_log_error(VOD_LOG_WARN, request_context->log, 0,
+				"mp4_parser_parse_basic_metadata: invalid table index, size %uz", metadata_parts[MP4_METADATA_PART_INDEX].len);
+			context.index_counts = NULL;
+			context.index_counts_end = NULL;
+		}
+	}
 
 	rc = mp4_parser_parse_atoms(
 		request_context, 
@@ -2603,6 +3211,251 @@ mp4_parser_compare_tracks(const void *s1, const void *s2)
 	return track1->track_index - track2->track_index;
 }
 
+static const trak_atom_parser_t frame_index_parsers[] = {
+	// order is important
+	{ mp4_parser_parse_ctts_atom,							offsetof(trak_atom_infos_t, ctts), PARSE_FLAG_FRAMES_PTS_DELAY },
+	{ mp4_parser_parse_stsc_atom,							offsetof(trak_atom_infos_t, stsc), PARSE_FLAG_FRAMES_OFFSET },
+	{ mp4_parser_parse_stsz_atom,							offsetof(trak_atom_infos_t, stsz), PARSE_FLAG_FRAMES_SIZE },
+	{ mp4_parser_parse_stco_atom,							offsetof(trak_atom_infos_t, stco), PARSE_FLAG_FRAMES_OFFSET },
+	{ mp4_parser_parse_stss_atom,							offsetof(trak_atom_infos_t, stss), PARSE_FLAG_FRAMES_IS_KEY },
+	{ NULL, 0, 0 }
+};
+
+static vod_status_t
+mp4_parser_build_frame_index(
+	frames_parse_context_t* context,
+	mp4_track_base_metadata_t* track,
+	vod_str_t* result)
+{
+	media_frame_index_cache_t* frame_index_cache = context->parse_params.frame_index_cache;
+	request_context_t* request_context = context->request_context;
+	frames_parse_context_t build_context;
+	frame_index_header_t* header;
+	const trak_atom_parser_t* cur_parser;
+	input_frame_t* cur_frame;
+	input_frame_t* last_frame;
+	uint64_t* offsets;
+	uint32_t* sizes;
+	uint32_t* pts_delays;
+	uint32_t* dts_shifts;
+	u_char* key_frames;
+	uint32_t checkpoint_count;
+	uint32_t frame_count;
+	uint32_t uniform_size;
+	uint32_t field_size;
+	uint32_t dts_shift;
+	uint32_t i;
+	vod_status_t rc;
+	size_t size;
+
+	rc = mp4_parser_validate_stsz_atom(request_context, &track->trak_atom_infos.stsz, 0, &uniform_size, &field_size, &frame_count);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	if (frame_count == 0 || frame_count > FRAME_INDEX_MAX_FRAMES)
+	{
+		result->len = 0;
+		return VOD_OK;
+	}
+
+	checkpoint_count = vod_div_ceil(frame_count, FRAME_INDEX_CHECKPOINT_INTERVAL);
+
+	size = frame_index_get_size(frame_count, checkpoint_count);
+
+	// building the index is expensive, skip it if it will not be stored, or if it is built by another request
+	if (!frame_index_cache->can_store(
+		frame_index_cache->context, 
+		&track->file_info, 
+		track->media_info.media_type, 
+		track->track_index, 
+		size))
+	{
+		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_parser_build_frame_index: index of size %uz will not be stored, skipping", size);
+		result->len = 0;
+		return VOD_OK;
+	}
+
+	// parse the tables of the whole track
+	vod_memzero(&build_context, sizeof(build_context));
+	build_context.request_context = request_context;
+	build_context.media_info = context->media_info;
+	build_context.parse_params = context->parse_params;
+	build_context.mvhd_timescale = context->mvhd_timescale;
+	build_context.last_frame = frame_count;
+	build_context.frame_count = frame_count;
+
+	build_context.frames = vod_alloc(request_context->pool, sizeof(build_context.frames[0]) * frame_count);
+	if (build_context.frames == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_parser_build_frame_index: vod_alloc failed (1)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	vod_memzero(build_context.frames, sizeof(build_context.frames[0]) * frame_count);
+
+	for (cur_parser = frame_index_parsers; cur_parser->parse; cur_parser++)
+	{
+		rc = cur_parser->parse((atom_info_t*)((u_char*)&track->trak_atom_infos + cur_parser->offset), &build_context);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	// serialize the index
+	header = vod_alloc(request_context->pool, size);
+	if (header == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_parser_build_frame_index: vod_alloc failed (2)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	header->version = FRAME_INDEX_VERSION;
+	header->frame_count = frame_count;
+	header->checkpoint_count = checkpoint_count;
+	header->checkpoint_interval = FRAME_INDEX_CHECKPOINT_INTERVAL;
+
+	offsets = (uint64_t*)(header + 1);
+	sizes = (uint32_t*)(offsets + frame_count);
+	pts_delays = sizes + frame_count;
+	dts_shifts = pts_delays + frame_count;
+	key_frames = (u_char*)(dts_shifts + checkpoint_count);
+
+	vod_memzero(key_frames, vod_div_ceil(frame_count, 8));
+
+	dts_shift = 0;
+	cur_frame = build_context.frames;
+	last_frame = cur_frame + frame_count;
+	for (i = 0; cur_frame < last_frame; cur_frame++, i++)
+	{
+		// dts_shifts[n] holds the dts shift of frames [0, n * checkpoint_interval)
+		if ((i % FRAME_INDEX_CHECKPOINT_INTERVAL) == 0)
+		{
+			dts_shifts[i / FRAME_INDEX_CHECKPOINT_INTERVAL] = dts_shift;
+		}
+
+		offsets[i] = cur_frame->offset;
+		sizes[i] = cur_frame->size;
+		pts_delays[i] = cur_frame->pts_delay;
+
+		if ((int32_t)cur_frame->pts_delay < 0 && (uint32_t)-(int32_t)cur_frame->pts_delay > dts_shift)
+		{
+			dts_shift = (uint32_t)-(int32_t)cur_frame->pts_delay;
+		}
+
+		if (cur_frame->key_frame)
+		{
+			key_frames[i >> 3] |= (1 << (i & 7));
+		}
+	}
+
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+		"mp4_parser_build_frame_index: built index of %uD frames, size %uz", frame_count, size);
+
+	result->data = (u_char*)header;
+	result->len = size;
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_parser_apply_frame_index(
+	frames_parse_context_t* context,
+	vod_str_t* frame_index)
+{
+	frame_index_header_t* header = (frame_index_header_t*)frame_index->data;
+	input_frame_t* cur_frame;
+	input_frame_t* last_frame;
+	uint64_t* offsets;
+	uint32_t* sizes;
+	uint32_t* pts_delays;
+	uint32_t* dts_shifts;
+	u_char* key_frames;
+	uint32_t frame_count;
+	uint32_t dts_shift;
+	uint32_t index;
+	uint32_t i;
+	int parse_type = context->parse_params.parse_type;
+
+	if (frame_index->len < sizeof(*header) ||
+		header->version != FRAME_INDEX_VERSION ||
+		header->checkpoint_interval != FRAME_INDEX_CHECKPOINT_INTERVAL ||
+		header->checkpoint_count != vod_div_ceil(header->frame_count, FRAME_INDEX_CHECKPOINT_INTERVAL) ||
+		frame_index->len != frame_index_get_size(header->frame_count, header->checkpoint_count))
+	{
+		vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
+			"mp4_parser_apply_frame_index: invalid frame index, size %uz", frame_index->len);
+		return VOD_BAD_DATA;
+	}
+
+	frame_count = header->frame_count;
+	if (context->last_frame > frame_count)
+	{
+		vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
+			"mp4_parser_apply_frame_index: last frame %uD exceeds index frame count %uD", 
+			context->last_frame, frame_count);
+		return VOD_BAD_DATA;
+	}
+
+	offsets = (uint64_t*)(header + 1);
+	sizes = (uint32_t*)(offsets + frame_count);
+	pts_delays = sizes + frame_count;
+	dts_shifts = pts_delays + frame_count;
+	key_frames = (u_char*)(dts_shifts + header->checkpoint_count);
+
+	cur_frame = context->frames;
+	last_frame = cur_frame + context->frame_count;
+	index = context->first_frame;
+
+	if ((parse_type & PARSE_FLAG_FRAMES_PTS_DELAY) != 0 && context->last_frame > 0)
+	{
+		// the dts shift of frames [0, last_frame) - start from the nearest checkpoint
+		i = (context->last_frame - 1) / FRAME_INDEX_CHECKPOINT_INTERVAL;
+		dts_shift = dts_shifts[i];
+		for (i *= FRAME_INDEX_CHECKPOINT_INTERVAL; i < context->last_frame; i++)
+		{
+			if ((int32_t)pts_delays[i] < 0 && (uint32_t)-(int32_t)pts_delays[i] > dts_shift)
+			{
+				dts_shift = (uint32_t)-(int32_t)pts_delays[i];
+			}
+		}
+
+		context->dts_shift = dts_shift;
+	}
+
+	for (; cur_frame < last_frame; cur_frame++, index++)
+	{
+		cur_frame->offset = offsets[index];
+
+		if ((parse_type & PARSE_FLAG_FRAMES_SIZE) != 0)
+		{
+			cur_frame->size = sizes[index];
+			context->total_frames_size += cur_frame->size;
+		}
+
+		if ((parse_type & PARSE_FLAG_FRAMES_PTS_DELAY) != 0)
+		{
+			cur_frame->pts_delay = pts_delays[index];
+		}
+
+		if ((parse_type & PARSE_FLAG_FRAMES_IS_KEY) != 0)
+		{
+			cur_frame->key_frame = (key_frames[index >> 3] >> (index & 7)) & 1;
+			if (cur_frame->key_frame)
+			{
+				context->key_frame_count++;
+			}
+		}
+	}
+
+	return VOD_OK;
+}
+
 vod_status_t
 mp4_parser_parse_frames(
 	request_context_t* request_context,
@@ -2614,6 +3467,7 @@ mp4_parser_parse_frames(
 	media_format_read_request_t* read_req,
 	media_track_array_t* result)
 {
+	media_frame_index_cache_t* frame_index_cache = parse_params->frame_index_cache;
 	mp4_base_metadata_t* metadata = vod_container_of(base_metadata, mp4_base_metadata_t, base);
 	mp4_track_base_metadata_t* first_track = (mp4_track_base_metadata_t*)metadata->base.tracks.elts;
 	mp4_track_base_metadata_t* last_track = first_track + metadata->base.tracks.nelts;
@@ -2627,6 +3481,7 @@ mp4_parser_parse_frames(
 	void* frames_source_context;
 	vod_status_t rc;
 	vod_array_t tracks;
+	vod_str_t frame_index;
 	uint64_t last_offset;
 	uint32_t media_type;
 
@@ -2669,6 +3524,7 @@ mp4_parser_parse_frames(
 
 		// update the media info on the context
 		context.media_info = &cur_track->media_info;
+		context.checkpoints = cur_track->checkpoints;
 
 		// reset the output part of the context
 		vod_memzero(&context.stss_start_pos, sizeof(context) - offsetof(frames_parse_context_t, stss_start_pos));
@@ -2687,6 +3543,41 @@ mp4_parser_parse_frames(
 			context.stss_start_pos = (const uint32_t*)(cur_track->trak_atom_infos.stss.ptr + sizeof(stss_atom_t));
 		}
 
+		// get the pre-parsed frame index of the track (encrypted tracks are always parsed from the atoms)
+		frame_index.len = 0;
+		if (frame_index_cache != NULL &&
+			(parse_params->parse_type & (PARSE_FLAG_FRAMES_DURATION | PARSE_FLAG_FRAMES_OFFSET)) == 
+				(PARSE_FLAG_FRAMES_DURATION | PARSE_FLAG_FRAMES_OFFSET) &&
+			cur_track->trak_atom_infos.saiz.size == 0 &&
+			cur_track->trak_atom_infos.senc.size == 0)
+		{
+			if (!frame_index_cache->get(
+				frame_index_cache->context, 
+				&cur_track->file_info, 
+				media_type, 
+				cur_track->track_index, 
+				&frame_index))
+			{
+				rc = mp4_parser_build_frame_index(&context, cur_track, &frame_index);
+				if (rc != VOD_OK)
+				{
+					// fall back to parsing only the required frames
+					vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+						"mp4_parser_parse_frames: mp4_parser_build_frame_index failed %i", rc);
+					frame_index.len = 0;
+				}
+				else if (frame_index.len > 0)
+				{
+					frame_index_cache->store(
+						frame_index_cache->context, 
+						&cur_track->file_info, 
+						media_type, 
+						cur_track->track_index, 
+						&frame_index);
+				}
+			}
+		}
+
 		for (cur_parser = trak_atom_parsers; cur_parser->parse; cur_parser++)
 		{
 			if ((parse_params->parse_type & cur_parser->flag) == 0)
@@ -2694,6 +3585,11 @@ mp4_parser_parse_frames(
 				continue;
 			}
 
+			if (frame_index.len > 0 && (cur_parser->flag & FRAME_INDEX_FLAGS) != 0)
+			{
+				continue;
+			}
+
 			vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0, "mp4_parser_parse_frames: running parser 0x%xD", cur_parser->flag);
 			rc = cur_parser->parse((atom_info_t*)((u_char*)&cur_track->trak_atom_infos + cur_parser->offset), &context);
 			if (rc != VOD_OK)
@@ -2702,6 +3598,25 @@ mp4_parser_parse_frames(
 			}
 		}
 
+		if (frame_index.len > 0 && 
+			mp4_parser_apply_frame_index(&context, &frame_index) != VOD_OK)
+		{
+			// the index does not match the atoms, run the parsers that were skipped
+			for (cur_parser = trak_atom_parsers; cur_parser->parse; cur_parser++)
+			{
+				if ((parse_params->parse_type & cur_parser->flag & FRAME_INDEX_FLAGS) == 0)
+				{
+					continue;
+				}
+
+				rc = cur_parser->parse((atom_info_t*)((u_char*)&cur_track->trak_atom_infos + cur_parser->offset), &context);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
+			}
+		}
+
 		// estimate the bitrate from frame size if no bitrate was read from the file
 		if (cur_track->media_info.bitrate == 0 && cur_track->media_info.full_duration > 0)
 		{
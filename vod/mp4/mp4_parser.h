@@ -28,6 +28,12 @@ vod_status_t mp4_parser_uncompress_moov(
 	off_t* moov_offset,
 	size_t* moov_size);
 
+vod_status_t mp4_parser_build_table_index(
+	request_context_t* request_context,
+	const u_char* moov,
+	size_t moov_size,
+	vod_str_t* result);
+
 vod_status_t mp4_parser_parse_basic_metadata(
 	request_context_t* request_context,
 	media_parse_params_t* parse_params,
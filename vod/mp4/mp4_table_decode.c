@@ -0,0 +1,196 @@
+#include "mp4_table_decode.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MP4_TABLE_DECODE_X86
+#include <immintrin.h>
+#endif
+
+// constants
+#define BLOCK_SIZE (8)		// in table entries
+
+// typedefs
+typedef uint32_t(*mp4_table_decode_stsz32_t)(
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame,
+	const u_char* cur_pos,
+	uint64_t* total_size);
+
+typedef struct {
+	mp4_table_decode_stsz32_t stsz32;
+} mp4_table_decoders_t;
+
+////// scalar
+
+// Note: the scalar version leaves the whole table to the caller
+static uint32_t
+mp4_table_decode_stsz32_scalar(
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame,
+	const u_char* cur_pos,
+	uint64_t* total_size)
+{
+	(void)cur_frame;
+	(void)last_frame;
+	(void)cur_pos;
+	(void)total_size;
+
+	return 0;
+}
+
+static mp4_table_decoders_t scalar_decoders = {
+	mp4_table_decode_stsz32_scalar,
+};
+
+#ifdef MP4_TABLE_DECODE_X86
+
+#define BSWAP32_MASK 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+
+////// ssse3
+
+__attribute__((target("ssse3")))
+static uint32_t
+mp4_table_decode_stsz32_ssse3(
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame,
+	const u_char* cur_pos,
+	uint64_t* total_size)
+{
+	input_frame_t* start_frame = cur_frame;
+	uint32_t sizes[BLOCK_SIZE];
+	__m128i bswap = _mm_setr_epi8(BSWAP32_MASK);
+	__m128i max_size = _mm_set1_epi32(MAX_FRAME_SIZE);
+	__m128i zero = _mm_setzero_si128();
+	__m128i total = _mm_setzero_si128();
+	__m128i v0, v1, invalid;
+	uint64_t totals[2];
+	int i;
+
+	for (; last_frame - cur_frame >= BLOCK_SIZE; cur_frame += BLOCK_SIZE, cur_pos += BLOCK_SIZE * sizeof(uint32_t))
+	{
+		v0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)cur_pos), bswap);
+		v1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(cur_pos + 16)), bswap);
+
+		// Note: sizes above 2^31 are negative when compared as signed
+		invalid = _mm_or_si128(
+			_mm_or_si128(_mm_cmpgt_epi32(v0, max_size), _mm_cmplt_epi32(v0, zero)),
+			_mm_or_si128(_mm_cmpgt_epi32(v1, max_size), _mm_cmplt_epi32(v1, zero)));
+		if (_mm_movemask_epi8(invalid) != 0)
+		{
+			break;
+		}
+
+		total = _mm_add_epi64(total, _mm_unpacklo_epi32(v0, zero));
+		total = _mm_add_epi64(total, _mm_unpackhi_epi32(v0, zero));
+		total = _mm_add_epi64(total, _mm_unpacklo_epi32(v1, zero));
+		total = _mm_add_epi64(total, _mm_unpackhi_epi32(v1, zero));
+
+		_mm_storeu_si128((__m128i*)sizes, v0);
+		_mm_storeu_si128((__m128i*)(sizes + 4), v1);
+
+		for (i = 0; i < BLOCK_SIZE; i++)
+		{
+			cur_frame[i].size = sizes[i];
+		}
+	}
+
+	_mm_storeu_si128((__m128i*)totals, total);
+	*total_size += totals[0] + totals[1];
+
+	return cur_frame - start_frame;
+}
+
+static mp4_table_decoders_t ssse3_decoders = {
+	mp4_table_decode_stsz32_ssse3,
+};
+
+////// avx2
+
+__attribute__((target("avx2")))
+static uint32_t
+mp4_table_decode_stsz32_avx2(
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame,
+	const u_char* cur_pos,
+	uint64_t* total_size)
+{
+	input_frame_t* start_frame = cur_frame;
+	uint32_t sizes[BLOCK_SIZE];
+	__m256i bswap = _mm256_setr_epi8(BSWAP32_MASK, BSWAP32_MASK);
+	__m256i max_size = _mm256_set1_epi32(MAX_FRAME_SIZE);
+	__m256i total = _mm256_setzero_si256();
+	__m256i v;
+	uint64_t totals[4];
+	int i;
+
+	for (; last_frame - cur_frame >= BLOCK_SIZE; cur_frame += BLOCK_SIZE, cur_pos += BLOCK_SIZE * sizeof(uint32_t))
+	{
+		v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)cur_pos), bswap);
+
+		// Note: the unsigned max equals max_size only when all the sizes are within the limit
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_max_epu32(v, max_size), max_size)) != -1)
+		{
+			break;
+		}
+
+		total = _mm256_add_epi64(total, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)));
+		total = _mm256_add_epi64(total, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+
+		_mm256_storeu_si256((__m256i*)sizes, v);
+
+		for (i = 0; i < BLOCK_SIZE; i++)
+		{
+			cur_frame[i].size = sizes[i];
+		}
+	}
+
+	_mm256_storeu_si256((__m256i*)totals, total);
+	*total_size += totals[0] + totals[1] + totals[2] + totals[3];
+
+	return cur_frame - start_frame;
+}
+
+static mp4_table_decoders_t avx2_decoders = {
+	mp4_table_decode_stsz32_avx2,
+};
+
+#endif // MP4_TABLE_DECODE_X86
+
+////// dispatch
+
+static mp4_table_decoders_t* decoders = NULL;
+
+static mp4_table_decoders_t*
+mp4_table_get_decoders(void)
+{
+	if (decoders != NULL)
+	{
+		return decoders;
+	}
+
+	decoders = &scalar_decoders;
+
+#ifdef MP4_TABLE_DECODE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		decoders = &avx2_decoders;
+	}
+	else if (__builtin_cpu_supports("ssse3"))
+	{
+		decoders = &ssse3_decoders;
+	}
+#endif // MP4_TABLE_DECODE_X86
+
+	return decoders;
+}
+
+uint32_t
+mp4_table_decode_stsz32(
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame,
+	const u_char* cur_pos,
+	uint64_t* total_size)
+{
+	return mp4_table_get_decoders()->stsz32(cur_frame, last_frame, cur_pos, total_size);
+}
@@ -0,0 +1,18 @@
+#ifndef __MP4_TABLE_DECODE_H__
+#define __MP4_TABLE_DECODE_H__
+
+// includes
+#include "../media_format.h"
+
+// functions
+
+// Note: decodes the table in blocks using simd instructions, when supported by the cpu, and returns the
+//		number of entries that were decoded. stops on the first block that contains a size larger than
+//		MAX_FRAME_SIZE, the remaining entries should be decoded (and validated) by the caller
+uint32_t mp4_table_decode_stsz32(
+	input_frame_t* cur_frame,
+	input_frame_t* last_frame,
+	const u_char* cur_pos,
+	uint64_t* total_size);
+
+#endif //__MP4_TABLE_DECODE_H__